@@ -0,0 +1,487 @@
+#include "airconv_context.hpp"
+#include "airconv_public.h"
+#include "metallib_writer.hpp"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/WithColor.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "dxbc_converter.hpp"
+
+namespace dxmt::dxbc {
+llvm::Error convertDXBC(
+  sm50_shader_t pShader, const char *name, llvm::LLVMContext &context, llvm::Module &module,
+  SM50_SHADER_COMPILATION_ARGUMENT_DATA *pArgs
+);
+} // namespace dxmt::dxbc
+
+using namespace llvm;
+
+/*
+ * Allocation accounting: every operator new in this process (LLVM included,
+ * since airconv is linked statically) bumps a thread-local counter, which the
+ * phases below sample before and after they run.
+ */
+
+static thread_local uint64_t AllocationCount = 0;
+
+static void *
+countedAllocate(size_t Size, size_t Alignment = 0) {
+  AllocationCount++;
+  void *Ptr = nullptr;
+  if (Alignment > alignof(std::max_align_t)) {
+    if (posix_memalign(&Ptr, Alignment, Size ? Size : 1))
+      Ptr = nullptr;
+  } else {
+    Ptr = malloc(Size ? Size : 1);
+  }
+  if (!Ptr)
+    report_bad_alloc_error("airconv-bench: allocation failed");
+  return Ptr;
+}
+
+void *operator new(size_t Size) { return countedAllocate(Size); }
+void *operator new[](size_t Size) { return countedAllocate(Size); }
+void *operator new(size_t Size, std::align_val_t Al) { return countedAllocate(Size, size_t(Al)); }
+void *operator new[](size_t Size, std::align_val_t Al) { return countedAllocate(Size, size_t(Al)); }
+void operator delete(void *Ptr) noexcept { free(Ptr); }
+void operator delete[](void *Ptr) noexcept { free(Ptr); }
+void operator delete(void *Ptr, size_t) noexcept { free(Ptr); }
+void operator delete[](void *Ptr, size_t) noexcept { free(Ptr); }
+void operator delete(void *Ptr, std::align_val_t) noexcept { free(Ptr); }
+void operator delete[](void *Ptr, std::align_val_t) noexcept { free(Ptr); }
+void operator delete(void *Ptr, size_t, std::align_val_t) noexcept { free(Ptr); }
+void operator delete[](void *Ptr, size_t, std::align_val_t) noexcept { free(Ptr); }
+
+static cl::list<std::string>
+  Inputs(cl::Positional, cl::OneOrMore, cl::desc("<dxbc files or directories>"));
+
+static cl::opt<std::string>
+  OutputFilename("o", cl::desc("Write the JSON report to <filename>"), cl::value_desc("filename"), cl::init("-"));
+
+static cl::opt<unsigned>
+  Iterations("n", cl::desc("Number of times each shader is compiled"), cl::init(3));
+
+namespace {
+
+enum Phase : unsigned {
+  /* SM50Initialize: DXBC container/token parsing and control flow recovery */
+  PhaseParse,
+  /* LLVMContext, Module and initializeModule */
+  PhaseSetup,
+  /* convertDXBC: AIR construction */
+  PhaseConvert,
+  /* linkMSAD / linkSamplePos */
+  PhaseLink,
+  /* runOptimizationPasses */
+  PhaseOptimize,
+  /* MetallibWriter::Write */
+  PhaseSerialize,
+  /* Module and LLVMContext destruction */
+  PhaseTeardown,
+  /* SM50Compile end to end, as the runtime calls it */
+  PhaseCompile,
+  PhaseCount,
+};
+
+const char *PhaseNames[PhaseCount] = {
+  "parse", "setup", "convert", "link", "optimize", "serialize", "teardown", "compile",
+};
+
+struct Sample {
+  double Microseconds;
+  uint64_t Allocations;
+};
+
+struct ShaderTypeRecord {
+  unsigned Shaders = 0;
+  unsigned Failures = 0;
+  std::array<std::vector<Sample>, PhaseCount> Phases;
+};
+
+class PhaseTimer {
+public:
+  PhaseTimer(std::vector<Sample> &Samples) :
+      Samples(Samples),
+      Allocations(AllocationCount),
+      Start(std::chrono::steady_clock::now()) {}
+
+  ~PhaseTimer() {
+    auto End = std::chrono::steady_clock::now();
+    Samples.push_back({std::chrono::duration<double, std::micro>(End - Start).count(), AllocationCount - Allocations});
+  }
+
+private:
+  std::vector<Sample> &Samples;
+  uint64_t Allocations;
+  std::chrono::steady_clock::time_point Start;
+};
+
+const char *
+shaderTypeName(microsoft::D3D10_SB_TOKENIZED_PROGRAM_TYPE Type) {
+  switch (Type) {
+  case microsoft::D3D10_SB_PIXEL_SHADER:
+    return "pixel";
+  case microsoft::D3D10_SB_VERTEX_SHADER:
+    return "vertex";
+  case microsoft::D3D10_SB_GEOMETRY_SHADER:
+    return "geometry";
+  case microsoft::D3D11_SB_HULL_SHADER:
+    return "hull";
+  case microsoft::D3D11_SB_DOMAIN_SHADER:
+    return "domain";
+  case microsoft::D3D11_SB_COMPUTE_SHADER:
+    return "compute";
+  default:
+    return "other";
+  }
+}
+
+bool
+canCompileStandalone(microsoft::D3D10_SB_TOKENIZED_PROGRAM_TYPE Type) {
+  return Type == microsoft::D3D10_SB_PIXEL_SHADER || Type == microsoft::D3D10_SB_VERTEX_SHADER ||
+         Type == microsoft::D3D11_SB_COMPUTE_SHADER;
+}
+
+void
+collectInputs(StringRef Path, std::vector<std::string> &Files) {
+  if (!sys::fs::is_directory(Path)) {
+    Files.push_back(Path.str());
+    return;
+  }
+  std::error_code EC;
+  for (sys::fs::recursive_directory_iterator I(Path, EC), E; I != E && !EC; I.increment(EC)) {
+    StringRef Name = I->path();
+    if (Name.endswith(".cso") || Name.endswith(".fxc") || Name.endswith(".dxbc") || Name.endswith(".obj"))
+      Files.push_back(Name.str());
+  }
+  if (EC)
+    WithColor::warning() << Path << ": " << EC.message() << '\n';
+}
+
+/**
+ * Runs the same sequence of steps as SM50Compile, one phase at a time.
+ */
+bool
+measurePhases(
+  sm50_shader_t Shader, SM50_SHADER_COMMON_DATA &Common, ShaderTypeRecord &Record, std::string &Message
+) {
+  auto Internal = (dxmt::dxbc::SM50ShaderInternal *)Shader;
+  std::unique_ptr<LLVMContext> Context;
+  std::unique_ptr<Module> M;
+  {
+    PhaseTimer T(Record.Phases[PhaseSetup]);
+    Context = std::make_unique<LLVMContext>();
+    Context->setOpaquePointers(false);
+    M = std::make_unique<Module>("shader.air", *Context);
+    dxmt::initializeModule(*M);
+  }
+  {
+    PhaseTimer T(Record.Phases[PhaseConvert]);
+    if (auto Err = dxmt::dxbc::convertDXBC(
+          Shader, "shader_main", *Context, *M, (SM50_SHADER_COMPILATION_ARGUMENT_DATA *)&Common
+        )) {
+      Message = toString(std::move(Err));
+      return false;
+    }
+  }
+  {
+    PhaseTimer T(Record.Phases[PhaseLink]);
+    if (Internal->shader_info.use_msad)
+      dxmt::linkMSAD(*M);
+    if (Internal->shader_info.use_samplepos)
+      dxmt::linkSamplePos(*M);
+  }
+  {
+    PhaseTimer T(Record.Phases[PhaseOptimize]);
+    dxmt::runOptimizationPasses(*M);
+  }
+  {
+    PhaseTimer T(Record.Phases[PhaseSerialize]);
+    SmallVector<char, 0> Metallib;
+    raw_svector_ostream OS(Metallib);
+    dxmt::metallib::MetallibWriter Writer;
+    Writer.Write(*M, OS);
+  }
+  {
+    PhaseTimer T(Record.Phases[PhaseTeardown]);
+    M.reset();
+    Context.reset();
+  }
+  return true;
+}
+
+double
+totalMicroseconds(const std::vector<Sample> &Samples) {
+  double Total = 0;
+  for (auto &S : Samples)
+    Total += S.Microseconds;
+  return Total;
+}
+
+/**
+ * Compares the phased path, which builds a fresh LLVMContext per compilation,
+ * with SM50Compile, which reuses the thread's pooled context.
+ */
+void
+writeThroughput(json::OStream &J, const ShaderTypeRecord &Record) {
+  auto &Compiles = Record.Phases[PhaseCompile];
+  if (Compiles.empty())
+    return;
+  double Fresh = 0;
+  for (unsigned P = PhaseSetup; P <= PhaseTeardown; P++)
+    Fresh += totalMicroseconds(Record.Phases[P]);
+  double Pooled = totalMicroseconds(Compiles);
+  J.attributeObject("throughput", [&] {
+    J.attribute("fresh_context_per_s", Fresh > 0 ? Compiles.size() * 1e6 / Fresh : 0.0);
+    J.attribute("sm50compile_per_s", Pooled > 0 ? Compiles.size() * 1e6 / Pooled : 0.0);
+  });
+}
+
+void
+writeSummary(json::OStream &J, std::vector<Sample> &Samples) {
+  auto percentile = [&](double P, auto Projection) {
+    std::vector<double> Values;
+    Values.reserve(Samples.size());
+    for (auto &S : Samples)
+      Values.push_back(Projection(S));
+    std::sort(Values.begin(), Values.end());
+    size_t Rank = std::max<size_t>(1, size_t(std::ceil(P * Values.size())));
+    return Values[std::min(Rank, Values.size()) - 1];
+  };
+  auto time = [](const Sample &S) { return S.Microseconds; };
+  auto allocations = [](const Sample &S) { return double(S.Allocations); };
+
+  J.attribute("samples", int64_t(Samples.size()));
+  J.attribute("total_us", totalMicroseconds(Samples));
+  J.attribute("median_us", percentile(0.5, time));
+  J.attribute("p99_us", percentile(0.99, time));
+  J.attribute("median_allocations", int64_t(percentile(0.5, allocations)));
+  J.attribute("p99_allocations", int64_t(percentile(0.99, allocations)));
+}
+
+struct PackingRecord {
+  uint64_t Libraries = 0;
+  uint64_t Functions = 0;
+  uint64_t InputBytes = 0;
+  uint64_t PackedBytes = 0;
+  double PackMicroseconds = 0;
+  double ParseMicroseconds = 0;
+};
+
+/**
+ * Packs the last build of every shader into a single library with
+ * SM50PackBitcode, as the runtime does for a batch of variants, then parses it
+ * back and checks that each function came through intact.
+ */
+bool
+measurePacking(ArrayRef<sm50_bitcode_t> Libraries, PackingRecord &Record, std::string &Message) {
+  std::vector<SM50_COMPILED_BITCODE> Inputs(Libraries.size());
+  std::vector<dxmt::metallib::MetallibFunction> Expected;
+  for (size_t I = 0; I < Libraries.size(); I++) {
+    SM50GetCompiledBitcode(Libraries[I], &Inputs[I]);
+    Record.InputBytes += Inputs[I].Size;
+    if (auto Err = dxmt::metallib::ParseMetallib(
+          StringRef((const char *)Inputs[I].Data, Inputs[I].Size), Expected
+        )) {
+      Message = toString(std::move(Err));
+      return false;
+    }
+  }
+  Record.Libraries = Libraries.size();
+
+  sm50_bitcode_t Packed;
+  sm50_error_t Err;
+  auto T0 = std::chrono::steady_clock::now();
+  if (SM50PackBitcode(Inputs.data(), Inputs.size(), &Packed, &Err)) {
+    Message = SM50GetErrorMessageString(Err);
+    SM50FreeError(Err);
+    return false;
+  }
+  auto T1 = std::chrono::steady_clock::now();
+  SM50_COMPILED_BITCODE Data;
+  SM50GetCompiledBitcode(Packed, &Data);
+  std::vector<dxmt::metallib::MetallibFunction> Functions;
+  auto ParseErr = dxmt::metallib::ParseMetallib(StringRef((const char *)Data.Data, Data.Size), Functions);
+  auto T2 = std::chrono::steady_clock::now();
+  Record.PackMicroseconds = std::chrono::duration<double, std::micro>(T1 - T0).count();
+  Record.ParseMicroseconds = std::chrono::duration<double, std::micro>(T2 - T1).count();
+  Record.PackedBytes = Data.Size;
+  Record.Functions = Functions.size();
+
+  if (ParseErr) {
+    Message = toString(std::move(ParseErr));
+  } else if (Functions.size() != Expected.size()) {
+    Message = "packed library has " + std::to_string(Functions.size()) + " functions, expected " +
+              std::to_string(Expected.size());
+  } else {
+    for (size_t I = 0; I < Functions.size(); I++) {
+      auto &A = Functions[I], &B = Expected[I];
+      // only the offsets in OFFT may differ
+      if (A.Name != B.Name || A.Type != B.Type || A.Tags.size() != B.Tags.size() || A.Bitcode != B.Bitcode ||
+          A.PublicMetadata != B.PublicMetadata || A.PrivateMetadata != B.PrivateMetadata) {
+        Message = ("function " + B.Name + " differs after packing").str();
+        break;
+      }
+    }
+  }
+  SM50DestroyBitcode(Packed);
+  return Message.empty();
+}
+
+} // namespace
+
+int
+main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+  cl::ParseCommandLineOptions(argc, argv, "Per-phase compile time benchmark of airconv\n");
+
+  std::vector<std::string> Files;
+  for (auto &Input : Inputs)
+    collectInputs(Input, Files);
+  std::sort(Files.begin(), Files.end());
+
+  StringMap<ShaderTypeRecord> Records;
+  unsigned NumFailures = 0;
+
+  SM50_SHADER_COMMON_DATA Common;
+  Common.metal_version = SM50_SHADER_METAL_320;
+  Common.flags = {};
+  Common.next = nullptr;
+  Common.type = SM50_SHADER_COMMON;
+
+  // the last build of each shader, packed together once everything is measured
+  std::vector<sm50_bitcode_t> Libraries;
+
+  for (auto &File : Files) {
+    ErrorOr<std::unique_ptr<MemoryBuffer>> FileOrErr = MemoryBuffer::getFile(File, /*IsText=*/false);
+    if (std::error_code EC = FileOrErr.getError()) {
+      WithColor::error() << File << ": " << EC.message() << '\n';
+      NumFailures++;
+      continue;
+    }
+    auto Bytecode = FileOrErr.get()->getBuffer();
+
+    std::vector<Sample> ParseSamples;
+    ShaderTypeRecord *Record = nullptr;
+    std::string Message;
+    for (unsigned Iteration = 0; Iteration < Iterations && Message.empty(); Iteration++) {
+      sm50_shader_t Shader;
+      sm50_error_t Err;
+      MTL_SHADER_REFLECTION Reflection;
+      {
+        PhaseTimer T(ParseSamples);
+        if (SM50Initialize(Bytecode.data(), Bytecode.size(), &Shader, &Reflection, &Err)) {
+          Message = SM50GetErrorMessageString(Err);
+          SM50FreeError(Err);
+          break;
+        }
+      }
+      auto Type = ((dxmt::dxbc::SM50ShaderInternal *)Shader)->shader_type;
+      Record = &Records[shaderTypeName(Type)];
+
+      if (canCompileStandalone(Type) && measurePhases(Shader, Common, *Record, Message)) {
+        PhaseTimer T(Record->Phases[PhaseCompile]);
+        sm50_bitcode_t Bitcode;
+        // function names are unique within a packed library
+        std::string Name = "shader_" + std::to_string(Libraries.size());
+        if (SM50Compile(Shader, (SM50_SHADER_COMPILATION_ARGUMENT_DATA *)&Common, Name.c_str(), &Bitcode, &Err)) {
+          Message = SM50GetErrorMessageString(Err);
+          SM50FreeError(Err);
+        } else if (Iteration + 1 == Iterations) {
+          Libraries.push_back(Bitcode);
+        } else {
+          SM50DestroyBitcode(Bitcode);
+        }
+      }
+      SM50Destroy(Shader);
+    }
+
+    if (!Record) {
+      WithColor::error() << File << ": " << Message << '\n';
+      NumFailures++;
+      continue;
+    }
+    auto &Parse = Record->Phases[PhaseParse];
+    Parse.insert(Parse.end(), ParseSamples.begin(), ParseSamples.end());
+    Record->Shaders++;
+    if (!Message.empty()) {
+      WithColor::error() << File << ": " << Message << '\n';
+      Record->Failures++;
+      NumFailures++;
+    }
+  }
+
+  PackingRecord Packing;
+  if (!Libraries.empty()) {
+    std::string Message;
+    if (!measurePacking(Libraries, Packing, Message)) {
+      WithColor::error() << "packing: " << Message << '\n';
+      NumFailures++;
+    }
+    for (auto Bitcode : Libraries)
+      SM50DestroyBitcode(Bitcode);
+  }
+
+  std::error_code EC;
+  ToolOutputFile Out(OutputFilename, EC, sys::fs::OF_Text);
+  if (EC) {
+    errs() << EC.message() << '\n';
+    return 1;
+  }
+
+  {
+    json::OStream J(Out.os(), 2);
+    J.object([&] {
+      J.attribute("shaders", int64_t(Files.size()));
+      J.attribute("failures", int64_t(NumFailures));
+      J.attribute("iterations", int64_t(Iterations));
+      J.attributeObject("types", [&] {
+        for (auto &Entry : Records) {
+          auto &Record = Entry.getValue();
+          J.attributeObject(Entry.getKey(), [&] {
+            J.attribute("shaders", int64_t(Record.Shaders));
+            J.attribute("failures", int64_t(Record.Failures));
+            writeThroughput(J, Record);
+            J.attributeObject("phases", [&] {
+              for (unsigned P = 0; P < PhaseCount; P++) {
+                if (Record.Phases[P].empty())
+                  continue;
+                J.attributeObject(PhaseNames[P], [&] { writeSummary(J, Record.Phases[P]); });
+              }
+            });
+          });
+        }
+      });
+      J.attributeObject("packing", [&] {
+        J.attribute("libraries", int64_t(Packing.Libraries));
+        J.attribute("functions", int64_t(Packing.Functions));
+        J.attribute("input_bytes", int64_t(Packing.InputBytes));
+        J.attribute("packed_bytes", int64_t(Packing.PackedBytes));
+        J.attribute("pack_us", Packing.PackMicroseconds);
+        J.attribute("parse_us", Packing.ParseMicroseconds);
+      });
+    });
+  }
+  Out.os() << '\n';
+  Out.keep();
+
+  return NumFailures ? 1 : 0;
+}
@@ -12,10 +12,18 @@
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Error.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Support/WithColor.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
 #include <system_error>
+#include <thread>
+#include <vector>
 
 #ifdef __WIN32
 #include "d3dcompiler.h"
@@ -77,13 +85,23 @@ static cl::opt<bool> PreserveAssemblyUseListOrder(
   cl::init(false), cl::Hidden
 );
 
+static cl::opt<std::string> BatchInput(
+  "batch", cl::desc("Compile every DXBC file in a directory, or listed in a manifest (one path per line). "
+                    "-o then names the output directory"),
+  cl::value_desc("dir|manifest")
+);
+
+static cl::opt<unsigned>
+  BatchJobs("j", cl::desc("Number of worker threads in batch mode (default: all cores)"), cl::init(0));
+
 cl::list<std::string> f("f", cl::Prefix, cl::Hidden);
 
 namespace {
 
 struct LLVMDisDiagnosticHandler : public DiagnosticHandler {
   char *Prefix;
-  LLVMDisDiagnosticHandler(char *PrefixPtr) : Prefix(PrefixPtr) {}
+  bool ExitOnError;
+  LLVMDisDiagnosticHandler(char *PrefixPtr, bool ExitOnError = true) : Prefix(PrefixPtr), ExitOnError(ExitOnError) {}
   bool handleDiagnostics(const DiagnosticInfo &DI) override {
     raw_ostream &OS = errs();
     OS << Prefix << ": ";
@@ -106,7 +124,7 @@ struct LLVMDisDiagnosticHandler : public DiagnosticHandler {
     DI.print(DP);
     OS << '\n';
 
-    if (DI.getSeverity() == DS_Error)
+    if (DI.getSeverity() == DS_Error && ExitOnError)
       exit(1);
     return true;
   }
@@ -122,6 +140,248 @@ llvm::Error convertDXBC(
 
 static ExitOnError ExitOnErr;
 
+static std::string
+inferOutputFilename(StringRef IFN) {
+  std::string Name = (IFN.endswith(".cso")    ? IFN.drop_back(4)
+                      : IFN.endswith(".fxc")  ? IFN.drop_back(4)
+                      : IFN.endswith(".obj")  ? IFN.drop_back(4)
+                      : IFN.endswith(".o")    ? IFN.drop_back(2)
+                      : IFN.endswith(".dxbc") ? IFN.drop_back(5)
+                                              : IFN)
+                       .str();
+  Name += DisassembleDXBC ? ".txt"
+          : EmitMetallib  ? ".metallib"
+          : EmitLLVM      ? ".ll"
+                          : ".air";
+  return Name;
+}
+
+namespace {
+
+struct BatchEntry {
+  std::string InputPath;
+  std::string OutputPath;
+};
+
+struct BatchFailure {
+  std::string InputPath;
+  std::string Message;
+};
+
+bool
+isDXBCFilename(StringRef Name) {
+  return Name.endswith(".cso") || Name.endswith(".fxc") || Name.endswith(".dxbc") || Name.endswith(".obj") ||
+         Name.endswith(".o");
+}
+
+/**
+ * Collects the inputs of a batch. A directory is searched recursively for DXBC
+ * files; anything else is read as a manifest with one path per line (relative
+ * paths are resolved against the manifest's directory, `#` starts a comment).
+ * Relative layout is preserved under the output directory when one is given.
+ */
+bool
+collectBatchEntries(StringRef Source, StringRef OutputDir, std::vector<BatchEntry> &Entries) {
+  auto makeOutput = [&](StringRef Input, StringRef Relative) {
+    if (OutputDir.empty())
+      return inferOutputFilename(Input);
+    SmallString<256> Output(OutputDir);
+    sys::path::append(Output, inferOutputFilename(Relative));
+    return std::string(Output);
+  };
+
+  if (sys::fs::is_directory(Source)) {
+    std::error_code EC;
+    for (sys::fs::recursive_directory_iterator I(Source, EC), E; I != E && !EC; I.increment(EC)) {
+      StringRef Path = I->path();
+      if (I->type() == sys::fs::file_type::directory_file || !isDXBCFilename(Path))
+        continue;
+      StringRef Relative = Path.drop_front(Source.size()).ltrim("/\\");
+      Entries.push_back({Path.str(), makeOutput(Path, Relative)});
+    }
+    if (EC) {
+      errs() << Source << ": " << EC.message() << '\n';
+      return false;
+    }
+    std::sort(Entries.begin(), Entries.end(), [](const BatchEntry &A, const BatchEntry &B) {
+      return A.InputPath < B.InputPath;
+    });
+    return true;
+  }
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> ManifestOrErr = MemoryBuffer::getFile(Source, /*IsText=*/true);
+  if (std::error_code EC = ManifestOrErr.getError()) {
+    errs() << Source << ": could not open manifest: " << EC.message() << '\n';
+    return false;
+  }
+  StringRef BaseDir = sys::path::parent_path(Source);
+  SmallVector<StringRef, 0> Lines;
+  ManifestOrErr.get()->getBuffer().split(Lines, '\n', -1, false);
+  for (StringRef Line : Lines) {
+    Line = Line.trim();
+    if (Line.empty() || Line.startswith("#"))
+      continue;
+    SmallString<256> Path;
+    if (sys::path::is_absolute(Line) || BaseDir.empty()) {
+      Path = Line;
+    } else {
+      Path = BaseDir;
+      sys::path::append(Path, Line);
+    }
+    Entries.push_back(
+      {std::string(Path), makeOutput(Path, sys::path::is_absolute(Line) ? sys::path::filename(Line) : Line)}
+    );
+  }
+  return true;
+}
+
+bool
+compileBatchEntry(char *Argv0, const BatchEntry &Entry, uint64_t &InputBytes, std::string &Message) {
+  raw_string_ostream ErrorOut(Message);
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> FileOrErr = MemoryBuffer::getFile(Entry.InputPath, /*IsText=*/false);
+  if (std::error_code EC = FileOrErr.getError()) {
+    ErrorOut << "could not open input file: " << EC.message();
+    return false;
+  }
+  auto MemRef = FileOrErr->get()->getMemBufferRef();
+  InputBytes += MemRef.getBufferSize();
+
+  sm50_shader_t sm50;
+  sm50_error_t err;
+  if (SM50Initialize(MemRef.getBufferStart(), MemRef.getBufferSize(), &sm50, nullptr, &err)) {
+    ErrorOut << SM50GetErrorMessageString(err);
+    SM50FreeError(err);
+    return false;
+  }
+
+  SM50_SHADER_COMMON_DATA data;
+  data.metal_version = SM50_SHADER_METAL_320;
+  data.flags = {};
+  data.next = 0;
+  data.type = SM50_SHADER_COMMON;
+
+  // the worker's context is reused like in the runtime: the lease releases the
+  // names of struct types after each shader and recycles the context now and
+  // then, so that the output doesn't depend on what was compiled before it
+  dxmt::ContextLease Lease;
+  auto &Context = Lease.context();
+  auto &M = Lease.module();
+  Context.setDiagnosticHandler(std::make_unique<LLVMDisDiagnosticHandler>(Argv0, false));
+  M.setModuleIdentifier("default");
+
+  auto convert_err =
+    dxmt::dxbc::convertDXBC(sm50, "shader_main", Context, M, (SM50_SHADER_COMPILATION_ARGUMENT_DATA *)&data);
+  SM50Destroy(sm50);
+  if (convert_err) {
+    ErrorOut << toString(std::move(convert_err));
+    return false;
+  }
+
+  if (!OptLevelO0)
+    dxmt::runOptimizationPasses(M);
+
+  dxmt::linkMSAD(M);
+  dxmt::linkSamplePos(M);
+  dxmt::linkTessellation(M);
+
+  if (auto Parent = sys::path::parent_path(Entry.OutputPath); !Parent.empty()) {
+    if (std::error_code EC = sys::fs::create_directories(Parent)) {
+      ErrorOut << Parent << ": " << EC.message();
+      return false;
+    }
+  }
+
+  std::error_code EC;
+  ToolOutputFile Out(
+    Entry.OutputPath, EC, (EmitLLVM || EmitMetallib) ? sys::fs::OF_TextWithCRLF : sys::fs::OF_None
+  );
+  if (EC) {
+    ErrorOut << EC.message();
+    return false;
+  }
+
+  if (EmitLLVM) {
+    M.print(Out.os(), nullptr, PreserveAssemblyUseListOrder);
+  } else if (EmitMetallib) {
+    dxmt::metallib::MetallibWriter writer;
+    writer.Write(M, Out.os());
+  } else {
+    WriteBitcodeToFile(M, Out.os(), PreserveBitcodeUseListOrder, nullptr, true);
+  }
+
+  Out.keep();
+  return true;
+}
+
+int
+runBatch(char *Argv0) {
+  if (DisassembleDXBC) {
+    errs() << "-disas-dxbc is not supported in batch mode" << '\n';
+    return 1;
+  }
+  if (!HullBeforeDomain.empty() || !VertexBeforeHull.empty() || !HullAfterVertex.empty() ||
+      !VertexBeforeGeometry.empty() || !GeometryAfterVertex.empty()) {
+    errs() << "pipeline stage options are not supported in batch mode" << '\n';
+    return 1;
+  }
+
+  std::vector<BatchEntry> Entries;
+  if (!collectBatchEntries(BatchInput, OutputFilename, Entries))
+    return 1;
+
+  unsigned NumWorkers = BatchJobs ? BatchJobs.getValue() : std::max(1u, std::thread::hardware_concurrency());
+  NumWorkers = std::max(1u, std::min<unsigned>(NumWorkers, Entries.size()));
+
+  std::atomic_size_t NextEntry = 0;
+  std::atomic_uint64_t TotalInputBytes = 0;
+  std::atomic_size_t NumSucceeded = 0;
+  std::mutex FailuresMutex;
+  std::vector<BatchFailure> Failures;
+
+  auto T0 = std::chrono::steady_clock::now();
+
+  auto Worker = [&]() {
+    uint64_t InputBytes = 0;
+    for (size_t Index = NextEntry++; Index < Entries.size(); Index = NextEntry++) {
+      std::string Message;
+      if (compileBatchEntry(Argv0, Entries[Index], InputBytes, Message)) {
+        NumSucceeded++;
+      } else {
+        std::lock_guard<std::mutex> Lock(FailuresMutex);
+        Failures.push_back({Entries[Index].InputPath, std::move(Message)});
+      }
+    }
+    TotalInputBytes += InputBytes;
+  };
+
+  std::vector<std::thread> Workers;
+  Workers.reserve(NumWorkers);
+  for (unsigned I = 0; I < NumWorkers; I++)
+    Workers.emplace_back(Worker);
+  for (auto &W : Workers)
+    W.join();
+
+  double Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - T0).count();
+
+  std::sort(Failures.begin(), Failures.end(), [](const BatchFailure &A, const BatchFailure &B) {
+    return A.InputPath < B.InputPath;
+  });
+  for (auto &Failure : Failures) {
+    WithColor::error(errs(), Argv0) << Failure.InputPath << ": " << Failure.Message << '\n';
+  }
+
+  outs() << format(
+    "%zu shaders (%zu failed) in %.3fs with %u threads: %.1f shaders/s, %.2f MB/s\n", Entries.size(),
+    Failures.size(), Seconds, NumWorkers, Seconds > 0 ? NumSucceeded / Seconds : 0.0,
+    Seconds > 0 ? TotalInputBytes / Seconds / 1e6 : 0.0
+  );
+
+  return Failures.empty() ? 0 : 1;
+}
+
+} // namespace
+
 int main(int argc, char **argv) {
   InitLLVM X(argc, argv);
 
@@ -134,6 +394,9 @@ int main(int argc, char **argv) {
   Context.setOpaquePointers(false);
   cl::ParseCommandLineOptions(argc, argv, "DXBC to Metal AIR transpiler\n");
 
+  if (!BatchInput.empty())
+    return runBatch(argv[0]);
+
   // bool FastMath = true;
   // for (StringRef Flag : f) {
   //   if (Flag == "no-fast-math") {
@@ -145,18 +408,7 @@ int main(int argc, char **argv) {
     if (InputFilename == "-") {
       OutputFilename = "-";
     } else {
-      StringRef IFN = InputFilename;
-      OutputFilename = (IFN.endswith(".cso")    ? IFN.drop_back(4)
-                        : IFN.endswith(".fxc")  ? IFN.drop_back(4)
-                        : IFN.endswith(".obj")  ? IFN.drop_back(4)
-                        : IFN.endswith(".o")    ? IFN.drop_back(2)
-                        : IFN.endswith(".dxbc") ? IFN.drop_back(5)
-                                                : IFN)
-                         .str();
-      OutputFilename += DisassembleDXBC ? ".txt"
-                        : EmitMetallib  ? ".metallib"
-                        : EmitLLVM      ? ".ll"
-                                        : ".air";
+      OutputFilename = inferOutputFilename(InputFilename);
     }
   }
 
@@ -62,6 +62,54 @@ void initializeModule(llvm::Module &M) {
 
 };
 
+constexpr unsigned kContextRecycleInterval = 128;
+
+struct ThreadContext {
+  std::unique_ptr<LLVMContext> context;
+  unsigned compilations = 0;
+  bool leased = false;
+};
+
+static thread_local ThreadContext thread_context;
+
+static std::unique_ptr<LLVMContext>
+createContext() {
+  auto context = std::make_unique<LLVMContext>();
+  context->setOpaquePointers(false); // I suspect Metal uses LLVM 14...
+  return context;
+}
+
+ContextLease::ContextLease() {
+  auto &tc = thread_context;
+  if (tc.leased) {
+    private_context_ = createContext();
+    context_ = private_context_.get();
+  } else {
+    if (!tc.context || tc.compilations >= kContextRecycleInterval) {
+      tc.context.reset();
+      tc.context = createContext();
+      tc.compilations = 0;
+    }
+    tc.leased = true;
+    tc.compilations++;
+    context_ = tc.context.get();
+  }
+  module_ = std::make_unique<Module>("shader.air", *context_);
+  initializeModule(*module_);
+}
+
+ContextLease::~ContextLease() {
+  if (!private_context_) {
+    // identified struct types outlive the module: release their names, or
+    // the next module would get `argument_buffer_struct.1` and so on
+    for (auto type : module_->getIdentifiedStructTypes())
+      type->setName("");
+  }
+  module_.reset();
+  if (!private_context_)
+    thread_context.leased = false;
+}
+
 static std::atomic_flag llvm_overwrite = false;
 
 void
@@ -155,6 +203,44 @@ runOptimizationPasses(llvm::Module &M) {
   MPM.run(M, MAM);
 }
 
+void
+runFastOptimizationPasses(llvm::Module &M) {
+  // Only what a shader needs to be correct and not pathologically slow to
+  // compile into a PSO: helpers are inlined and the register files are
+  // promoted out of memory. Everything else is left to the optimized tier.
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+
+  llvm::PassInstrumentationCallbacks PIC;
+  PassBuilder PB(nullptr, PipelineTuningOptions(), {}, &PIC);
+
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  ModulePassManager MPM;
+
+  MPM.addPass(AlwaysInlinerPass());
+
+  {
+    FunctionPassManager FPM;
+    FPM.addPass(SROAPass());
+    FPM.addPass(PromotePass());
+
+    // not optimizations: these work around Metal compiler issues
+    FPM.addPass(air::Lower16BitTexReadPass());
+    FPM.addPass(air::SimdgroupImplicitMemBarrierPass());
+
+    MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+  }
+
+  MPM.run(M, MAM);
+}
+
 void
 removeNamedMetadata(llvm::Module &M, StringRef Name) {
   if (auto MD = M.getNamedMetadata(Name)) {
@@ -1,13 +1,53 @@
 #pragma once
+#include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Passes/OptimizationLevel.h"
+#include <memory>
 
 namespace dxmt {
 
+/**
+ * Borrows the calling thread's LLVMContext and creates an initialized module
+ * in it. The context is reused by subsequent compilations on the same thread,
+ * so type and constant uniquing tables don't have to be rebuilt every time.
+ * Since a context never frees what it has uniqued, it's recreated after a
+ * fixed number of compilations.
+ */
+class ContextLease {
+public:
+  ContextLease();
+  ~ContextLease();
+
+  ContextLease(const ContextLease &) = delete;
+  ContextLease &operator=(const ContextLease &) = delete;
+
+  llvm::LLVMContext &
+  context() {
+    return *context_;
+  }
+
+  llvm::Module &
+  module() {
+    return *module_;
+  }
+
+private:
+  llvm::LLVMContext *context_;
+  // owns the context if the thread's context is already leased (re-entrance)
+  std::unique_ptr<llvm::LLVMContext> private_context_;
+  std::unique_ptr<llvm::Module> module_;
+};
+
 void initializeModule(llvm::Module &M);
 
 void runOptimizationPasses(llvm::Module &M);
 
+/**
+ * A minimal pipeline for shaders that are needed right away and will be
+ * replaced by a fully optimized build later.
+ */
+void runFastOptimizationPasses(llvm::Module &M);
+
 void linkMSAD(llvm::Module &M);
 
 void linkSamplePos(llvm::Module &M);
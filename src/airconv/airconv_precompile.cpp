@@ -0,0 +1,830 @@
+#include "airconv_public.h"
+#include "cache_sqlite.h"
+#include "sha1/sha1_util.hpp"
+#include "winemetal.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/WithColor.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/*
+ * dxmt-precompile: builds shader cache entries ahead of time from a pipeline
+ * log recorded by d3d11 (pipelines_<metal version>.db) and the DXBC blobs it
+ * refers to. Every variant those pipelines need is compiled in parallel and
+ * written to a shader cache database (shaders_<metal version>.db), which
+ * `dxmt-shader-pack create` can turn into a pack afterwards.
+ *
+ * Nothing here talks to Metal, so it runs wherever airconv builds.
+ */
+
+using namespace llvm;
+using dxmt::Sha1Digest;
+using dxmt::Sha1HashState;
+
+static cl::opt<std::string>
+  PipelineLogPath(cl::Positional, cl::Required, cl::desc("<pipelines.db>"));
+
+static cl::list<std::string>
+  ShaderInputs("s", cl::OneOrMore, cl::desc("DXBC file or directory referenced by the pipeline log"),
+               cl::value_desc("path"));
+
+static cl::opt<std::string>
+  OutputDatabase("o", cl::Required, cl::desc("Shader cache database to write"), cl::value_desc("shaders.db"));
+
+static cl::opt<std::string>
+  ReportFilename("report", cl::desc("Write the JSON report to <filename>"), cl::value_desc("filename"),
+                 cl::init("-"));
+
+static cl::opt<unsigned>
+  MetalVersion("metal-version", cl::desc("Metal language version of the target (310 or 320)"), cl::init(320));
+
+static cl::opt<bool>
+  SampleNaNToZero("sample-nan-to-zero", cl::desc("Match the d3d11.sampleNaNToZero option of the target"));
+
+enum GPUFamily { GPUFamilyAny, GPUFamilyApple9, GPUFamilyPreApple9 };
+
+static cl::opt<GPUFamily> TargetFamily(
+  "gpu-family", cl::desc("GPU family to build tessellation variants for"), cl::init(GPUFamilyAny),
+  cl::values(
+    clEnumValN(GPUFamilyAny, "any", "both clamped and unclamped tessellation factors"),
+    clEnumValN(GPUFamilyApple9, "apple9", "Apple9 and later"),
+    clEnumValN(GPUFamilyPreApple9, "pre-apple9", "earlier than Apple9, tessellation factors clamped to 8")
+  )
+);
+
+static cl::opt<bool>
+  NoCompress("no-compress", cl::desc("Store shaders uncompressed, like DXMT_SHADER_CACHE_COMPRESSION=none"));
+
+static cl::opt<unsigned>
+  NumThreads("j", cl::desc("Number of compiler threads (default: all cores)"), cl::init(0));
+
+/* must match kDXMTShaderCacheVersion and kDXMTPipelineLogVersion */
+constexpr uint64_t kShaderCacheVersion = 19;
+constexpr uint64_t kPipelineLogVersion = 1;
+
+namespace {
+
+/*
+ * The on-disk layout of PipelineRecordHeader (d3d11_pipeline_log.hpp), spelled
+ * out with plain types so that no D3D11 header is needed. Both sides
+ * static_assert its size.
+ */
+
+struct RenderTargetBlendDesc {
+  uint32_t BlendEnable;
+  uint32_t LogicOpEnable;
+  uint32_t SrcBlend;
+  uint32_t DestBlend;
+  uint32_t BlendOp;
+  uint32_t SrcBlendAlpha;
+  uint32_t DestBlendAlpha;
+  uint32_t BlendOpAlpha;
+  uint32_t LogicOp;
+  uint8_t RenderTargetWriteMask;
+};
+
+struct BlendDesc {
+  uint32_t AlphaToCoverageEnable;
+  uint32_t IndependentBlendEnable;
+  RenderTargetBlendDesc RenderTarget[8];
+};
+
+enum PipelineKind : uint32_t {
+  PipelineKindGraphics,
+  PipelineKindGeometry,
+  PipelineKindTessellation,
+  PipelineKindCompute,
+};
+
+struct PipelineRecordHeader {
+  PipelineKind Kind;
+  uint32_t NumInputElements;
+  Sha1Digest VertexShader;
+  Sha1Digest HullShader;
+  Sha1Digest DomainShader;
+  Sha1Digest GeometryShader;
+  Sha1Digest PixelShader;
+  Sha1Digest ComputeShader;
+  uint32_t HasInputLayout;
+  uint32_t HasBlendState;
+  BlendDesc BlendState;
+  uint32_t NumColorAttachments;
+  WMTPixelFormat ColorAttachmentFormats[8];
+  WMTPixelFormat DepthStencilFormat;
+  uint32_t TopologyClass;
+  uint32_t RasterizationEnabled;
+  uint32_t SampleCount;
+  uint32_t GSStripTopology;
+  SM50_INDEX_BUFFER_FORAMT IndexBufferFormat;
+  uint32_t SampleMask;
+  uint32_t GSPassthrough;
+};
+
+static_assert(sizeof(PipelineRecordHeader) == 532, "pipeline record layout changed");
+
+struct PipelineRecord {
+  PipelineRecordHeader Header;
+  std::vector<SM50_IA_INPUT_ELEMENT> InputLayout;
+};
+
+constexpr uint32_t kBlendSrc1Color = 16; // D3D11_BLEND_SRC1_COLOR
+
+/* MTLD3D11BlendState::IsDualSourceBlending */
+bool
+isDualSourceBlending(const BlendDesc &Desc) {
+  auto &RT = Desc.RenderTarget[0];
+  return RT.BlendEnable && (RT.SrcBlend >= kBlendSrc1Color || RT.SrcBlendAlpha >= kBlendSrc1Color ||
+                            RT.DestBlendAlpha >= kBlendSrc1Color || RT.DestBlend >= kBlendSrc1Color);
+}
+
+/* dxmt::IsUnorm8RenderTargetFormat */
+bool
+isUnorm8RenderTargetFormat(WMTPixelFormat Format) {
+  switch (Format) {
+  case WMTPixelFormatA8Unorm:
+  case WMTPixelFormatR8Unorm:
+  case WMTPixelFormatRG8Unorm:
+  case WMTPixelFormatRGBA8Unorm:
+  case WMTPixelFormatBGRA8Unorm:
+  case WMTPixelFormatBGRX8Unorm:
+    return true;
+  default:
+    return false;
+  }
+}
+
+struct Shader {
+  Sha1Digest Digest;
+  std::string Path;
+  std::unique_ptr<MemoryBuffer> Bytecode;
+  sm50_shader_t Handle = nullptr;
+  MTL_SHADER_REFLECTION Reflection;
+  bool Referenced = false;
+};
+
+struct InputLayout {
+  Sha1Digest Digest;
+  uint32_t SlotMask = 0;
+  std::vector<SM50_IA_INPUT_ELEMENT> Elements;
+};
+
+enum VariantKind : unsigned {
+  VariantVertex,
+  VariantPixel,
+  VariantCompute,
+  VariantTessellationVertexHull,
+  VariantTessellationDomain,
+  VariantGeometryVertex,
+  VariantGeometry,
+  VariantKindCount,
+};
+
+const char *VariantPrefixes[VariantKindCount] = {"vs", "ps", "cs", "vshs", "ds", "vsgs", "gs"};
+
+/**
+ * One entry of the shader cache, with the compilation arguments the d3d11
+ * CreateVariantShader specializations would pass for it.
+ */
+struct Variant {
+  VariantKind Kind;
+  /* the shader owning the cache entry, whose get_shader() creates it */
+  Shader *Owner;
+  /* the other stage of a tessellation or geometry pipeline, if any */
+  Shader *Linked = nullptr;
+  const InputLayout *Layout = nullptr;
+  uint32_t GSPassthrough = 0;
+  bool RasterizationDisabled = false;
+  uint32_t SampleMask = 0;
+  uint32_t UnormOutputRegMask = 0;
+  bool DualSourceBlending = false;
+  bool DisableDepthOutput = false;
+  SM50_INDEX_BUFFER_FORAMT IndexBufferFormat = SM50_INDEX_BUFFER_FORMAT_NONE;
+  uint32_t MaxPotentialTessFactor = 0;
+  bool StripTopology = false;
+
+  Sha1Digest Digest;
+  std::string FunctionName;
+
+  /* results */
+  double Microseconds = 0;
+  size_t Size = 0;
+  std::string Error;
+};
+
+/*
+ * The variant digests must be exactly the ones computed in d3d11_shader.cpp,
+ * field by field and with the same types, or the runtime will never find the
+ * entries written here.
+ */
+void
+computeDigest(Variant &V, SM50_SHADER_FLAG Flags) {
+  Sha1HashState H;
+  H.update(Flags);
+  switch (V.Kind) {
+  case VariantVertex:
+    H.update(V.GSPassthrough);
+    H.update(V.RasterizationDisabled);
+    if (V.Layout)
+      H.update(V.Layout->Digest);
+    break;
+  case VariantPixel:
+    H.update(V.SampleMask);
+    H.update(V.UnormOutputRegMask);
+    H.update(V.DualSourceBlending);
+    H.update(V.DisableDepthOutput);
+    break;
+  case VariantCompute:
+    break;
+  case VariantTessellationVertexHull:
+    H.update(V.Linked->Digest);
+    H.update(V.IndexBufferFormat);
+    H.update(V.MaxPotentialTessFactor);
+    if (V.Layout)
+      H.update(V.Layout->Digest);
+    break;
+  case VariantTessellationDomain:
+    H.update(V.Linked->Digest);
+    H.update(V.GSPassthrough);
+    H.update(V.RasterizationDisabled);
+    H.update(V.MaxPotentialTessFactor);
+    break;
+  case VariantGeometryVertex:
+    H.update(V.Linked->Digest);
+    H.update(V.IndexBufferFormat);
+    H.update(V.StripTopology);
+    if (V.Layout)
+      H.update(V.Layout->Digest);
+    break;
+  case VariantGeometry:
+    H.update(V.Linked->Digest);
+    H.update(V.StripTopology);
+    break;
+  default:
+    break;
+  }
+  V.Digest = H.final();
+  V.FunctionName = std::string(VariantPrefixes[V.Kind]) + "_" + V.Owner->Digest.string().substr(0, 8) + "_" +
+                   V.Digest.string();
+}
+
+sm50_bitcode_t
+compileVariant(Variant &V, SM50_SHADER_COMMON_DATA *Common) {
+  SM50_SHADER_IA_INPUT_LAYOUT_DATA IALayout;
+  IALayout.type = SM50_SHADER_IA_INPUT_LAYOUT;
+  IALayout.index_buffer_format = V.IndexBufferFormat;
+  IALayout.slot_mask = V.Layout ? V.Layout->SlotMask : 0;
+  IALayout.num_elements = V.Layout ? V.Layout->Elements.size() : 0;
+  IALayout.elements = V.Layout ? const_cast<SM50_IA_INPUT_ELEMENT *>(V.Layout->Elements.data()) : nullptr;
+
+  SM50_SHADER_GS_PASS_THROUGH_DATA GSPassthrough;
+  GSPassthrough.type = SM50_SHADER_GS_PASS_THROUGH;
+  GSPassthrough.DataEncoded = V.GSPassthrough;
+  GSPassthrough.RasterizationDisabled = V.RasterizationDisabled;
+
+  SM50_SHADER_PSO_TESSELLATOR_DATA Tessellator;
+  Tessellator.type = SM50_SHADER_PSO_TESSELLATOR;
+  Tessellator.next = Common;
+  Tessellator.max_potential_tess_factor = V.MaxPotentialTessFactor;
+
+  SM50_SHADER_PSO_GEOMETRY_SHADER_DATA Geometry;
+  Geometry.type = SM50_SHADER_PSO_GEOMETRY_SHADER;
+  Geometry.strip_topology = V.StripTopology;
+
+  SM50_SHADER_PSO_PIXEL_SHADER_DATA Pixel;
+  Pixel.type = SM50_SHADER_PSO_PIXEL_SHADER;
+  Pixel.next = Common;
+  Pixel.sample_mask = V.SampleMask;
+  Pixel.dual_source_blending = V.DualSourceBlending;
+  Pixel.disable_depth_output = V.DisableDepthOutput;
+  Pixel.unorm_output_reg_mask = V.UnormOutputRegMask;
+
+  sm50_bitcode_t Bitcode = nullptr;
+  sm50_error_t Err = nullptr;
+  int Failed = 0;
+  const char *Name = V.FunctionName.c_str();
+  switch (V.Kind) {
+  case VariantVertex:
+    IALayout.next = Common;
+    GSPassthrough.next = V.Layout ? (void *)&IALayout : (void *)Common;
+    Failed = SM50Compile(V.Owner->Handle, (SM50_SHADER_COMPILATION_ARGUMENT_DATA *)&GSPassthrough, Name, &Bitcode, &Err);
+    break;
+  case VariantPixel:
+    Failed = SM50Compile(V.Owner->Handle, (SM50_SHADER_COMPILATION_ARGUMENT_DATA *)&Pixel, Name, &Bitcode, &Err);
+    break;
+  case VariantCompute:
+    Failed = SM50Compile(V.Owner->Handle, (SM50_SHADER_COMPILATION_ARGUMENT_DATA *)Common, Name, &Bitcode, &Err);
+    break;
+  case VariantTessellationVertexHull:
+    IALayout.next = &Tessellator;
+    Failed = SM50CompileTessellationPipelineHull(
+      V.Linked->Handle, V.Owner->Handle, (SM50_SHADER_COMPILATION_ARGUMENT_DATA *)&IALayout, Name, &Bitcode, &Err
+    );
+    break;
+  case VariantTessellationDomain:
+    GSPassthrough.next = &Tessellator;
+    Failed = SM50CompileTessellationPipelineDomain(
+      V.Linked->Handle, V.Owner->Handle, (SM50_SHADER_COMPILATION_ARGUMENT_DATA *)&GSPassthrough, Name, &Bitcode,
+      &Err
+    );
+    break;
+  case VariantGeometryVertex:
+    IALayout.next = Common;
+    Geometry.next = &IALayout;
+    Failed = SM50CompileGeometryPipelineVertex(
+      V.Owner->Handle, V.Linked->Handle, (SM50_SHADER_COMPILATION_ARGUMENT_DATA *)&Geometry, Name, &Bitcode, &Err
+    );
+    break;
+  case VariantGeometry:
+    Geometry.next = Common;
+    Failed = SM50CompileGeometryPipelineGeometry(
+      V.Linked->Handle, V.Owner->Handle, (SM50_SHADER_COMPILATION_ARGUMENT_DATA *)&Geometry, Name, &Bitcode, &Err
+    );
+    break;
+  default:
+    break;
+  }
+  if (Failed) {
+    V.Error = SM50GetErrorMessageString(Err);
+    SM50FreeError(Err);
+    return nullptr;
+  }
+  return Bitcode;
+}
+
+/**
+ * Runs `Fn(I)` for every I below `Count` on `Threads` threads.
+ */
+template <typename Fn>
+void
+parallelFor(size_t Count, unsigned Threads, Fn &&F) {
+  std::atomic<size_t> Next = 0;
+  auto Worker = [&] {
+    for (size_t I; (I = Next.fetch_add(1, std::memory_order_relaxed)) < Count;)
+      F(I);
+  };
+  std::vector<std::thread> Workers;
+  for (unsigned T = 1; T < Threads; T++)
+    Workers.emplace_back(Worker);
+  Worker();
+  for (auto &W : Workers)
+    W.join();
+}
+
+void
+collectInputs(StringRef Path, std::vector<std::string> &Files) {
+  if (!sys::fs::is_directory(Path)) {
+    Files.push_back(Path.str());
+    return;
+  }
+  std::error_code EC;
+  for (sys::fs::recursive_directory_iterator I(Path, EC), E; I != E && !EC; I.increment(EC)) {
+    if (!sys::fs::is_directory(I->path()))
+      Files.push_back(I->path());
+  }
+  if (EC)
+    WithColor::warning() << Path << ": " << EC.message() << '\n';
+}
+
+bool
+isDXBC(StringRef Data) {
+  if (Data.size() < 32 || !Data.startswith("DXBC"))
+    return false;
+  uint32_t Size;
+  std::memcpy(&Size, Data.data() + 24, sizeof(Size));
+  return Size == Data.size();
+}
+
+std::vector<PipelineRecord>
+loadPipelineLog(const char *Path) {
+  std::vector<PipelineRecord> Records;
+  auto Reader = cache_sqlite_reader_open(Path, kPipelineLogVersion);
+  if (!Reader)
+    return Records;
+  std::vector<Sha1Digest> Keys(cache_sqlite_reader_copy_keys(Reader, sizeof(Sha1Digest), nullptr, 0));
+  Keys.resize(std::min<uint64_t>(
+    Keys.size(), cache_sqlite_reader_copy_keys(Reader, sizeof(Sha1Digest), Keys.data(), Keys.size())
+  ));
+  for (auto &Key : Keys) {
+    size_t Size = 0;
+    auto Data = (uint8_t *)cache_sqlite_reader_get(Reader, &Key, sizeof(Key), &Size);
+    if (!Data)
+      continue;
+    // the same checks as PipelineRecord::deserialize
+    PipelineRecord Record;
+    auto &Header = Record.Header;
+    if (Size >= sizeof(Header)) {
+      std::memcpy(&Header, Data, sizeof(Header));
+      if (Size == sizeof(Header) + Header.NumInputElements * sizeof(SM50_IA_INPUT_ELEMENT) &&
+          Header.Kind <= PipelineKindCompute && Header.NumColorAttachments <= 8) {
+        Record.InputLayout.resize(Header.NumInputElements);
+        if (Header.NumInputElements)
+          std::memcpy(Record.InputLayout.data(), Data + sizeof(Header), Size - sizeof(Header));
+        Records.push_back(std::move(Record));
+      }
+    }
+    free(Data);
+  }
+  cache_sqlite_reader_close(Reader);
+  return Records;
+}
+
+struct VariantKeyHash {
+  size_t
+  operator()(const std::pair<Sha1Digest, Sha1Digest> &Key) const {
+    std::hash<Sha1Digest> H;
+    return H(Key.first) ^ (H(Key.second) * 31);
+  }
+};
+
+using VariantKey = std::pair<Sha1Digest, Sha1Digest>;
+
+class VariantCollector {
+public:
+  VariantCollector(SM50_SHADER_FLAG Flags) : Flags(Flags) {}
+
+  void
+  add(Variant &&V) {
+    computeDigest(V, Flags);
+    if (Seen.insert({V.Owner->Digest, V.Digest}).second)
+      Variants.push_back(std::move(V));
+  }
+
+  /* d3d11_pipeline_cache.cpp keeps one CachedInputLayout per distinct layout */
+  const InputLayout *
+  inputLayout(const PipelineRecord &Record) {
+    if (!Record.Header.HasInputLayout)
+      return nullptr;
+    std::string Bytes((const char *)Record.InputLayout.data(), Record.InputLayout.size() * sizeof(SM50_IA_INPUT_ELEMENT));
+    auto &Layout = Layouts[Bytes];
+    if (!Layout) {
+      Layout = std::make_unique<InputLayout>();
+      Layout->Elements = Record.InputLayout;
+      for (auto &Element : Layout->Elements)
+        Layout->SlotMask |= 1 << Element.slot;
+      Sha1HashState H;
+      H.update(Layout->SlotMask);
+      H.update(Layout->Elements.size());
+      for (auto &Element : Layout->Elements)
+        H.update(Element);
+      Layout->Digest = H.final();
+    }
+    return Layout.get();
+  }
+
+  std::vector<Variant> Variants;
+
+private:
+  SM50_SHADER_FLAG Flags;
+  std::unordered_set<VariantKey, VariantKeyHash> Seen;
+  std::unordered_map<std::string, std::unique_ptr<InputLayout>> Layouts;
+};
+
+/**
+ * The variants requested by the pipeline constructors in d3d11_pipeline.cpp,
+ * d3d11_pipeline_gs.cpp and d3d11_pipeline_ts.cpp.
+ */
+void
+expandPipeline(const PipelineRecord &Record, Shader *VS, Shader *HS, Shader *DS, Shader *GS, Shader *PS,
+               Shader *CS, VariantCollector &Collector) {
+  auto &Header = Record.Header;
+  if (Header.Kind == PipelineKindCompute) {
+    Collector.add({.Kind = VariantCompute, .Owner = CS});
+    return;
+  }
+
+  auto Layout = Collector.inputLayout(Record);
+  if (PS) {
+    Variant V{.Kind = VariantPixel, .Owner = PS};
+    V.SampleMask = Header.SampleMask;
+    V.DualSourceBlending = Header.HasBlendState && isDualSourceBlending(Header.BlendState);
+    V.DisableDepthOutput = Header.DepthStencilFormat == WMTPixelFormatInvalid;
+    for (unsigned I = 0; I < Header.NumColorAttachments; I++)
+      V.UnormOutputRegMask |= uint32_t(isUnorm8RenderTargetFormat(Header.ColorAttachmentFormats[I])) << I;
+    Collector.add(std::move(V));
+  }
+
+  switch (Header.Kind) {
+  case PipelineKindGraphics: {
+    Variant V{.Kind = VariantVertex, .Owner = VS, .Layout = Layout};
+    V.GSPassthrough = Header.GSPassthrough;
+    V.RasterizationDisabled = !Header.RasterizationEnabled;
+    Collector.add(std::move(V));
+    break;
+  }
+  case PipelineKindGeometry: {
+    Variant V{.Kind = VariantGeometryVertex, .Owner = VS, .Linked = GS, .Layout = Layout};
+    V.IndexBufferFormat = Header.IndexBufferFormat;
+    V.StripTopology = Header.GSStripTopology;
+    Collector.add(std::move(V));
+    Collector.add({.Kind = VariantGeometry, .Owner = GS, .Linked = VS, .StripTopology = bool(Header.GSStripTopology)});
+    break;
+  }
+  case PipelineKindTessellation: {
+    // depends on the device, so both are built unless told otherwise
+    uint32_t Factor = DS->Reflection.PostTessellator.MaxPotentialTessFactor;
+    uint32_t Clamped = std::min(8u, Factor);
+    std::vector<uint32_t> Factors;
+    if (TargetFamily != GPUFamilyPreApple9)
+      Factors.push_back(Factor);
+    if (TargetFamily != GPUFamilyApple9 && (Factors.empty() || Clamped != Factor))
+      Factors.push_back(Clamped);
+    for (auto MaxFactor : Factors) {
+      Variant VH{.Kind = VariantTessellationVertexHull, .Owner = HS, .Linked = VS, .Layout = Layout};
+      VH.IndexBufferFormat = Header.IndexBufferFormat;
+      VH.MaxPotentialTessFactor = MaxFactor;
+      Collector.add(std::move(VH));
+      Variant D{.Kind = VariantTessellationDomain, .Owner = DS, .Linked = HS};
+      D.GSPassthrough = Header.GSPassthrough;
+      D.RasterizationDisabled = !Header.RasterizationEnabled;
+      D.MaxPotentialTessFactor = MaxFactor;
+      Collector.add(std::move(D));
+    }
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+double
+percentile(std::vector<double> Values, double P) {
+  if (Values.empty())
+    return 0;
+  std::sort(Values.begin(), Values.end());
+  size_t Rank = std::max<size_t>(1, size_t(std::ceil(P * Values.size())));
+  return Values[std::min(Rank, Values.size()) - 1];
+}
+
+} // namespace
+
+int
+main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+  cl::ParseCommandLineOptions(argc, argv, "Ahead-of-time shader cache builder for DXMT pipeline logs\n");
+
+  if (MetalVersion != SM50_SHADER_METAL_310 && MetalVersion != SM50_SHADER_METAL_320) {
+    WithColor::error() << "unsupported metal version " << MetalVersion << '\n';
+    return 1;
+  }
+  unsigned Threads = NumThreads ? NumThreads : std::max(1u, std::thread::hardware_concurrency());
+  auto Start = std::chrono::steady_clock::now();
+
+  // shaders are identified by the digest of their bytecode, like CreateShader does
+  std::vector<std::string> Files;
+  for (auto &Input : ShaderInputs)
+    collectInputs(Input, Files);
+  std::unordered_map<Sha1Digest, std::unique_ptr<Shader>> Shaders;
+  for (auto &File : Files) {
+    auto FileOrErr = MemoryBuffer::getFile(File, /*IsText=*/false);
+    if (std::error_code EC = FileOrErr.getError()) {
+      WithColor::warning() << File << ": " << EC.message() << '\n';
+      continue;
+    }
+    auto Data = FileOrErr.get()->getBuffer();
+    if (!isDXBC(Data))
+      continue;
+    auto Digest = Sha1HashState::compute(Data.data(), Data.size());
+    auto &Entry = Shaders[Digest];
+    if (Entry)
+      continue;
+    Entry = std::make_unique<Shader>();
+    Entry->Digest = Digest;
+    Entry->Path = File;
+    Entry->Bytecode = std::move(FileOrErr.get());
+  }
+
+  auto Records = loadPipelineLog(PipelineLogPath.c_str());
+  if (Records.empty()) {
+    WithColor::error() << PipelineLogPath << ": no pipeline recorded\n";
+    return 1;
+  }
+
+  auto lookup = [&](const Sha1Digest &Digest, bool &Missing) -> Shader * {
+    if (Digest == Sha1Digest{})
+      return nullptr;
+    auto Iter = Shaders.find(Digest);
+    if (Iter == Shaders.end()) {
+      Missing = true;
+      return nullptr;
+    }
+    Iter->second->Referenced = true;
+    return Iter->second.get();
+  };
+  struct ResolvedRecord {
+    const PipelineRecord *Record;
+    Shader *VS, *HS, *DS, *GS, *PS, *CS;
+  };
+  std::vector<ResolvedRecord> Resolved;
+  unsigned NumMissing = 0;
+  for (auto &Record : Records) {
+    auto &Header = Record.Header;
+    bool Missing = false;
+    ResolvedRecord R{&Record,
+                     lookup(Header.VertexShader, Missing),
+                     lookup(Header.HullShader, Missing),
+                     lookup(Header.DomainShader, Missing),
+                     lookup(Header.GeometryShader, Missing),
+                     lookup(Header.PixelShader, Missing),
+                     lookup(Header.ComputeShader, Missing)};
+    if (Missing || (Header.Kind == PipelineKindCompute ? !R.CS : !R.VS) ||
+        (Header.Kind == PipelineKindGeometry && !R.GS) ||
+        (Header.Kind == PipelineKindTessellation && (!R.HS || !R.DS))) {
+      NumMissing++;
+      continue;
+    }
+    Resolved.push_back(R);
+  }
+
+  std::vector<Shader *> Referenced;
+  for (auto &Entry : Shaders) {
+    if (Entry.second->Referenced)
+      Referenced.push_back(Entry.second.get());
+  }
+  std::atomic<unsigned> NumInvalid = 0;
+  parallelFor(Referenced.size(), Threads, [&](size_t I) {
+    auto S = Referenced[I];
+    sm50_error_t Err;
+    if (SM50Initialize(
+          S->Bytecode->getBufferStart(), S->Bytecode->getBufferSize(), &S->Handle, &S->Reflection, &Err
+        )) {
+      WithColor::error() << S->Path << ": " << SM50GetErrorMessageString(Err) << '\n';
+      SM50FreeError(Err);
+      S->Handle = nullptr;
+      NumInvalid++;
+    }
+  });
+
+  SM50_SHADER_FLAG Flags = {};
+  if (SampleNaNToZero)
+    Flags = SM50_SHADER_FLAG(Flags | SM50_SHADER_FLAG_SAMPLE_NAN_TO_ZERO);
+  VariantCollector Collector(Flags);
+  for (auto &R : Resolved) {
+    bool Valid = true;
+    for (auto S : {R.VS, R.HS, R.DS, R.GS, R.PS, R.CS})
+      Valid &= !S || S->Handle;
+    if (!Valid) {
+      NumMissing++;
+      continue;
+    }
+    expandPipeline(*R.Record, R.VS, R.HS, R.DS, R.GS, R.PS, R.CS, Collector);
+  }
+  auto &Variants = Collector.Variants;
+
+  // entries already in the output are left alone, so that reruns are incremental
+  std::unordered_set<VariantKey, VariantKeyHash> Existing;
+  if (sys::fs::exists(OutputDatabase)) {
+    if (auto Reader = cache_sqlite_reader_open(OutputDatabase.c_str(), kShaderCacheVersion)) {
+      std::vector<VariantKey> Keys(cache_sqlite_reader_copy_keys(Reader, sizeof(VariantKey), nullptr, 0));
+      Keys.resize(std::min<uint64_t>(
+        Keys.size(), cache_sqlite_reader_copy_keys(Reader, sizeof(VariantKey), Keys.data(), Keys.size())
+      ));
+      Existing.insert(Keys.begin(), Keys.end());
+      cache_sqlite_reader_close(Reader);
+    }
+  }
+  std::vector<Variant *> Pending;
+  for (auto &V : Variants) {
+    if (!Existing.contains({V.Owner->Digest, V.Digest}))
+      Pending.push_back(&V);
+  }
+
+  auto Writer = cache_sqlite_writer_open(
+    OutputDatabase.c_str(), kShaderCacheVersion, CACHE_SQLITE_DEFAULT_BATCH_SIZE,
+    CACHE_SQLITE_DEFAULT_FLUSH_INTERVAL_MS
+  );
+  if (!Writer) {
+    WithColor::error() << OutputDatabase << ": can't open for writing\n";
+    return 1;
+  }
+  if (!NoCompress)
+    cache_sqlite_writer_set_codec(Writer, CACHE_CODEC_LZ4);
+
+  auto CompileStart = std::chrono::steady_clock::now();
+  std::atomic<unsigned> NumFailures = 0;
+  std::mutex ErrorMutex;
+  parallelFor(Pending.size(), Threads, [&](size_t I) {
+    auto &V = *Pending[I];
+    SM50_SHADER_COMMON_DATA Common;
+    Common.type = SM50_SHADER_COMMON;
+    Common.next = nullptr;
+    Common.metal_version = SM50_SHADER_METAL_VERSION(unsigned(MetalVersion));
+    Common.flags = Flags;
+
+    auto VariantStart = std::chrono::steady_clock::now();
+    auto Bitcode = compileVariant(V, &Common);
+    V.Microseconds =
+      std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - VariantStart).count();
+    if (!Bitcode) {
+      std::lock_guard<std::mutex> Lock(ErrorMutex);
+      WithColor::error() << V.FunctionName << " (" << V.Owner->Path << "): " << V.Error << '\n';
+      NumFailures++;
+      return;
+    }
+    SM50_COMPILED_BITCODE Data;
+    SM50GetCompiledBitcode(Bitcode, &Data);
+    VariantKey Key{V.Owner->Digest, V.Digest};
+    cache_sqlite_writer_set(Writer, &Key, sizeof(Key), Data.Data, Data.Size);
+    V.Size = Data.Size;
+    SM50DestroyBitcode(Bitcode);
+  });
+  double CompileSeconds =
+    std::chrono::duration<double>(std::chrono::steady_clock::now() - CompileStart).count();
+  cache_sqlite_writer_close(Writer);
+
+  for (auto S : Referenced) {
+    if (S->Handle)
+      SM50Destroy(S->Handle);
+  }
+
+  std::error_code EC;
+  ToolOutputFile Out(ReportFilename, EC, sys::fs::OF_Text);
+  if (EC) {
+    errs() << EC.message() << '\n';
+    return 1;
+  }
+
+  {
+    std::vector<double> PerKind[VariantKindCount];
+    double CompileMicroseconds = 0;
+    uint64_t Bytes = 0;
+    for (auto V : Pending) {
+      if (!V->Error.empty())
+        continue;
+      PerKind[V->Kind].push_back(V->Microseconds);
+      CompileMicroseconds += V->Microseconds;
+      Bytes += V->Size;
+    }
+    unsigned NumCompiled = Pending.size() - NumFailures;
+
+    json::OStream J(Out.os(), 2);
+    J.object([&] {
+      J.attribute("pipelines", int64_t(Records.size()));
+      J.attribute("skipped_pipelines", int64_t(NumMissing));
+      J.attribute("shaders", int64_t(Referenced.size()));
+      J.attribute("invalid_shaders", int64_t(NumInvalid));
+      J.attribute("variants", int64_t(Variants.size()));
+      J.attribute("already_cached", int64_t(Variants.size() - Pending.size()));
+      J.attribute("compiled", int64_t(NumCompiled));
+      J.attribute("failures", int64_t(NumFailures));
+      J.attribute("threads", int64_t(Threads));
+      J.attribute("bytes_written", int64_t(Bytes));
+      J.attribute(
+        "total_s", std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count()
+      );
+      J.attributeObject("throughput", [&] {
+        J.attribute("compile_wall_s", CompileSeconds);
+        J.attribute("compile_cpu_s", CompileMicroseconds / 1e6);
+        J.attribute("variants_per_s", CompileSeconds > 0 ? NumCompiled / CompileSeconds : 0.0);
+      });
+      J.attributeObject("kinds", [&] {
+        for (unsigned K = 0; K < VariantKindCount; K++) {
+          if (PerKind[K].empty())
+            continue;
+          J.attributeObject(VariantPrefixes[K], [&] {
+            double Total = 0;
+            for (auto Us : PerKind[K])
+              Total += Us;
+            J.attribute("variants", int64_t(PerKind[K].size()));
+            J.attribute("total_us", Total);
+            J.attribute("median_us", percentile(PerKind[K], 0.5));
+            J.attribute("p99_us", percentile(PerKind[K], 0.99));
+          });
+        }
+      });
+      J.attributeArray("compiled_variants", [&] {
+        for (auto V : Pending) {
+          J.object([&] {
+            J.attribute("function", V->FunctionName);
+            J.attribute("shader", V->Owner->Path);
+            J.attribute("us", V->Microseconds);
+            if (V->Error.empty())
+              J.attribute("bytes", int64_t(V->Size));
+            else
+              J.attribute("error", V->Error);
+          });
+        }
+      });
+    });
+  }
+  Out.os() << '\n';
+  Out.keep();
+
+  return NumFailures || NumInvalid ? 1 : 0;
+}
@@ -224,6 +224,8 @@ enum SM50_SHADER_METAL_VERSION {
 
 enum SM50_SHADER_FLAG {
   SM50_SHADER_FLAG_SAMPLE_NAN_TO_ZERO = 1 << 0,
+  /* run a minimal optimization pipeline, trading shader quality for compile time */
+  SM50_SHADER_FLAG_FAST_OPTIMIZATION = 1 << 1,
 };
 
 struct SM50_SHADER_COMMON_DATA {
@@ -302,6 +304,14 @@ AIRCONV_API void SM50GetCompiledBitcode(
   sm50_bitcode_t pBitcode, struct SM50_COMPILED_BITCODE *pData
 );
 AIRCONV_API void SM50DestroyBitcode(sm50_bitcode_t pBitcode);
+/**
+ * Packs the functions of several compiled libraries into a single one, so that
+ * they can be loaded at once. Function names must be unique across them.
+ */
+AIRCONV_API int SM50PackBitcode(
+  const struct SM50_COMPILED_BITCODE *pLibraries, uint32_t NumLibraries,
+  sm50_bitcode_t *ppBitcode, sm50_error_t *ppError
+);
 AIRCONV_API size_t SM50GetErrorMessage(sm50_error_t pError, char *pBuffer, size_t BufferSize);
 AIRCONV_API void SM50FreeError(sm50_error_t pError);
 
@@ -435,6 +435,14 @@ llvm::Error convert_dxbc_pixel_shader(
     shader_flags = sm50_common->flags;
   }
 
+  // templates are captured before optimization, so the tier doesn't matter
+  VariantTemplateKey template_key{
+    metal_version, SM50_SHADER_FLAG(shader_flags & ~SM50_SHADER_FLAG_FAST_OPTIMIZATION), pso_sample_mask
+  };
+  std::shared_ptr<const VariantTemplate> body_template;
+  bool template_known = find_variant_template(pShaderInternal, template_key, body_template);
+  bool template_linked = body_template && link_variant_template(*body_template, module);
+
   IREffect prologue([](auto) { return std::monostate(); });
   IRValue epilogue([](struct context ctx) -> pvalue {
     auto retTy = ctx.function->getReturnType();
@@ -522,11 +530,13 @@ llvm::Error convert_dxbc_pixel_shader(
   if (auto err = prologue.build(ctx).takeError()) {
     return err;
   }
-  auto real_entry = convert_basicblocks(pShaderInternal->entry(), ctx, epilogue_bb);
-  if (auto err = real_entry.takeError()) {
-    return err;
+  if (!template_linked || !instantiate_variant_template(*body_template, ctx, function_metadata, epilogue_bb)) {
+    auto real_entry = convert_basicblocks(pShaderInternal->entry(), ctx, epilogue_bb);
+    if (auto err = real_entry.takeError()) {
+      return err;
+    }
+    builder.CreateBr(real_entry.get());
   }
-  builder.CreateBr(real_entry.get());
 
   builder.SetInsertPoint(epilogue_bb);
   auto epilogue_result = epilogue.build(ctx);
@@ -540,6 +550,9 @@ llvm::Error convert_dxbc_pixel_shader(
     builder.CreateRet(value);
   }
 
+  if (!template_known)
+    extract_variant_template(pShaderInternal, template_key, ctx, function_metadata, epilogue_bb);
+
   module.getOrInsertNamedMetadata("air.fragment")
     ->addOperand(function_metadata);
 
@@ -665,6 +678,14 @@ llvm::Error convert_dxbc_vertex_shader(
     shader_flags = sm50_common->flags;
   }
 
+  // input layout, stream output and GS pass-through only change prologue and epilogue
+  VariantTemplateKey template_key{
+    metal_version, SM50_SHADER_FLAG(shader_flags & ~SM50_SHADER_FLAG_FAST_OPTIMIZATION), 0xffffffff
+  };
+  std::shared_ptr<const VariantTemplate> body_template;
+  bool template_known = find_variant_template(pShaderInternal, template_key, body_template);
+  bool template_linked = body_template && link_variant_template(*body_template, module);
+
   IREffect prologue([](auto) { return std::monostate(); });
   IRValue epilogue([](struct context ctx) -> pvalue {
     auto retTy = ctx.function->getReturnType();
@@ -826,11 +847,13 @@ llvm::Error convert_dxbc_vertex_shader(
   if (auto err = prologue.build(ctx).takeError()) {
     return err;
   }
-  auto real_entry = convert_basicblocks(pShaderInternal->entry(), ctx, epilogue_bb);
-  if (auto err = real_entry.takeError()) {
-    return err;
+  if (!template_linked || !instantiate_variant_template(*body_template, ctx, function_metadata, epilogue_bb)) {
+    auto real_entry = convert_basicblocks(pShaderInternal->entry(), ctx, epilogue_bb);
+    if (auto err = real_entry.takeError()) {
+      return err;
+    }
+    builder.CreateBr(real_entry.get());
   }
-  builder.CreateBr(real_entry.get());
 
   builder.SetInsertPoint(epilogue_bb);
   auto epilogue_result = epilogue.build(ctx);
@@ -894,6 +917,9 @@ llvm::Error convert_dxbc_vertex_shader(
     builder.CreateRet(value);
   }
 
+  if (!template_known)
+    extract_variant_template(pShaderInternal, template_key, ctx, function_metadata, epilogue_bb);
+
   module.getOrInsertNamedMetadata("air.vertex")->addOperand(function_metadata);
   return llvm::Error::success();
 };
@@ -1019,6 +1045,18 @@ bool CheckGSSignatureIsPassThrough(
   return true;
 };
 
+static void
+runOptimizationPasses(llvm::Module &M, SM50_SHADER_COMPILATION_ARGUMENT_DATA *pArgs) {
+  using namespace dxmt::dxbc;
+  SM50_SHADER_COMMON_DATA *sm50_common = nullptr;
+  if (args_get_data<SM50_SHADER_COMMON, SM50_SHADER_COMMON_DATA>(pArgs, &sm50_common) &&
+      (sm50_common->flags & SM50_SHADER_FLAG_FAST_OPTIMIZATION)) {
+    dxmt::runFastOptimizationPasses(M);
+    return;
+  }
+  dxmt::runOptimizationPasses(M);
+}
+
 AIRCONV_API int SM50Initialize(
   const void *pBytecode, size_t BytecodeSize, sm50_shader_t *ppShader,
   MTL_SHADER_REFLECTION *pRefl, sm50_error_t *ppError
@@ -1395,16 +1433,19 @@ AIRCONV_API int SM50Compile(
     *ppError = (sm50_error_t)errorObj;
     return 1;
   }
+  if (pShader == nullptr) {
+    errorOut << "shader was not initialized\0";
+    *ppError = (sm50_error_t)errorObj;
+    return 1;
+  }
 
   // pArgs is ignored for now
-  LLVMContext context;
-
-  context.setOpaquePointers(false); // I suspect Metal uses LLVM 14...
+  ContextLease lease;
+  auto &context = lease.context();
 
   auto &shader_info = ((dxmt::dxbc::SM50ShaderInternal *)pShader)->shader_info;
 
-  auto pModule = std::make_unique<Module>("shader.air", context);
-  initializeModule(*pModule);
+  auto pModule = &lease.module();
 
   if (auto err = dxmt::dxbc::convertDXBC(
         pShader, FunctionName, context, *pModule, pArgs
@@ -1421,7 +1462,7 @@ AIRCONV_API int SM50Compile(
   if (shader_info.use_samplepos)
     linkSamplePos(*pModule);
 
-  runOptimizationPasses(*pModule);
+  runOptimizationPasses(*pModule, pArgs);
 
   // Serialize AIR
   auto compiled = new SM50CompiledBitcodeInternal();
@@ -1432,8 +1473,6 @@ AIRCONV_API int SM50Compile(
 
   writer.Write(*pModule, OS);
 
-  pModule.reset();
-
   *ppBitcode = (sm50_bitcode_t)compiled;
   return 0;
 }
@@ -1456,17 +1495,20 @@ AIRCONV_API int SM50CompileTessellationPipelineHull(
     *ppError = (sm50_error_t)errorObj;
     return 1;
   }
+  if (pVertexShader == nullptr || pHullShader == nullptr) {
+    errorOut << "shader was not initialized\0";
+    *ppError = (sm50_error_t)errorObj;
+    return 1;
+  }
 
   // pArgs is ignored for now
-  LLVMContext context;
-
-  context.setOpaquePointers(false); // I suspect Metal uses LLVM 14...
+  ContextLease lease;
+  auto &context = lease.context();
 
   auto &shader_info =
     ((dxmt::dxbc::SM50ShaderInternal *)pHullShader)->shader_info;
 
-  auto pModule = std::make_unique<Module>("shader.air", context);
-  initializeModule(*pModule);
+  auto pModule = &lease.module();
 
   if (auto err = dxmt::dxbc::convert_dxbc_vertex_hull_shader(
         (dxbc::SM50ShaderInternal *)pVertexShader, (dxbc::SM50ShaderInternal *)pHullShader, 
@@ -1485,7 +1527,7 @@ AIRCONV_API int SM50CompileTessellationPipelineHull(
     linkSamplePos(*pModule);
   linkTessellation(*pModule);
 
-  runOptimizationPasses(*pModule);
+  runOptimizationPasses(*pModule, pHullShaderArgs);
 
   // Serialize AIR
   auto compiled = new SM50CompiledBitcodeInternal();
@@ -1496,8 +1538,6 @@ AIRCONV_API int SM50CompileTessellationPipelineHull(
 
   writer.Write(*pModule, OS);
 
-  pModule.reset();
-
   *ppBitcode = (sm50_bitcode_t)compiled;
   return 0;
 }
@@ -1520,17 +1560,20 @@ AIRCONV_API int SM50CompileTessellationPipelineDomain(
     *ppError = (sm50_error_t)errorObj;
     return 1;
   }
+  if (pHullShader == nullptr || pDomainShader == nullptr) {
+    errorOut << "shader was not initialized\0";
+    *ppError = (sm50_error_t)errorObj;
+    return 1;
+  }
 
   // pArgs is ignored for now
-  LLVMContext context;
-
-  context.setOpaquePointers(false); // I suspect Metal uses LLVM 14...
+  ContextLease lease;
+  auto &context = lease.context();
 
   auto &shader_info =
     ((dxmt::dxbc::SM50ShaderInternal *)pDomainShader)->shader_info;
 
-  auto pModule = std::make_unique<Module>("shader.air", context);
-  initializeModule(*pModule);
+  auto pModule = &lease.module();
 
   if (auto err = dxmt::dxbc::convert_dxbc_tesselator_domain_shader(
         (dxbc::SM50ShaderInternal *)pDomainShader, FunctionName,
@@ -1550,7 +1593,7 @@ AIRCONV_API int SM50CompileTessellationPipelineDomain(
     linkSamplePos(*pModule);
   linkTessellation(*pModule);
   
-  runOptimizationPasses(*pModule);
+  runOptimizationPasses(*pModule, pDomainShaderArgs);
 
   // Serialize AIR
   auto compiled = new SM50CompiledBitcodeInternal();
@@ -1561,8 +1604,6 @@ AIRCONV_API int SM50CompileTessellationPipelineDomain(
 
   writer.Write(*pModule, OS);
 
-  pModule.reset();
-
   *ppBitcode = (sm50_bitcode_t)compiled;
   return 0;
 }
@@ -1585,16 +1626,19 @@ AIRCONV_API int SM50CompileGeometryPipelineVertex(
     *ppError = (sm50_error_t)errorObj;
     return 1;
   }
+  if (pVertexShader == nullptr || pGeometryShader == nullptr) {
+    errorOut << "shader was not initialized\0";
+    *ppError = (sm50_error_t)errorObj;
+    return 1;
+  }
 
   // pArgs is ignored for now
-  LLVMContext context;
-
-  context.setOpaquePointers(false); // I suspect Metal uses LLVM 14...
+  ContextLease lease;
+  auto &context = lease.context();
 
   auto &shader_info = ((dxmt::dxbc::SM50ShaderInternal *)pGeometryShader)->shader_info;
 
-  auto pModule = std::make_unique<Module>("shader.air", context);
-  initializeModule(*pModule);
+  auto pModule = &lease.module();
 
   if (auto err = dxmt::dxbc::convert_dxbc_vertex_for_geometry_shader(
         (dxbc::SM50ShaderInternal *)pVertexShader, FunctionName,
@@ -1613,7 +1657,7 @@ AIRCONV_API int SM50CompileGeometryPipelineVertex(
   if (shader_info.use_samplepos)
     linkSamplePos(*pModule);
 
-  runOptimizationPasses(*pModule);
+  runOptimizationPasses(*pModule, pVertexShaderArgs);
 
   // Serialize AIR
   auto compiled = new SM50CompiledBitcodeInternal();
@@ -1624,8 +1668,6 @@ AIRCONV_API int SM50CompileGeometryPipelineVertex(
 
   writer.Write(*pModule, OS);
 
-  pModule.reset();
-
   *ppBitcode = (sm50_bitcode_t)compiled;
   return 0;
 }
@@ -1648,17 +1690,20 @@ AIRCONV_API int SM50CompileGeometryPipelineGeometry(
     *ppError = (sm50_error_t)errorObj;
     return 1;
   }
+  if (pVertexShader == nullptr || pGeometryShader == nullptr) {
+    errorOut << "shader was not initialized\0";
+    *ppError = (sm50_error_t)errorObj;
+    return 1;
+  }
 
   // pArgs is ignored for now
-  LLVMContext context;
-
-  context.setOpaquePointers(false); // I suspect Metal uses LLVM 14...
+  ContextLease lease;
+  auto &context = lease.context();
 
   auto &shader_info =
     ((dxmt::dxbc::SM50ShaderInternal *)pGeometryShader)->shader_info;
 
-  auto pModule = std::make_unique<Module>("shader.air", context);
-  initializeModule(*pModule);
+  auto pModule = &lease.module();
 
   if (auto err = dxmt::dxbc::convert_dxbc_geometry_shader(
         (dxbc::SM50ShaderInternal *)pGeometryShader, FunctionName,
@@ -1677,7 +1722,7 @@ AIRCONV_API int SM50CompileGeometryPipelineGeometry(
   if (shader_info.use_samplepos)
     linkSamplePos(*pModule);
   
-  runOptimizationPasses(*pModule);
+  runOptimizationPasses(*pModule, pGeometryShaderArgs);
 
   // Serialize AIR
   auto compiled = new SM50CompiledBitcodeInternal();
@@ -1688,8 +1733,6 @@ AIRCONV_API int SM50CompileGeometryPipelineGeometry(
 
   writer.Write(*pModule, OS);
 
-  pModule.reset();
-
   *ppBitcode = (sm50_bitcode_t)compiled;
   return 0;
 }
@@ -1707,6 +1750,46 @@ AIRCONV_API void SM50DestroyBitcode(sm50_bitcode_t pBitcode) {
   delete pBitcodeInternal;
 }
 
+AIRCONV_API int SM50PackBitcode(
+  const SM50_COMPILED_BITCODE *pLibraries, uint32_t NumLibraries,
+  sm50_bitcode_t *ppBitcode, sm50_error_t *ppError
+) {
+  using namespace llvm;
+
+  if (ppError) {
+    *ppError = nullptr;
+  }
+  auto fail = [&](Error err) {
+    if (ppError) {
+      auto errorObj = new SM50ErrorInternal();
+      raw_svector_ostream errorOut(errorObj->buf);
+      errorOut << toString(std::move(err));
+      *ppError = (sm50_error_t)errorObj;
+    } else {
+      consumeError(std::move(err));
+    }
+    return 1;
+  };
+
+  std::vector<dxmt::metallib::MetallibFunction> functions;
+  for (uint32_t i = 0; i < NumLibraries; i++) {
+    StringRef data((const char *)pLibraries[i].Data, pLibraries[i].Size);
+    if (auto err = dxmt::metallib::ParseMetallib(data, functions))
+      return fail(std::move(err));
+  }
+
+  auto packed = new SM50CompiledBitcodeInternal();
+  raw_svector_ostream OS(packed->vec);
+  dxmt::metallib::MetallibWriter writer;
+  if (auto err = writer.Write(functions, OS)) {
+    delete packed;
+    return fail(std::move(err));
+  }
+
+  *ppBitcode = (sm50_bitcode_t)packed;
+  return 0;
+}
+
 AIRCONV_API size_t SM50GetErrorMessage(sm50_error_t pError, char *pBuffer, size_t BufferSize) {
   auto pInternal = (SM50ErrorInternal *)pError;
   auto str_len = std::min(pInternal->buf.size(), BufferSize - 1);
@@ -2,8 +2,11 @@
 
 #include <cstdint>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
+#include <tuple>
 #include <unordered_map>
 #include <variant>
 #include <vector>
@@ -406,6 +409,34 @@ private:
   RegisterComponentType component_type_;
 };
 
+/**
+ * Variant-independent part of a shader: the converted body, outlined from the
+ * entry function and retained as bitcode, so that another variant only has to
+ * build its own prologue and epilogue around it.
+ *
+ * Each parameter of the body is identified by what it binds to rather than by
+ * position, since argument indices change between variants: an entry function
+ * argument by its AIR argument metadata, anything else by its role in
+ * io_binding_map.
+ */
+struct VariantTemplate {
+  llvm::SmallVector<char, 0> bitcode;
+  std::vector<std::string> parameters;
+};
+
+/* what the body still depends on besides prologue and epilogue */
+struct VariantTemplateKey {
+  SM50_SHADER_METAL_VERSION metal_version;
+  SM50_SHADER_FLAG flags;
+  uint32_t pso_sample_mask;
+
+  bool
+  operator<(const VariantTemplateKey &rhs) const {
+    return std::tie(metal_version, flags, pso_sample_mask) <
+           std::tie(rhs.metal_version, rhs.flags, rhs.pso_sample_mask);
+  }
+};
+
 class SM50ShaderInternal {
 public:
   dxmt::dxbc::ShaderInfo shader_info;
@@ -438,12 +469,46 @@ public:
   microsoft::D3D10_SB_PRIMITIVE_TOPOLOGY gs_output_topology = {};
   uint32_t gs_max_vertex_output = 0;
   uint32_t gs_instance_count = 1;
+  std::mutex variant_template_mutex;
+  /* nullptr: the body of this shader can't be made a template */
+  std::map<VariantTemplateKey, std::shared_ptr<const VariantTemplate>> variant_templates;
 
   BasicBlock *entry() const {
     return bbs.front().get();
   }
 };
 
+/**
+ * Returns false if no template has been attempted for \p key yet, in which
+ * case the caller should convert the body and call extract_variant_template.
+ */
+bool find_variant_template(
+  SM50ShaderInternal *shader, const VariantTemplateKey &key, std::shared_ptr<const VariantTemplate> &result
+);
+
+/**
+ * Must be called on a module that doesn't contain the entry function yet.
+ */
+bool link_variant_template(const VariantTemplate &body_template, llvm::Module &module);
+
+/**
+ * Emits a call to the linked template body followed by a branch to
+ * \p epilogue_bb. On failure nothing is emitted and the linked body is
+ * removed, the caller has to convert the body itself.
+ */
+bool instantiate_variant_template(
+  const VariantTemplate &body_template, context &ctx, llvm::MDNode *function_metadata, llvm::BasicBlock *epilogue_bb
+);
+
+/**
+ * Outlines the converted body of a complete entry function and records it as
+ * the template for \p key. The entry function stays valid either way.
+ */
+void extract_variant_template(
+  SM50ShaderInternal *shader, const VariantTemplateKey &key, context &ctx, llvm::MDNode *function_metadata,
+  llvm::BasicBlock *epilogue_bb
+);
+
 void handle_signature(
   microsoft::CSignatureParser &inputParser,
   microsoft::CSignatureParser5 &outputParser,
@@ -0,0 +1,321 @@
+#include "dxbc_converter.hpp"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/CodeExtractor.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace dxmt::dxbc {
+
+using namespace llvm;
+
+constexpr char kVariantBodyName[] = "dxmt.variant_body";
+
+static std::vector<std::pair<std::string, Value *>>
+get_resource_roles(const io_binding_map &resource) {
+  std::vector<std::pair<std::string, Value *>> roles;
+  auto add = [&](const std::string &role, Value *value) {
+    // constants are cloned with the body, arguments are keyed by metadata
+    if (value && !isa<Constant>(value) && !isa<Argument>(value))
+      roles.emplace_back("res:" + role, value);
+  };
+  auto add_register_file = [&](const std::string &role, const register_file &file) {
+    add(role + ".int4", file.ptr_int4);
+    add(role + ".float4", file.ptr_float4);
+  };
+  auto add_indexable = [&](const std::string &role,
+                           const std::unordered_map<uint32_t, indexable_register_file> &map) {
+    for (auto &[idx, file] : map) {
+      add(role + ".x" + std::to_string(idx) + ".int", file.ptr_int_vec);
+      add(role + ".x" + std::to_string(idx) + ".float", file.ptr_float_vec);
+    }
+  };
+
+  add_register_file("input", resource.input);
+  add_register_file("output", resource.output);
+  add_register_file("temp", resource.temp);
+  add_register_file("patch_constant_output", resource.patch_constant_output);
+  add_indexable("temp", resource.indexable_temp_map);
+  for (unsigned i = 0; i < resource.phases.size(); i++) {
+    add_register_file("phase" + std::to_string(i), resource.phases[i].temp);
+    add_indexable("phase" + std::to_string(i), resource.phases[i].indexable_temp_map);
+  }
+  add("thread_id", resource.thread_id_arg);
+  add("thread_group_id", resource.thread_group_id_arg);
+  add("thread_id_in_group", resource.thread_id_in_group_arg);
+  add("thread_id_in_group_flat", resource.thread_id_in_group_flat_arg);
+  add("coverage_mask_in", resource.coverage_mask_arg);
+  add("domain", resource.domain);
+  add("patch_id", resource.patch_id);
+  add("thread_id_in_patch", resource.thread_id_in_patch);
+  add("gs_instance_id", resource.gs_instance_id);
+  add("depth_output", resource.depth_output_reg);
+  add("stencil_ref", resource.stencil_ref_reg);
+  add("coverage_mask_out", resource.coverage_mask_reg);
+  add("cmp_exch_temp", resource.cmp_exch_temp);
+  add("vertex_id", resource.vertex_id);
+  add("vertex_id_with_base", resource.vertex_id_with_base);
+  add("instance_id", resource.instance_id);
+  add("instance_id_with_base", resource.instance_id_with_base);
+  add("base_vertex_id", resource.base_vertex_id);
+  add("base_instance_id", resource.base_instance_id);
+  add("vertex_buffer_table", resource.vertex_buffer_table);
+  return roles;
+}
+
+static bool
+append_metadata_key(const Metadata *md, std::string &key) {
+  if (!md) {
+    key += "~";
+    return true;
+  }
+  if (auto str = dyn_cast<MDString>(md)) {
+    key += '"';
+    key += str->getString();
+    key += '"';
+    return true;
+  }
+  if (auto constant = dyn_cast<ConstantAsMetadata>(md)) {
+    auto integer = dyn_cast<ConstantInt>(constant->getValue());
+    if (!integer)
+      return false;
+    key += std::to_string(integer->getSExtValue());
+    return true;
+  }
+  if (auto node = dyn_cast<MDNode>(md)) {
+    key += '(';
+    for (auto &op : node->operands()) {
+      if (!append_metadata_key(op.get(), key))
+        return false;
+      key += ',';
+    }
+    key += ')';
+    return true;
+  }
+  return false;
+}
+
+/**
+ * One key per argument of the entry function, empty if the argument can't be
+ * identified unambiguously.
+ */
+static std::vector<std::string>
+get_argument_keys(Function *function, MDNode *function_metadata) {
+  std::vector<std::string> keys(function->arg_size());
+  auto inputs = dyn_cast<MDTuple>(function_metadata->getOperand(2).get());
+  if (!inputs)
+    return keys;
+  for (auto &op : inputs->operands()) {
+    auto field = dyn_cast<MDNode>(op.get());
+    if (!field || field->getNumOperands() < 2)
+      continue;
+    auto index = mdconst::dyn_extract<ConstantInt>(field->getOperand(0));
+    if (!index || index->getZExtValue() >= keys.size())
+      continue;
+    // the leading operand is the argument index, which is what differs
+    std::string key = "arg:";
+    bool valid = true;
+    for (unsigned i = 1; i < field->getNumOperands() && valid; i++) {
+      valid = append_metadata_key(field->getOperand(i).get(), key);
+      key += ',';
+    }
+    if (valid)
+      keys[index->getZExtValue()] = std::move(key);
+  }
+  for (unsigned i = 0; i < keys.size(); i++) {
+    for (unsigned j = i + 1; j < keys.size(); j++) {
+      if (!keys[i].empty() && keys[i] == keys[j]) {
+        keys[i].clear();
+        keys[j].clear();
+      }
+    }
+  }
+  return keys;
+}
+
+bool
+find_variant_template(
+  SM50ShaderInternal *shader, const VariantTemplateKey &key, std::shared_ptr<const VariantTemplate> &result
+) {
+  std::lock_guard<std::mutex> lock(shader->variant_template_mutex);
+  auto it = shader->variant_templates.find(key);
+  if (it == shader->variant_templates.end())
+    return false;
+  result = it->second;
+  return true;
+}
+
+bool
+link_variant_template(const VariantTemplate &body_template, Module &module) {
+  auto buffer = MemoryBufferRef(
+    StringRef(body_template.bitcode.data(), body_template.bitcode.size()), "variant_template"
+  );
+  auto template_module = parseBitcodeFile(buffer, module.getContext());
+  if (!template_module) {
+    consumeError(template_module.takeError());
+    return false;
+  }
+  if (Linker::linkModules(module, std::move(template_module.get())))
+    return false;
+  return module.getFunction(kVariantBodyName) != nullptr;
+}
+
+bool
+instantiate_variant_template(
+  const VariantTemplate &body_template, context &ctx, MDNode *function_metadata, llvm::BasicBlock *epilogue_bb
+) {
+  auto body = ctx.module.getFunction(kVariantBodyName);
+  if (!body)
+    return false;
+
+  std::unordered_map<std::string, Value *> values;
+  for (auto &[role, value] : get_resource_roles(ctx.resource))
+    values.emplace(role, value);
+  auto argument_keys = get_argument_keys(ctx.function, function_metadata);
+  for (unsigned i = 0; i < argument_keys.size(); i++) {
+    if (!argument_keys[i].empty())
+      values.emplace(argument_keys[i], ctx.function->getArg(i));
+  }
+
+  SmallVector<Value *, 16> args;
+  for (unsigned i = 0; i < body_template.parameters.size(); i++) {
+    auto it = values.find(body_template.parameters[i]);
+    if (it == values.end() || i >= body->arg_size()) {
+      body->eraseFromParent();
+      return false;
+    }
+    auto value = it->second;
+    auto param_type = body->getArg(i)->getType();
+    if (value->getType() != param_type) {
+      // named struct types are created per compilation, so pointers to the
+      // same layout may still differ in type
+      if (!value->getType()->isPointerTy() || !param_type->isPointerTy() ||
+          value->getType()->getPointerAddressSpace() != param_type->getPointerAddressSpace()) {
+        body->eraseFromParent();
+        return false;
+      }
+      value = ctx.builder.CreateBitCast(value, param_type);
+    }
+    args.push_back(value);
+  }
+  if (args.size() != body->arg_size()) {
+    body->eraseFromParent();
+    return false;
+  }
+
+  body->setLinkage(GlobalValue::InternalLinkage);
+  body->addFnAttr(Attribute::AlwaysInline);
+  ctx.builder.CreateCall(body, args);
+  ctx.builder.CreateBr(epilogue_bb);
+  return true;
+}
+
+static std::shared_ptr<const VariantTemplate>
+create_variant_template(context &ctx, MDNode *function_metadata, llvm::BasicBlock *epilogue_bb) {
+  auto function = ctx.function;
+  auto entry_bb = &function->getEntryBlock();
+  auto entry_br = dyn_cast<BranchInst>(entry_bb->getTerminator());
+  if (!entry_br || entry_br->isConditional())
+    return nullptr;
+  auto header = entry_br->getSuccessor(0);
+
+  SmallPtrSet<llvm::BasicBlock *, 8> epilogue_blocks;
+  SmallVector<llvm::BasicBlock *, 8> worklist{epilogue_bb};
+  while (!worklist.empty()) {
+    auto bb = worklist.pop_back_val();
+    if (!epilogue_blocks.insert(bb).second)
+      continue;
+    for (auto succ : successors(bb))
+      worklist.push_back(succ);
+  }
+  if (epilogue_blocks.count(header) || epilogue_blocks.count(entry_bb))
+    return nullptr;
+
+  SmallVector<llvm::BasicBlock *, 32> body_blocks{header};
+  for (auto &bb : *function) {
+    if (&bb != entry_bb && &bb != header && !epilogue_blocks.count(&bb))
+      body_blocks.push_back(&bb);
+  }
+
+  CodeExtractorAnalysisCache CEAC(*function);
+  CodeExtractor extractor(body_blocks);
+  if (!extractor.isEligible())
+    return nullptr;
+  SetVector<Value *> inputs, outputs;
+  auto body = extractor.extractCodeRegion(CEAC, inputs, outputs);
+  if (!body)
+    return nullptr;
+  // the outlined body is inlined back by the optimization pipeline, so the
+  // current variant is unaffected whether or not a template comes out of it
+  body->addFnAttr(Attribute::AlwaysInline);
+  if (!outputs.empty() || !body->getReturnType()->isVoidTy() || body->arg_size() != inputs.size())
+    return nullptr;
+
+  std::unordered_map<Value *, std::string> roles;
+  for (auto &[role, value] : get_resource_roles(ctx.resource))
+    roles.emplace(value, role);
+  auto argument_keys = get_argument_keys(function, function_metadata);
+
+  auto body_template = std::make_shared<VariantTemplate>();
+  for (auto input : inputs) {
+    std::string key;
+    if (auto arg = dyn_cast<Argument>(input)) {
+      key = argument_keys[arg->getArgNo()];
+    } else if (auto it = roles.find(input); it != roles.end()) {
+      key = it->second;
+    }
+    if (key.empty())
+      return nullptr;
+    body_template->parameters.push_back(std::move(key));
+  }
+
+  ValueToValueMapTy vmap;
+  auto template_module = CloneModule(*function->getParent(), vmap, [&](const GlobalValue *gv) {
+    return gv == body || isa<GlobalVariable>(gv);
+  });
+  auto cloned_body = cast<Function>(vmap[body]);
+  cloned_body->setName(kVariantBodyName);
+  cloned_body->setLinkage(GlobalValue::ExternalLinkage);
+  cloned_body->removeFnAttr(Attribute::AlwaysInline);
+
+  for (auto &md : make_early_inc_range(template_module->named_metadata()))
+    template_module->eraseNamedMetadata(&md);
+  // leave nothing the variant module would have to define itself (e.g. the
+  // entry function) or that would be linked in for nothing
+  for (auto &f : make_early_inc_range(template_module->functions())) {
+    if (&f != cloned_body && f.use_empty())
+      f.eraseFromParent();
+  }
+  for (auto &gv : make_early_inc_range(template_module->globals())) {
+    if (gv.use_empty())
+      gv.eraseFromParent();
+  }
+
+  raw_svector_ostream OS(body_template->bitcode);
+  WriteBitcodeToFile(*template_module, OS);
+  return body_template;
+}
+
+void
+extract_variant_template(
+  SM50ShaderInternal *shader, const VariantTemplateKey &key, context &ctx, MDNode *function_metadata,
+  llvm::BasicBlock *epilogue_bb
+) {
+  auto body_template = create_variant_template(ctx, function_metadata, epilogue_bb);
+  std::lock_guard<std::mutex> lock(shader->variant_template_mutex);
+  shader->variant_templates.emplace(key, std::move(body_template));
+}
+
+} // namespace dxmt::dxbc
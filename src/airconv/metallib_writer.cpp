@@ -1,5 +1,7 @@
 #include "metallib_writer.hpp"
 #include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringSet.h"
 #include "llvm/IR/Constants.h"
 
 using namespace llvm;
@@ -17,55 +19,75 @@ struct InputAttribute {
   // TODO: extend patch/control point here
 };
 
-void MetallibWriter::Write(const llvm::Module &module, raw_ostream &OS) {
-
+/**
+ * Sections of a library being written. Offsets in the function list are
+ * relative to the start of each section.
+ */
+struct LibraryContents {
   SmallVector<char, 0> bitcode;
   SmallVector<char, 0> public_metadata;
   SmallVector<char, 0> private_metadata;
   SmallVector<char, 0> function_def;
-
   uint32_t fn_count = 0;
+};
+
+static void WriteModule(const llvm::Module &module, LibraryContents &lib) {
 
-  raw_svector_ostream bitcode_stream(bitcode);
+  raw_svector_ostream bitcode_stream(lib.bitcode);
+  uint64_t bitcode_offset = bitcode_stream.tell();
   WriteBitcodeToFile(module, bitcode_stream, false, nullptr, true);
+  uint64_t bitcode_size = bitcode_stream.tell() - bitcode_offset;
 
-  auto hash =
-    compute_sha256_hash((const uint8_t *)bitcode.data(), bitcode.size());
+  auto hash = compute_sha256_hash(
+    (const uint8_t *)lib.bitcode.data() + bitcode_offset, bitcode_size
+  );
 
-  raw_svector_ostream public_metadata_stream(public_metadata);
-  raw_svector_ostream private_metadata_stream(private_metadata);
+  raw_svector_ostream public_metadata_stream(lib.public_metadata);
+  raw_svector_ostream private_metadata_stream(lib.private_metadata);
 
   {
 
-    raw_svector_ostream function_def_stream(function_def);
+    raw_svector_ostream function_def_stream(lib.function_def);
+
+    // every function of the module shares its bitcode
+    auto begin_function = [&](MDNode *fn, FunctionType type) {
+      lib.fn_count++;
+      auto func = dyn_cast<Function>(
+        dyn_cast<ConstantAsMetadata>(fn->getOperand(0).get())->getValue()
+      );
+      auto name = func->getName();
+      uint64_t entry = function_def_stream.tell();
+      function_def_stream << value((uint32_t)0); // patched by end_function
+      function_def_stream << "NAME";
+      function_def_stream << value((uint16_t)(name.size() + 1));
+      function_def_stream << name << '\0';
+      function_def_stream << value(MTLB_TYPE_TAG{.type = type});
+      function_def_stream << value(MTLB_HASH_TAG{.hash = hash});
+      function_def_stream << value(MTLB_MDSZ_TAG{.bitcodeSize = bitcode_size});
+      function_def_stream << value(MTLB_OFFT_TAG{
+        .PublicMetadataOffset = public_metadata_stream.tell(),
+        .PrivateMetadataOffset = private_metadata_stream.tell(),
+        .BitcodeOffset = bitcode_offset,
+      });
+      function_def_stream << value(MTLB_VERS_TAG{
+        .airVersionMajor = 2,
+        .airVersionMinor = 6,
+        .languageVersionMajor = 3,
+        .languageVersionMinor = 1,
+      });
+      return entry;
+    };
+    auto end_function = [&](uint64_t entry) {
+      function_def_stream << "ENDT";
+      // the size of a function entry includes the size itself
+      uint32_t entry_size = function_def_stream.tell() - entry;
+      memcpy(&lib.function_def[entry], &entry_size, sizeof(entry_size));
+    };
 
     auto vertexFns = module.getNamedMetadata("air.vertex");
     if (vertexFns) {
       for (auto fn : vertexFns->operands()) {
-        fn_count++;
-        auto func = dyn_cast<Function>(
-          dyn_cast<ConstantAsMetadata>(fn->getOperand(0).get())->getValue()
-        );
-        auto name = func->getName();
-        function_def_stream << "NAME";
-        function_def_stream << value((uint16_t)(name.size() + 1));
-        function_def_stream << name << '\0';
-        function_def_stream
-          << value(MTLB_TYPE_TAG{.type = FunctionType::Vertex});
-        function_def_stream << value(MTLB_HASH_TAG{.hash = hash});
-        function_def_stream
-          << value(MTLB_MDSZ_TAG{.bitcodeSize = bitcode.size()});
-        function_def_stream << value(MTLB_OFFT_TAG{
-          .PublicMetadataOffset = public_metadata_stream.tell(),
-          .PrivateMetadataOffset = private_metadata_stream.tell(),
-          .BitcodeOffset = 0, // ??
-        });
-        function_def_stream << value(MTLB_VERS_TAG{
-          .airVersionMajor = 2,
-          .airVersionMinor = 6,
-          .languageVersionMajor = 3,
-          .languageVersionMinor = 1,
-        });
+        auto entry = begin_function(fn, FunctionType::Vertex);
         while (fn->getNumOperands() > 3 && isa<MDTuple>(fn->getOperand(3).get())
         ) {
           auto maybe_patch_tuple = cast<MDTuple>(fn->getOperand(3).get());
@@ -90,7 +112,7 @@ void MetallibWriter::Write(const llvm::Module &module, raw_ostream &OS) {
           }
           break;
         }
-        function_def_stream << "ENDT";
+        end_function(entry);
         auto inputs = dyn_cast<MDTuple>(fn->getOperand(2).get());
 
         std::vector<InputAttribute> attribtues;
@@ -161,31 +183,8 @@ void MetallibWriter::Write(const llvm::Module &module, raw_ostream &OS) {
     auto fragmentFns = module.getNamedMetadata("air.fragment");
     if (fragmentFns) {
       for (auto fn : fragmentFns->operands()) {
-        fn_count++;
-        auto func = dyn_cast<Function>(
-          dyn_cast<ConstantAsMetadata>(fn->getOperand(0).get())->getValue()
-        );
-        auto name = func->getName();
-        function_def_stream << "NAME";
-        function_def_stream << value((uint16_t)(name.size() + 1));
-        function_def_stream << name << '\0';
-        function_def_stream
-          << value(MTLB_TYPE_TAG{.type = FunctionType::Fragment});
-        function_def_stream << value(MTLB_HASH_TAG{.hash = hash});
-        function_def_stream
-          << value(MTLB_MDSZ_TAG{.bitcodeSize = bitcode.size()});
-        function_def_stream << value(MTLB_OFFT_TAG{
-          .PublicMetadataOffset = public_metadata_stream.tell(),
-          .PrivateMetadataOffset = private_metadata_stream.tell(),
-          .BitcodeOffset = 0, // ??
-        });
-        function_def_stream << value(MTLB_VERS_TAG{
-          .airVersionMajor = 2,
-          .airVersionMinor = 6,
-          .languageVersionMajor = 3,
-          .languageVersionMinor = 1,
-        });
-        function_def_stream << "ENDT";
+        auto entry = begin_function(fn, FunctionType::Fragment);
+        end_function(entry);
         public_metadata_stream << value(4);
         public_metadata_stream << "ENDT";
         private_metadata_stream << value(4);
@@ -195,31 +194,8 @@ void MetallibWriter::Write(const llvm::Module &module, raw_ostream &OS) {
     auto kernelFns = module.getNamedMetadata("air.kernel");
     if (kernelFns) {
       for (auto fn : kernelFns->operands()) {
-        fn_count++;
-        auto func = dyn_cast<Function>(
-          dyn_cast<ConstantAsMetadata>(fn->getOperand(0).get())->getValue()
-        );
-        auto name = func->getName();
-        function_def_stream << "NAME";
-        function_def_stream << value((uint16_t)(name.size() + 1));
-        function_def_stream << name << '\0';
-        function_def_stream
-          << value(MTLB_TYPE_TAG{.type = FunctionType::Kernel});
-        function_def_stream << value(MTLB_HASH_TAG{.hash = hash});
-        function_def_stream
-          << value(MTLB_MDSZ_TAG{.bitcodeSize = bitcode.size()});
-        function_def_stream << value(MTLB_OFFT_TAG{
-          .PublicMetadataOffset = public_metadata_stream.tell(),
-          .PrivateMetadataOffset = private_metadata_stream.tell(),
-          .BitcodeOffset = 0, // ??
-        });
-        function_def_stream << value(MTLB_VERS_TAG{
-          .airVersionMajor = 2,
-          .airVersionMinor = 6,
-          .languageVersionMajor = 3,
-          .languageVersionMinor = 1,
-        });
-        function_def_stream << "ENDT";
+        auto entry = begin_function(fn, FunctionType::Kernel);
+        end_function(entry);
 
         std::vector<InputAttribute> attribtues;
 
@@ -289,31 +265,8 @@ void MetallibWriter::Write(const llvm::Module &module, raw_ostream &OS) {
     auto objectFns = module.getNamedMetadata("air.object");
     if (objectFns) {
       for (auto fn : objectFns->operands()) {
-        fn_count++;
-        auto func = dyn_cast<Function>(
-          dyn_cast<ConstantAsMetadata>(fn->getOperand(0).get())->getValue()
-        );
-        auto name = func->getName();
-        function_def_stream << "NAME";
-        function_def_stream << value((uint16_t)(name.size() + 1));
-        function_def_stream << name << '\0';
-        function_def_stream
-          << value(MTLB_TYPE_TAG{.type = FunctionType::Object});
-        function_def_stream << value(MTLB_HASH_TAG{.hash = hash});
-        function_def_stream
-          << value(MTLB_MDSZ_TAG{.bitcodeSize = bitcode.size()});
-        function_def_stream << value(MTLB_OFFT_TAG{
-          .PublicMetadataOffset = public_metadata_stream.tell(),
-          .PrivateMetadataOffset = private_metadata_stream.tell(),
-          .BitcodeOffset = 0, // ??
-        });
-        function_def_stream << value(MTLB_VERS_TAG{
-          .airVersionMajor = 2,
-          .airVersionMinor = 6,
-          .languageVersionMajor = 3,
-          .languageVersionMinor = 1,
-        });
-        function_def_stream << "ENDT";
+        auto entry = begin_function(fn, FunctionType::Object);
+        end_function(entry);
 
         SmallVector<char, 0> fn_public_metadata;
         raw_svector_ostream fn_public_metadata_stream(fn_public_metadata);
@@ -330,31 +283,8 @@ void MetallibWriter::Write(const llvm::Module &module, raw_ostream &OS) {
     auto meshFns = module.getNamedMetadata("air.mesh");
     if (meshFns) {
       for (auto fn : meshFns->operands()) {
-        fn_count++;
-        auto func = dyn_cast<Function>(
-          dyn_cast<ConstantAsMetadata>(fn->getOperand(0).get())->getValue()
-        );
-        auto name = func->getName();
-        function_def_stream << "NAME";
-        function_def_stream << value((uint16_t)(name.size() + 1));
-        function_def_stream << name << '\0';
-        function_def_stream
-          << value(MTLB_TYPE_TAG{.type = FunctionType::Mesh});
-        function_def_stream << value(MTLB_HASH_TAG{.hash = hash});
-        function_def_stream
-          << value(MTLB_MDSZ_TAG{.bitcodeSize = bitcode.size()});
-        function_def_stream << value(MTLB_OFFT_TAG{
-          .PublicMetadataOffset = public_metadata_stream.tell(),
-          .PrivateMetadataOffset = private_metadata_stream.tell(),
-          .BitcodeOffset = 0, // ??
-        });
-        function_def_stream << value(MTLB_VERS_TAG{
-          .airVersionMajor = 2,
-          .airVersionMinor = 6,
-          .languageVersionMajor = 3,
-          .languageVersionMinor = 1,
-        });
-        function_def_stream << "ENDT";
+        auto entry = begin_function(fn, FunctionType::Mesh);
+        end_function(entry);
 
         SmallVector<char, 0> fn_public_metadata;
         raw_svector_ostream fn_public_metadata_stream(fn_public_metadata);
@@ -369,26 +299,29 @@ void MetallibWriter::Write(const llvm::Module &module, raw_ostream &OS) {
     }
   }
 
+}
+
+static void WriteLibrary(const LibraryContents &lib, raw_ostream &OS) {
   MTLBHeader header;
   header.Magic = MTLB_Magic;
-  header.FileSize =
-    sizeof(MTLBHeader) + sizeof(uint32_t) /* fn count */ +
-    sizeof(uint32_t) /* constant: function list size */ + function_def.size() +
-    sizeof(MTLBFourCC::EndTag) /* extended header*/
-    + public_metadata.size() + private_metadata.size() + bitcode.size();
+  header.FileSize = sizeof(MTLBHeader) + sizeof(uint32_t) /* fn count */ +
+                    lib.function_def.size() +
+                    sizeof(MTLBFourCC::EndTag) /* extended header*/
+                    + lib.public_metadata.size() +
+                    lib.private_metadata.size() + lib.bitcode.size();
   header.FunctionListOffset = sizeof(MTLBHeader);
-  header.FunctionListSize = function_def.size() + 4;
+  header.FunctionListSize = lib.function_def.size();
   header.PublicMetadataOffset =
     header.FunctionListOffset + header.FunctionListSize +
     sizeof(uint32_t) // extra room for function count
     + sizeof(MTLBFourCC::EndTag);
-  header.PublicMetadataSize = public_metadata.size();
+  header.PublicMetadataSize = lib.public_metadata.size();
   header.PrivateMetadataOffset =
     header.PublicMetadataOffset + header.PublicMetadataSize;
-  header.PrivateMetadataSize = private_metadata.size();
+  header.PrivateMetadataSize = lib.private_metadata.size();
   header.BitcodeOffset =
     header.PrivateMetadataOffset + header.PrivateMetadataSize;
-  header.BitcodeSize = bitcode.size();
+  header.BitcodeSize = lib.bitcode.size();
 
   header.Type = FileType::MTLBType_Executable; // executable
   header.Platform = Platform::MTLBPlatform_macOS;
@@ -400,13 +333,233 @@ void MetallibWriter::Write(const llvm::Module &module, raw_ostream &OS) {
 
   // write to stream
   OS << value(header);
-  OS << value(fn_count);
-  OS << value((uint32_t)header.FunctionListSize);
-  OS << function_def;
+  OS << value(lib.fn_count);
+  OS << lib.function_def;
   OS.write("ENDT", 4); // extend header
-  OS << public_metadata;
-  OS << private_metadata;
-  OS << bitcode;
+  OS << lib.public_metadata;
+  OS << lib.private_metadata;
+  OS << lib.bitcode;
+}
+
+void MetallibWriter::Write(const llvm::Module &module, raw_ostream &OS) {
+  LibraryContents lib;
+  WriteModule(module, lib);
+  WriteLibrary(lib, OS);
+}
+
+void MetallibWriter::Write(
+  ArrayRef<const llvm::Module *> modules, raw_ostream &OS
+) {
+  LibraryContents lib;
+  for (auto module : modules)
+    WriteModule(*module, lib);
+  WriteLibrary(lib, OS);
+}
+
+template <typename T>
+static bool read(StringRef data, uint64_t offset, T &value) {
+  if (offset > data.size() || data.size() - offset < sizeof(T))
+    return false;
+  memcpy(&value, data.data() + offset, sizeof(T));
+  return true;
+}
+
+static Error parseError(const Twine &message) {
+  return createStringError(inconvertibleErrorCode(), "metallib: " + message);
+}
+
+/**
+ * Calls `visit(tag, payload, payload_offset)` for each tag of a function entry
+ * until ENDT, and returns the size of the tags, ENDT included.
+ */
+template <typename Visit>
+static Expected<uint64_t> forEachTag(StringRef tags, Visit &&visit) {
+  uint64_t offset = 0;
+  while (true) {
+    MTLBFourCC tag;
+    if (!read(tags, offset, tag))
+      return parseError("function entry without ENDT");
+    offset += sizeof(tag);
+    if (tag == MTLBFourCC::EndTag)
+      return offset;
+    uint16_t size;
+    if (!read(tags, offset, size) || tags.size() - offset - sizeof(size) < size)
+      return parseError("truncated tag");
+    offset += sizeof(size);
+    if (Error err = visit(tag, tags.substr(offset, size), offset))
+      return std::move(err);
+    offset += size;
+  }
+}
+
+static Error readSection(
+  StringRef data, uint64_t section_offset, uint64_t section_size,
+  uint64_t offset, StringRef &metadata
+) {
+  StringRef section = data.substr(section_offset, section_size);
+  uint32_t size;
+  if (!read(section, offset, size) ||
+      section.size() - offset - sizeof(size) < size)
+    return parseError("metadata out of bounds");
+  metadata = section.substr(offset + sizeof(size), size);
+  return Error::success();
+}
+
+Error ParseMetallib(StringRef data, std::vector<MetallibFunction> &functions) {
+  MTLBHeader header;
+  if (!read(data, 0, header) || header.Magic != MTLB_Magic)
+    return parseError("not a metallib");
+  auto in_bounds = [&](uint64_t offset, uint64_t size) {
+    return offset <= data.size() && data.size() - offset >= size;
+  };
+  if (!in_bounds(header.FunctionListOffset, header.FunctionListSize) ||
+      !in_bounds(header.PublicMetadataOffset, header.PublicMetadataSize) ||
+      !in_bounds(header.PrivateMetadataOffset, header.PrivateMetadataSize) ||
+      !in_bounds(header.BitcodeOffset, header.BitcodeSize))
+    return parseError("section out of bounds");
+
+  uint32_t fn_count;
+  if (!read(data, header.FunctionListOffset, fn_count))
+    return parseError("truncated function list");
+  StringRef list = data.substr(
+    header.FunctionListOffset + sizeof(fn_count), header.FunctionListSize
+  );
+  StringRef bitcode =
+    data.substr(header.BitcodeOffset, header.BitcodeSize);
+
+  uint64_t offset = 0;
+  for (uint32_t i = 0; i < fn_count; i++) {
+    uint32_t entry_size;
+    if (!read(list, offset, entry_size) || entry_size < sizeof(entry_size) ||
+        list.size() - offset < entry_size)
+      return parseError("function entry out of bounds");
+
+    MetallibFunction fn = {};
+    fn.Tags = list.substr(offset + sizeof(entry_size), entry_size - sizeof(entry_size));
+    uint32_t found = 0;
+    MTLB_OFFT_TAG offt;
+    uint64_t bitcode_size = 0;
+    auto tags_size = forEachTag(
+      fn.Tags, [&](MTLBFourCC tag, StringRef payload, uint64_t) -> Error {
+        switch (tag) {
+        case MTLBFourCC::Name:
+          if (payload.empty() || payload.back() != '\0')
+            return parseError("unterminated function name");
+          fn.Name = payload.drop_back();
+          found |= 1;
+          break;
+        case MTLBFourCC::Type:
+          if (payload.size() != sizeof(FunctionType))
+            return parseError("invalid TYPE tag");
+          fn.Type = (FunctionType)payload[0];
+          found |= 2;
+          break;
+        case MTLBFourCC::Size:
+          if (payload.size() != sizeof(bitcode_size))
+            return parseError("invalid MDSZ tag");
+          memcpy(&bitcode_size, payload.data(), sizeof(bitcode_size));
+          found |= 4;
+          break;
+        case MTLBFourCC::Offset:
+          if (payload.size() != offt.TAG_SIZE)
+            return parseError("invalid OFFT tag");
+          memcpy(
+            &offt.PublicMetadataOffset, payload.data(), offt.TAG_SIZE
+          );
+          found |= 8;
+          break;
+        default:
+          break;
+        }
+        return Error::success();
+      }
+    );
+    if (!tags_size)
+      return tags_size.takeError();
+    if (*tags_size != fn.Tags.size())
+      return parseError("function entry size mismatch");
+    if (found != 15)
+      return parseError("function entry without NAME, TYPE, MDSZ or OFFT");
+
+    if (Error err = readSection(
+          data, header.PublicMetadataOffset, header.PublicMetadataSize,
+          offt.PublicMetadataOffset, fn.PublicMetadata
+        ))
+      return err;
+    if (Error err = readSection(
+          data, header.PrivateMetadataOffset, header.PrivateMetadataSize,
+          offt.PrivateMetadataOffset, fn.PrivateMetadata
+        ))
+      return err;
+    if (offt.BitcodeOffset > bitcode.size() ||
+        bitcode.size() - offt.BitcodeOffset < bitcode_size)
+      return parseError("bitcode out of bounds");
+    fn.Bitcode = bitcode.substr(offt.BitcodeOffset, bitcode_size);
+
+    functions.push_back(fn);
+    offset += entry_size;
+  }
+  if (offset != list.size())
+    return parseError("function list size mismatch");
+  return Error::success();
+}
+
+Error MetallibWriter::Write(
+  ArrayRef<MetallibFunction> functions, raw_ostream &OS
+) {
+  LibraryContents lib;
+  // functions that came from the same module keep sharing its bitcode
+  DenseMap<std::pair<const char *, size_t>, uint64_t> bitcode_offsets;
+  StringSet<> names;
+
+  raw_svector_ostream bitcode_stream(lib.bitcode);
+  raw_svector_ostream public_metadata_stream(lib.public_metadata);
+  raw_svector_ostream private_metadata_stream(lib.private_metadata);
+  raw_svector_ostream function_def_stream(lib.function_def);
+
+  for (auto &fn : functions) {
+    if (!names.insert(fn.Name).second)
+      return parseError("duplicate function " + fn.Name);
+
+    auto [bitcode_offset, inserted] =
+      bitcode_offsets.try_emplace(
+      {fn.Bitcode.data(), fn.Bitcode.size()}, bitcode_stream.tell()
+    );
+    if (inserted)
+      bitcode_stream << fn.Bitcode;
+
+    uint64_t entry = function_def_stream.tell();
+    function_def_stream << value((uint32_t)(sizeof(uint32_t) + fn.Tags.size()));
+    function_def_stream << fn.Tags;
+    MTLB_OFFT_TAG offt{
+      .PublicMetadataOffset = public_metadata_stream.tell(),
+      .PrivateMetadataOffset = private_metadata_stream.tell(),
+      .BitcodeOffset = bitcode_offset->second,
+    };
+    // only OFFT changes, the other tags still describe the same function
+    auto tags_size = forEachTag(
+      fn.Tags,
+      [&](MTLBFourCC tag, StringRef payload, uint64_t payload_offset) -> Error {
+        if (tag == MTLBFourCC::Offset && payload.size() == offt.TAG_SIZE)
+          memcpy(
+            &lib.function_def[entry + sizeof(uint32_t) + payload_offset],
+            &offt.PublicMetadataOffset, offt.TAG_SIZE
+          );
+        return Error::success();
+      }
+    );
+    if (!tags_size)
+      return tags_size.takeError();
+
+    public_metadata_stream << value((uint32_t)fn.PublicMetadata.size());
+    public_metadata_stream << fn.PublicMetadata;
+    private_metadata_stream << value((uint32_t)fn.PrivateMetadata.size());
+    private_metadata_stream << fn.PrivateMetadata;
+    lib.fn_count++;
+  }
+
+  WriteLibrary(lib, OS);
+  return Error::success();
 }
 
-} // namespace dxmt::metallib
\ No newline at end of file
+} // namespace dxmt::metallib
@@ -1,6 +1,9 @@
 #pragma once
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Support/Error.h"
 #include <cstdint>
+#include <vector>
 #include "sha256.hpp"
 
 namespace dxmt::metallib {
@@ -114,10 +117,41 @@ struct __attribute__((packed)) MTLB_VATY {
 
 static_assert(sizeof(MTLB_VATY) == 2, "");
 
+/**
+ * A function of a parsed metallib. Everything refers to the parsed data.
+ */
+struct MetallibFunction {
+  llvm::StringRef Name;
+  FunctionType Type;
+  /* the tags of its function list entry, from NAME to ENDT */
+  llvm::StringRef Tags;
+  llvm::StringRef PublicMetadata;
+  llvm::StringRef PrivateMetadata;
+  llvm::StringRef Bitcode;
+};
+
+/**
+ * Reads the function list of a metallib, checking that everything it points
+ * to is within `data`.
+ */
+llvm::Error
+ParseMetallib(llvm::StringRef data, std::vector<MetallibFunction> &functions);
+
 class MetallibWriter {
 
 public:
   void Write(const llvm::Module &module, llvm::raw_ostream &OS);
+  /**
+   * A single library with the functions of all modules, each module keeping
+   * its own bitcode.
+   */
+  void Write(llvm::ArrayRef<const llvm::Module *> modules, llvm::raw_ostream &OS);
+  /**
+   * Packs functions parsed from other libraries into one, so that they can be
+   * loaded together. Function names must be unique.
+   */
+  llvm::Error
+  Write(llvm::ArrayRef<MetallibFunction> functions, llvm::raw_ostream &OS);
 };
 
 } // namespace dxmt::metallib
\ No newline at end of file
@@ -107,6 +107,7 @@ public:
 
   void *
   MapDynamicBuffer(Rc<DynamicBuffer> &dynamic) {
+    InvalidateArgumentTables();
     auto ret = ctx_state.current_dynamic_buffer_allocations.find(dynamic.ptr());
     if (ret != ctx_state.current_dynamic_buffer_allocations.end()) {
       auto &allocation_state = ret->second;
@@ -204,6 +205,7 @@ public:
         for (auto &stage : state_.ShaderStages) {
             stage.SRVs.set_dirty();
         }
+        InvalidateArgumentTables();
         Rc<TextureAllocation> new_allocation = dynamic->allocate(ctx_state.cmd_queue.CoherentSeqId());
         uint32_t id = ctx_state.current_cmdlist->used_dynamic_lineartextures.size();
         // track the current allocation in case of a following NO_OVERWRITE map
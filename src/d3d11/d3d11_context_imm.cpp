@@ -117,6 +117,7 @@ public:
 
   void *
   MapDynamicBuffer(Rc<DynamicBuffer> &dynamic, uint64_t current_seq_id, uint64_t coherent_seq_id) {
+    InvalidateArgumentTables();
     if (auto next_sub = dynamic->nextSuballocation()) {
       EmitST([allocation = dynamic->immediateName(), next_sub](ArgumentEncodingContext &enc) mutable {
         allocation->useSuballocation(next_sub);
@@ -211,6 +212,7 @@ public:
           stage.SRVs.set_dirty();
         }
 
+        InvalidateArgumentTables();
         dynamic->updateImmediateName(current_seq_id, dynamic->allocate(coherent_seq_id), false);
         EmitST([allocation = dynamic->immediateName(),
               texture = Rc(dynamic->texture)](ArgumentEncodingContext &enc) mutable {
@@ -25,6 +25,7 @@ since it is for internal use only
 #include "d3d11_resource.hpp"
 #include "dxmt_texture.hpp"
 #include "util_flags.hpp"
+#include "util_hash.hpp"
 #include "util_math.hpp"
 #include "util_win32_compat.h"
 
@@ -1254,6 +1255,8 @@ public:
       return TessellationDraw(ControlPointCount, VertexCount, 1, StartVertexLocation, 0);
     }
     EmitOP([Primitive, StartVertexLocation, VertexCount](ArgumentEncodingContext& enc) {
+      if (enc.skipPendingPipelineDraw())
+        return;
       enc.bumpVisibilityResultOffset();
       enc.resolveRenderPassBarrier();
       auto &cmd = enc.encodeRenderCommand<wmtcmd_render_draw>();
@@ -1292,6 +1295,8 @@ public:
         state_.InputAssembler.IndexBufferOffset +
         StartIndexLocation * (state_.InputAssembler.IndexBufferFormat == DXGI_FORMAT_R32_UINT ? 4 : 2);
     EmitOP([IndexType, IndexBufferOffset, Primitive, IndexCount, BaseVertexLocation](ArgumentEncodingContext &enc) {
+      if (enc.skipPendingPipelineDraw())
+        return;
       enc.bumpVisibilityResultOffset();
       auto [index_buffer, index_sub_offset] = enc.currentIndexBuffer();
       enc.resolveRenderPassBarrier();
@@ -1331,6 +1336,8 @@ public:
     }
     EmitOP([Primitive, StartVertexLocation, VertexCountPerInstance, InstanceCount,
           StartInstanceLocation](ArgumentEncodingContext &enc) {
+      if (enc.skipPendingPipelineDraw())
+        return;
       enc.bumpVisibilityResultOffset();
       enc.resolveRenderPassBarrier();
       auto &cmd = enc.encodeRenderCommand<wmtcmd_render_draw>();
@@ -1378,6 +1385,8 @@ public:
         StartIndexLocation * (state_.InputAssembler.IndexBufferFormat == DXGI_FORMAT_R32_UINT ? 4 : 2);
     EmitOP([IndexType, IndexBufferOffset, Primitive, InstanceCount, BaseVertexLocation, StartInstanceLocation,
           IndexCountPerInstance](ArgumentEncodingContext &enc) {
+      if (enc.skipPendingPipelineDraw())
+        return;
       enc.bumpVisibilityResultOffset();
       auto [index_buffer, index_sub_offset] = enc.currentIndexBuffer();
       enc.resolveRenderPassBarrier();
@@ -1572,6 +1581,8 @@ public:
     if (auto bindable = reinterpret_cast<D3D11ResourceCommon *>(pBufferForArgs)) {
       EmitOP([IndexType, IndexBufferOffset, Primitive, ArgBuffer = bindable->buffer(),
               AlignedByteOffsetForArgs](ArgumentEncodingContext &enc) {
+        if (enc.skipPendingPipelineDraw())
+          return;
         auto [buffer, buffer_offset] = enc.access<PipelineStage::Vertex>(
             ArgBuffer, AlignedByteOffsetForArgs, sizeof(DXMT_DRAW_INDEXED_ARGUMENTS), DXMT_ENCODER_RESOURCE_ACESS_READ
         );
@@ -1610,6 +1621,8 @@ public:
     }
     if (auto bindable = reinterpret_cast<D3D11ResourceCommon *>(pBufferForArgs)) {
       EmitOP([Primitive, ArgBuffer = bindable->buffer(), AlignedByteOffsetForArgs](ArgumentEncodingContext &enc) {
+        if (enc.skipPendingPipelineDraw())
+          return;
         auto [buffer, buffer_offset] = enc.access<PipelineStage::Vertex>(
             ArgBuffer, AlignedByteOffsetForArgs, sizeof(DXMT_DRAW_ARGUMENTS), DXMT_ENCODER_RESOURCE_ACESS_READ
         );
@@ -1922,6 +1935,8 @@ public:
       state_.InputAssembler.IndexBuffer = nullptr;
       EmitST([](ArgumentEncodingContext &enc) { enc.bindIndexBuffer({}); });
     }
+    if (state_.InputAssembler.IndexBufferFormat != Format)
+      pipeline_state_dirty_ = true;
     state_.InputAssembler.IndexBufferFormat = Format;
     state_.InputAssembler.IndexBufferOffset = Offset;
   }
@@ -2693,6 +2708,8 @@ public:
         hazard = true;
       }
     }
+    if (hazard)
+      pipeline_state_dirty_ = true;
 
     return hazard;
   }
@@ -2735,6 +2752,7 @@ public:
         state_.InputAssembler.IndexBuffer = nullptr;
         state_.InputAssembler.IndexBufferFormat = DXGI_FORMAT_UNKNOWN;
         state_.InputAssembler.IndexBufferOffset = 0;
+        pipeline_state_dirty_ = true;
         EmitST([](ArgumentEncodingContext &enc) { enc.bindIndexBuffer({}); });
         hazard = true;
       }
@@ -2786,6 +2804,8 @@ public:
         WARN("OMSetRenderTargets: invalid render targets");
         return;
       }
+      // formats and sample count
+      pipeline_state_dirty_ = true;
       auto &BoundRTVs = state_.OutputMerger.RTVs;
       constexpr unsigned RTVSlotCount = D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT;
       for (unsigned rtv_index = 0; rtv_index < RTVSlotCount; rtv_index++) {
@@ -2975,6 +2995,8 @@ public:
     }
     state_.OutputMerger.StencilRef = StencilRef;
     dirty_state.set(DirtyState::DepthStencilState);
+    // whether rasterization is enabled
+    pipeline_state_dirty_ = true;
   }
 
   void
@@ -3225,6 +3247,125 @@ public:
     return aligned;
   }
 
+  static constexpr unsigned kArgumentTableCacheWays = 4;
+
+  struct ArgumentTableCacheEntry {
+    const MTL_SHADER_REFLECTION *reflection = nullptr;
+    PipelineKind kind = PipelineKind::Ordinary;
+    uint64_t epoch = 0;
+    size_t hash = 0;
+    uint64_t offset = 0;
+    std::vector<uint64_t> signature;
+    /* keep the addresses in the signature from being taken by new objects */
+    Com<IMTLD3D11Shader> shader;
+    std::vector<Com<D3D11ShaderResourceView, false>> views;
+  };
+
+  struct ArgumentTableCache {
+    std::array<ArgumentTableCacheEntry, kArgumentTableCacheWays> entries;
+    unsigned next = 0;
+  };
+
+  /**
+  Argument tables encoded in the current encoder, by binding signature. The
+  epoch moves on when the encoder ends, since offsets are relative to its
+  argument buffer, and when a resource that can be bound gets a new allocation
+  while recording, since tables hold the addresses of current allocations.
+  */
+  D3D11StagesState<ArgumentTableCache> argument_table_cache_ = {};
+  std::vector<uint64_t> argument_table_signature_;
+  uint64_t argument_table_epoch_ = 1;
+
+  void
+  InvalidateArgumentTables() {
+    argument_table_epoch_++;
+  }
+
+  void
+  ResetArgumentTables() {
+    InvalidateArgumentTables();
+    for (auto &cache : argument_table_cache_) {
+      for (auto &entry : cache.entries) {
+        entry.shader = nullptr;
+        entry.views.clear();
+      }
+    }
+  }
+
+  /**
+  Returns true and the offset of a table encoded earlier in the current encoder
+  by the same shader from the same bindings. Otherwise allocates the region for
+  a new table, remembers it under the current signature and returns false.
+
+  The signature is made of the sampler states and the buffer or texture, view
+  and slice of each SRV the shader reads. UAVs are not part of it: a table that
+  binds any is encoded for every draw, so that their accesses are tracked again.
+  */
+  template <PipelineStage stage, PipelineKind kind>
+  bool
+  ReuseOrPreAllocateArgumentTable(const MTL_SHADER_REFLECTION *reflection, uint64_t &offset) {
+    auto &ShaderStage = state_.ShaderStages[stage];
+    auto &signature = argument_table_signature_;
+    signature.clear();
+
+    for (uint64_t mask = reflection->SamplerSlotMask; mask; mask &= mask - 1) {
+      unsigned slot = __builtin_ctzll(mask);
+      signature.push_back(
+          ShaderStage.Samplers.test_bound(slot) ? reinterpret_cast<uintptr_t>(ShaderStage.Samplers[slot].Sampler) : 0
+      );
+    }
+    auto append_srv = [&](unsigned slot) {
+      if (!ShaderStage.SRVs.test_bound(slot)) {
+        signature.push_back(0);
+        return;
+      }
+      auto &srv = ShaderStage.SRVs[slot].SRV;
+      signature.push_back(
+          srv->buffer_ ? reinterpret_cast<uintptr_t>(srv->buffer_) : reinterpret_cast<uintptr_t>(srv->texture_)
+      );
+      signature.push_back(srv->view_id_);
+      signature.push_back((uint64_t)srv->slice_.byteLength << 32 | srv->slice_.byteOffset);
+      signature.push_back((uint64_t)srv->slice_.elementCount << 32 | srv->slice_.firstElement);
+    };
+    for (uint64_t mask = reflection->SRVSlotMaskLo; mask; mask &= mask - 1)
+      append_srv(__builtin_ctzll(mask));
+    for (uint64_t mask = reflection->SRVSlotMaskHi; mask; mask &= mask - 1)
+      append_srv(64 + __builtin_ctzll(mask));
+
+    HashState hash;
+    for (auto word : signature)
+      hash.add(word);
+
+    auto &cache = argument_table_cache_[stage];
+    for (auto &entry : cache.entries) {
+      if (entry.epoch == argument_table_epoch_ && entry.hash == hash && entry.reflection == reflection &&
+          entry.kind == kind && entry.signature == signature) {
+        offset = entry.offset;
+        return true;
+      }
+    }
+
+    offset = PreAllocateArgumentBuffer(reflection->ArgumentTableQwords << 3, 32);
+    auto &entry = cache.entries[cache.next++ % kArgumentTableCacheWays];
+    entry.reflection = reflection;
+    entry.kind = kind;
+    entry.epoch = argument_table_epoch_;
+    entry.hash = hash;
+    entry.offset = offset;
+    entry.signature.assign(signature.begin(), signature.end());
+    entry.shader = ShaderStage.Shader;
+    entry.views.clear();
+    for (uint64_t mask = reflection->SRVSlotMaskLo; mask; mask &= mask - 1) {
+      if (ShaderStage.SRVs.test_bound(__builtin_ctzll(mask)))
+        entry.views.push_back(ShaderStage.SRVs[__builtin_ctzll(mask)].SRV);
+    }
+    for (uint64_t mask = reflection->SRVSlotMaskHi; mask; mask &= mask - 1) {
+      if (ShaderStage.SRVs.test_bound(64 + __builtin_ctzll(mask)))
+        entry.views.push_back(ShaderStage.SRVs[64 + __builtin_ctzll(mask)].SRV);
+    }
+    return false;
+  }
+
   template <PipelineStage stage, PipelineKind kind>
   void
   UploadShaderStageResourceBinding() {
@@ -3254,11 +3395,22 @@ public:
     }
 
     if (reflection->NumArguments && (dirty_sampler || dirty_srv || uav_bound)) {
-      auto ArgumentTableQwords = reflection->ArgumentTableQwords;
-      auto offset = PreAllocateArgumentBuffer(ArgumentTableQwords << 3, 32);
-      EmitST([=, arg = managed_shader->arguments_info()](ArgumentEncodingContext &enc) {
-        enc.encodeShaderResources<stage, kind>(reflection, arg, offset);
-      });
+      uint64_t offset;
+      if (uav_bound) {
+        auto ArgumentTableQwords = reflection->ArgumentTableQwords;
+        offset = PreAllocateArgumentBuffer(ArgumentTableQwords << 3, 32);
+        EmitST([=, arg = managed_shader->arguments_info()](ArgumentEncodingContext &enc) {
+          enc.encodeShaderResources<stage, kind>(reflection, arg, offset);
+        });
+        // a resource read by an earlier table may have been written since
+        InvalidateArgumentTables();
+      } else if (ReuseOrPreAllocateArgumentTable<stage, kind>(reflection, offset)) {
+        EmitST([=](ArgumentEncodingContext &enc) { enc.bindShaderResources<stage, kind>(offset); });
+      } else {
+        EmitST([=, arg = managed_shader->arguments_info()](ArgumentEncodingContext &enc) {
+          enc.encodeShaderResources<stage, kind>(reflection, arg, offset);
+        });
+      }
       ShaderStage.Samplers.clear_dirty();
       ShaderStage.SRVs.clear_dirty();
       if (stage == PipelineStage::Pixel || stage == PipelineStage::Compute) {
@@ -4253,6 +4405,7 @@ public:
         enc.endPass();
       });
       allocated_encoder_argbuf_size_ = nullptr;
+      ResetArgumentTables();
       break;
     }
     case CommandBufferState::ComputeEncoderActive:
@@ -4261,6 +4414,7 @@ public:
         enc.endPass();
       });
       allocated_encoder_argbuf_size_ = nullptr;
+      ResetArgumentTables();
       break;
     case CommandBufferState::UpdateBlitEncoderActive:
     case CommandBufferState::ReadbackBlitEncoderActive:
@@ -4291,6 +4445,7 @@ public:
   */
   void
   InvalidateRenderPipeline() {
+    pipeline_state_dirty_ = true;
     if (cmdbuf_state != CommandBufferState::RenderPipelineReady &&
         cmdbuf_state != CommandBufferState::TessellationRenderPipelineReady&&
         cmdbuf_state != CommandBufferState::GeometryRenderPipelineReady)
@@ -4759,13 +4914,25 @@ public:
       return DrawCallStatus::Invalid;
     }
 
-    MTLCompiledGraphicsPipeline *pipeline;
-
-    MTL_GRAPHICS_PIPELINE_DESC pipelineDesc;
-    InitializeGraphicsPipelineDesc<IndexedDraw>(pipelineDesc);
+    bool indexed = last_pipeline_desc_.IndexBufferFormat != SM50_INDEX_BUFFER_FORMAT_NONE;
+    if (pipeline_state_dirty_ || !last_pipeline_ || indexed != IndexedDraw) {
+      MTL_GRAPHICS_PIPELINE_DESC pipelineDesc;
+      InitializeGraphicsPipelineDesc<IndexedDraw>(pipelineDesc);
+      // state set again to the same values, which is common
+      if (!last_pipeline_ || !std::equal_to<MTL_GRAPHICS_PIPELINE_DESC>{}(pipelineDesc, last_pipeline_desc_))
+        device->CreateGraphicsPipeline(&pipelineDesc, &last_pipeline_);
+      last_pipeline_desc_ = pipelineDesc;
+      pipeline_state_dirty_ = false;
+    }
+    MTLCompiledGraphicsPipeline *pipeline = last_pipeline_;
 
-    device->CreateGraphicsPipeline(&pipelineDesc, &pipeline);
-    EmitST([pso = std::move(pipeline)](ArgumentEncodingContext& enc) {
+    // skipping stream output draws would lose data instead of a frame
+    bool async = !last_pipeline_desc_.SOLayout && IsAsyncPipelineCompilationEnabled();
+    EmitST([pso = std::move(pipeline), async](ArgumentEncodingContext& enc) {
+      auto render_encoder = enc.currentRenderEncoder();
+      render_encoder->pipeline_pending = async && !pso->GetIsDone();
+      if (render_encoder->pipeline_pending)
+        return;
       MTL_COMPILED_GRAPHICS_PIPELINE GraphicsPipeline{};
       pso->GetPipeline(&GraphicsPipeline); // may block
       if (!GraphicsPipeline.PipelineState)
@@ -4773,7 +4940,7 @@ public:
       auto &cmd = enc.encodeRenderCommand<wmtcmd_render_setpso>();
       cmd.type = WMTRenderCommandSetPSO;
       cmd.pso = GraphicsPipeline.PipelineState;
-      enc.currentRenderEncoder()->last_pso = GraphicsPipeline.PipelineState;
+      render_encoder->last_pso = GraphicsPipeline.PipelineState;
     });
 
     cmdbuf_state = CommandBufferState::RenderPipelineReady;
@@ -5092,12 +5259,20 @@ public:
 
   void ResetD3D11ContextState() {
     state_ = {};
+    pipeline_state_dirty_ = true;
   }
 
 protected:
   MTLD3D11Device *device;
   CommandBufferState cmdbuf_state = CommandBufferState::Idle;
   CommandBufferState previous_render_pipeline_state = CommandBufferState::Idle;
+  /**
+  The last pipeline resolved by FinalizeCurrentRenderPipeline, reused as is
+  until a state it depends on is set again
+  */
+  MTLCompiledGraphicsPipeline *last_pipeline_ = nullptr;
+  MTL_GRAPHICS_PIPELINE_DESC last_pipeline_desc_ = {};
+  bool pipeline_state_dirty_ = true;
   ContextInternalState &ctx_state;
   ContextInternalState::device_mutex_t &mutex;
 
@@ -5479,8 +5654,7 @@ public:
 
   template <CommandWithContext<ArgumentEncodingContext> cmd>
   void Emit(cmd &&fn) {
-    list.emit(std::forward<cmd>(fn),
-              allocate_cpu_heap(list.calculateCommandSize<cmd>(), 16));
+    list.emit(std::forward<cmd>(fn));
   }
 
 #pragma endregion
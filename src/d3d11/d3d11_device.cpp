@@ -1032,6 +1032,10 @@ public:
     return S_OK;
   };
 
+  void PrioritizeWork(ThreadpoolWork *pWork) override {
+    pipeline_cache_->PrioritizeWork(pWork);
+  };
+
   Device &GetDXMTDevice() override { return device_; };
 
   void CreateCommandList(ID3D11CommandList** pCommandList) final {
@@ -26,6 +26,7 @@ class MTLCompiledGraphicsPipeline;
 class MTLCompiledComputePipeline;
 class MTLCompiledGeometryPipeline;
 class MTLCompiledTessellationMeshPipeline;
+class ThreadpoolWork;
 
 class MTLD3D11Device : public ID3D11Device5 {
 public:
@@ -50,6 +51,12 @@ public:
                                              MTLCompiledTessellationMeshPipeline *
                                                  *ppPipeline) = 0;
 
+  /**
+  Moves a pipeline (and whatever it's waiting for) to the front of the
+  compilation queue, because the calling thread is about to block on it
+  */
+  virtual void PrioritizeWork(ThreadpoolWork *pWork) = 0;
+
   virtual bool IsTraced() = 0;
 
   virtual Device& GetDXMTDevice() = 0;
@@ -1,4 +1,5 @@
 #include "Metal.hpp"
+#include "config/config.hpp"
 #include "d3d11_private.h"
 #include "d3d11_pipeline.hpp"
 #include "d3d11_device.hpp"
@@ -18,7 +19,7 @@ public:
         topology_class(pDesc->TopologyClass), device_(pDevice),
         pBlendState(pDesc->BlendState),
         RasterizationEnabled(pDesc->RasterizationEnabled),
-        SampleCount(pDesc->SampleCount) {
+        SampleCount(pDesc->SampleCount), upgrade_(this), vertex_shader_(pDesc->VertexShader) {
     uint32_t unorm_output_reg_mask = 0;
     for (unsigned i = 0; i < num_rtvs; i++) {
       rtv_formats[i] = pDesc->ColorAttachmentFormats[i];
@@ -47,7 +48,16 @@ public:
   }
 
   void GetPipeline(MTL_COMPILED_GRAPHICS_PIPELINE *pPipeline) final {
+    if (!ready_.load(std::memory_order_acquire))
+      device_->PrioritizeWork(this);
     ready_.wait(false, std::memory_order_acquire);
+    if (optimized_ready_.load(std::memory_order_acquire)) {
+      GetTieredCompilationStatistics().optimized_pipeline_uses.fetch_add(1, std::memory_order_relaxed);
+      *pPipeline = {optimized_state_};
+      return;
+    }
+    if (OptimizedVertexShader)
+      GetTieredCompilationStatistics().fast_pipeline_uses.fetch_add(1, std::memory_order_relaxed);
     *pPipeline = {state_};
   }
 
@@ -55,7 +65,6 @@ public:
 
     TRACE("Start compiling 1 PSO");
 
-    WMT::Reference<WMT::Error> err;
     MTL_COMPILED_SHADER vs, ps;
     if (!VertexShader->GetShader(&vs)) {
       return VertexShader;
@@ -64,6 +73,75 @@ public:
       return PixelShader;
     }
 
+    state_ = CreatePipelineState(vs, ps);
+
+    if (state_ == nullptr)
+      return this;
+
+    TRACE("Compiled 1 PSO");
+
+    CompiledShader *optimized_vs = VertexShader->GetOptimizedShader();
+    CompiledShader *optimized_ps = PixelShader ? PixelShader->GetOptimizedShader() : nullptr;
+    if (optimized_vs || optimized_ps) {
+      OptimizedVertexShader = optimized_vs ? optimized_vs : VertexShader;
+      OptimizedPixelShader = optimized_ps ? optimized_ps : PixelShader;
+      vertex_shader_->schedule_background_work(&upgrade_);
+    }
+
+    return this;
+  }
+
+  bool GetIsDone() { return ready_; }
+
+  void SetIsDone(bool state) {
+    ready_.store(state);
+    ready_.notify_all();
+  }
+
+private:
+  /**
+  Rebuilds the pipeline from the optimized shaders and publishes it, while
+  the one built from the fast tier stays in use until then.
+   */
+  class UpgradeWork : public ThreadpoolWork {
+  public:
+    UpgradeWork(MTLCompiledGraphicsPipelineImpl *pipeline) : pipeline_(pipeline) {}
+
+    ThreadpoolWork *RunThreadpoolWork() {
+      return pipeline_->RunUpgrade();
+    }
+
+    bool GetIsDone() { return done_; }
+
+    void SetIsDone(bool state) { done_.store(state); }
+
+  private:
+    MTLCompiledGraphicsPipelineImpl *pipeline_;
+    std::atomic_bool done_;
+  };
+
+  ThreadpoolWork *RunUpgrade() {
+    MTL_COMPILED_SHADER vs, ps;
+    if (!OptimizedVertexShader->GetShader(&vs)) {
+      return OptimizedVertexShader;
+    }
+    if (OptimizedPixelShader && !OptimizedPixelShader->GetShader(&ps)) {
+      return OptimizedPixelShader;
+    }
+
+    optimized_state_ = CreatePipelineState(vs, ps);
+
+    if (optimized_state_ != nullptr) {
+      optimized_ready_.store(true, std::memory_order_release);
+      GetTieredCompilationStatistics().pipelines_upgraded.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    return &upgrade_;
+  }
+
+  WMT::Reference<WMT::RenderPipelineState>
+  CreatePipelineState(MTL_COMPILED_SHADER &vs, MTL_COMPILED_SHADER &ps) {
+    WMT::Reference<WMT::Error> err;
     WMTRenderPipelineInfo info;
     WMT::InitializeRenderPipelineInfo(info);
 
@@ -96,26 +174,15 @@ public:
     info.immutable_vertex_buffers = (1 << 16) | (1 << 29) | (1 << 30);
     info.immutable_fragment_buffers = (1 << 29) | (1 << 30);
 
-    state_ = device_->GetMTLDevice().newRenderPipelineState(info, err);
+    auto state = device_->GetMTLDevice().newRenderPipelineState(info, err);
 
-    if (state_ == nullptr) {
+    if (state == nullptr) {
       ERR("Failed to create PSO: ", err.description().getUTF8String());
-      return this;
     }
 
-    TRACE("Compiled 1 PSO");
-
-    return this;
-  }
-
-  bool GetIsDone() { return ready_; }
-
-  void SetIsDone(bool state) {
-    ready_.store(state);
-    ready_.notify_all();
+    return state;
   }
 
-private:
   UINT num_rtvs;
   UINT ps_valid_render_targets;
   WMTPixelFormat rtv_formats[8];
@@ -129,8 +196,20 @@ private:
   WMT::Reference<WMT::RenderPipelineState> state_;
   bool RasterizationEnabled;
   UINT SampleCount;
+  UpgradeWork upgrade_;
+  ManagedShader vertex_shader_;
+  CompiledShader *OptimizedVertexShader = nullptr;
+  CompiledShader *OptimizedPixelShader = nullptr;
+  std::atomic_bool optimized_ready_ = false;
+  WMT::Reference<WMT::RenderPipelineState> optimized_state_;
 };
 
+bool
+IsAsyncPipelineCompilationEnabled() {
+  static bool enabled = Config::getInstance().getOption<bool>("d3d11.asyncPipelineCompilation", false);
+  return enabled;
+}
+
 std::unique_ptr<MTLCompiledGraphicsPipeline>
 CreateGraphicsPipeline(MTLD3D11Device *pDevice,
                        MTL_GRAPHICS_PIPELINE_DESC *pDesc) {
@@ -151,6 +230,8 @@ public:
   }
 
   void GetPipeline(MTL_COMPILED_COMPUTE_PIPELINE *pPipeline) final {
+    if (!ready_.load(std::memory_order_acquire))
+      device_->PrioritizeWork(this);
     ready_.wait(false, std::memory_order_acquire);
     *pPipeline = {state_};
   }
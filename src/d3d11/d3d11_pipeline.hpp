@@ -174,4 +174,10 @@ CreateGeometryPipeline(MTLD3D11Device *pDevice, MTL_GRAPHICS_PIPELINE_DESC *pDes
 std::unique_ptr<MTLCompiledTessellationMeshPipeline>
 CreateTessellationMeshPipeline(MTLD3D11Device *pDevice, MTL_GRAPHICS_PIPELINE_DESC *pDesc);
 
+/**
+Whether draws should be skipped instead of waiting for their graphics
+pipeline to compile
+*/
+bool IsAsyncPipelineCompilationEnabled();
+
 }; // namespace dxmt
\ No newline at end of file
@@ -1,16 +1,23 @@
 #include "d3d11_pipeline_cache.hpp"
 #include "airconv_public.h"
+#include "config/config.hpp"
 #include "d3d11_device.hpp"
 #include "d3d11_shader.hpp"
 #include "d3d11_pipeline.hpp"
+#include "d3d11_pipeline_log.hpp"
 #include "dxmt_shader_cache.hpp"
 #include "dxmt_tasks.hpp"
+#include "util_concurrent_map.hpp"
 #include "log/log.hpp"
 #include "sha1/sha1_util.hpp"
+#include "util_hash128.hpp"
 #include "../d3d10/d3d10_shader.hpp"
 #include "../d3d10/d3d10_input_layout.hpp"
+#include <algorithm>
+#include <array>
 #include <cstring>
 #include <shared_mutex>
+#include <unordered_set>
 
 namespace dxmt {
 
@@ -68,31 +75,95 @@ template <> struct task_trait<ThreadpoolWork *> {
 class PipelineCache : public MTLD3D11PipelineCacheBase {
 
   class CachedSM50Shader final : public Shader {
+    /**
+    SM50Initialize is deferred to the scheduler, so that creating a shader
+    only costs a hash. Accessors that need its result wait for it, or run it
+    themselves if no worker has picked it up yet.
+     */
+    class InitializeWork : public ThreadpoolWork {
+    public:
+      InitializeWork(CachedSM50Shader *shader) : shader_(shader) {}
+
+      ThreadpoolWork *RunThreadpoolWork() {
+        shader_->Initialize(false);
+        return this;
+      }
+
+      bool GetIsDone() { return done_; }
+
+      void SetIsDone(bool state) { done_.store(state); }
+
+    private:
+      CachedSM50Shader *shader_;
+      std::atomic_bool done_;
+    };
+
+    enum InitializeState : uint32_t {
+      kInitializePending,
+      kInitializeRunning,
+      kInitializeDone,
+    };
+
     PipelineCache *cache;
     sm50_shader_t shader = nullptr;
     Sha1Digest sha1_;
-    MTL_SHADER_REFLECTION reflection_;
-    MTL_SM50_SHADER_ARGUMENT *arguments_info_buffer;
-    std::unordered_map<ShaderVariant, std::unique_ptr<CompiledShader>> variants;
-
-  public:
-    CachedSM50Shader(PipelineCache *cache, sm50_shader_t shader_transfered,
-                     const Sha1Digest &hash, MTL_SHADER_REFLECTION &reflection)
-        : cache(cache), shader(shader_transfered), sha1_(hash),
-          reflection_(reflection) {
-      if (reflection_.NumConstantBuffers + reflection_.NumArguments) {
-        arguments_info_buffer = (MTL_SM50_SHADER_ARGUMENT *)malloc(
-            sizeof(MTL_SM50_SHADER_ARGUMENT) *
-            (reflection_.NumConstantBuffers + reflection_.NumArguments));
-        SM50GetArgumentsInfo(shader, arguments_info_buffer,
-                             arguments_info_buffer +
-                                 reflection_.NumConstantBuffers);
-      } else {
-        arguments_info_buffer = nullptr;
+    MTL_SHADER_REFLECTION reflection_ = {};
+    MTL_SM50_SHADER_ARGUMENT *arguments_info_buffer = nullptr;
+    ConcurrentHashMap<ShaderVariant, std::unique_ptr<CompiledShader>> variants{
+        &GetPipelineLookupStatistics().variants, 3
+    };
+    std::vector<uint8_t> bytecode_;
+    std::atomic_uint32_t initialize_state_ = kInitializePending;
+    InitializeWork initialize_;
+
+    void Initialize(bool wait) {
+      uint32_t state = kInitializePending;
+      if (initialize_state_.compare_exchange_strong(state, kInitializeRunning, std::memory_order_acquire)) {
+        sm50_error_t err;
+        if (SM50Initialize(bytecode_.data(), bytecode_.size(), &shader, &reflection_, &err)) {
+          ERR("Failed to initialize shader: ", SM50GetErrorMessageString(err));
+          SM50FreeError(err);
+          shader = nullptr;
+          reflection_ = {};
+        } else if (reflection_.NumConstantBuffers + reflection_.NumArguments) {
+          arguments_info_buffer = (MTL_SM50_SHADER_ARGUMENT *)malloc(
+              sizeof(MTL_SM50_SHADER_ARGUMENT) *
+              (reflection_.NumConstantBuffers + reflection_.NumArguments));
+          SM50GetArgumentsInfo(shader, arguments_info_buffer,
+                               arguments_info_buffer +
+                                   reflection_.NumConstantBuffers);
+        }
+#ifndef DXMT_DEBUG
+        // kept for dump() in debug builds
+        bytecode_ = {};
+#endif
+        initialize_state_.store(kInitializeDone, std::memory_order_release);
+        initialize_state_.notify_all();
+        return;
       }
+      while (wait && state != kInitializeDone) {
+        initialize_state_.wait(state, std::memory_order_acquire);
+        state = initialize_state_.load(std::memory_order_acquire);
+      }
+    }
+
+    void WaitInitialized() {
+      if (initialize_state_.load(std::memory_order_acquire) != kInitializeDone)
+        Initialize(true);
     }
 
+  public:
+    CachedSM50Shader(PipelineCache *cache, const void *pBytecode,
+                     uint32_t BytecodeLength, const Sha1Digest &hash)
+        : cache(cache), sha1_(hash),
+          bytecode_((const uint8_t *)pBytecode,
+                    (const uint8_t *)pBytecode + BytecodeLength),
+          initialize_(this) {}
+
     ~CachedSM50Shader() {
+      // shaders go with the cache, which has joined its workers by then: the
+      // work has either finished or is left in a queue that is never popped
+      D3D11_ASSERT(initialize_state_.load(std::memory_order_acquire) != kInitializeRunning);
       if (shader) {
         SM50Destroy(shader);
         if (arguments_info_buffer)
@@ -104,38 +175,46 @@ class PipelineCache : public MTLD3D11PipelineCacheBase {
     CachedSM50Shader(CachedSM50Shader &&moved) = delete;
     CachedSM50Shader(const CachedSM50Shader &copy) = delete;
 
-    virtual sm50_shader_t handle() { return shader; };
-    virtual MTL_SHADER_REFLECTION &reflection() { return reflection_; }
+    ThreadpoolWork *initialize_work() { return &initialize_; }
+
+    virtual sm50_shader_t handle() {
+      WaitInitialized();
+      return shader;
+    };
+    virtual MTL_SHADER_REFLECTION &reflection() {
+      WaitInitialized();
+      return reflection_;
+    }
     virtual MTL_SM50_SHADER_ARGUMENT *constant_buffers_info() {
+      WaitInitialized();
       return arguments_info_buffer;
     };
     virtual MTL_SM50_SHADER_ARGUMENT *arguments_info() {
+      WaitInitialized();
       return arguments_info_buffer + reflection_.NumConstantBuffers;
     };
     virtual CompiledShader *get_shader(ShaderVariant variant) {
-      auto c = variants.insert({variant, nullptr});
-      if (c.second) {
-        c.first->second = std::visit(
+      // replayed pipelines are created on worker threads
+      auto [compiled, created] = variants.findOrInsert(variant, [&] {
+        return std::visit(
             [=, this](auto var) {
               return CreateVariantShader(cache->device, this, var);
             },
             variant);
-        cache->scheduler_.submit(c.first->second.get());
-      }
-      return c.first->second.get();
+      });
+      if (created)
+        cache->scheduler_.submit(compiled->get());
+      return compiled->get();
     }
     virtual const Sha1Digest &sha1() { return sha1_; };
 
 #ifdef DXMT_DEBUG
-    void *bytecode;
-    size_t bytecode_length;
-
     virtual void dump() {
       std::fstream dump_out;
       dump_out.open("shader_dump_" + sha1_.string() + ".cso",
                     std::ios::out | std::ios::binary);
       if (dump_out) {
-        dump_out.write((char *)bytecode, bytecode_length);
+        dump_out.write((char *)bytecode_.data(), bytecode_.size());
       }
       dump_out.close();
       WARN("shader dumped to ./shader_dump_" + sha1_.string() + ".cso");
@@ -145,15 +224,22 @@ class PipelineCache : public MTLD3D11PipelineCacheBase {
 #endif
 
     virtual WMT::Reference<WMT::DispatchData> find_cached_variant(Sha1Digest &variant_digest) final {
-      auto reader = cache->scache_.getReader();
-      if (reader)
-        return reader->get(std::make_pair(sha1_, variant_digest));
-      return {};
+      return cache->scache_.find({sha1_, variant_digest});
     };
     virtual void update_cached_variant(Sha1Digest &variant_digest, WMT::DispatchData data) final {
-      auto writer = cache->scache_.getWriter();
-      if (writer)
-        writer->set(std::make_pair(sha1_, variant_digest), data);
+      cache->scache_.insert({sha1_, variant_digest}, data);
+    }
+    virtual void schedule_background_work(ThreadpoolWork *work) final {
+      cache->scheduler_.submit_background(work);
+    }
+    virtual std::shared_ptr<ShaderLibraryBatch>
+    join_library_batch(WMT::DispatchData data, const std::string &func_name) final {
+      if (!IsShaderLibraryBatchingEnabled())
+        return nullptr;
+      auto [batch, created] = cache->library_batcher_.join(data, func_name);
+      if (created)
+        cache->scheduler_.submit(batch.get());
+      return batch;
     }
   };
 
@@ -188,7 +274,33 @@ class PipelineCache : public MTLD3D11PipelineCacheBase {
     uint32_t input_slot_mask_;
   };
 
+  /**
+  Recreates a pipeline from the log, once all of its shaders exist.
+   */
+  class ReplayWork : public ThreadpoolWork {
+  public:
+    ReplayWork(PipelineCache *cache, const PipelineRecord *record) : cache_(cache), record_(record) {}
+
+    ThreadpoolWork *RunThreadpoolWork() {
+      cache_->Replay(*record_);
+      return this;
+    }
+
+    bool GetIsDone() { return done_; }
+
+    void SetIsDone(bool state) { done_.store(state); }
+
+  private:
+    PipelineCache *cache_;
+    const PipelineRecord *record_;
+    std::atomic_bool done_;
+  };
+
   ShaderCache& scache_;
+  PipelineLog& log_;
+
+  /* outlives the workers, which may still run its batches */
+  ShaderLibraryBatcher library_batcher_;
 
   task_scheduler<ThreadpoolWork *> scheduler_;
 
@@ -202,23 +314,262 @@ class PipelineCache : public MTLD3D11PipelineCacheBase {
       so_layouts;
   dxmt::mutex mutex_so_;
 
+  /**
+  Identifies bytecode without keeping it around, which the shader doesn't
+  once it's initialized: Hash128 and the length, plus the MD5-based checksum
+  that the compiler stores in the DXBC header.
+   */
+  struct ShaderContentKey {
+    Hash128 hash;
+    uint32_t length;
+    std::array<uint8_t, 16> checksum;
+
+    ShaderContentKey(const void *pBytecode, uint32_t BytecodeLength)
+        : hash(Hash128::compute(pBytecode, BytecodeLength)), length(BytecodeLength) {
+      std::memcpy(checksum.data(), (const char *)pBytecode + 4, checksum.size());
+    }
+
+    bool operator==(const ShaderContentKey &other) const = default;
+  };
+
+  struct ShaderContentKeyHash {
+    size_t
+    operator()(const ShaderContentKey &key) const noexcept {
+      return std::hash<Hash128>{}(key.hash);
+    }
+  };
+
   std::unordered_map<Sha1Digest, std::unique_ptr<CachedSM50Shader>> shaders_;
+  std::unordered_map<ShaderContentKey, CachedSM50Shader *, ShaderContentKeyHash> shaders_by_content_;
   std::shared_mutex mutex_shares;
 
-  std::unordered_map<MTL_GRAPHICS_PIPELINE_DESC, std::unique_ptr<MTLCompiledGraphicsPipeline>> pipelines_;
-  dxmt::mutex mutex_;
+  /* looked up on every pipeline change, without taking a lock */
+  template <typename Key, typename Pipeline>
+  using PipelineMap = ConcurrentHashMap<Key, std::unique_ptr<Pipeline>>;
+
+  PipelineMap<MTL_GRAPHICS_PIPELINE_DESC, MTLCompiledGraphicsPipeline> pipelines_{
+      &GetPipelineLookupStatistics().pipelines, 8
+  };
+  PipelineMap<MTL_GRAPHICS_PIPELINE_DESC, MTLCompiledGeometryPipeline> pipelines_gs_{
+      &GetPipelineLookupStatistics().pipelines
+  };
+  PipelineMap<MTL_GRAPHICS_PIPELINE_DESC, MTLCompiledTessellationMeshPipeline> pipelines_ts_{
+      &GetPipelineLookupStatistics().pipelines
+  };
+  PipelineMap<ManagedShader, MTLCompiledComputePipeline> pipelines_cs_{&GetPipelineLookupStatistics().pipelines};
+
+  std::vector<bool> replay_scheduled_;
+  std::vector<std::unique_ptr<ReplayWork>> replay_works_;
+  /* replayed pipelines not requested by the application yet */
+  std::unordered_set<const void *> replayed_pipelines_;
+  std::atomic_uint32_t replayed_pending_ = 0;
+  dxmt::mutex mutex_replay_;
+
+  ManagedShader FindShader(const Sha1Digest &sha1) {
+    if (IsNullDigest(sha1))
+      return nullptr;
+    std::shared_lock<std::shared_mutex> lock(mutex_shares);
+    auto iter = shaders_.find(sha1);
+    return iter != shaders_.end() ? iter->second.get() : nullptr;
+  }
+
+  void ScheduleReplay(const Sha1Digest &sha1) {
+    auto indices = log_.recordsUsingShader(sha1);
+    if (!indices)
+      return;
+    std::lock_guard<dxmt::mutex> lock(mutex_replay_);
+    for (auto index : *indices) {
+      if (replay_scheduled_[index])
+        continue;
+      auto &header = log_.record(index).Header;
+      bool ready = true;
+      for (auto shader : {&header.VertexShader, &header.HullShader, &header.DomainShader, &header.GeometryShader,
+                          &header.PixelShader, &header.ComputeShader}) {
+        if (!IsNullDigest(*shader) && !FindShader(*shader)) {
+          ready = false;
+          break;
+        }
+      }
+      if (!ready)
+        continue;
+      replay_scheduled_[index] = true;
+      replay_works_.push_back(std::make_unique<ReplayWork>(this, &log_.record(index)));
+      scheduler_.submit_background(replay_works_.back().get());
+    }
+  }
+
+  void Replay(const PipelineRecord &record) {
+    auto &header = record.Header;
+    if (header.Kind == PipelineKind::Compute) {
+      MTL_COMPUTE_PIPELINE_DESC desc{FindShader(header.ComputeShader)};
+      if (!desc.ComputeShader)
+        return;
+      FindOrCreatePipeline(pipelines_cs_, desc.ComputeShader, [&] {
+        return CreateComputePipeline(device, desc.ComputeShader);
+      }, true);
+      return;
+    }
+
+    MTL_GRAPHICS_PIPELINE_DESC desc = {};
+    desc.VertexShader = FindShader(header.VertexShader);
+    desc.HullShader = FindShader(header.HullShader);
+    desc.DomainShader = FindShader(header.DomainShader);
+    desc.GeometryShader = FindShader(header.GeometryShader);
+    desc.PixelShader = FindShader(header.PixelShader);
+    if (!desc.VertexShader)
+      return;
+    if (header.HasInputLayout)
+      desc.InputLayout = GetInputLayout(MTL_INPUT_LAYOUT_DESC(record.InputLayout));
+    if (header.HasBlendState) {
+      if (FAILED(blend_states.CreateStateObject(&header.BlendState, &desc.BlendState)))
+        return;
+      // kept alive by the state object cache, like any blend state a pipeline refers to
+      desc.BlendState->Release();
+    }
+    desc.SOLayout = nullptr;
+    desc.NumColorAttachments = header.NumColorAttachments;
+    memcpy(desc.ColorAttachmentFormats, header.ColorAttachmentFormats, sizeof(desc.ColorAttachmentFormats));
+    desc.DepthStencilFormat = header.DepthStencilFormat;
+    desc.TopologyClass = header.TopologyClass;
+    desc.RasterizationEnabled = header.RasterizationEnabled;
+    desc.SampleCount = header.SampleCount;
+    desc.GSStripTopology = header.GSStripTopology;
+    desc.IndexBufferFormat = header.IndexBufferFormat;
+    desc.SampleMask = header.SampleMask;
+    desc.GSPassthrough = header.GSPassthrough;
+
+    switch (header.Kind) {
+    case PipelineKind::Graphics:
+      FindOrCreatePipeline(pipelines_, desc, [&] { return CreateGraphicsPipeline(device, &desc); }, true);
+      break;
+    case PipelineKind::Geometry:
+      FindOrCreatePipeline(pipelines_gs_, desc, [&] { return CreateGeometryPipeline(device, &desc); }, true);
+      break;
+    case PipelineKind::Tessellation:
+      FindOrCreatePipeline(
+          pipelines_ts_, desc, [&] { return CreateTessellationMeshPipeline(device, &desc); }, true
+      );
+      break;
+    default:
+      break;
+    }
+  }
+
+  void RecordPipeline(PipelineKind kind, const MTL_GRAPHICS_PIPELINE_DESC *pDesc, ManagedShader ComputeShader) {
+    if (!log_.enabled())
+      return;
+    PipelineRecord record;
+    auto &header = record.Header;
+    // zeroed padding, the record is hashed as a whole
+    std::memset(&header, 0, sizeof(header));
+    header.Kind = kind;
+    if (ComputeShader) {
+      header.ComputeShader = ComputeShader->sha1();
+      log_.add(record);
+      return;
+    }
+    // stream output layouts are not recorded
+    if (pDesc->SOLayout)
+      return;
+    auto digest = [](ManagedShader shader) { return shader ? shader->sha1() : Sha1Digest{}; };
+    header.VertexShader = digest(pDesc->VertexShader);
+    header.HullShader = digest(pDesc->HullShader);
+    header.DomainShader = digest(pDesc->DomainShader);
+    header.GeometryShader = digest(pDesc->GeometryShader);
+    header.PixelShader = digest(pDesc->PixelShader);
+    if (pDesc->InputLayout) {
+      MTL_SHADER_INPUT_LAYOUT_ELEMENT_DESC *elements;
+      uint32_t num_elements = pDesc->InputLayout->input_layout_element(&elements);
+      record.InputLayout.assign(elements, elements + num_elements);
+      header.HasInputLayout = 1;
+      header.NumInputElements = num_elements;
+    }
+    if (pDesc->BlendState) {
+      pDesc->BlendState->GetDesc1(&header.BlendState);
+      header.HasBlendState = 1;
+    }
+    header.NumColorAttachments = pDesc->NumColorAttachments;
+    memcpy(header.ColorAttachmentFormats, pDesc->ColorAttachmentFormats, sizeof(header.ColorAttachmentFormats));
+    header.DepthStencilFormat = pDesc->DepthStencilFormat;
+    header.TopologyClass = pDesc->TopologyClass;
+    header.RasterizationEnabled = pDesc->RasterizationEnabled;
+    header.SampleCount = pDesc->SampleCount;
+    header.GSStripTopology = pDesc->GSStripTopology;
+    header.IndexBufferFormat = pDesc->IndexBufferFormat;
+    header.SampleMask = pDesc->SampleMask;
+    header.GSPassthrough = pDesc->GSPassthrough;
+    log_.add(record);
+  }
 
-  std::unordered_map<MTL_GRAPHICS_PIPELINE_DESC, std::unique_ptr<MTLCompiledGeometryPipeline>> pipelines_gs_;
-  dxmt::mutex mutex_gs_;
+  /**
+  `replay` is set when the pipeline is created ahead of time from the log,
+  and the returned flag tells whether the pipeline was created by this call.
+   */
+  template <typename Key, typename Pipeline, typename Create>
+  std::pair<Pipeline *, bool>
+  FindOrCreatePipeline(PipelineMap<Key, Pipeline> &pipelines, const Key &key, Create &&create, bool replay) {
+    auto [value, created] = pipelines.findOrInsert(key, create);
+    Pipeline *pipeline = value->get();
+    if (!created)
+      return {pipeline, false};
+    scheduler_.submit(pipeline);
+    if (replay) {
+      std::lock_guard<dxmt::mutex> lock(mutex_replay_);
+      replayed_pipelines_.insert(pipeline);
+      replayed_pending_.fetch_add(1, std::memory_order_relaxed);
+      PipelineLog::statistics().replayed.fetch_add(1, std::memory_order_relaxed);
+    }
+    return {pipeline, true};
+  }
 
-  std::unordered_map<MTL_GRAPHICS_PIPELINE_DESC, std::unique_ptr<MTLCompiledTessellationMeshPipeline>> pipelines_ts_;
-  dxmt::mutex mutex_ts_;
+  void CountReplayHit(ThreadpoolWork *pipeline) {
+    if (!replayed_pending_.load(std::memory_order_relaxed))
+      return;
+    std::lock_guard<dxmt::mutex> lock(mutex_replay_);
+    if (replayed_pipelines_.erase(pipeline)) {
+      replayed_pending_.fetch_sub(1, std::memory_order_relaxed);
+      PipelineLog::statistics().replay_hits.fetch_add(1, std::memory_order_relaxed);
+      // the application wants it now, no longer speculative
+      scheduler_.prioritize(pipeline, task_priority::visible);
+    }
+  }
 
-  std::unordered_map<ManagedShader, std::unique_ptr<MTLCompiledComputePipeline>> pipelines_cs_;
-  dxmt::mutex mutex_cs_;
+  ManagedInputLayout GetInputLayout(MTL_INPUT_LAYOUT_DESC &&buffer) {
+    std::lock_guard<dxmt::mutex> lock(mutex_ia_);
+    if (!input_layouts.contains(buffer)) {
+      uint32_t input_slot_mask = 0;
+      for (auto &element : buffer) {
+        input_slot_mask |= (1 << element.Slot);
+      }
+      input_layouts.emplace(buffer, std::make_unique<CachedInputLayout>(
+                                        MTL_INPUT_LAYOUT_DESC(buffer), input_slot_mask));
+    }
+    return input_layouts.at(buffer).get();
+  }
 
   CachedSM50Shader *CreateShader(const void *pBytecode,
                                  uint32_t BytecodeLength) {
+    // the full validation happens in SM50Initialize, which is deferred
+    if (!pBytecode || BytecodeLength < 32) {
+      ERR("Failed to initialize shader: invalid DXBC container");
+      return nullptr;
+    }
+    uint32_t container_size;
+    std::memcpy(&container_size, (const char *)pBytecode + 24, sizeof(container_size));
+    if (container_size != BytecodeLength || std::memcmp(pBytecode, "DXBC", 4)) {
+      ERR("Failed to initialize shader: invalid DXBC container");
+      return nullptr;
+    }
+    // applications often create the same shader again, SHA-1 is only needed
+    // the first time, for the shader cache
+    ShaderContentKey content_key(pBytecode, BytecodeLength);
+    {
+      std::shared_lock<std::shared_mutex> lock(mutex_shares);
+      auto result = shaders_by_content_.find(content_key);
+      if (result != shaders_by_content_.end()) {
+        return result->second;
+      }
+    }
     auto sha1 = Sha1HashState::compute(pBytecode, BytecodeLength);
     {
       std::shared_lock<std::shared_mutex> lock(mutex_shares);
@@ -227,28 +578,21 @@ class PipelineCache : public MTLD3D11PipelineCacheBase {
         return shaders_.at(sha1).get();
       }
     }
-    sm50_error_t err;
-    sm50_shader_t sm50;
-    MTL_SHADER_REFLECTION reflection;
-    if (SM50Initialize(pBytecode, BytecodeLength, &sm50, &reflection, &err)) {
-      ERR("Failed to initialize shader: ", SM50GetErrorMessageString(err));
-      SM50FreeError(err);
-      return nullptr;
-    }
-    auto shader = std::make_unique<CachedSM50Shader>(this, sm50, sha1, reflection);
+    auto shader = std::make_unique<CachedSM50Shader>(this, pBytecode, BytecodeLength, sha1);
+    CachedSM50Shader *inserted;
     {
       std::unique_lock<std::shared_mutex> lock(mutex_shares);
       auto result = shaders_.find(sha1);
       if (result != shaders_.end()) {
         return shaders_.at(sha1).get();
       }
-#ifdef DXMT_DEBUG
-      shader->bytecode = malloc(BytecodeLength);
-      shader->bytecode_length = BytecodeLength;
-      memcpy(shader->bytecode, pBytecode, BytecodeLength);
-#endif
-      return shaders_.emplace(sha1, std::move(shader)).first->second.get();
+      inserted = shaders_.emplace(sha1, std::move(shader)).first->second.get();
+      // the key can only be taken by a different bytecode on a collision
+      shaders_by_content_.emplace(content_key, inserted);
     }
+    scheduler_.submit(inserted->initialize_work());
+    ScheduleReplay(sha1);
+    return inserted;
   }
 
   virtual HRESULT AddVertexShader(const void *pBytecode,
@@ -323,7 +667,6 @@ class PipelineCache : public MTLD3D11PipelineCacheBase {
                          const D3D11_INPUT_ELEMENT_DESC *pInputElementDesc,
                          UINT NumElements,
                          IMTLD3D11InputLayout **ppInputLayout) override {
-    std::lock_guard<dxmt::mutex> lock(mutex_ia_);
     std::vector<MTL_SHADER_INPUT_LAYOUT_ELEMENT_DESC> buffer(NumElements);
     uint32_t num_metal_ia_elements;
     HRESULT hr;
@@ -333,16 +676,8 @@ class PipelineCache : public MTLD3D11PipelineCacheBase {
       return hr;
     }
     buffer.resize(num_metal_ia_elements);
-    if (!input_layouts.contains(buffer)) {
-      uint32_t input_slot_mask = 0;
-      for (auto &element : buffer) {
-        input_slot_mask |= (1 << element.Slot);
-      }
-      input_layouts.emplace(buffer, std::make_unique<CachedInputLayout>(
-                                        std::move(buffer), input_slot_mask));
-    }
     *ppInputLayout =
-        ref(new MTLD3D11InputLayout(device, input_layouts.at(buffer).get()));
+        ref(new MTLD3D11InputLayout(device, GetInputLayout(std::move(buffer))));
     return hr;
   }
 
@@ -379,82 +714,81 @@ class PipelineCache : public MTLD3D11PipelineCacheBase {
 
   void GetGraphicsPipeline(MTL_GRAPHICS_PIPELINE_DESC *pDesc,
                            MTLCompiledGraphicsPipeline **ppPipeline) override {
-    std::lock_guard<dxmt::mutex> lock(mutex_);
-
-    if (auto iter = pipelines_.find(*pDesc); iter != pipelines_.end()) {
-      *ppPipeline = iter->second.get();
-      return;
-    }
-    auto [iter, inserted] = pipelines_.insert({*pDesc, CreateGraphicsPipeline(device, pDesc)});
-    if (!inserted) {
-      D3D11_ASSERT(0 && "duplicated graphics pipeline");
-    } else {
-      scheduler_.submit(iter->second.get());
-    }
-    *ppPipeline = iter->second.get();
+    auto [pipeline, created] = FindOrCreatePipeline(pipelines_, *pDesc, [&] {
+      return CreateGraphicsPipeline(device, pDesc);
+    }, false);
+    if (created)
+      RecordPipeline(PipelineKind::Graphics, pDesc, nullptr);
+    else
+      CountReplayHit(pipeline);
+    *ppPipeline = pipeline;
   }
 
   void GetGeometryPipeline(
       MTL_GRAPHICS_PIPELINE_DESC *pDesc,
       MTLCompiledGeometryPipeline **ppPipeline) override {
-    std::lock_guard<dxmt::mutex> lock(mutex_gs_);
-
-    if (auto iter = pipelines_gs_.find(*pDesc); iter != pipelines_gs_.end()) {
-      *ppPipeline = iter->second.get();
-      return;
-    }
-    auto [iter, inserted] = pipelines_gs_.insert({*pDesc, CreateGeometryPipeline(device, pDesc)});
-    if (!inserted) {
-      D3D11_ASSERT(0 && "duplicated geometry pipeline");
-    } else {
-      scheduler_.submit(iter->second.get());
-    }
-    *ppPipeline = iter->second.get();
+    auto [pipeline, created] = FindOrCreatePipeline(pipelines_gs_, *pDesc, [&] {
+      return CreateGeometryPipeline(device, pDesc);
+    }, false);
+    if (created)
+      RecordPipeline(PipelineKind::Geometry, pDesc, nullptr);
+    else
+      CountReplayHit(pipeline);
+    *ppPipeline = pipeline;
   }
 
   void GetTessellationPipeline(MTL_GRAPHICS_PIPELINE_DESC * pDesc,
                                    MTLCompiledTessellationMeshPipeline *
                                        *ppPipeline) override {
-    std::lock_guard<dxmt::mutex> lock(mutex_ts_);
-
-    if (auto iter = pipelines_ts_.find(*pDesc); iter != pipelines_ts_.end()) {
-      *ppPipeline = iter->second.get();
-      return;
-    }
-    auto [iter, inserted] = pipelines_ts_.insert({*pDesc, CreateTessellationMeshPipeline(device, pDesc)});
-    if (!inserted) {
-      D3D11_ASSERT(0 && "duplicated tessellation pipeline");
-    } else {
-      scheduler_.submit(iter->second.get());
-    }
-    *ppPipeline = iter->second.get();
+    auto [pipeline, created] = FindOrCreatePipeline(pipelines_ts_, *pDesc, [&] {
+      return CreateTessellationMeshPipeline(device, pDesc);
+    }, false);
+    if (created)
+      RecordPipeline(PipelineKind::Tessellation, pDesc, nullptr);
+    else
+      CountReplayHit(pipeline);
+    *ppPipeline = pipeline;
   }
 
   void GetComputePipeline(MTL_COMPUTE_PIPELINE_DESC *pDesc,
                                   MTLCompiledComputePipeline **ppPipeline) override {
-   std::lock_guard<dxmt::mutex> lock(mutex_cs_);
+    auto [pipeline, created] = FindOrCreatePipeline(pipelines_cs_, pDesc->ComputeShader, [&] {
+      return CreateComputePipeline(device, pDesc->ComputeShader);
+    }, false);
+    if (created)
+      RecordPipeline(PipelineKind::Compute, nullptr, pDesc->ComputeShader);
+    else
+      CountReplayHit(pipeline);
+    *ppPipeline = pipeline;
+  }
 
-    if (auto iter = pipelines_cs_.find(pDesc->ComputeShader); iter != pipelines_cs_.end()) {
-      *ppPipeline = iter->second.get();
-      return;
-    }
-    auto [iter, inserted] = pipelines_cs_.insert({pDesc->ComputeShader, CreateComputePipeline(device, pDesc->ComputeShader)});
-    if (!inserted) {
-      D3D11_ASSERT(0 && "duplicated compute pipeline");
-    } else {
-      scheduler_.submit(iter->second.get());
-    }
-    *ppPipeline = iter->second.get();
+  void PrioritizeWork(ThreadpoolWork *pWork) override {
+    scheduler_.prioritize(pWork);
   }
 
 public:
   PipelineCache(MTLD3D11Device *pDevice) :
       scache_(ShaderCache::getInstance(pDevice->GetDXMTDevice().metalVersion())),
+      log_(PipelineLog::getInstance(pDevice->GetDXMTDevice().metalVersion())),
+      library_batcher_(pDevice),
+      scheduler_(std::max(Config::getInstance().getOption<int32_t>("d3d11.compilerThreads", 0), 0)),
       device(pDevice),
       blend_states(pDevice),
-      so_layouts(pDevice) {};
+      so_layouts(pDevice),
+      replay_scheduled_(log_.size()) {};
+
+  ~PipelineCache() {
+    // workers may still run or pick up work that refers to the members below
+    scheduler_.stop();
+  }
 };
 
+PipelineLookupStatistics &
+GetPipelineLookupStatistics() {
+  static PipelineLookupStatistics statistics;
+  return statistics;
+}
+
 std::unique_ptr<MTLD3D11PipelineCacheBase>
 InitializePipelineCache(MTLD3D11Device *device) {
   return std::make_unique<PipelineCache>(device);
@@ -1,6 +1,7 @@
 #pragma once
 #include "d3d11_input_layout.hpp"
 #include "d3d11_state_object.hpp"
+#include "util_concurrent_map.hpp"
 
 namespace dxmt {
 
@@ -29,8 +30,20 @@ public:
   virtual void
   GetTessellationPipeline(MTL_GRAPHICS_PIPELINE_DESC *pDesc, MTLCompiledTessellationMeshPipeline **ppPipeline) = 0;
   virtual void GetComputePipeline(MTL_COMPUTE_PIPELINE_DESC *pDesc, MTLCompiledComputePipeline **ppPipeline) = 0;
+  virtual void PrioritizeWork(ThreadpoolWork *pWork) = 0;
 };
 
+struct PipelineLookupStatistics {
+  ConcurrentHashMapStatistics pipelines;
+  ConcurrentHashMapStatistics variants;
+};
+
+/**
+Only lookups that miss take a lock, these count how often they do and how
+often they have to wait for it
+*/
+PipelineLookupStatistics &GetPipelineLookupStatistics();
+
 std::unique_ptr<MTLD3D11PipelineCacheBase>
 InitializePipelineCache(MTLD3D11Device *device);
 
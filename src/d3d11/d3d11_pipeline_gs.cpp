@@ -43,6 +43,8 @@ public:
   }
 
   void GetPipeline(MTL_COMPILED_GRAPHICS_PIPELINE *pPipeline) final {
+    if (!ready_.load(std::memory_order_acquire))
+      device_->PrioritizeWork(this);
     ready_.wait(false, std::memory_order_acquire);
     *pPipeline = {state_mesh_};
   }
@@ -0,0 +1,113 @@
+#include "d3d11_pipeline_log.hpp"
+#include "config/config.hpp"
+#include "dxmt_shader_cache.hpp"
+#include "log/log.hpp"
+#include "util_string.hpp"
+#include <cstring>
+#include <memory>
+
+namespace dxmt {
+
+std::vector<uint8_t>
+PipelineRecord::serialize() const {
+  std::vector<uint8_t> data(sizeof(Header) + InputLayout.size() * sizeof(MTL_SHADER_INPUT_LAYOUT_ELEMENT_DESC));
+  std::memcpy(data.data(), &Header, sizeof(Header));
+  if (!InputLayout.empty())
+    std::memcpy(data.data() + sizeof(Header), InputLayout.data(), data.size() - sizeof(Header));
+  return data;
+}
+
+bool
+PipelineRecord::deserialize(const void *data, size_t size) {
+  if (size < sizeof(Header))
+    return false;
+  std::memcpy(&Header, data, sizeof(Header));
+  if (size != sizeof(Header) + Header.NumInputElements * sizeof(MTL_SHADER_INPUT_LAYOUT_ELEMENT_DESC))
+    return false;
+  if (Header.Kind > PipelineKind::Compute || Header.NumColorAttachments > 8)
+    return false;
+  InputLayout.resize(Header.NumInputElements);
+  if (!InputLayout.empty())
+    std::memcpy(InputLayout.data(), (const uint8_t *)data + sizeof(Header), size - sizeof(Header));
+  return true;
+}
+
+PipelineLog &
+PipelineLog::getInstance(WMTMetalVersion version) {
+  static dxmt::mutex mutex;
+  static std::unordered_map<WMTMetalVersion, std::unique_ptr<PipelineLog>> logs;
+
+  std::lock_guard<dxmt::mutex> lock(mutex);
+  auto iter = logs.find(version);
+  if (iter == logs.end()) {
+    auto inserted = logs.insert({version, std::make_unique<PipelineLog>(version)});
+    return *inserted.first->second;
+  }
+  return *iter->second;
+}
+
+PipelineLogStatistics &
+PipelineLog::statistics() {
+  static PipelineLogStatistics statistics;
+  return statistics;
+}
+
+PipelineLog::PipelineLog(WMTMetalVersion metal_version) {
+  if (!Config::getInstance().getOption<bool>("d3d11.pipelineReplay", true))
+    return;
+  auto path = GetShaderCacheFilePath(str::format("pipelines_", (unsigned int)metal_version, ".db"));
+  if (path.empty())
+    return;
+  writer_ = WMT::CacheWriter::alloc_init(path.c_str(), kDXMTPipelineLogVersion);
+  auto reader = WMT::CacheReader::alloc_init(path.c_str(), kDXMTPipelineLogVersion);
+  if (!reader)
+    return;
+
+  std::vector<Sha1Digest> keys(reader.copyKeys<Sha1Digest>(nullptr, 0));
+  keys.resize(std::min<uint64_t>(keys.size(), reader.copyKeys(keys.data(), keys.size())));
+  std::vector<uint8_t> buffer;
+  for (auto &key : keys) {
+    auto data = reader.get(key);
+    if (!data)
+      continue;
+    buffer.resize(data.copyBytes(nullptr, 0));
+    data.copyBytes(buffer.data(), buffer.size());
+    PipelineRecord record;
+    if (!record.deserialize(buffer.data(), buffer.size()))
+      continue;
+    auto &header = record.Header;
+    size_t index = records_.size();
+    for (auto shader : {&header.VertexShader, &header.HullShader, &header.DomainShader, &header.GeometryShader,
+                        &header.PixelShader, &header.ComputeShader}) {
+      if (!IsNullDigest(*shader))
+        records_by_shader_[*shader].push_back(index);
+    }
+    records_.push_back(std::move(record));
+    known_.insert(key);
+  }
+  if (records_.size())
+    Logger::info(str::format("Loaded ", records_.size(), " pipelines to replay"));
+}
+
+const std::vector<size_t> *
+PipelineLog::recordsUsingShader(const Sha1Digest &shader) const {
+  auto iter = records_by_shader_.find(shader);
+  if (iter == records_by_shader_.end())
+    return nullptr;
+  return &iter->second;
+}
+
+void
+PipelineLog::add(const PipelineRecord &record) {
+  if (!writer_)
+    return;
+  auto data = record.serialize();
+  auto digest = Sha1HashState::compute(data.data(), data.size());
+  std::lock_guard<dxmt::mutex> lock(mutex_);
+  if (!known_.insert(digest).second)
+    return;
+  writer_.set(digest, WMT::MakeDispatchData(data.data(), data.size()));
+  statistics().recorded.fetch_add(1, std::memory_order_relaxed);
+}
+
+} // namespace dxmt
@@ -0,0 +1,130 @@
+#pragma once
+
+#include "Metal.hpp"
+#include "airconv_public.h"
+#include "d3d11_input_layout.hpp"
+#include "sha1/sha1_util.hpp"
+#include "thread.hpp"
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace dxmt {
+
+// also used by dxmt-precompile
+constexpr int kDXMTPipelineLogVersion = 1;
+
+enum class PipelineKind : uint32_t {
+  Graphics,
+  Geometry,
+  Tessellation,
+  Compute,
+};
+
+/**
+Fixed-size part of a pipeline record. Shaders are referenced by digest and
+left zeroed if absent, everything else is stored by content.
+*/
+struct PipelineRecordHeader {
+  PipelineKind Kind;
+  uint32_t NumInputElements;
+  Sha1Digest VertexShader;
+  Sha1Digest HullShader;
+  Sha1Digest DomainShader;
+  Sha1Digest GeometryShader;
+  Sha1Digest PixelShader;
+  Sha1Digest ComputeShader;
+  uint32_t HasInputLayout;
+  uint32_t HasBlendState;
+  D3D11_BLEND_DESC1 BlendState;
+  uint32_t NumColorAttachments;
+  WMTPixelFormat ColorAttachmentFormats[8];
+  WMTPixelFormat DepthStencilFormat;
+  WMTPrimitiveTopologyClass TopologyClass;
+  uint32_t RasterizationEnabled;
+  uint32_t SampleCount;
+  uint32_t GSStripTopology;
+  SM50_INDEX_BUFFER_FORAMT IndexBufferFormat;
+  uint32_t SampleMask;
+  uint32_t GSPassthrough;
+};
+
+// mirrored with plain types by dxmt-precompile (airconv_precompile.cpp)
+static_assert(sizeof(PipelineRecordHeader) == 532);
+static_assert(sizeof(MTL_SHADER_INPUT_LAYOUT_ELEMENT_DESC) == sizeof(SM50_IA_INPUT_ELEMENT));
+
+/**
+A pipeline as requested by the application, in a form that can be stored
+and recreated by another process.
+*/
+struct PipelineRecord {
+  PipelineRecordHeader Header;
+  MTL_INPUT_LAYOUT_DESC InputLayout;
+
+  std::vector<uint8_t> serialize() const;
+  bool deserialize(const void *data, size_t size);
+};
+
+inline bool
+IsNullDigest(const Sha1Digest &digest) {
+  return digest == Sha1Digest{};
+}
+
+struct PipelineLogStatistics {
+  std::atomic<uint32_t> recorded = 0;
+  std::atomic<uint32_t> replayed = 0;
+  /* replayed pipelines that were later requested by the application */
+  std::atomic<uint32_t> replay_hits = 0;
+};
+
+/**
+Every pipeline created for a draw or dispatch, stored next to the shader
+cache, and loaded on the next launch so that pipelines can be recreated as
+soon as their shaders are.
+*/
+class PipelineLog {
+public:
+  static PipelineLog &getInstance(WMTMetalVersion version);
+
+  static PipelineLogStatistics &statistics();
+
+  PipelineLog(WMTMetalVersion metal_version);
+  PipelineLog(const PipelineLog &copy) = delete;
+
+  bool
+  enabled() const {
+    return writer_ != nullptr;
+  }
+
+  size_t
+  size() const {
+    return records_.size();
+  }
+
+  const PipelineRecord &
+  record(size_t index) const {
+    return records_[index];
+  }
+
+  /**
+  Indices of the loaded records that use the shader, or nullptr
+  */
+  const std::vector<size_t> *recordsUsingShader(const Sha1Digest &shader) const;
+
+  /**
+  Appends the record, unless it's already in the log
+  */
+  void add(const PipelineRecord &record);
+
+private:
+  /* immutable once loaded */
+  std::vector<PipelineRecord> records_;
+  std::unordered_map<Sha1Digest, std::vector<size_t>> records_by_shader_;
+
+  dxmt::mutex mutex_;
+  std::unordered_set<Sha1Digest> known_;
+  WMT::Reference<WMT::CacheWriter> writer_;
+};
+
+} // namespace dxmt
@@ -63,6 +63,8 @@ public:
   }
 
   void GetPipeline(MTL_COMPILED_TESSELLATION_MESH_PIPELINE *pPipeline) final {
+    if (!ready_.load(std::memory_order_acquire))
+      device_->PrioritizeWork(this);
     ready_.wait(false, std::memory_order_acquire);
     *pPipeline = {state_rasterization_, hull_reflection.NumOutputElement,
                   hull_reflection.ThreadsPerPatch};
@@ -20,13 +20,90 @@ getGlobalShaderFlag() {
   return shader_flag;
 };
 
+bool
+IsTieredShaderCompilationEnabled() {
+  static bool enabled = Config::getInstance().getOption<bool>("d3d11.tieredShaderCompilation", false);
+  return enabled;
+}
+
+TieredCompilationStatistics &
+GetTieredCompilationStatistics() {
+  static TieredCompilationStatistics statistics;
+  return statistics;
+}
+
+bool
+IsShaderLibraryBatchingEnabled() {
+  static bool enabled = Config::getInstance().getOption<bool>("d3d11.shaderLibraryBatching", false);
+  return enabled;
+}
+
+ShaderLibraryBatchStatistics &
+GetShaderLibraryBatchStatistics() {
+  static ShaderLibraryBatchStatistics statistics;
+  return statistics;
+}
+
+/* keeps the first variants of a batch from waiting on too many others */
+constexpr size_t kMaxLibrariesPerBatch = 64;
+
+bool
+ShaderLibraryBatch::add(WMT::DispatchData data, const std::string &func_name) {
+  std::lock_guard<dxmt::mutex> lock(mutex_);
+  if (closed_ || libraries_.size() >= kMaxLibrariesPerBatch || !func_names_.insert(func_name).second)
+    return false;
+  libraries_.emplace_back(data);
+  return true;
+}
+
+ThreadpoolWork *
+ShaderLibraryBatch::RunThreadpoolWork() {
+  auto pool = WMT::MakeAutoreleasePool();
+  std::vector<WMT::Reference<WMT::DispatchData>> libraries;
+  {
+    std::lock_guard<dxmt::mutex> lock(mutex_);
+    closed_ = true;
+    libraries = std::move(libraries_);
+  }
+
+  WMT::Reference<WMT::Error> err;
+  if (libraries.size() == 1) {
+    library_ = device_->GetMTLDevice().newLibrary(libraries[0], err);
+  } else {
+    std::vector<WMT::DispatchData> datas(libraries.begin(), libraries.end());
+    library_ = device_->GetMTLDevice().newPackedLibrary(datas.data(), datas.size(), err);
+  }
+
+  if (err || !library_) {
+    ERR("Failed to create MTLLibrary for ", libraries.size(), " shaders: ", err.description().getUTF8String());
+    library_ = nullptr;
+    return this;
+  }
+
+  auto &statistics = GetShaderLibraryBatchStatistics();
+  statistics.batches.fetch_add(1, std::memory_order_relaxed);
+  statistics.libraries.fetch_add(libraries.size(), std::memory_order_relaxed);
+  return this;
+}
+
+std::pair<std::shared_ptr<ShaderLibraryBatch>, bool>
+ShaderLibraryBatcher::join(WMT::DispatchData data, const std::string &func_name) {
+  std::lock_guard<dxmt::mutex> lock(mutex_);
+  if (open_ && open_->add(data, func_name))
+    return {open_, false};
+  open_ = std::make_shared<ShaderLibraryBatch>(device_);
+  open_->add(data, func_name);
+  return {open_, true};
+}
+
 template <typename Proc>
 class GeneralShaderCompileTask : public CompiledShader {
 public:
   GeneralShaderCompileTask(MTLD3D11Device *pDevice, ManagedShader shader,
-                           Proc &&proc, std::string func_name, const Sha1Digest& variant_digest)
+                           Proc &&proc, std::string func_name, const Sha1Digest& variant_digest,
+                           bool tiered = false)
       : CompiledShader(), proc(std::forward<Proc>(proc)), func_name(func_name), device_(pDevice),
-        shader_(shader), variant_digest_(variant_digest) {
+        shader_(shader), variant_digest_(variant_digest), tiered_(tiered) {
     sm50_common.type = SM50_SHADER_COMMON;
     sm50_common.metal_version = (SM50_SHADER_METAL_VERSION)pDevice->GetDXMTDevice().metalVersion();
     sm50_common.flags = getGlobalShaderFlag();
@@ -43,58 +120,53 @@ public:
     return ret;
   }
 
+  CompiledShader *GetOptimizedShader() final { return optimized_.get(); }
+
   ThreadpoolWork *
   RunThreadpoolWork() {
     auto pool = WMT::MakeAutoreleasePool();
-    WMT::Reference<WMT::Error> err;
-    WMT::Reference<WMT::DispatchData> lib_data = shader_->find_cached_variant(variant_digest_);
-
-    while (lib_data != nullptr) {
-      auto library = device_->GetMTLDevice().newLibrary(lib_data, err);
-
-      if (err || !library) {
-        ERR("Failed to create MTLLibrary from cache: ", err.description().getUTF8String());
-        lib_data = nullptr;
-        break;
-      }
-
-      function_ = library.newFunction(func_name.c_str());
-
-      if (function_ == nullptr) {
-        ERR("Failed to create MTLFunction from cache: ", func_name);
-        lib_data = nullptr;
-        break;
-      }
-      break;
-    }
-
-    if (!lib_data) {
-      SM50_COMPILED_BITCODE bitcode;
-      sm50_bitcode_t compile_result = proc(func_name.c_str(), &sm50_common);
 
-      if (!compile_result)
+    if (batch_) {
+      // back from the library batch joined below
+      auto batch = std::move(batch_);
+      auto lib_data = std::move(lib_data_);
+      if (batch->library() != nullptr)
+        function_ = batch->library().newFunction(func_name.c_str());
+      if (function_ != nullptr || LoadFunction(lib_data, lib_data_cached_)) {
+        if (!lib_data_cached_)
+          PublishCompiledVariant(lib_data);
         return this;
-
-      SM50GetCompiledBitcode(compile_result, &bitcode);
-      lib_data = WMT::MakeDispatchData(bitcode.Data, bitcode.Size);
-      auto library = device_->GetMTLDevice().newLibrary(lib_data, err);
-
-      if (err) {
-        ERR("Failed to create MTLLibrary: ", err.description().getUTF8String());
+      }
+      if (!lib_data_cached_) {
         shader_->dump();
         return this;
       }
+      // a broken cache entry, compile it again
+    } else if (auto lib_data = shader_->find_cached_variant(variant_digest_)) {
+      if (JoinLibraryBatch(lib_data, true))
+        return batch_.get();
+      if (LoadFunction(lib_data, true))
+        return this;
+    }
 
-      shader_->update_cached_variant(variant_digest_, lib_data);
+    if (tiered_)
+      sm50_common.flags |= SM50_SHADER_FLAG_FAST_OPTIMIZATION;
+    sm50_bitcode_t compile_result = proc(func_name.c_str(), &sm50_common);
 
-      SM50DestroyBitcode(compile_result);
-      function_ = library.newFunction(func_name.c_str());
+    if (!compile_result)
+      return this;
 
-      if (function_ == nullptr) {
-        ERR("Failed to create MTLFunction: ", func_name);
-        shader_->dump();
-      }
-    }
+    SM50_COMPILED_BITCODE bitcode;
+    SM50GetCompiledBitcode(compile_result, &bitcode);
+    auto lib_data = WMT::MakeDispatchData(bitcode.Data, bitcode.Size);
+    SM50DestroyBitcode(compile_result);
+
+    if (JoinLibraryBatch(lib_data, false))
+      return batch_.get();
+    if (LoadFunction(lib_data, false))
+      PublishCompiledVariant(lib_data);
+    else
+      shader_->dump();
 
     return this;
   }
@@ -104,14 +176,65 @@ public:
   void SetIsDone(bool state) { ready_.store(state); }
 
 private:
+  bool
+  JoinLibraryBatch(WMT::DispatchData lib_data, bool cached) {
+    batch_ = shader_->join_library_batch(lib_data, func_name);
+    if (!batch_)
+      return false;
+    lib_data_ = lib_data;
+    lib_data_cached_ = cached;
+    return true;
+  }
+
+  bool
+  LoadFunction(WMT::DispatchData lib_data, bool cached) {
+    WMT::Reference<WMT::Error> err;
+    auto library = device_->GetMTLDevice().newLibrary(lib_data, err);
+
+    if (err || !library) {
+      ERR(cached ? "Failed to create MTLLibrary from cache: " : "Failed to create MTLLibrary: ",
+          err.description().getUTF8String());
+      return false;
+    }
+
+    function_ = library.newFunction(func_name.c_str());
+
+    if (function_ == nullptr) {
+      ERR(cached ? "Failed to create MTLFunction from cache: " : "Failed to create MTLFunction: ", func_name);
+      return false;
+    }
+    return true;
+  }
+
+  void
+  PublishCompiledVariant(WMT::DispatchData lib_data) {
+    if (tiered_) {
+      // the optimized build is the one worth caching
+      optimized_ = std::make_unique<GeneralShaderCompileTask>(
+          device_, shader_, Proc(proc), func_name, variant_digest_
+      );
+      shader_->schedule_background_work(optimized_.get());
+      GetTieredCompilationStatistics().fast_shaders_compiled.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      shader_->update_cached_variant(variant_digest_, lib_data);
+      if (IsTieredShaderCompilationEnabled())
+        GetTieredCompilationStatistics().optimized_shaders_compiled.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
   SM50_SHADER_COMMON_DATA sm50_common;
   Proc proc;
   std::string func_name;
   MTLD3D11Device *device_;
   ManagedShader shader_;
   Sha1Digest variant_digest_;
+  bool tiered_;
   std::atomic_bool ready_;
   WMT::Reference<WMT::Function> function_;
+  std::unique_ptr<GeneralShaderCompileTask> optimized_;
+  std::shared_ptr<ShaderLibraryBatch> batch_;
+  WMT::Reference<WMT::DispatchData> lib_data_;
+  bool lib_data_cached_ = false;
 };
 
 template <>
@@ -157,7 +280,7 @@ CreateVariantShader(MTLD3D11Device *pDevice, ManagedShader shader,
     return compile_result;
   };
   return std::make_unique<GeneralShaderCompileTask<decltype(proc)>>(
-      pDevice, shader, std::move(proc), func_name, variant_digest);
+      pDevice, shader, std::move(proc), func_name, variant_digest, IsTieredShaderCompilationEnabled());
 };
 
 template <>
@@ -194,7 +317,7 @@ CreateVariantShader(MTLD3D11Device *pDevice, ManagedShader shader,
     return compile_result;
   };
   return std::make_unique<GeneralShaderCompileTask<decltype(proc)>>(
-      pDevice, shader, std::move(proc), func_name, variant_digest);
+      pDevice, shader, std::move(proc), func_name, variant_digest, IsTieredShaderCompilationEnabled());
 };
 
 template <>
@@ -283,6 +406,7 @@ CreateVariantShader(MTLD3D11Device *pDevice, ManagedShader shader,
   auto proc = [=](const char *func_name, SM50_SHADER_COMMON_DATA *common) -> sm50_bitcode_t  {
     SM50_SHADER_GS_PASS_THROUGH_DATA gs_passthrough;
     SM50_SHADER_PSO_TESSELLATOR_DATA pso_tess;
+    gs_passthrough.type = SM50_SHADER_GS_PASS_THROUGH;
     gs_passthrough.DataEncoded = variant.gs_passthrough;
     gs_passthrough.RasterizationDisabled = variant.rasterization_disabled;
     gs_passthrough.next = &pso_tess;
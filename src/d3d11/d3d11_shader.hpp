@@ -7,7 +7,13 @@
 #include "d3d11_input_layout.hpp"
 #include "sha1/sha1_util.hpp"
 #include "log/log.hpp"
+#include "thread.hpp"
+#include <atomic>
+#include <memory>
+#include <string>
+#include <unordered_set>
 #include <variant>
+#include <vector>
 
 struct MTL_COMPILED_SHADER {
   /**
@@ -200,6 +206,62 @@ public:
   return false if it's not ready
    */
   virtual bool GetShader(MTL_COMPILED_SHADER *pShaderData) = 0;
+  /**
+  the fully optimized build that replaces this one, if it was compiled by
+  the fast tier. only meaningful once this shader is done.
+   */
+  virtual CompiledShader *GetOptimizedShader() { return nullptr; }
+};
+
+/**
+Variant libraries that are ready around the same time are loaded with a single
+newLibrary call: the first variant opens a batch and submits it, the ones that
+follow join it until it runs. Each of them waits for the batch, then takes its
+function from the shared library.
+ */
+class ShaderLibraryBatch final : public ThreadpoolWork {
+public:
+  ShaderLibraryBatch(MTLD3D11Device *device) : device_(device) {}
+
+  ThreadpoolWork *RunThreadpoolWork();
+
+  bool GetIsDone() { return done_; }
+
+  void SetIsDone(bool state) { done_.store(state); }
+
+  /**
+  null if the batch failed, its variants load their own library then
+   */
+  WMT::Library library() { return library_; }
+
+private:
+  friend class ShaderLibraryBatcher;
+
+  bool add(WMT::DispatchData data, const std::string &func_name);
+
+  MTLD3D11Device *device_;
+  dxmt::mutex mutex_;
+  bool closed_ = false;
+  std::vector<WMT::Reference<WMT::DispatchData>> libraries_;
+  std::unordered_set<std::string> func_names_;
+  WMT::Reference<WMT::Library> library_;
+  std::atomic_bool done_;
+};
+
+class ShaderLibraryBatcher {
+public:
+  ShaderLibraryBatcher(MTLD3D11Device *device) : device_(device) {}
+
+  /**
+  Adds a variant library to the open batch, or to a new one, in which case
+  `created` is set and the caller submits it.
+   */
+  std::pair<std::shared_ptr<ShaderLibraryBatch>, bool> join(WMT::DispatchData data, const std::string &func_name);
+
+private:
+  MTLD3D11Device *device_;
+  dxmt::mutex mutex_;
+  std::shared_ptr<ShaderLibraryBatch> open_;
 };
 
 class Shader {
@@ -217,8 +279,39 @@ public:
 
   virtual WMT::Reference<WMT::DispatchData> find_cached_variant(Sha1Digest &key) = 0;
   virtual void update_cached_variant(Sha1Digest &key, WMT::DispatchData data) = 0;
+  virtual void schedule_background_work(ThreadpoolWork *work) = 0;
+  /**
+  null if library batching is disabled
+   */
+  virtual std::shared_ptr<ShaderLibraryBatch> join_library_batch(WMT::DispatchData data, const std::string &func_name) = 0;
+};
+
+/**
+Tiered compilation: vertex and pixel shaders are first built with a minimal
+optimization pipeline, and graphics pipelines switch to the fully optimized
+build once it's available. Only the optimized build goes into the shader cache.
+ */
+bool IsTieredShaderCompilationEnabled();
+
+struct TieredCompilationStatistics {
+  std::atomic_uint32_t fast_shaders_compiled = 0;
+  std::atomic_uint32_t optimized_shaders_compiled = 0;
+  std::atomic_uint32_t pipelines_upgraded = 0;
+  std::atomic_uint64_t fast_pipeline_uses = 0;
+  std::atomic_uint64_t optimized_pipeline_uses = 0;
+};
+
+TieredCompilationStatistics &GetTieredCompilationStatistics();
+
+bool IsShaderLibraryBatchingEnabled();
+
+struct ShaderLibraryBatchStatistics {
+  std::atomic_uint32_t batches = 0;
+  std::atomic_uint32_t libraries = 0;
 };
 
+ShaderLibraryBatchStatistics &GetShaderLibraryBatchStatistics();
+
 template <typename Variant>
 std::unique_ptr<CompiledShader>
 CreateVariantShader(MTLD3D11Device *, ManagedShader, Variant);
@@ -10,9 +10,14 @@
 #include "dxmt_hud_state.hpp"
 #include "dxmt_statistics.hpp"
 #include "dxmt_presenter.hpp"
+#include "dxmt_shader_cache.hpp"
 #include "log/log.hpp"
 #include "d3d11_resource.hpp"
 #include "d3d11_device.hpp"
+#include "d3d11_pipeline.hpp"
+#include "d3d11_pipeline_cache.hpp"
+#include "d3d11_pipeline_log.hpp"
+#include "d3d11_shader.hpp"
 #include "util_cpu_fence.hpp"
 #include "util_env.hpp"
 #include "util_string.hpp"
@@ -867,6 +872,57 @@ public:
         std::min(frame.render_pass_optimized, 999u),
         std::min(frame.clear_pass_count - frame.clear_pass_optimized, 999u), std::min(frame.clear_pass_optimized, 99u)
     ));
+    hud.printLine(std::format(
+        "Filtered:{:6} Reuse:{:3}%", std::min(frame.render_command_filtered, 999999u),
+        frame.argument_table_count ? frame.argument_table_reused * 100ull / frame.argument_table_count : 0ull
+    ));
+    if (IsAsyncPipelineCompilationEnabled())
+      hud.printLine(std::format("Skipped:{:4}", std::min(frame.pending_pipeline_draws, 9999u)));
+    if (IsTieredShaderCompilationEnabled()) {
+      auto &tiered = GetTieredCompilationStatistics();
+      auto fast_uses = tiered.fast_pipeline_uses.load(std::memory_order_relaxed);
+      auto optimized_uses = tiered.optimized_pipeline_uses.load(std::memory_order_relaxed);
+      hud.printLine(std::format(
+          "Tier:{:4}>{:<4} PSO:{:4} {:3}%", std::min(tiered.fast_shaders_compiled.load(), 9999u),
+          std::min(tiered.optimized_shaders_compiled.load(), 9999u), std::min(tiered.pipelines_upgraded.load(), 9999u),
+          fast_uses + optimized_uses ? optimized_uses * 100 / (fast_uses + optimized_uses) : 100
+      ));
+    }
+    if (IsShaderLibraryBatchingEnabled()) {
+      auto &batching = GetShaderLibraryBatchStatistics();
+      hud.printLine(std::format(
+          "Libs:{:5}/{:<5}", std::min(batching.batches.load(std::memory_order_relaxed), 99999u),
+          std::min(batching.libraries.load(std::memory_order_relaxed), 99999u)
+      ));
+    }
+    {
+      auto &cache = ShaderCache::statistics();
+      auto hits = cache.hits.load(std::memory_order_relaxed);
+      auto misses = cache.misses.load(std::memory_order_relaxed);
+      if (hits + misses)
+        hud.printLine(std::format(
+            "Cache:{:5}/{:<5} New:{:5}", std::min(hits, 99999u), std::min(hits + misses, 99999u),
+            std::min(cache.inserts.load(std::memory_order_relaxed), 99999u)
+        ));
+    }
+    {
+      auto &lookup = GetPipelineLookupStatistics();
+      hud.printLine(std::format(
+          "Lookup: PSO {:4}/{:<4} Var {:4}/{:<4}",
+          std::min(lookup.pipelines.contended.load(std::memory_order_relaxed), 9999u),
+          std::min(lookup.pipelines.locked.load(std::memory_order_relaxed), 9999u),
+          std::min(lookup.variants.contended.load(std::memory_order_relaxed), 9999u),
+          std::min(lookup.variants.locked.load(std::memory_order_relaxed), 9999u)
+      ));
+    }
+    {
+      auto &replay = PipelineLog::statistics();
+      if (auto replayed = replay.replayed.load(std::memory_order_relaxed))
+        hud.printLine(std::format(
+            "Replay:{:5}/{:<5}", std::min(replay.replay_hits.load(std::memory_order_relaxed), 99999u),
+            std::min(replayed, 99999u)
+        ));
+    }
     {
       /* scaler info */
       auto &info = frame.last_scaler_info;
@@ -0,0 +1,220 @@
+#include "dxmt_command_filter.hpp"
+#include <cstddef>
+#include <cstring>
+
+namespace dxmt {
+
+constexpr unsigned kUnknownCount = ~0u;
+
+/* everything the command sets, after the header */
+constexpr size_t kRasterizerStateBegin = offsetof(wmtcmd_render_setrasterizerstate, fill_mode);
+constexpr size_t kRasterizerStateEnd =
+    offsetof(wmtcmd_render_setrasterizerstate, depth_bias_clamp) + sizeof(float);
+
+void
+RenderCommandFilter::reset() {
+  buffer_known_.fill(0);
+  offset_known_.fill(0);
+  texture_known_.fill(0);
+  viewport_count_ = kUnknownCount;
+  scissor_rect_count_ = kUnknownCount;
+  pso_known_ = false;
+  dsso_known_ = false;
+  stencil_ref_known_ = false;
+  blend_color_known_ = false;
+  rasterizer_state_known_ = false;
+}
+
+bool
+RenderCommandFilter::setBuffer(BufferStage stage, const wmtcmd_render_setbuffer *cmd) {
+  if (cmd->index >= kBufferSlots)
+    return false;
+  auto &binding = buffers_[stage][cmd->index];
+  uint32_t bit = 1u << cmd->index;
+  if ((buffer_known_[stage] & offset_known_[stage] & bit) && binding.buffer == cmd->buffer &&
+      binding.offset == cmd->offset)
+    return true;
+  binding.buffer = cmd->buffer;
+  binding.offset = cmd->offset;
+  buffer_known_[stage] |= bit;
+  offset_known_[stage] |= bit;
+  return false;
+}
+
+bool
+RenderCommandFilter::setBufferOffset(BufferStage stage, const wmtcmd_render_setbufferoffset *cmd) {
+  if (cmd->index >= kBufferSlots)
+    return false;
+  auto &binding = buffers_[stage][cmd->index];
+  uint32_t bit = 1u << cmd->index;
+  if ((offset_known_[stage] & bit) && binding.offset == cmd->offset)
+    return true;
+  binding.offset = cmd->offset;
+  offset_known_[stage] |= bit;
+  return false;
+}
+
+void
+RenderCommandFilter::invalidateBuffer(BufferStage stage, unsigned index) {
+  if (index >= kBufferSlots)
+    return;
+  buffer_known_[stage] &= ~(1u << index);
+  offset_known_[stage] &= ~(1u << index);
+}
+
+bool
+RenderCommandFilter::setTexture(const wmtcmd_render_settexture *cmd) {
+  if (cmd->index >= kTextureSlots)
+    return false;
+  auto &known = texture_known_[cmd->index >> 6];
+  uint64_t bit = 1ull << (cmd->index & 63);
+  if ((known & bit) && textures_[cmd->index] == cmd->texture)
+    return true;
+  textures_[cmd->index] = cmd->texture;
+  known |= bit;
+  return false;
+}
+
+bool
+RenderCommandFilter::setViewports(const WMTViewport *viewports, unsigned count) {
+  if (count == viewport_count_ && !memcmp(viewports_.data(), viewports, sizeof(WMTViewport) * count))
+    return true;
+  if (count > kViewports) {
+    viewport_count_ = kUnknownCount;
+    return false;
+  }
+  memcpy(viewports_.data(), viewports, sizeof(WMTViewport) * count);
+  viewport_count_ = count;
+  return false;
+}
+
+bool
+RenderCommandFilter::setScissorRects(const WMTScissorRect *rects, unsigned count) {
+  if (count == scissor_rect_count_ && !memcmp(scissor_rects_.data(), rects, sizeof(WMTScissorRect) * count))
+    return true;
+  if (count > kViewports) {
+    scissor_rect_count_ = kUnknownCount;
+    return false;
+  }
+  memcpy(scissor_rects_.data(), rects, sizeof(WMTScissorRect) * count);
+  scissor_rect_count_ = count;
+  return false;
+}
+
+uint32_t
+RenderCommandFilter::filter(wmtcmd_render_nop *cmd_head) {
+  uint32_t filtered = 0;
+  auto prev = reinterpret_cast<wmtcmd_base *>(cmd_head);
+  while (auto cmd = reinterpret_cast<wmtcmd_base *>(prev->next.get())) {
+    bool redundant = false;
+    switch ((WMTRenderCommandType)cmd->type) {
+    case WMTRenderCommandSetVertexBuffer:
+      redundant = setBuffer(BufferStageVertex, (const wmtcmd_render_setbuffer *)cmd);
+      break;
+    case WMTRenderCommandSetVertexBufferOffset:
+      redundant = setBufferOffset(BufferStageVertex, (const wmtcmd_render_setbufferoffset *)cmd);
+      break;
+    case WMTRenderCommandSetFragmentBuffer:
+      redundant = setBuffer(BufferStageFragment, (const wmtcmd_render_setbuffer *)cmd);
+      break;
+    case WMTRenderCommandSetFragmentBufferOffset:
+      redundant = setBufferOffset(BufferStageFragment, (const wmtcmd_render_setbufferoffset *)cmd);
+      break;
+    case WMTRenderCommandSetMeshBuffer:
+      redundant = setBuffer(BufferStageMesh, (const wmtcmd_render_setbuffer *)cmd);
+      break;
+    case WMTRenderCommandSetMeshBufferOffset:
+      redundant = setBufferOffset(BufferStageMesh, (const wmtcmd_render_setbufferoffset *)cmd);
+      break;
+    case WMTRenderCommandSetObjectBuffer:
+      redundant = setBuffer(BufferStageObject, (const wmtcmd_render_setbuffer *)cmd);
+      break;
+    case WMTRenderCommandSetObjectBufferOffset:
+      redundant = setBufferOffset(BufferStageObject, (const wmtcmd_render_setbufferoffset *)cmd);
+      break;
+    case WMTRenderCommandSetFragmentBytes:
+      // the bytes are copied into a buffer Metal allocates every time
+      invalidateBuffer(BufferStageFragment, ((const wmtcmd_render_setbytes *)cmd)->index);
+      break;
+    case WMTRenderCommandSetFragmentTexture:
+      redundant = setTexture((const wmtcmd_render_settexture *)cmd);
+      break;
+    case WMTRenderCommandSetRasterizerState: {
+      auto body = (const wmtcmd_render_setrasterizerstate *)cmd;
+      redundant = rasterizer_state_known_ &&
+                  !memcmp(
+                      (const char *)&rasterizer_state_ + kRasterizerStateBegin, (const char *)body + kRasterizerStateBegin,
+                      kRasterizerStateEnd - kRasterizerStateBegin
+                  );
+      rasterizer_state_ = *body;
+      rasterizer_state_known_ = true;
+      break;
+    }
+    case WMTRenderCommandSetViewports: {
+      auto body = (wmtcmd_render_setviewports *)cmd;
+      redundant = setViewports((const WMTViewport *)body->viewports.get(), body->viewport_count);
+      break;
+    }
+    case WMTRenderCommandSetViewport:
+      redundant = setViewports(&((const wmtcmd_render_setviewport *)cmd)->viewport, 1);
+      break;
+    case WMTRenderCommandSetScissorRects: {
+      auto body = (wmtcmd_render_setscissorrects *)cmd;
+      redundant = setScissorRects((const WMTScissorRect *)body->scissor_rects.get(), body->rect_count);
+      break;
+    }
+    case WMTRenderCommandSetScissorRect:
+      redundant = setScissorRects(&((const wmtcmd_render_setscissorrect *)cmd)->scissor_rect, 1);
+      break;
+    case WMTRenderCommandSetPSO: {
+      auto body = (const wmtcmd_render_setpso *)cmd;
+      redundant = pso_known_ && pso_ == body->pso;
+      pso_ = body->pso;
+      pso_known_ = true;
+      break;
+    }
+    case WMTRenderCommandSetDSSO: {
+      auto body = (const wmtcmd_render_setdsso *)cmd;
+      redundant = dsso_known_ && dsso_ == body->dsso && stencil_ref_known_ && stencil_ref_ == body->stencil_ref;
+      dsso_ = body->dsso;
+      stencil_ref_ = body->stencil_ref;
+      dsso_known_ = true;
+      stencil_ref_known_ = true;
+      break;
+    }
+    case WMTRenderCommandSetBlendFactorAndStencilRef: {
+      auto body = (const wmtcmd_render_setblendcolor *)cmd;
+      redundant = blend_color_known_ && !memcmp(blend_color_, &body->red, sizeof(blend_color_)) &&
+                  stencil_ref_known_ && stencil_ref_ == body->stencil_ref;
+      memcpy(blend_color_, &body->red, sizeof(blend_color_));
+      stencil_ref_ = body->stencil_ref;
+      blend_color_known_ = true;
+      stencil_ref_known_ = true;
+      break;
+    }
+    case WMTRenderCommandDXMTGeometryDraw:
+    case WMTRenderCommandDXMTGeometryDrawIndexed:
+    case WMTRenderCommandDXMTGeometryDrawIndirect:
+    case WMTRenderCommandDXMTGeometryDrawIndexedIndirect:
+    case WMTRenderCommandDXMTTessellationMeshDraw:
+    case WMTRenderCommandDXMTTessellationMeshDrawIndexed:
+    case WMTRenderCommandDXMTTessellationMeshDrawIndirect:
+    case WMTRenderCommandDXMTTessellationMeshDrawIndexedIndirect:
+      // these bind the index buffer and draw arguments of the object stage
+      invalidateBuffer(BufferStageObject, 20);
+      invalidateBuffer(BufferStageObject, 21);
+      break;
+    default:
+      break;
+    }
+    if (redundant) {
+      prev->next.set(cmd->next.get());
+      filtered++;
+    } else {
+      prev = cmd;
+    }
+  }
+  return filtered;
+}
+
+} // namespace dxmt
@@ -0,0 +1,70 @@
+#pragma once
+#include "winemetal.h"
+#include <array>
+#include <cstdint>
+
+namespace dxmt {
+
+/**
+Shadow of the state set on a Metal render command encoder, used to unlink
+commands from a render pass that set a binding or state to the value it
+already has. Nothing is known when a pass starts, so the first command of
+each kind is always kept.
+*/
+class RenderCommandFilter {
+public:
+  /* forgets everything, for a new render command encoder */
+  void reset();
+
+  /* returns the number of commands unlinked from the list */
+  uint32_t filter(wmtcmd_render_nop *cmd_head);
+
+private:
+  static constexpr unsigned kBufferSlots = 32;
+  static constexpr unsigned kTextureSlots = 128;
+  static constexpr unsigned kViewports = 16;
+
+  enum BufferStage {
+    BufferStageVertex,
+    BufferStageFragment,
+    BufferStageMesh,
+    BufferStageObject,
+    BufferStageCount,
+  };
+
+  struct BufferBinding {
+    obj_handle_t buffer;
+    uint64_t offset;
+  };
+
+  bool setBuffer(BufferStage stage, const wmtcmd_render_setbuffer *cmd);
+  bool setBufferOffset(BufferStage stage, const wmtcmd_render_setbufferoffset *cmd);
+  void invalidateBuffer(BufferStage stage, unsigned index);
+  bool setTexture(const wmtcmd_render_settexture *cmd);
+  bool setViewports(const WMTViewport *viewports, unsigned count);
+  bool setScissorRects(const WMTScissorRect *rects, unsigned count);
+
+  std::array<std::array<BufferBinding, kBufferSlots>, BufferStageCount> buffers_;
+  std::array<uint32_t, BufferStageCount> buffer_known_;
+  std::array<uint32_t, BufferStageCount> offset_known_;
+  std::array<obj_handle_t, kTextureSlots> textures_;
+  std::array<uint64_t, kTextureSlots / 64> texture_known_;
+
+  std::array<WMTViewport, kViewports> viewports_;
+  std::array<WMTScissorRect, kViewports> scissor_rects_;
+  unsigned viewport_count_;
+  unsigned scissor_rect_count_;
+
+  obj_handle_t pso_;
+  obj_handle_t dsso_;
+  uint8_t stencil_ref_;
+  float blend_color_[4];
+  wmtcmd_render_setrasterizerstate rasterizer_state_;
+  bool pso_known_;
+  bool dsso_known_;
+  bool stencil_ref_known_;
+  bool blend_color_known_;
+  bool rasterizer_state_known_;
+};
+
+} // namespace dxmt
@@ -1,6 +1,14 @@
 #pragma once
+#include <algorithm>
 #include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
 #include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 namespace dxmt {
 
@@ -10,114 +18,168 @@ concept CommandWithContext = requires(F f, context &ctx) {
 };
 
 namespace impl {
-template <typename context> class CommandBase {
-public:
-  virtual void invoke(context &) = 0;
-  virtual ~CommandBase() noexcept {};
-  CommandBase<context> *next = nullptr;
-};
 
-template <typename context, typename F> class LambdaCommand final : public CommandBase<context> {
-public:
-  void
-  invoke(context &ctx) final {
-    std::invoke(func, ctx);
-  };
-  ~LambdaCommand() noexcept final = default;
-  LambdaCommand(F &&ff) : CommandBase<context>(), func(std::forward<F>(ff)) {}
-  LambdaCommand(const LambdaCommand &copy) = delete;
-  LambdaCommand &operator=(const LambdaCommand &copy_assign) = delete;
-
-private:
-  F func;
+constexpr size_t kCommandAlignment = 16;
+constexpr size_t kCommandSegmentSize = 0x10000;
+/* resets a spare segment survives without being used */
+constexpr uint32_t kCommandSegmentLifetime = 64;
+
+/**
+Precedes the payload of every command in the stream. `invoke` is its opcode,
+one function per command type.
+*/
+template <typename context> struct alignas(kCommandAlignment) CommandHeader {
+  void (*invoke)(void *payload, context &ctx);
+  size_t stride;
 };
 
-template <typename context> class EmtpyCommand final : public CommandBase<context> {
-public:
-  void invoke(context &ctx) final{/* nop */};
-  ~EmtpyCommand() noexcept = default;
+template <typename context, typename F>
+void
+invoke_command(void *payload, context &ctx) {
+  std::invoke(*std::launder(reinterpret_cast<F *>(payload)), ctx);
+}
+
+template <typename F>
+void
+destroy_command(void *payload) {
+  std::launder(reinterpret_cast<F *>(payload))->~F();
+}
+
+struct CommandDestructor {
+  void (*destroy)(void *payload);
+  void *payload;
 };
 
-template <typename value_t> struct LinkedListNode {
-  value_t value;
-  LinkedListNode *next;
+struct CommandSegment {
+  /* what malloc returned, `data` is rounded up to kCommandAlignment: 32-bit
+     mingw only guarantees 8 bytes */
+  void *allocation;
+  char *data;
+  size_t capacity;
+  size_t size;
+  uint32_t unused_times;
 };
 
 } // namespace impl
 
+/**
+Commands are packed one after another into segments the list keeps between
+resets, each one a header followed by the captured state of its lambda.
+Commands that aren't trivially destructible are also recorded on the side, so
+that reset() only visits those.
+*/
 template <typename Context> class CommandList {
-
-  impl::EmtpyCommand<Context> empty;
-  impl::CommandBase<Context> *list_end;
-
-public:
-  CommandList() : list_end(&empty) {
-    empty.next = nullptr;
+  using header_t = impl::CommandHeader<Context>;
+
+  std::vector<impl::CommandSegment> segments_;
+  size_t current_ = 0;
+  std::vector<impl::CommandDestructor> destructors_;
+
+  void *
+  allocate(size_t stride) {
+    if (!segments_.empty()) {
+      auto &segment = segments_[current_];
+      if (segment.capacity - segment.size >= stride) {
+        void *ptr = segment.data + segment.size;
+        segment.size += stride;
+        return ptr;
+      }
+      current_++;
+    }
+    if (current_ == segments_.size() || segments_[current_].capacity < stride) {
+      size_t capacity = std::max(stride, impl::kCommandSegmentSize);
+      auto allocation = malloc(capacity + impl::kCommandAlignment - 1);
+      auto data = (char *)(((uintptr_t)allocation + impl::kCommandAlignment - 1) & ~(impl::kCommandAlignment - 1));
+      segments_.insert(segments_.begin() + current_, {allocation, data, capacity, 0, 0});
+    }
+    auto &segment = segments_[current_];
+    segment.size = stride;
+    return segment.data;
   }
-  ~CommandList() {
+
+  void
+  release() {
     reset();
+    for (auto &segment : segments_)
+      free(segment.allocation);
+    segments_.clear();
   }
 
-  void
-  reset() {
-    impl::CommandBase<Context> *cur = empty.next;
-    while (cur) {
-      auto next = cur->next;
-      cur->~CommandBase<Context>(); // call destructor
-      cur = next;
-    }
-    empty.next = nullptr;
-    list_end = &empty;
+public:
+  CommandList() {}
+  ~CommandList() {
+    release();
   }
 
   CommandList(const CommandList &copy) = delete;
   CommandList(CommandList &&move) {
-    this->reset();
-    empty.next = move.empty.next;
-    list_end = move.list_end;
-    move.empty.next = nullptr;
-    move.list_end = nullptr;
+    segments_ = std::move(move.segments_);
+    current_ = move.current_;
+    destructors_ = std::move(move.destructors_);
+    move.segments_.clear();
+    move.current_ = 0;
+    move.destructors_.clear();
   }
 
   CommandList& operator=(CommandList&& move) {
-    this->reset();
-    empty.next = move.empty.next;
-    list_end = move.list_end;
-    move.empty.next = nullptr;
-    move.list_end = nullptr;
+    this->release();
+    segments_ = std::move(move.segments_);
+    current_ = move.current_;
+    destructors_ = std::move(move.destructors_);
+    move.segments_.clear();
+    move.current_ = 0;
+    move.destructors_.clear();
     return *this;
   }
 
+  void
+  reset() {
+    for (auto &destructor : destructors_)
+      destructor.destroy(destructor.payload);
+    destructors_.clear();
+    for (size_t i = 0; i < segments_.size(); i++) {
+      auto &segment = segments_[i];
+      segment.unused_times = segment.size ? 0 : segment.unused_times + 1;
+      segment.size = 0;
+    }
+    while (segments_.size() > 1 && segments_.back().unused_times > impl::kCommandSegmentLifetime) {
+      free(segments_.back().allocation);
+      segments_.pop_back();
+    }
+    current_ = 0;
+  }
+
   template <CommandWithContext<Context> Fn>
-  constexpr unsigned
+  static constexpr unsigned
   calculateCommandSize() {
-    using command_t = impl::LambdaCommand<Context, Fn>;
-    return sizeof(command_t);
+    using command_t = std::decay_t<Fn>;
+    return (sizeof(header_t) + sizeof(command_t) + impl::kCommandAlignment - 1) & ~(impl::kCommandAlignment - 1);
   }
 
   template <CommandWithContext<Context> Fn>
   unsigned
-  emit(Fn &&cmd, void *buffer) {
-    using command_t = impl::LambdaCommand<Context, Fn>;
-    auto cmd_h = new (buffer) command_t(std::forward<Fn>(cmd));
-    list_end->next = cmd_h;
-    list_end = cmd_h;
-    return sizeof(command_t);
-  }
-
-  void append(CommandList &&list) {
-    list_end->next = list.empty.next;
-    list_end = list.list_end;
-    list.empty.next = nullptr;
-    list.list_end = nullptr;
+  emit(Fn &&cmd) {
+    using command_t = std::decay_t<Fn>;
+    static_assert(alignof(command_t) <= impl::kCommandAlignment);
+    constexpr unsigned stride = calculateCommandSize<Fn>();
+    auto header = new (allocate(stride)) header_t;
+    header->invoke = &impl::invoke_command<Context, command_t>;
+    header->stride = stride;
+    auto payload = new (header + 1) command_t(std::forward<Fn>(cmd));
+    if constexpr (!std::is_trivially_destructible_v<command_t>)
+      destructors_.push_back({&impl::destroy_command<command_t>, payload});
+    return stride;
   }
 
   void
   execute(Context &context) {
-    impl::CommandBase<Context> *cur = &empty;
-    while (cur) {
-      cur->invoke(context);
-      cur = cur->next;
+    for (size_t i = 0; i <= current_ && i < segments_.size(); i++) {
+      auto &segment = segments_[i];
+      for (size_t offset = 0; offset < segment.size;) {
+        auto header = reinterpret_cast<header_t *>(segment.data + offset);
+        header->invoke(header + 1, context);
+        offset += header->stride;
+      }
     }
   };
 };
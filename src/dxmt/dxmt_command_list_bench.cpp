@@ -0,0 +1,275 @@
+/*
+ * dxmt-command-list-bench: cost of recording, executing and resetting the
+ * commands of a frame.
+ *
+ *   dxmt-command-list-bench [draws] [frames]
+ *
+ * Every draw records the commands a typical D3D11 draw turns into: a vertex
+ * buffer binding holding a reference, a pipeline and a few constant buffer
+ * bindings, and the draw itself, out of a handful of distinct command types.
+ * "packed" is CommandList, "linked" the list of virtual commands it replaced,
+ * allocated from a bump arena like the chunk heap.
+ */
+
+#include "dxmt_command_list.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+namespace {
+
+struct bench_context {
+  uint64_t checksum = 0;
+  uint64_t draws = 0;
+};
+
+struct bench_resource {
+  std::atomic_uint32_t refcount = 1;
+  uint64_t gpu_address = 0x1000;
+};
+
+/* an Rc-like reference, which makes its commands non-trivially destructible */
+class bench_ref {
+public:
+  bench_ref(bench_resource *resource) : resource_(resource) { resource_->refcount.fetch_add(1, std::memory_order_relaxed); }
+  bench_ref(bench_ref &&move) : resource_(move.resource_) { move.resource_ = nullptr; }
+  bench_ref(const bench_ref &copy) = delete;
+  ~bench_ref() {
+    if (resource_)
+      resource_->refcount.fetch_sub(1, std::memory_order_release);
+  }
+  bench_resource *
+  operator->() const {
+    return resource_;
+  }
+
+private:
+  bench_resource *resource_;
+};
+
+namespace linked {
+
+template <typename context> class CommandBase {
+public:
+  virtual void invoke(context &) = 0;
+  virtual ~CommandBase() noexcept {};
+  CommandBase<context> *next = nullptr;
+};
+
+template <typename context, typename F> class LambdaCommand final : public CommandBase<context> {
+public:
+  void
+  invoke(context &ctx) final {
+    func(ctx);
+  };
+  ~LambdaCommand() noexcept final = default;
+  LambdaCommand(F &&ff) : CommandBase<context>(), func(std::forward<F>(ff)) {}
+
+private:
+  F func;
+};
+
+template <typename context> class EmptyCommand final : public CommandBase<context> {
+public:
+  void invoke(context &ctx) final {};
+};
+
+class arena {
+public:
+  void *
+  allocate(size_t size) {
+    size = (size + 15) & ~size_t(15);
+    if (blocks_.empty() || offset_ + size > kBlockSize) {
+      if (++current_ >= blocks_.size()) {
+        blocks_.emplace_back((char *)aligned_alloc(16, kBlockSize));
+        current_ = blocks_.size() - 1;
+      }
+      offset_ = 0;
+    }
+    void *ptr = blocks_[current_].get() + offset_;
+    offset_ += size;
+    return ptr;
+  }
+
+  void
+  reset() {
+    current_ = -1;
+    offset_ = kBlockSize;
+  }
+
+private:
+  struct deleter {
+    void
+    operator()(char *ptr) {
+      free(ptr);
+    }
+  };
+  static constexpr size_t kBlockSize = 0x400000;
+  std::vector<std::unique_ptr<char, deleter>> blocks_;
+  size_t current_ = -1;
+  size_t offset_ = kBlockSize;
+};
+
+template <typename Context> class CommandList {
+  EmptyCommand<Context> empty;
+  CommandBase<Context> *list_end = &empty;
+
+public:
+  arena heap;
+
+  template <typename Fn>
+  void
+  emit(Fn &&cmd) {
+    using command_t = LambdaCommand<Context, Fn>;
+    auto cmd_h = new (heap.allocate(sizeof(command_t))) command_t(std::forward<Fn>(cmd));
+    list_end->next = cmd_h;
+    list_end = cmd_h;
+  }
+
+  void
+  execute(Context &context) {
+    CommandBase<Context> *cur = &empty;
+    while (cur) {
+      cur->invoke(context);
+      cur = cur->next;
+    }
+  }
+
+  void
+  reset() {
+    CommandBase<Context> *cur = empty.next;
+    while (cur) {
+      auto next = cur->next;
+      cur->~CommandBase<Context>();
+      cur = next;
+    }
+    empty.next = nullptr;
+    list_end = &empty;
+    heap.reset();
+  }
+};
+
+} // namespace linked
+
+/* distinct command types, like the many EmitST/EmitOP call sites */
+template <unsigned Variant, typename List>
+void
+record_draw(List &list, bench_resource *vertex_buffer, uint32_t draw) {
+  list.emit([buffer = bench_ref(vertex_buffer), offset = draw * 16u, stride = 32u](bench_context &ctx) {
+    ctx.checksum += buffer->gpu_address + offset + stride + Variant;
+  });
+  list.emit([pipeline = uint64_t(Variant * 4096), sample_mask = 0xffffffffu, blend = Variant](bench_context &ctx) {
+    ctx.checksum ^= pipeline + sample_mask + blend;
+  });
+  list.emit([cbuf = std::array<uint64_t, 4>{draw, draw + 1u, draw + 2u, Variant}](bench_context &ctx) {
+    for (auto address : cbuf)
+      ctx.checksum += address;
+  });
+  list.emit([vertex_count = 3u + Variant, instance_count = 1u, start = draw](bench_context &ctx) {
+    ctx.checksum += vertex_count * instance_count + start;
+    ctx.draws++;
+  });
+}
+
+template <typename List>
+void
+record_frame(List &list, bench_resource *vertex_buffer, uint32_t draws) {
+  for (uint32_t draw = 0; draw < draws; draw++) {
+    switch (draw & 7) {
+    case 0: record_draw<0>(list, vertex_buffer, draw); break;
+    case 1: record_draw<1>(list, vertex_buffer, draw); break;
+    case 2: record_draw<2>(list, vertex_buffer, draw); break;
+    case 3: record_draw<3>(list, vertex_buffer, draw); break;
+    case 4: record_draw<4>(list, vertex_buffer, draw); break;
+    case 5: record_draw<5>(list, vertex_buffer, draw); break;
+    case 6: record_draw<6>(list, vertex_buffer, draw); break;
+    case 7: record_draw<7>(list, vertex_buffer, draw); break;
+    }
+  }
+}
+
+struct frame_result {
+  double record_us = 0;
+  double execute_us = 0;
+  double reset_us = 0;
+  uint64_t checksum = 0;
+};
+
+template <typename List>
+frame_result
+bench_frames(uint32_t draws, uint32_t frames) {
+  frame_result result;
+  bench_resource vertex_buffer;
+  List list;
+  // the first frame grows the storage
+  for (uint32_t frame = 0; frame <= frames; frame++) {
+    bench_context ctx;
+    auto t0 = std::chrono::steady_clock::now();
+    record_frame(list, &vertex_buffer, draws);
+    auto t1 = std::chrono::steady_clock::now();
+    list.execute(ctx);
+    auto t2 = std::chrono::steady_clock::now();
+    list.reset();
+    auto t3 = std::chrono::steady_clock::now();
+    if (ctx.draws != draws || vertex_buffer.refcount.load() != 1) {
+      fprintf(stderr, "frame %u: %llu draws executed, refcount %u\n", frame, (unsigned long long)ctx.draws,
+              vertex_buffer.refcount.load());
+      exit(1);
+    }
+    if (!frame)
+      continue;
+    result.record_us += std::chrono::duration<double, std::micro>(t1 - t0).count();
+    result.execute_us += std::chrono::duration<double, std::micro>(t2 - t1).count();
+    result.reset_us += std::chrono::duration<double, std::micro>(t3 - t2).count();
+    result.checksum ^= ctx.checksum;
+  }
+  result.record_us /= frames;
+  result.execute_us /= frames;
+  result.reset_us /= frames;
+  return result;
+}
+
+void
+print_result(const char *name, const frame_result &result, bool last) {
+  printf("  \"%s\": {\n", name);
+  printf("    \"record_us_per_frame\": %.1f,\n", result.record_us);
+  printf("    \"execute_us_per_frame\": %.1f,\n", result.execute_us);
+  printf("    \"reset_us_per_frame\": %.1f\n", result.reset_us);
+  printf("  }%s\n", last ? "" : ",");
+}
+
+} // namespace
+
+int
+main(int argc, char **argv) {
+  uint32_t draws = argc > 1 ? strtoul(argv[1], nullptr, 10) : 10000;
+  uint32_t frames = argc > 2 ? strtoul(argv[2], nullptr, 10) : 200;
+  if (!draws || !frames) {
+    fprintf(stderr, "usage: dxmt-command-list-bench [draws] [frames]\n");
+    return 1;
+  }
+
+  // a few frames of each first, so that neither runs on a cold CPU
+  bench_frames<linked::CommandList<bench_context>>(draws, frames / 10 + 1);
+  bench_frames<dxmt::CommandList<bench_context>>(draws, frames / 10 + 1);
+
+  auto packed = bench_frames<dxmt::CommandList<bench_context>>(draws, frames);
+  auto linked = bench_frames<linked::CommandList<bench_context>>(draws, frames);
+  if (packed.checksum != linked.checksum) {
+    fprintf(stderr, "checksum mismatch\n");
+    return 1;
+  }
+
+  printf("{\n");
+  printf("  \"draws\": %u,\n", draws);
+  printf("  \"commands\": %u,\n", draws * 4);
+  printf("  \"frames\": %u,\n", frames);
+  print_result("packed", packed, false);
+  print_result("linked", linked, true);
+  printf("}\n");
+  return 0;
+}
@@ -1,8 +1,10 @@
 #include "dxmt_command_queue.hpp"
 #include "Metal.hpp"
+#include "config/config.hpp"
 #include "dxmt_statistics.hpp"
 #include "util_env.hpp"
 #include "util_win32_compat.h"
+#include <algorithm>
 #include <atomic>
 
 #define ASYNC_ENCODING 1
@@ -42,6 +44,12 @@ CommandQueue::CommandQueue(WMT::Device device) :
   };
   event = device.newSharedEvent();
 
+  auto encoding_threads = std::clamp(Config::getInstance().getOption<int32_t>("dxmt.encodingThreads", 0), 0, 8);
+  for (int32_t i = 0; i < encoding_threads; i++) {
+    auto &worker = *encoding_workers_.emplace_back(std::make_unique<EncodingWorker>());
+    worker.thread = dxmt::thread([this, &worker]() { this->EncodingWorkerThread(worker); });
+  }
+
   std::string env = env::getEnvVar("DXMT_CAPTURE_FRAME");
 
   if (!env.empty()) {
@@ -58,9 +66,14 @@ CommandQueue::~CommandQueue() {
   ready_for_encode++;
   ready_for_encode.notify_one();
   ready_for_commit++;
-  ready_for_commit.notify_one();
+  ready_for_commit.notify_all();
   SharedEventListener_destroy(shared_event_listener);
   encodeThread.join();
+  for (auto &worker : encoding_workers_) {
+    worker->seq.store(~0ull);
+    worker->seq.notify_one();
+    worker->thread.join();
+  }
   finishThread.join();
   for (unsigned i = 0; i < kCommandChunkCount; i++) {
     auto &chunk = chunks[i];
@@ -137,11 +150,73 @@ CommandQueue::CommitChunkInternal(CommandChunk &chunk, uint64_t seq) {
   if (chunk.resource_initializer_event_id) {
     cmdbuf.encodeWaitForEvent(initializer.event(), chunk.resource_initializer_event_id);
   }
-  chunk.encode(chunk.attached_cmdbuf, this->argument_encoding_ctx);
-  cmdbuf.commit();
 
-  ready_for_commit.fetch_add(1, std::memory_order_release);
-  ready_for_commit.notify_one();
+  if (encoding_workers_.empty()) {
+    chunk.encode(chunk.attached_cmdbuf, this->argument_encoding_ctx);
+    cmdbuf.commit();
+
+    ready_for_commit.fetch_add(1, std::memory_order_release);
+    ready_for_commit.notify_all();
+    return;
+  }
+
+  // the commands have to be executed in order, but encoding them into the command buffer doesn't
+  auto &worker = *encoding_workers_[seq % encoding_workers_.size()];
+  for (uint64_t busy; (busy = worker.seq.load(std::memory_order_acquire));)
+    worker.seq.wait(busy, std::memory_order_acquire);
+  worker.list = chunk.prepare(chunk.attached_cmdbuf, this->argument_encoding_ctx, worker.heap);
+  worker.seq.store(seq, std::memory_order_release);
+  worker.seq.notify_one();
+}
+
+bool
+CommandQueue::WaitForCommitTurn(uint64_t seq) {
+  for (uint64_t committed; (committed = ready_for_commit.load(std::memory_order_acquire)) != seq;) {
+    if (stopped.load())
+      return false;
+    ready_for_commit.wait(committed, std::memory_order_acquire);
+  }
+  return !stopped.load();
+}
+
+uint32_t
+CommandQueue::EncodingWorkerThread(EncodingWorker &worker) {
+  env::setThreadName("dxmt-encode-worker");
+  SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+  for (;;) {
+    uint64_t seq;
+    while (!(seq = worker.seq.load(std::memory_order_acquire))) {
+      if (stopped.load())
+        return 0;
+      worker.seq.wait(0, std::memory_order_acquire);
+    }
+    if (stopped.load())
+      break;
+
+    auto pool = WMT::MakeAutoreleasePool();
+    auto &chunk = chunks[seq % kCommandChunkCount];
+    auto &list = worker.list;
+    if (list.ordered && !WaitForCommitTurn(seq))
+      break;
+    auto t0 = clock::now();
+    auto filtered = argument_encoding_ctx.encodeCommands(chunk.attached_cmdbuf, list);
+    auto t1 = clock::now();
+    if (!list.ordered && !WaitForCommitTurn(seq))
+      break;
+    // only one worker at a time gets here
+    statistics.at(list.frame_id).encode_flush_interval += (t1 - t0);
+    statistics.at(list.frame_id).render_command_filtered += filtered;
+    chunk.attached_cmdbuf.commit();
+
+    ready_for_commit.fetch_add(1, std::memory_order_release);
+    ready_for_commit.notify_all();
+    worker.seq.store(0, std::memory_order_release);
+    worker.seq.notify_one();
+  }
+  worker.seq.store(0);
+  worker.seq.notify_one();
+  TRACE("encoding worker gracefully terminates");
+  return 0;
 }
 
 uint32_t
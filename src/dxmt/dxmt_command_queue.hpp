@@ -17,7 +17,9 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
+#include <memory>
 #include <span>
+#include <vector>
 
 namespace dxmt {
 
@@ -82,7 +84,7 @@ public:
   template <CommandWithContext<ArgumentEncodingContext> F>
   void
   emitcc(F &&func) {
-    list_enc.emit(std::forward<F>(func), allocate_cpu_heap(list_enc.calculateCommandSize<F>(), 16));
+    list_enc.emit(std::forward<F>(func));
   }
 
   void
@@ -102,6 +104,23 @@ public:
     statistics.encode_flush_interval += (t2 - t1);
   };
 
+  /**
+  Same as encode(), except that the encoders are left in `heap` for
+  encodeCommands() to put into the command buffer, possibly on another thread
+  */
+  EncoderList
+  prepare(WMT::CommandBuffer cmdbuf, ArgumentEncodingContext &enc, EncoderHeap &heap) {
+    enc.$$setEncodingContext(chunk_id, frame_, heap);
+    auto &statistics = enc.currentFrameStatistics();
+    auto t0 = clock::now();
+    list_enc.execute(enc);
+    attached_cmdbuf = cmdbuf;
+    auto list = enc.prepareCommands(cmdbuf, chunk_id, chunk_event_id, readback);
+    auto t1 = clock::now();
+    statistics.encode_prepare_interval += (t1 - t0);
+    return list;
+  }
+
   uint64_t chunk_id;
   uint64_t chunk_event_id;
   uint64_t frame_;
@@ -140,6 +159,26 @@ private:
 
   uint32_t WaitForFinishThread();
 
+  /**
+  Encodes chunks prepared by the encode thread into their command buffers,
+  then commits them in submission order
+  */
+  struct EncodingWorker {
+    EncoderHeap heap;
+    /* the chunk handed over, 0 when idle */
+    std::atomic_uint64_t seq = 0;
+    EncoderList list;
+    dxmt::thread thread;
+  };
+
+  uint32_t EncodingWorkerThread(EncodingWorker &worker);
+
+  /**
+  Waits until the command buffers of all chunks before `seq` are committed.
+  Returns false if the queue is being destroyed.
+  */
+  bool WaitForCommitTurn(uint64_t seq);
+
   std::atomic_uint64_t ready_for_encode = 1; // we start from 1, so 0 is always coherent
   std::atomic_uint64_t ready_for_commit = 1;
   std::atomic_uint64_t chunk_ongoing = 0;
@@ -152,6 +191,8 @@ private:
   uint64_t frame_count = 0;
   uint32_t max_latency_ = 3;
 
+  std::vector<std::unique_ptr<EncodingWorker>> encoding_workers_;
+
   dxmt::thread encodeThread;
   dxmt::thread finishThread;
   WMT::Device device;
@@ -6,6 +6,7 @@
 #include "dxmt_occlusion_query.hpp"
 #include "dxmt_presenter.hpp"
 #include "wsi_platform.hpp"
+#include <algorithm>
 #include <cstdint>
 #include <cfloat>
 
@@ -43,7 +44,6 @@ ArgumentEncodingContext::ArgumentEncodingContext(CommandQueue &queue, WMT::Devic
                                 WMTResourceHazardTrackingModeUntracked;
   dummy_cbuffer_ = device.newBuffer(dummy_cbuffer_info_);
   std::memset(dummy_cbuffer_info_.memory.get(), 0, 65536);
-  cpu_buffer_chunks_.emplace_back();
   barrier_event_ = device_.newEvent();
   for (unsigned i = 0; i < kParityLane; i++) {
     fence_pool_[i] = device.newFence();
@@ -233,6 +233,17 @@ template void ArgumentEncodingContext::encodeShaderResources<PipelineStage::Pixe
     const MTL_SHADER_REFLECTION *reflection, const MTL_SM50_SHADER_ARGUMENT *arguments, uint64_t argument_buffer_offset
 );
 
+template void ArgumentEncodingContext::bindShaderResources<PipelineStage::Vertex, PipelineKind::Ordinary>(uint64_t argument_buffer_offset);
+template void ArgumentEncodingContext::bindShaderResources<PipelineStage::Pixel, PipelineKind::Ordinary>(uint64_t argument_buffer_offset);
+template void ArgumentEncodingContext::bindShaderResources<PipelineStage::Vertex, PipelineKind::Tessellation>(uint64_t argument_buffer_offset);
+template void ArgumentEncodingContext::bindShaderResources<PipelineStage::Pixel, PipelineKind::Tessellation>(uint64_t argument_buffer_offset);
+template void ArgumentEncodingContext::bindShaderResources<PipelineStage::Hull, PipelineKind::Tessellation>(uint64_t argument_buffer_offset);
+template void ArgumentEncodingContext::bindShaderResources<PipelineStage::Domain, PipelineKind::Tessellation>(uint64_t argument_buffer_offset);
+template void ArgumentEncodingContext::bindShaderResources<PipelineStage::Compute, PipelineKind::Ordinary>(uint64_t argument_buffer_offset);
+template void ArgumentEncodingContext::bindShaderResources<PipelineStage::Vertex, PipelineKind::Geometry>(uint64_t argument_buffer_offset);
+template void ArgumentEncodingContext::bindShaderResources<PipelineStage::Geometry, PipelineKind::Geometry>(uint64_t argument_buffer_offset);
+template void ArgumentEncodingContext::bindShaderResources<PipelineStage::Pixel, PipelineKind::Geometry>(uint64_t argument_buffer_offset);
+
 inline uint64_t
 TextureMetadata(uint32_t array_length, float min_lod) {
   return ((uint64_t)array_length << 32) | (uint64_t)std::bit_cast<uint32_t>(min_lod);
@@ -359,6 +370,22 @@ ArgumentEncodingContext::encodeShaderResources(
     }
   }
 
+  currentFrameStatistics().argument_table_count++;
+  setShaderResourceTable<stage, kind>(offset);
+}
+
+template <PipelineStage stage, PipelineKind kind>
+void
+ArgumentEncodingContext::bindShaderResources(uint64_t offset) {
+  auto &statistics = currentFrameStatistics();
+  statistics.argument_table_count++;
+  statistics.argument_table_reused++;
+  setShaderResourceTable<stage, kind>(offset);
+}
+
+template <PipelineStage stage, PipelineKind kind>
+void
+ArgumentEncodingContext::setShaderResourceTable(uint64_t offset) {
   if constexpr (stage == PipelineStage::Compute) {
     auto &cmd = encodeComputeCommand<wmtcmd_compute_setbufferoffset>();
     cmd.type = WMTComputeCommandSetBufferOffset;
@@ -782,10 +809,9 @@ ArgumentEncodingContext::resolveRenderPassBarrier() {
 }
 
 void
-ArgumentEncodingContext::$$setEncodingContext(uint64_t seq_id, uint64_t frame_id) {
-  current_buffer_chunk_ = 0;
-  cpu_buffer_ = cpu_buffer_chunks_[current_buffer_chunk_].ptr;
-  cpu_buffer_offset_ = 0;
+ArgumentEncodingContext::$$setEncodingContext(uint64_t seq_id, uint64_t frame_id, EncoderHeap &heap) {
+  heap_ = &heap;
+  heap_->reset();
   seq_id_ = seq_id;
   frame_id_ = frame_id;
 }
@@ -794,6 +820,16 @@ constexpr unsigned kEncoderOptimizerThreshold = 64;
 
 QueryReadbacks
 ArgumentEncodingContext::flushCommands(WMT::CommandBuffer cmdbuf, uint64_t seqId, uint64_t event_seq_id) {
+  QueryReadbacks readbacks{};
+  auto filtered = encodeCommands(cmdbuf, prepareCommands(cmdbuf, seqId, event_seq_id, readbacks));
+  currentFrameStatistics().render_command_filtered += filtered;
+  return readbacks;
+}
+
+EncoderList
+ArgumentEncodingContext::prepareCommands(
+    WMT::CommandBuffer cmdbuf, uint64_t seqId, uint64_t event_seq_id, QueryReadbacks &readbacks
+) {
   assert(!encoder_current);
 
   unsigned encoder_count = encoder_count_;
@@ -811,22 +847,8 @@ ArgumentEncodingContext::flushCommands(WMT::CommandBuffer cmdbuf, uint64_t seqId
     assert(encoder_index == encoder_count);
   }
 
-  if (encoder_count > 1) {
-    unsigned j, i;
-    for (j = encoder_count - 2; j != ~0u; j--) {
-      // TODO(fences): we don't actively move encoders other than clear and render
-      if (encoders[j]->type != EncoderType::Clear && encoders[j]->type != EncoderType::Render)
-        continue;
-      for (i = j + 1; i < encoder_count; i++) {
-        if (encoders[i]->type == EncoderType::Null)
-          continue;
-        if (checkEncoderRelation(encoders[j], encoders[i]) == DXMT_ENCODER_LIST_OP_SYNCHRONIZE)
-          break;
-      }
-    }
-  }
-
-  QueryReadbacks readbacks{};
+  if (encoder_count > 1)
+    reorderEncoders(encoders, encoder_count);
 
   if (auto count = vro_state_.reset()) {
     readbacks.visibility = std::make_unique<VisibilityResultReadback>(
@@ -837,8 +859,44 @@ ArgumentEncodingContext::flushCommands(WMT::CommandBuffer cmdbuf, uint64_t seqId
 
   readbacks.timestamp = timestamp_state_.flush(cmdbuf);
 
-  while (encoder_index) {
-    auto current = encoders[encoder_count - encoder_index];
+  EncoderList list{
+      .encoders = encoders,
+      .count = encoder_count,
+      .seq_id = seqId,
+      .frame_id = frame_id_,
+      .event_seq_id = event_seq_id,
+      .visibility = readbacks.visibility.get(),
+      .timestamp = readbacks.timestamp.get(),
+      .ordered = false,
+  };
+  for (unsigned i = 0; i < encoder_count; i++) {
+    switch (encoders[i]->type) {
+    case EncoderType::Present:
+    case EncoderType::SpatialUpscale:
+    case EncoderType::TemporalUpscale:
+    case EncoderType::SampleTimestamp:
+      list.ordered = true;
+      break;
+    default:
+      break;
+    }
+  }
+
+  encoder_head.next = nullptr;
+  encoder_last = &encoder_head;
+  encoder_count_ = 0;
+
+  heap_->trim();
+
+  return list;
+}
+
+uint32_t
+ArgumentEncodingContext::encodeCommands(WMT::CommandBuffer cmdbuf, const EncoderList &list) {
+  RenderCommandFilter filter;
+  uint32_t filtered = 0;
+  for (unsigned encoder_index = 0; encoder_index < list.count; encoder_index++) {
+    auto current = list.encoders[encoder_index];
     switch (current->type) {
     case EncoderType::Render: {
       auto data = static_cast<RenderEncoderData *>(current);
@@ -890,8 +948,8 @@ ArgumentEncodingContext::flushCommands(WMT::CommandBuffer cmdbuf, uint64_t seqId
         render_pass_info.render_target_height = data->render_target_height;
       }
       if (data->use_visibility_result) {
-        assert(readbacks.visibility);
-        render_pass_info.visibility_buffer = readbacks.visibility->visibility_result_heap;
+        assert(list.visibility);
+        render_pass_info.visibility_buffer = list.visibility->visibility_result_heap;
       }
       auto gpu_buffer_ = data->allocated_argbuf;
       auto encoder = cmdbuf.renderCommandEncoder(render_pass_info);
@@ -927,7 +985,7 @@ ArgumentEncodingContext::flushCommands(WMT::CommandBuffer cmdbuf, uint64_t seqId
           uint32_t end_of_command;
         };
         auto [mapped_task_data, task_data_buffer, task_data_buffer_offset] =
-            queue_.AllocateArgumentBuffer(seq_id_, sizeof(GS_MARSHAL_TASK) * task_count);
+            queue_.AllocateArgumentBuffer(list.seq_id, sizeof(GS_MARSHAL_TASK) * task_count);
         auto tasks_data = (GS_MARSHAL_TASK *)mapped_task_data;
         for (unsigned i = 0; i<task_count; i++) {
           auto & task = data->gs_arg_marshal_tasks[i];
@@ -953,7 +1011,7 @@ ArgumentEncodingContext::flushCommands(WMT::CommandBuffer cmdbuf, uint64_t seqId
           uint32_t end_of_command;
         };
         auto [mapped_task_data, task_data_buffer, task_data_buffer_offset] =
-            queue_.AllocateArgumentBuffer(seq_id_, sizeof(TS_MARSHAL_TASK) * task_count);
+            queue_.AllocateArgumentBuffer(list.seq_id, sizeof(TS_MARSHAL_TASK) * task_count);
         auto tasks_data = (TS_MARSHAL_TASK *)mapped_task_data;
         for (unsigned i = 0; i<task_count; i++) {
           auto & task = data->ts_arg_marshal_tasks[i];
@@ -975,6 +1033,8 @@ ArgumentEncodingContext::flushCommands(WMT::CommandBuffer cmdbuf, uint64_t seqId
             WMTRenderStageVertex | WMTRenderStageMesh | WMTRenderStageObject
         );
       }
+      filter.reset();
+      filtered += filter.filter(&data->cmd_head);
       encoder.encodeCommands(&data->cmd_head);
       data->fence_update_vertex.forEach(
           data->fence_update, // if a fence is updated at fragment, no need to update again pre-raster
@@ -1027,7 +1087,7 @@ ArgumentEncodingContext::flushCommands(WMT::CommandBuffer cmdbuf, uint64_t seqId
           }
       );
       auto t1 = clock::now();
-      currentFrameStatistics().drawable_blocking_interval += (t1 - t0);
+      queue_.statistics.at(list.frame_id).drawable_blocking_interval += (t1 - t0);
       if (data->after > 0)
         cmdbuf.presentDrawableAfterMinimumDuration(drawable, data->after);
       else
@@ -1146,7 +1206,7 @@ ArgumentEncodingContext::flushCommands(WMT::CommandBuffer cmdbuf, uint64_t seqId
     }
     case EncoderType::SampleTimestamp: {
       auto data = static_cast<SampleTimestampData *>(current);
-      if (auto readback = readbacks.timestamp.get(); readback->sampleBuffer()) {
+      if (auto readback = list.timestamp; readback->sampleBuffer()) {
 
         /**
         Since Metal driver may change the execution order of encoders, implement a "barrier" to prevent that
@@ -1185,21 +1245,249 @@ ArgumentEncodingContext::flushCommands(WMT::CommandBuffer cmdbuf, uint64_t seqId
     default:
       break;
     }
-    encoder_index--;
   }
-  encoder_head.next = nullptr;
-  encoder_last = &encoder_head;
-  encoder_count_ = 0;
 
-  cmdbuf.encodeSignalEvent(queue_.event, event_seq_id);
+  cmdbuf.encodeSignalEvent(queue_.event, list.event_seq_id);
+  return filtered;
+}
+
+void
+EncoderDependencyGraph::reset(unsigned encoder_count) {
+  count_ = encoder_count;
+  words_ = (encoder_count + 63) >> 6;
+  waiters_.assign(kParityLane * words_, 0);
+  updaters_.assign(kParityLane * words_, 0);
+  barriers_.assign(words_, 0);
+  wait_.assign(encoder_count, FenceSet{});
+  update_.assign(encoder_count, FenceSet{});
+  candidate_keys_.clear();
+  candidates_.clear();
+}
+
+void
+EncoderDependencyGraph::setBarrier(unsigned index) {
+  barriers_[index >> 6] |= 1ull << (index & 63);
+}
+
+void
+EncoderDependencyGraph::setFences(unsigned index, const FenceSet &wait, const FenceSet &update) {
+  auto word = index >> 6;
+  auto bit = 1ull << (index & 63);
+  auto apply = [&](std::vector<uint64_t> &bitsets, FenceSet &current, const FenceSet &fences) {
+    FenceSet removed = current;
+    removed.subtract(fences);
+    removed.forEach([&](unsigned fence) { bitsets[fence * words_ + word] &= ~bit; });
+    FenceSet added = fences;
+    added.subtract(current);
+    added.forEach([&](unsigned fence) { bitsets[fence * words_ + word] |= bit; });
+    current = fences;
+  };
+  apply(waiters_, wait_[index], wait);
+  apply(updaters_, update_[index], update);
+}
+
+unsigned
+EncoderDependencyGraph::nextDependency(unsigned after, const FenceSet &wait, const FenceSet &update) {
+  unsigned first = after + 1;
+  if (first >= count_)
+    return count_;
+  rows_.clear();
+  rows_.push_back(barriers_.data());
+  // what the encoder updates must not be moved across a waiter, and vice versa
+  FenceSet(update).forEach([&](unsigned fence) { rows_.push_back(&waiters_[fence * words_]); });
+  FenceSet(wait).forEach([&](unsigned fence) { rows_.push_back(&updaters_[fence * words_]); });
+  uint64_t mask = ~0ull << (first & 63);
+  for (unsigned word = first >> 6; word < words_; word++) {
+    uint64_t bits = 0;
+    for (auto row : rows_)
+      bits |= row[word];
+    if ((bits &= mask))
+      return std::min(count_, (word << 6) + bit::tzcnt(bits));
+    mask = ~0ull;
+  }
+  return count_;
+}
+
+void
+EncoderDependencyGraph::addCandidate(const void *key, unsigned index) {
+  candidate_keys_.push_back({key, index});
+}
+
+void
+EncoderDependencyGraph::sortCandidates() {
+  std::sort(candidate_keys_.begin(), candidate_keys_.end());
+  candidate_keys_.erase(std::unique(candidate_keys_.begin(), candidate_keys_.end()), candidate_keys_.end());
+  candidates_.resize(candidate_keys_.size());
+  for (size_t i = 0; i < candidate_keys_.size(); i++)
+    candidates_[i] = candidate_keys_[i].second;
+}
+
+std::pair<const unsigned *, const unsigned *>
+EncoderDependencyGraph::candidates(const void *key, unsigned after) const {
+  auto begin = std::lower_bound(candidate_keys_.begin(), candidate_keys_.end(), std::make_pair(key, after + 1));
+  auto end = std::lower_bound(begin, candidate_keys_.end(), std::make_pair(key, ~0u));
+  return {candidates_.data() + (begin - candidate_keys_.begin()), candidates_.data() + (end - candidate_keys_.begin())};
+}
+
+static FenceSet
+DependencyWait(EncoderData *encoder) {
+  if (encoder->type == EncoderType::Render) {
+    auto render = reinterpret_cast<RenderEncoderData *>(encoder);
+    return render->fence_wait.unionOf(render->fence_wait_vertex);
+  }
+  return encoder->fence_wait;
+}
+
+static FenceSet
+DependencyUpdate(EncoderData *encoder) {
+  if (encoder->type == EncoderType::Render) {
+    auto render = reinterpret_cast<RenderEncoderData *>(encoder);
+    return render->fence_update.unionOf(render->fence_update_vertex);
+  }
+  return encoder->fence_update;
+}
 
-  for (size_t i = cpu_buffer_chunks_.size() - 1; i > current_buffer_chunk_; i--) {
-    if (++cpu_buffer_chunks_[i].underused_times > kEncodingContextCPUHeapLifetime) {
-      cpu_buffer_chunks_.pop_back();
+/**
+Attachments that must be the same for a render pass to be merged with another
+one or a clear. A render pass without any is keyed with nullptr.
+*/
+template <typename Fn>
+static void
+ForEachRenderAttachment(RenderEncoderData *render, Fn &&fn) {
+  bool keyed = false;
+  for (unsigned i = 0; i < render->render_target_count; i++) {
+    if (render->colors[i].attachment) {
+      fn(render->colors[i].attachment.ptr());
+      keyed = true;
     }
   }
+  if (render->depth.attachment) {
+    fn(render->depth.attachment.ptr());
+    keyed |= render->dsv_planar_flags & 1;
+  }
+  if (render->stencil.attachment) {
+    fn(render->stencil.attachment.ptr());
+    keyed |= render->dsv_planar_flags & 2;
+  }
+  if (!keyed)
+    fn(nullptr);
+}
 
-  return readbacks;
+void
+ArgumentEncodingContext::reorderEncoders(EncoderData **encoders, unsigned count) {
+  if (count < kEncoderOptimizerThreshold) {
+    unsigned j, i;
+    for (j = count - 2; j != ~0u; j--) {
+      // TODO(fences): we don't actively move encoders other than clear and render
+      if (encoders[j]->type != EncoderType::Clear && encoders[j]->type != EncoderType::Render)
+        continue;
+      for (i = j + 1; i < count; i++) {
+        if (encoders[i]->type == EncoderType::Null)
+          continue;
+        if (checkEncoderRelation(encoders[j], encoders[i]) == DXMT_ENCODER_LIST_OP_SYNCHRONIZE)
+          break;
+      }
+    }
+    return;
+  }
+
+  /**
+  Same as above, except that instead of visiting every encoder after j, only
+  those that share an attachment with it are checked, up to the first one it
+  has a data dependency with. Others would be swapped without side effects.
+  */
+  auto &graph = dependency_graph_;
+  graph.reset(count);
+  for (unsigned i = 0; i < count; i++) {
+    auto encoder = encoders[i];
+    switch (encoder->type) {
+    case EncoderType::Null:
+      continue;
+    case EncoderType::SignalEvent:
+    case EncoderType::WaitForEvent:
+    case EncoderType::SampleTimestamp:
+      graph.setBarrier(i);
+      break;
+    case EncoderType::Render:
+      ForEachRenderAttachment(reinterpret_cast<RenderEncoderData *>(encoder), [&](const void *key) {
+        graph.addCandidate(key, i);
+      });
+      break;
+    case EncoderType::Clear:
+      graph.addCandidate(reinterpret_cast<ClearEncoderData *>(encoder)->attachment.ptr(), i);
+      break;
+    case EncoderType::Resolve:
+      graph.addCandidate(reinterpret_cast<ResolveEncoderData *>(encoder)->src->allocation, i);
+      break;
+    default:
+      break;
+    }
+    graph.setFences(i, DependencyWait(encoder), DependencyUpdate(encoder));
+  }
+  graph.sortCandidates();
+
+  // 8 color attachments, depth and stencil, and the allocations of colors
+  std::array<const void *, 18> keys;
+  std::array<std::pair<const unsigned *, const unsigned *>, 18> cursors;
+  for (unsigned j = count - 2; j != ~0u; j--) {
+    auto former = encoders[j];
+    unsigned cursor_count = 0;
+    auto add_cursor = [&](const void *key) {
+      for (unsigned c = 0; c < cursor_count; c++) {
+        if (keys[c] == key)
+          return;
+      }
+      keys[cursor_count] = key;
+      cursors[cursor_count++] = graph.candidates(key, j);
+    };
+    if (former->type == EncoderType::Render) {
+      auto render = reinterpret_cast<RenderEncoderData *>(former);
+      ForEachRenderAttachment(render, add_cursor);
+      for (unsigned i = 0; i < render->render_target_count; i++) {
+        if (render->colors[i].attachment)
+          add_cursor(render->colors[i].attachment->allocation);
+      }
+    } else if (former->type == EncoderType::Clear) {
+      add_cursor(reinterpret_cast<ClearEncoderData *>(former)->attachment.ptr());
+    } else {
+      continue;
+    }
+
+    unsigned barrier = graph.nextDependency(j, DependencyWait(former), DependencyUpdate(former));
+    while (true) {
+      unsigned i = count;
+      for (unsigned c = 0; c < cursor_count; c++) {
+        if (cursors[c].first != cursors[c].second)
+          i = std::min(i, *cursors[c].first);
+      }
+      if (i >= count || i > barrier)
+        break;
+      for (unsigned c = 0; c < cursor_count; c++) {
+        if (cursors[c].first != cursors[c].second && *cursors[c].first == i)
+          cursors[c].first++;
+      }
+      auto latter = encoders[i];
+      if (latter->type == EncoderType::Null)
+        continue;
+      if (former->type == EncoderType::Clear && latter->type != EncoderType::Render)
+        continue;
+      auto op = checkEncoderRelation(former, latter);
+      if (former->type == EncoderType::Null) {
+        graph.setFences(i, DependencyWait(latter), DependencyUpdate(latter));
+        graph.setFences(j, {}, {});
+        break;
+      }
+      if (latter->type == EncoderType::Null) {
+        // a resolve merged into the render pass, which then depends on more
+        graph.setFences(i, {}, {});
+        graph.setFences(j, DependencyWait(former), DependencyUpdate(former));
+        barrier = graph.nextDependency(i, DependencyWait(former), DependencyUpdate(former));
+        continue;
+      }
+      if (op == DXMT_ENCODER_LIST_OP_SYNCHRONIZE)
+        break;
+    }
+  }
 }
 
 DXMT_ENCODER_LIST_OP
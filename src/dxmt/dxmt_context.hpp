@@ -3,6 +3,7 @@
 #include "Metal.hpp"
 #include "dxmt_buffer.hpp"
 #include "dxmt_command.hpp"
+#include "dxmt_command_filter.hpp"
 #include "dxmt_deptrack.hpp"
 #include "dxmt_occlusion_query.hpp"
 #include "dxmt_presenter.hpp"
@@ -178,6 +179,8 @@ struct RenderEncoderData : EncoderData {
   bool use_visibility_result = 0;
   bool use_tessellation = 0;
   bool use_geometry = 0;
+  /* the pipeline of following draws is still compiling, skip them */
+  bool pipeline_pending = 0;
   TileBarrierPSOKey tile_barrier_pso_key = {};
   WMT::RenderPipelineState last_pso = {};
 };
@@ -301,6 +304,145 @@ struct AllocatedTempBufferSlice {
   uint64_t gpu_address;
 };
 
+/**
+CPU memory holding the encoders of a chunk, from the moment its commands are
+executed until they are encoded into its command buffer
+*/
+class EncoderHeap {
+public:
+  EncoderHeap() {
+    chunks_.emplace_back();
+    reset();
+  }
+
+  void
+  reset() {
+    current_chunk_ = 0;
+    buffer_ = chunks_[current_chunk_].ptr;
+    offset_ = 0;
+  }
+
+  void *
+  allocate(size_t size, size_t alignment) {
+    assert(size < kEncodingContextCPUHeapSize);
+    for (;;) {
+      std::size_t adjustment = align_forward_adjustment((void *)offset_, alignment);
+      auto aligned = offset_ + adjustment;
+      offset_ = aligned + size;
+      if (unlikely(offset_ >= kEncodingContextCPUHeapSize)) {
+        current_chunk_++;
+        while (current_chunk_ >= chunks_.size()) {
+          chunks_.emplace_back();
+        }
+        auto &chunk = chunks_[current_chunk_];
+        chunk.underused_times = 0;
+        buffer_ = chunk.ptr;
+        offset_ = 0;
+        continue;
+      }
+      return ptr_add(buffer_, aligned);
+    }
+  }
+
+  /**
+  Releases chunks that have been left unused for a while
+  */
+  void
+  trim() {
+    for (size_t i = chunks_.size() - 1; i > current_chunk_; i--) {
+      if (++chunks_[i].underused_times > kEncodingContextCPUHeapLifetime) {
+        chunks_.pop_back();
+      }
+    }
+  }
+
+private:
+  struct chunk {
+    void *ptr;
+    size_t underused_times;
+
+    chunk() {
+      ptr = malloc(kEncodingContextCPUHeapSize);
+      underused_times = 0;
+    }
+    chunk(const chunk &copy) = delete;
+    chunk(chunk &&move) {
+      ptr = move.ptr;
+      underused_times = move.underused_times;
+      move.ptr = nullptr;
+    };
+    ~chunk() {
+      free(ptr);
+      ptr = nullptr;
+    }
+  };
+  std::vector<chunk> chunks_;
+  uint32_t current_chunk_ = 0;
+  void *buffer_;
+  uint64_t offset_;
+};
+
+/**
+Encoders of a chunk that are ready to be encoded into its command buffer. They
+stay in the EncoderHeap the chunk was executed with.
+*/
+struct EncoderList {
+  EncoderData **encoders;
+  unsigned count;
+  uint64_t seq_id;
+  uint64_t frame_id;
+  uint64_t event_seq_id;
+  VisibilityResultReadback *visibility;
+  TimestampReadback *timestamp;
+  /**
+  Encoded only after the command buffers of previous chunks are committed,
+  e.g. because it presents or uses the queue barrier
+  */
+  bool ordered;
+};
+
+/**
+Dependencies between the encoders of a chunk, built once before they are
+reordered. Each fence has a bitset of the encoders waiting on it and one of
+the encoders updating it, so the first encoder another one can't be moved
+across is found a word of encoders at a time. Encoders that can be merged are
+looked up by the attachments they share.
+*/
+class EncoderDependencyGraph {
+public:
+  void reset(unsigned encoder_count);
+
+  /* nothing is moved across this encoder */
+  void setBarrier(unsigned index);
+
+  /* replaces the fences of the encoder, e.g. after another is merged into it */
+  void setFences(unsigned index, const FenceSet &wait, const FenceSet &update);
+
+  /**
+  The first encoder after `after` that is a barrier or depends on the given
+  fences, or the encoder count if there is none.
+  */
+  unsigned nextDependency(unsigned after, const FenceSet &wait, const FenceSet &update);
+
+  void addCandidate(const void *key, unsigned index);
+  void sortCandidates();
+
+  /* encoders added with `key`, after `after` and in order */
+  std::pair<const unsigned *, const unsigned *> candidates(const void *key, unsigned after) const;
+
+private:
+  unsigned count_ = 0;
+  unsigned words_ = 0;
+  std::vector<uint64_t> waiters_;
+  std::vector<uint64_t> updaters_;
+  std::vector<uint64_t> barriers_;
+  std::vector<FenceSet> wait_;
+  std::vector<FenceSet> update_;
+  std::vector<const uint64_t *> rows_;
+  std::vector<std::pair<const void *, unsigned>> candidate_keys_;
+  std::vector<unsigned> candidates_;
+};
+
 class ArgumentEncodingContext {
 private:
   template <PipelineStage stage> void track(GenericAccessTracker &tracker, bool exclusive);
@@ -476,6 +618,11 @@ public:
       const MTL_SHADER_REFLECTION *reflection, const MTL_SM50_SHADER_ARGUMENT *arguments,
       uint64_t argument_buffer_offset
   );
+  /**
+  Binds the argument table already encoded at `argument_buffer_offset` of the
+  current encoder instead of encoding it again.
+  */
+  template <PipelineStage stage, PipelineKind kind> void bindShaderResources(uint64_t argument_buffer_offset);
 
   void retainAllocation(Allocation* allocation);
 
@@ -649,24 +796,7 @@ public:
 
   void *
   allocate_cpu_heap(size_t size, size_t alignment) {
-    assert(size < kEncodingContextCPUHeapSize);
-    for (;;) {
-      std::size_t adjustment = align_forward_adjustment((void *)cpu_buffer_offset_, alignment);
-      auto aligned = cpu_buffer_offset_ + adjustment;
-      cpu_buffer_offset_ = aligned + size;
-      if (unlikely(cpu_buffer_offset_ >= kEncodingContextCPUHeapSize)) {
-        current_buffer_chunk_++;
-        while (current_buffer_chunk_ >= cpu_buffer_chunks_.size()) {
-          cpu_buffer_chunks_.emplace_back();
-        }
-        auto &chunk = cpu_buffer_chunks_[current_buffer_chunk_];
-        chunk.underused_times = 0;
-        cpu_buffer_ = chunk.ptr;
-        cpu_buffer_offset_ = 0;
-        continue;
-      }
-      return ptr_add(cpu_buffer_, aligned);
-    }
+    return heap_->allocate(size, alignment);
   }
 
   template <typename T, bool ComputeCommandEncoder = false>
@@ -703,6 +833,21 @@ public:
 
   QueryReadbacks flushCommands(WMT::CommandBuffer cmdbuf, uint64_t seqId, uint64_t event_seq_id);
 
+  /**
+  First half of flushCommands: detaches and optimizes the encoders of the
+  current chunk. The returned list can be encoded on another thread while the
+  next chunk is executed into a different EncoderHeap.
+  */
+  EncoderList
+  prepareCommands(WMT::CommandBuffer cmdbuf, uint64_t seqId, uint64_t event_seq_id, QueryReadbacks &readbacks);
+
+  /**
+  Second half of flushCommands. Only reads state that doesn't change between
+  chunks, except for ordered lists, which must not be encoded concurrently.
+  Returns the number of redundant render commands that were left out.
+  */
+  uint32_t encodeCommands(WMT::CommandBuffer cmdbuf, const EncoderList &list);
+
   uint64_t currentSeqId() {return seq_id_;}
 
   uint64_t currentFrameId() {return frame_id_;}
@@ -710,7 +855,12 @@ public:
   CommandQueue& queue() { return queue_;}
 
   void
-  $$setEncodingContext(uint64_t seq_id, uint64_t frame_id);
+  $$setEncodingContext(uint64_t seq_id, uint64_t frame_id, EncoderHeap &heap);
+
+  void
+  $$setEncodingContext(uint64_t seq_id, uint64_t frame_id) {
+    $$setEncodingContext(seq_id, frame_id, default_heap_);
+  }
 
   void bumpVisibilityResultOffset();
   void beginVisibilityResultQuery(Rc<VisibilityResultQuery> &&query);
@@ -750,6 +900,14 @@ public:
     currentFrameStatistics().compatibility_flags.set(flag);
   }
 
+  bool
+  skipPendingPipelineDraw() {
+    if (!currentRenderEncoder()->pipeline_pending)
+      return false;
+    currentFrameStatistics().pending_pipeline_draws++;
+    return true;
+  }
+
   ArgumentEncodingContext(CommandQueue &queue, WMT::Device device, InternalCommandLibrary &lib);
   ~ArgumentEncodingContext();
 
@@ -777,6 +935,9 @@ private:
     TextureViewRef dst{};
   };
   ResolveSignatureMatchResult isResolveSignatureMatched(RenderEncoderData *former, ResolveEncoderData *latter);
+  void reorderEncoders(EncoderData **encoders, unsigned count);
+
+  template <PipelineStage stage, PipelineKind kind> void setShaderResourceTable(uint64_t argument_buffer_offset);
 
   std::array<VertexBufferBinding, kVertexBufferSlots> vbuf_;
   Rc<Buffer> ibuf_;
@@ -806,29 +967,9 @@ private:
   uint64_t seq_id_;
   uint64_t frame_id_;
 
-  struct chunk {
-    void *ptr;
-    size_t underused_times;
-
-    chunk() {
-      ptr = malloc(kEncodingContextCPUHeapSize);
-      underused_times = 0;
-    }
-    chunk(const chunk &copy) = delete;
-    chunk(chunk &&move) {
-      ptr = move.ptr;
-      underused_times = move.underused_times;
-      move.ptr = nullptr;
-    };
-    ~chunk() {
-      free(ptr);
-      ptr = nullptr;
-    }
-  };
-  std::vector<chunk> cpu_buffer_chunks_;
-  uint32_t current_buffer_chunk_ = 0;
-  void *cpu_buffer_;
-  uint64_t cpu_buffer_offset_;
+  EncoderHeap default_heap_;
+  EncoderHeap *heap_ = &default_heap_;
+  EncoderDependencyGraph dependency_graph_;
 
   VisibilityResultOffsetBumpState vro_state_;
   std::vector<Rc<VisibilityResultQuery>> pending_queries_;
@@ -4,6 +4,7 @@
 #include "log/log.hpp"
 #include "thread.hpp"
 #include "util_math.hpp"
+#include <algorithm>
 #include <mutex>
 #include <queue>
 
@@ -173,7 +174,8 @@ RingBumpState<Allocator, BlockSize, mutex>::allocate(
     if ((align(latest.allocated_size, alignment) + size) > latest.total_size) {
       break;
     }
-    latest.last_used_seq_id = seq_id;
+    // encoding workers may still allocate for a chunk older than the latest one
+    latest.last_used_seq_id = std::max(latest.last_used_seq_id, seq_id);
     return suballocate(latest, size, alignment);
   }
   return suballocate(
@@ -1,6 +1,10 @@
 #include "dxmt_shader_cache.hpp"
 #include "util_env.hpp"
 #include "util_string.hpp"
+#include <bit>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
 
 namespace dxmt {
 
@@ -18,9 +22,136 @@ ShaderCache::getInstance(WMTMetalVersion version) {
   return *iter->second;
 }
 
-ShaderCache::ShaderCache(WMTMetalVersion metal_version) {
-  if (env::getEnvVar("DXMT_SHADER_CACHE") == "0")
+ShaderCacheStatistics &
+ShaderCache::statistics() {
+  static ShaderCacheStatistics statistics;
+  return statistics;
+}
+
+void
+ShaderCacheKeyFilter::load(const ShaderCacheKey *keys, size_t count) {
+  uint64_t bits = std::bit_ceil(std::max<uint64_t>(count, 4096) * kBitsPerKey);
+  words_ = std::make_unique<std::atomic<uint64_t>[]>(bits / 64);
+  mask_ = bits - 1;
+  for (size_t i = 0; i < count; i++)
+    insert(keys[i]);
+}
+
+static inline void
+filter_hashes(const ShaderCacheKey &key, uint64_t &h1, uint64_t &h2) {
+  uint64_t a[2], b[2];
+  std::memcpy(a, key.first.data, sizeof(a));
+  std::memcpy(b, key.second.data, sizeof(b));
+  h1 = a[0] ^ b[1];
+  h2 = (a[1] ^ b[0]) | 1;
+}
+
+void
+ShaderCacheKeyFilter::insert(const ShaderCacheKey &key) {
+  if (!mask_)
+    return;
+  uint64_t h1, h2;
+  filter_hashes(key, h1, h2);
+  for (unsigned i = 0; i < kHashCount; i++) {
+    uint64_t bit = (h1 + i * h2) & mask_;
+    words_[bit / 64].fetch_or(1ull << (bit % 64), std::memory_order_relaxed);
+  }
+}
+
+bool
+ShaderCacheKeyFilter::mayContain(const ShaderCacheKey &key) const {
+  if (!mask_)
+    return true;
+  uint64_t h1, h2;
+  filter_hashes(key, h1, h2);
+  for (unsigned i = 0; i < kHashCount; i++) {
+    uint64_t bit = (h1 + i * h2) & mask_;
+    if (!(words_[bit / 64].load(std::memory_order_relaxed) & (1ull << (bit % 64))))
+      return false;
+  }
+  return true;
+}
+
+WMT::Reference<WMT::DispatchData>
+ShaderCacheHotEntries::find(const ShaderCacheKey &key) {
+  auto &s = shard(key);
+  std::lock_guard<dxmt::mutex> lock(s.mutex);
+  auto iter = s.map.find(key);
+  if (iter == s.map.end())
+    return {};
+  s.entries.splice(s.entries.begin(), s.entries, iter->second);
+  return iter->second->second;
+}
+
+void
+ShaderCacheHotEntries::insert(const ShaderCacheKey &key, WMT::DispatchData data) {
+  auto &s = shard(key);
+  std::lock_guard<dxmt::mutex> lock(s.mutex);
+  if (auto iter = s.map.find(key); iter != s.map.end()) {
+    iter->second->second = data;
+    s.entries.splice(s.entries.begin(), s.entries, iter->second);
+    return;
+  }
+  s.entries.emplace_front(key, data);
+  s.map.emplace(key, s.entries.begin());
+  if (s.entries.size() > kEntriesPerShard) {
+    s.map.erase(s.entries.back().first);
+    s.entries.pop_back();
+  }
+}
+
+WMT::Reference<WMT::DispatchData>
+ShaderCache::find(const ShaderCacheKey &key) {
+  auto &stats = statistics();
+  if (auto data = hot_.find(key)) {
+    stats.hot_hits.fetch_add(1, std::memory_order_relaxed);
+    stats.hits.fetch_add(1, std::memory_order_relaxed);
+    return data;
+  }
+  if (!scache_reader_)
+    return {};
+  if (!filter_.mayContain(key)) {
+    stats.filtered_misses.fetch_add(1, std::memory_order_relaxed);
+    stats.misses.fetch_add(1, std::memory_order_relaxed);
+    return {};
+  }
+  WMT::Reference<WMT::DispatchData> data;
+  {
+    auto reader = getReader();
+    data = reader->get(key);
+  }
+  // decompressed by the calling compile thread, without holding the reader
+  if (data)
+    data = WMT::CacheReader::decode(data);
+  if (!data) {
+    stats.misses.fetch_add(1, std::memory_order_relaxed);
+    return {};
+  }
+  stats.hits.fetch_add(1, std::memory_order_relaxed);
+  hot_.insert(key, data);
+  // only queued here, written along with the next batch
+  if (auto writer = getWriter())
+    writer->touch(key);
+  return data;
+}
+
+void
+ShaderCache::insert(const ShaderCacheKey &key, WMT::DispatchData data) {
+  if (!scache_writer_)
     return;
+  {
+    auto writer = getWriter();
+    writer->set(key, data);
+  }
+  filter_.insert(key);
+  hot_.insert(key, data);
+  statistics().inserts.fetch_add(1, std::memory_order_relaxed);
+}
+
+std::string
+GetShaderCacheFilePath(const std::string &name) {
+  if (env::getEnvVar("DXMT_SHADER_CACHE") == "0")
+    return {};
   std::string path;
   if (path = env::getEnvVar("DXMT_SHADER_CACHE_PATH"); !path.empty() && path.starts_with("/")) {
     if (!path.ends_with('/'))
@@ -28,9 +159,32 @@ ShaderCache::ShaderCache(WMTMetalVersion metal_version) {
   } else {
     path = str::format("dxmt/", env::getExeName(), "/");
   }
-  path += str::format("shaders_", (unsigned int)metal_version, ".db");
+  return path + name;
+}
+
+ShaderCache::ShaderCache(WMTMetalVersion metal_version) {
+  auto path = GetShaderCacheFilePath(str::format("shaders_", (unsigned int)metal_version, ".db"));
+  if (path.empty())
+    return;
   scache_writer_ = WMT::CacheWriter::alloc_init(path.c_str(), kDXMTShaderCacheVersion);
+  if (scache_writer_) {
+    uint64_t max_size_mb = kDXMTShaderCacheDefaultMaxSizeMB;
+    if (auto max_size = env::getEnvVar("DXMT_SHADER_CACHE_MAX_SIZE"); !max_size.empty())
+      max_size_mb = std::strtoull(max_size.c_str(), nullptr, 10);
+    // a size that doesn't fit in bytes can't be reached either
+    if (max_size_mb > (UINT64_MAX >> 20))
+      max_size_mb = 0;
+    scache_writer_.setSizeLimit(max_size_mb << 20);
+    if (env::getEnvVar("DXMT_SHADER_CACHE_COMPRESSION") != "none")
+      scache_writer_.setCodec(WMTCacheCodecLZ4);
+  }
   scache_reader_ = WMT::CacheReader::alloc_init(path.c_str(), kDXMTShaderCacheVersion);
+  if (scache_reader_) {
+    // the database may grow between both calls, extra keys are simply left out
+    std::vector<ShaderCacheKey> keys(scache_reader_.copyKeys<ShaderCacheKey>(nullptr, 0));
+    keys.resize(std::min<uint64_t>(keys.size(), scache_reader_.copyKeys(keys.data(), keys.size())));
+    filter_.load(keys.data(), keys.size());
+  }
 }
 
 } // namespace dxmt
\ No newline at end of file
@@ -1,10 +1,114 @@
 #pragma once
 #include "Metal.hpp"
+#include "sha1/sha1_util.hpp"
 #include "thread.hpp"
+#include <atomic>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
 
 namespace dxmt {
 
-constexpr int kDXMTShaderCacheVersion = 18;
+// also used by dxmt-precompile
+constexpr int kDXMTShaderCacheVersion = 19;
+
+constexpr uint64_t kDXMTShaderCacheDefaultMaxSizeMB = 1024;
+
+/**
+Path of a file in the per-executable cache directory, relative to the user
+cache directory unless DXMT_SHADER_CACHE_PATH is set. Empty if the cache is
+disabled.
+*/
+std::string GetShaderCacheFilePath(const std::string &name);
+
+/**
+Shader digest and variant digest
+*/
+using ShaderCacheKey = std::pair<Sha1Digest, Sha1Digest>;
+static_assert(sizeof(ShaderCacheKey) == 40, "keys are stored as raw bytes");
+
+struct ShaderCacheKeyHash {
+  size_t
+  operator()(const ShaderCacheKey &key) const noexcept {
+    // both halves are SHA-1 digests already
+    uint64_t a, b;
+    std::memcpy(&a, key.first.data, sizeof(a));
+    std::memcpy(&b, key.second.data, sizeof(b));
+    return a ^ (b * 0x9E3779B97F4A7C15ull);
+  }
+};
+
+struct ShaderCacheKeyEqual {
+  bool
+  operator()(const ShaderCacheKey &x, const ShaderCacheKey &y) const noexcept {
+    return x.first == y.first && x.second == y.second;
+  }
+};
+
+struct ShaderCacheStatistics {
+  std::atomic<uint32_t> hits = 0;
+  std::atomic<uint32_t> misses = 0;
+  std::atomic<uint32_t> inserts = 0;
+  /* served without taking the reader lock */
+  std::atomic<uint32_t> filtered_misses = 0;
+  std::atomic<uint32_t> hot_hits = 0;
+};
+
+/**
+Bloom filter of every key known to be stored, so that misses don't need a
+round trip to the database. Sized once when loaded; keys inserted later are
+still added, at the cost of a higher false positive rate.
+*/
+class ShaderCacheKeyFilter {
+public:
+  void load(const ShaderCacheKey *keys, size_t count);
+
+  bool
+  enabled() const {
+    return mask_ != 0;
+  }
+
+  void insert(const ShaderCacheKey &key);
+
+  bool mayContain(const ShaderCacheKey &key) const;
+
+private:
+  static constexpr unsigned kHashCount = 4;
+  static constexpr size_t kBitsPerKey = 16;
+
+  std::unique_ptr<std::atomic<uint64_t>[]> words_;
+  uint64_t mask_ = 0;
+};
+
+/**
+Recently found or inserted blobs, shared by every device using the same
+cache. Sharded so that compile threads rarely contend.
+*/
+class ShaderCacheHotEntries {
+public:
+  WMT::Reference<WMT::DispatchData> find(const ShaderCacheKey &key);
+
+  void insert(const ShaderCacheKey &key, WMT::DispatchData data);
+
+private:
+  static constexpr size_t kShardCount = 16;
+  static constexpr size_t kEntriesPerShard = 64;
+
+  struct Shard {
+    dxmt::mutex mutex;
+    std::list<std::pair<ShaderCacheKey, WMT::Reference<WMT::DispatchData>>> entries;
+    std::unordered_map<ShaderCacheKey, decltype(entries)::iterator, ShaderCacheKeyHash, ShaderCacheKeyEqual> map;
+  };
+
+  Shard &
+  shard(const ShaderCacheKey &key) {
+    return shards_[(ShaderCacheKeyHash{}(key) >> 32) % kShardCount];
+  }
+
+  Shard shards_[kShardCount];
+};
 
 class ShaderCache {
 public:
@@ -54,6 +158,20 @@ public:
     return {scache_reader_mutex_, scache_reader_};
   }
 
+  /**
+  Shared by all caches, regardless of Metal version. Evictions happen on the
+  writer thread and are only logged.
+  */
+  static ShaderCacheStatistics &statistics();
+
+  /**
+  Looks up the hot entries, then the database unless the key filter rules it
+  out. Hits refresh the entry's last-used time.
+  */
+  WMT::Reference<WMT::DispatchData> find(const ShaderCacheKey &key);
+
+  void insert(const ShaderCacheKey &key, WMT::DispatchData data);
+
   ShaderCache(WMTMetalVersion metal_version);
   ShaderCache(const ShaderCache &copy) = delete;
 
@@ -63,6 +181,9 @@ private:
 
   WMT::Reference<WMT::CacheReader> scache_reader_;
   dxmt::mutex scache_reader_mutex_;
+
+  ShaderCacheKeyFilter filter_;
+  ShaderCacheHotEntries hot_;
 };
 
 } // namespace dxmt
\ No newline at end of file
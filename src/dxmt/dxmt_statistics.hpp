@@ -46,8 +46,14 @@ struct FrameStatistics {
   uint32_t clear_pass_count = 0;
   uint32_t clear_pass_optimized = 0;
   uint32_t resolve_pass_optimized = 0;
+  /* render commands left out because they set what was already set */
+  uint32_t render_command_filtered = 0;
+  /* argument tables bound, and those bound again instead of being encoded */
+  uint32_t argument_table_count = 0;
+  uint32_t argument_table_reused = 0;
   uint32_t compute_pass_count = 0;
   uint32_t blit_pass_count = 0;
+  uint32_t pending_pipeline_draws = 0;
   uint32_t event_stall = 0;
   uint32_t latency = 0;
   clock::duration encode_prepare_interval{};
@@ -68,8 +74,12 @@ struct FrameStatistics {
     clear_pass_count = 0;
     clear_pass_optimized = 0;
     resolve_pass_optimized = 0;
+    render_command_filtered = 0;
+    argument_table_count = 0;
+    argument_table_reused = 0;
     compute_pass_count = 0;
     blit_pass_count = 0;
+    pending_pipeline_draws = 0;
     event_stall = 0;
     latency = 0;
     encode_prepare_interval = {};
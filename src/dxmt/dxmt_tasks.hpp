@@ -2,9 +2,12 @@
 
 #include "thread.hpp"
 #include "util_win32_compat.h"
+#include <algorithm>
 #include <atomic>
-#include <queue>
+#include <deque>
+#include <memory>
 #include <unordered_map>
+#include <vector>
 
 namespace dxmt {
 
@@ -14,50 +17,196 @@ template <typename Task> struct task_trait {
   void set_done(Task task);
 };
 
+/**
+Most urgent first.
+ */
+enum class task_priority : uint32_t {
+  /* something is blocked on it right now */
+  blocking,
+  /* requested by the application, needed by an upcoming draw or dispatch */
+  visible,
+  /* nobody asked for it yet, e.g. replayed pipelines and optimized rebuilds */
+  speculative,
+};
+
+constexpr uint32_t kTaskPriorityCount = 3;
+
+/**
+Each worker owns a queue per priority. Tasks submitted from a worker go to its
+own queue, the others are spread over all of them, and idle workers steal from
+the others before running anything less urgent.
+
+A task returning another one waits for it, and is queued again once it's done,
+at its own priority. Waiting passes the waiter's priority on to the task it
+waits for.
+
+Only tasks involved in waiting have state of their own, everything else is
+queued untracked and looked up in the queues if it gets prioritized.
+ */
 template <typename Task> class task_scheduler {
 public:
+  /**
+  From a worker, the priority of the task it's running, `visible` otherwise.
+   */
   void submit(Task task);
+  void submit(Task task, task_priority priority);
+  /**
+  Only picked up by idle workers, and never spawns a new one: background work
+  should not compete with anything that is being waited on.
+   */
+  void
+  submit_background(Task task) {
+    submit(task, task_priority::speculative);
+  }
+
+  /**
+  Raises the priority of a queued task, or of the one it's waiting for. Call it
+  before blocking on a task, so that it doesn't wait behind less urgent work.
+   */
+  void prioritize(Task task, task_priority priority = task_priority::blocking);
 
-  task_scheduler();
+  /**
+  `max_threads` bounds the number of workers, 0 means two per core.
+   */
+  task_scheduler(uint32_t max_threads = 0);
   ~task_scheduler();
 
+  /**
+  Joins the workers once they are done with the tasks they are running. Queued
+  tasks are never run after this, and neither are tasks submitted later. Call
+  it before anything the tasks refer to is destroyed.
+   */
+  void stop();
+
   uint64_t
   get_running_threads() {
     return running.load(std::memory_order_relaxed);
   }
 
+  uint64_t
+  get_threads() {
+    return threads_.load(std::memory_order_relaxed);
+  }
+
+  uint64_t
+  get_stolen_tasks() {
+    return stolen_.load(std::memory_order_relaxed);
+  }
+
 private:
-  void worker_func();
+  struct queued_task {
+    Task task;
+    /* an entry whose ticket no longer matches is stale and skipped, 0 if the
+       task has no state and this is its only entry */
+    uint64_t ticket;
+    task_priority priority;
+  };
+
+  struct alignas(64) worker_queue {
+    dxmt::mutex mutex;
+    std::deque<queued_task> tasks[kTaskPriorityCount];
+  };
+
+  struct task_state {
+    task_priority priority = task_priority::speculative;
+    /* ticket of the entry allowed to run it, 0 if not queued or queued untracked */
+    uint64_t ticket = 0;
+    Task waiting_for = {};
+    std::vector<Task> waiters;
+  };
+
+  static constexpr uint32_t kStateShards = 64;
 
-  dxmt::mutex worker_mutex_;
-  dxmt::condition_variable worker_cond_;
-  std::queue<Task> task_queue_;
-  std::queue<Task> task_continuation_queue_;
+  struct alignas(64) state_shard {
+    dxmt::mutex mutex;
+    std::unordered_map<Task, task_state> tasks;
+  };
 
-  dxmt::mutex deps_mutex_;
-  std::unordered_multimap<Task, Task> task_continuation_;
+  struct worker_context {
+    task_scheduler *scheduler;
+    uint32_t index;
+    task_priority priority;
+  };
+
+  static inline thread_local worker_context *current_ = nullptr;
+
+  state_shard &
+  shard(Task task) {
+    return shards_[std::hash<Task>{}(task) % kStateShards];
+  }
 
+  worker_context *
+  current() {
+    return current_ && current_->scheduler == this ? current_ : nullptr;
+  }
+
+  void enqueue(Task task, task_priority priority);
+  void push(const queued_task &entry);
+  bool pop(uint32_t index, queued_task &entry);
+  bool claim(const queued_task &entry, task_priority &priority);
+  void promote(Task task, task_priority priority);
+  void complete(Task task);
+  bool wait_for(Task waiter, task_priority priority, Task dependency);
+  void spawn_worker();
+  void worker_func(uint32_t index);
+
+  std::unique_ptr<worker_queue[]> queues_;
+  std::unique_ptr<state_shard[]> shards_;
+
+  dxmt::mutex spawn_mutex_;
   std::vector<dxmt::thread> workers_;
 
+  dxmt::mutex sleep_mutex_;
+  dxmt::condition_variable sleep_cond_;
+  std::atomic_uint32_t sleeping_ = 0;
+  /* entries of each priority in all queues, stale ones included */
+  std::atomic_uint64_t queued_[kTaskPriorityCount] = {};
+
+  bool
+  has_queued() {
+    for (auto &queued : queued_)
+      if (queued.load())
+        return true;
+    return false;
+  }
+
+  std::atomic_uint64_t next_ticket_ = 1;
+  std::atomic_uint32_t next_queue_ = 0;
+  std::atomic_uint64_t stolen_ = 0;
+
   std::atomic_bool destroyed = false;
   std::atomic_uint64_t running = 0;
-  uint64_t threads;
-  uint64_t max_threads;
+  std::atomic_uint32_t threads_ = 0;
+  uint32_t max_threads;
 };
 
-template <typename Task> task_scheduler<Task>::task_scheduler() {
-  max_threads = dxmt::thread::hardware_concurrency() * 2;
-  workers_.reserve(max_threads);
-  threads = 2;
+template <typename Task> task_scheduler<Task>::task_scheduler(uint32_t max_threads) {
+  this->max_threads = max_threads ? max_threads : std::max(2u, (uint32_t)dxmt::thread::hardware_concurrency() * 2);
+  queues_ = std::make_unique<worker_queue[]>(this->max_threads);
+  shards_ = std::make_unique<state_shard[]>(kStateShards);
+  workers_.reserve(this->max_threads);
 
-  for (unsigned i = 0; i < threads; i++) {
-    workers_.emplace_back([this]() { worker_func(); });
+  for (unsigned i = 0; i < std::min(2u, this->max_threads); i++) {
+    spawn_worker();
   }
 }
 
 template <typename Task> task_scheduler<Task>::~task_scheduler() {
+  stop();
+}
+
+template <typename Task>
+void
+task_scheduler<Task>::stop() {
   destroyed.store(true);
-  worker_cond_.notify_all();
+  {
+    std::lock_guard<dxmt::mutex> lock(sleep_mutex_);
+  }
+  sleep_cond_.notify_all();
+  {
+    // no worker is spawned once this is released
+    std::lock_guard<dxmt::mutex> lock(spawn_mutex_);
+  }
 
   for (auto &worker : workers_) {
     if (worker.joinable())
@@ -69,78 +218,282 @@ template <typename Task> task_scheduler<Task>::~task_scheduler() {
 
 template <typename Task>
 void
-task_scheduler<Task>::worker_func() {
-  struct task_trait<Task> task_trait;
-  std::vector<Task> continutation_buffer;
-  SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
-  while (!destroyed.load()) {
-    Task task;
-    {
-      std::unique_lock<dxmt::mutex> lock(worker_mutex_);
+task_scheduler<Task>::spawn_worker() {
+  uint32_t index = threads_.load(std::memory_order_relaxed);
+  workers_.emplace_back([this, index]() { worker_func(index); });
+  // the queue exists already, thieves may look at it from now on
+  threads_.store(index + 1, std::memory_order_release);
+}
 
-      if (task_queue_.empty() && task_continuation_queue_.empty()) {
-        worker_cond_.wait(lock, [this]() {
-          return task_queue_.size() || task_continuation_queue_.size() || destroyed.load();
-        });
+template <typename Task>
+void
+task_scheduler<Task>::push(const queued_task &entry) {
+  auto worker = current();
+  uint32_t index = worker ? worker->index
+                          : next_queue_.fetch_add(1, std::memory_order_relaxed) %
+                                threads_.load(std::memory_order_acquire);
+  {
+    auto &queue = queues_[index];
+    std::lock_guard<dxmt::mutex> lock(queue.mutex);
+    queue.tasks[(uint32_t)entry.priority].push_back(entry);
+  }
+  queued_[(uint32_t)entry.priority].fetch_add(1);
+  if (sleeping_.load()) {
+    // pairs with the check under sleep_mutex_, so that the wakeup isn't lost
+    { std::lock_guard<dxmt::mutex> lock(sleep_mutex_); }
+    sleep_cond_.notify_one();
+  }
+}
+
+/**
+The owner takes its oldest entry first, like the single queue did, and thieves
+take the newest, so they rarely compete for the same end.
+ */
+template <typename Task>
+bool
+task_scheduler<Task>::pop(uint32_t index, queued_task &entry) {
+  uint32_t threads = threads_.load(std::memory_order_acquire);
+  for (uint32_t p = 0; p < kTaskPriorityCount; p++) {
+    // most levels are empty most of the time, don't lock every queue for them
+    if (!queued_[p].load(std::memory_order_relaxed))
+      continue;
+    {
+      auto &queue = queues_[index];
+      std::lock_guard<dxmt::mutex> lock(queue.mutex);
+      auto &tasks = queue.tasks[p];
+      if (!tasks.empty()) {
+        entry = tasks.front();
+        tasks.pop_front();
+        queued_[p].fetch_sub(1);
+        return true;
+      }
+    }
+    for (uint32_t i = 1; i < threads; i++) {
+      auto &queue = queues_[(index + i) % threads];
+      std::lock_guard<dxmt::mutex> lock(queue.mutex);
+      auto &tasks = queue.tasks[p];
+      if (!tasks.empty()) {
+        entry = tasks.back();
+        tasks.pop_back();
+        queued_[p].fetch_sub(1);
+        stolen_.fetch_add(1, std::memory_order_relaxed);
+        return true;
       }
+    }
+  }
+  return false;
+}
 
-      if (!task_continuation_queue_.empty()) {
-        task = task_continuation_queue_.front();
-        task_continuation_queue_.pop();
-      } else if (!task_queue_.empty()) {
-        task = task_queue_.front();
-        task_queue_.pop();
-      } else {
-        break;
+template <typename Task>
+bool
+task_scheduler<Task>::claim(const queued_task &entry, task_priority &priority) {
+  if (!entry.ticket) {
+    priority = entry.priority;
+    return true;
+  }
+  auto &s = shard(entry.task);
+  std::lock_guard<dxmt::mutex> lock(s.mutex);
+  auto iter = s.tasks.find(entry.task);
+  if (iter == s.tasks.end() || iter->second.ticket != entry.ticket)
+    return false;
+  iter->second.ticket = 0;
+  priority = iter->second.priority;
+  return true;
+}
+
+/**
+Queues a waiter again, keeping its state: it may have waiters of its own.
+ */
+template <typename Task>
+void
+task_scheduler<Task>::enqueue(Task task, task_priority priority) {
+  queued_task entry{task, next_ticket_.fetch_add(1, std::memory_order_relaxed), priority};
+  {
+    auto &s = shard(task);
+    std::lock_guard<dxmt::mutex> lock(s.mutex);
+    auto &state = s.tasks[task];
+    // it may have been prioritized while it was waiting
+    if (state.priority > priority)
+      state.priority = priority;
+    entry.priority = state.priority;
+    state.ticket = entry.ticket;
+    state.waiting_for = {};
+  }
+  push(entry);
+}
+
+/**
+Moves the entry of an untracked task to a more urgent queue. There is none if
+it's running or done already.
+ */
+template <typename Task>
+void
+task_scheduler<Task>::promote(Task task, task_priority priority) {
+  uint32_t threads = threads_.load(std::memory_order_acquire);
+  for (uint32_t i = 0; i < threads; i++) {
+    auto &queue = queues_[i];
+    std::lock_guard<dxmt::mutex> lock(queue.mutex);
+    for (uint32_t p = (uint32_t)priority + 1; p < kTaskPriorityCount; p++) {
+      auto &tasks = queue.tasks[p];
+      auto iter = std::find_if(tasks.begin(), tasks.end(), [task](const queued_task &entry) {
+        return entry.task == task && !entry.ticket;
+      });
+      if (iter == tasks.end())
+        continue;
+      queued_task entry = *iter;
+      tasks.erase(iter);
+      entry.priority = priority;
+      queue.tasks[(uint32_t)priority].push_back(entry);
+      queued_[(uint32_t)priority].fetch_add(1);
+      queued_[p].fetch_sub(1);
+      return;
+    }
+  }
+}
+
+template <typename Task>
+void
+task_scheduler<Task>::complete(Task task) {
+  struct task_trait<Task> task_trait;
+  std::vector<Task> waiters;
+  {
+    auto &s = shard(task);
+    std::lock_guard<dxmt::mutex> lock(s.mutex);
+    if (auto iter = s.tasks.find(task); iter != s.tasks.end()) {
+      waiters = std::move(iter->second.waiters);
+      s.tasks.erase(iter);
+    }
+    task_trait.set_done(task);
+  }
+  for (auto waiter : waiters) {
+    enqueue(waiter, task_priority::speculative);
+  }
+}
+
+/**
+Returns false if `dependency` is done already, and `waiter` should run again.
+ */
+template <typename Task>
+bool
+task_scheduler<Task>::wait_for(Task waiter, task_priority priority, Task dependency) {
+  struct task_trait<Task> task_trait;
+  {
+    auto &s = shard(waiter);
+    std::lock_guard<dxmt::mutex> lock(s.mutex);
+    auto [iter, inserted] = s.tasks.try_emplace(waiter);
+    auto &state = iter->second;
+    state.waiting_for = dependency;
+    // it may have been prioritized while it was running
+    if (inserted || state.priority > priority)
+      state.priority = priority;
+    priority = state.priority;
+  }
+  bool inherit = false;
+  {
+    auto &s = shard(dependency);
+    std::lock_guard<dxmt::mutex> lock(s.mutex);
+    // spurious dependency
+    if (task_trait.get_done(dependency))
+      return false;
+    // a new state doesn't know where an untracked task is queued, its
+    // priority is found out by prioritizing it
+    auto &state = s.tasks[dependency];
+    state.waiters.push_back(waiter);
+    inherit = state.priority > priority;
+  }
+  if (inherit)
+    prioritize(dependency, priority);
+  return true;
+}
+
+template <typename Task>
+void
+task_scheduler<Task>::prioritize(Task task, task_priority priority) {
+  struct task_trait<Task> task_trait;
+  while (task) {
+    uint64_t ticket = 0;
+    {
+      auto &s = shard(task);
+      std::lock_guard<dxmt::mutex> lock(s.mutex);
+      auto iter = s.tasks.find(task);
+      if (iter != s.tasks.end()) {
+        auto &state = iter->second;
+        if (state.priority <= priority)
+          return;
+        state.priority = priority;
+        if (state.waiting_for) {
+          task = state.waiting_for;
+          continue;
+        }
+        // the old entry becomes stale
+        if (state.ticket)
+          ticket = state.ticket = next_ticket_.fetch_add(1, std::memory_order_relaxed);
+      } else if (task_trait.get_done(task)) {
+        return;
       }
     }
+    if (ticket)
+      push({task, ticket, priority});
+    else
+      promote(task, priority);
+    return;
+  }
+}
+
+template <typename Task>
+void
+task_scheduler<Task>::worker_func(uint32_t index) {
+  struct task_trait<Task> task_trait;
+  worker_context context{this, index, task_priority::visible};
+  current_ = &context;
+  SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+  while (!destroyed.load()) {
+    queued_task entry;
+    if (!pop(index, entry)) {
+      std::unique_lock<dxmt::mutex> lock(sleep_mutex_);
+      sleeping_.fetch_add(1);
+      sleep_cond_.wait(lock, [this]() { return has_queued() || destroyed.load(); });
+      sleeping_.fetch_sub(1);
+      continue;
+    }
+    if (!claim(entry, context.priority))
+      continue;
+
     running.fetch_add(1, std::memory_order_relaxed);
     while (true) {
-      Task continuation = task_trait.run_task(task);
-      if (continuation == task) {
-        {
-          std::unique_lock<dxmt::mutex> lock(deps_mutex_);
-          auto range = task_continuation_.equal_range(continuation);
-          for (auto itr = range.first; itr != range.second; ++itr) {
-            continutation_buffer.push_back(itr->second);
-          }
-          task_continuation_.erase(range.first, range.second);
-          task_trait.set_done(continuation);
-        }
-        {
-          std::unique_lock<dxmt::mutex> lock(worker_mutex_);
-          for (auto &task : continutation_buffer) {
-            task_continuation_queue_.push(task);
-          }
-        }
-        worker_cond_.notify_all();
-        continutation_buffer.clear();
-      } else {
-        std::unique_lock<dxmt::mutex> lock(deps_mutex_);
-        // spurious dependency
-        if (task_trait.get_done(continuation)) {
-          continue;
-        }
-        task_continuation_.insert({continuation, task});
+      Task dependency = task_trait.run_task(entry.task);
+      if (dependency == entry.task) {
+        complete(entry.task);
+      } else if (!wait_for(entry.task, context.priority, dependency)) {
+        continue;
       }
       break;
     }
     running.fetch_sub(1, std::memory_order_relaxed);
   }
+  current_ = nullptr;
 };
 
 template <typename Task>
 void
 task_scheduler<Task>::submit(Task task) {
-  std::unique_lock<dxmt::mutex> lock(worker_mutex_);
-  task_queue_.push(task);
+  auto worker = current();
+  submit(task, worker ? worker->priority : task_priority::visible);
+}
 
-  if (running.load(std::memory_order_relaxed) == threads && threads < max_threads) {
-    workers_.emplace_back([this]() { worker_func(); });
-    threads++;
-  }
+template <typename Task>
+void
+task_scheduler<Task>::submit(Task task, task_priority priority) {
+  push({task, 0, priority});
 
-  worker_cond_.notify_one();
+  if (priority == task_priority::speculative)
+    return;
+  if (running.load(std::memory_order_relaxed) == threads_.load(std::memory_order_relaxed) &&
+      threads_.load(std::memory_order_relaxed) < max_threads) {
+    std::lock_guard<dxmt::mutex> lock(spawn_mutex_);
+    if (!destroyed.load() && threads_.load(std::memory_order_relaxed) < max_threads)
+      spawn_worker();
+  }
 }
 
 }; // namespace dxmt
@@ -0,0 +1,190 @@
+/*
+ * dxmt-tasks-bench: scheduling overhead of task_scheduler.
+ *
+ *   dxmt-tasks-bench [tasks] [threads]
+ *
+ * - independent: empty tasks submitted from one thread, like shader variants
+ *   requested by a draw
+ * - dependent: empty tasks that wait for another one first, like pipelines
+ *   waiting for their shaders
+ * - latency: how long a prioritized task waits behind a backlog, directly
+ *   and through a task it depends on
+ */
+
+#include "dxmt_tasks.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+namespace {
+
+struct bench_task {
+  std::atomic_bool done = false;
+  bench_task *dependency = nullptr;
+  uint32_t spin_us = 0;
+  std::atomic_uint64_t *remaining = nullptr;
+};
+
+void
+spin(uint32_t us) {
+  auto end = std::chrono::steady_clock::now() + std::chrono::microseconds(us);
+  while (std::chrono::steady_clock::now() < end) {
+  }
+}
+
+double
+elapsed_ns(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+void
+wait_all(std::atomic_uint64_t &remaining) {
+  for (uint64_t value; (value = remaining.load(std::memory_order_acquire));)
+    remaining.wait(value, std::memory_order_acquire);
+}
+
+void
+wait_done(bench_task &task) {
+  task.done.wait(false, std::memory_order_acquire);
+}
+
+} // namespace
+
+namespace dxmt {
+
+/* util isn't linked, the stubs of util_win32_compat.h are the only callers */
+void
+Logger::warn(const std::string &message) {}
+
+template <> struct task_trait<bench_task *> {
+  bench_task *
+  run_task(bench_task *task) {
+    if (task->dependency && !task->dependency->done.load(std::memory_order_acquire))
+      return task->dependency;
+    spin(task->spin_us);
+    return task;
+  }
+  bool
+  get_done(bench_task *task) {
+    return task->done.load(std::memory_order_acquire);
+  }
+  void
+  set_done(bench_task *task) {
+    // the last thing the scheduler does with the task
+    task->done.store(true, std::memory_order_release);
+    task->done.notify_all();
+    if (task->remaining && task->remaining->fetch_sub(1, std::memory_order_acq_rel) == 1)
+      task->remaining->notify_all();
+  }
+};
+
+} // namespace dxmt
+
+using dxmt::task_priority;
+using dxmt::task_scheduler;
+
+static double
+bench_independent(task_scheduler<bench_task *> &scheduler, uint64_t count) {
+  std::vector<bench_task> tasks(count);
+  std::atomic_uint64_t remaining = count;
+  for (auto &task : tasks)
+    task.remaining = &remaining;
+  auto start = std::chrono::steady_clock::now();
+  for (auto &task : tasks)
+    scheduler.submit(&task);
+  wait_all(remaining);
+  return elapsed_ns(start) / count;
+}
+
+static double
+bench_dependent(task_scheduler<bench_task *> &scheduler, uint64_t count) {
+  uint64_t pairs = count / 2;
+  std::vector<bench_task> shaders(pairs), pipelines(pairs);
+  std::atomic_uint64_t remaining = pairs * 2;
+  for (uint64_t i = 0; i < pairs; i++) {
+    shaders[i].remaining = &remaining;
+    pipelines[i].remaining = &remaining;
+    pipelines[i].dependency = &shaders[i];
+  }
+  auto start = std::chrono::steady_clock::now();
+  // pipelines first, so that most of them have to wait
+  for (auto &pipeline : pipelines)
+    scheduler.submit(&pipeline);
+  for (auto &shader : shaders)
+    scheduler.submit(&shader);
+  wait_all(remaining);
+  return elapsed_ns(start) / (pairs * 2);
+}
+
+struct latency_result {
+  double backlog_us;
+  double prioritized_us;
+  double inherited_us;
+};
+
+static latency_result
+bench_latency(task_scheduler<bench_task *> &scheduler, uint64_t backlog_size) {
+  latency_result result;
+  std::vector<bench_task> backlog(backlog_size);
+  std::atomic_uint64_t remaining = backlog_size;
+  for (auto &task : backlog) {
+    task.remaining = &remaining;
+    task.spin_us = 20;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  for (auto &task : backlog)
+    scheduler.submit(&task, task_priority::visible);
+
+  // queued behind the backlog, then waited on
+  bench_task direct;
+  scheduler.submit(&direct, task_priority::speculative);
+  auto direct_start = std::chrono::steady_clock::now();
+  scheduler.prioritize(&direct);
+  wait_done(direct);
+  result.prioritized_us = elapsed_ns(direct_start) / 1000;
+
+  // waits for a task that is queued behind the backlog
+  bench_task shader, pipeline;
+  pipeline.dependency = &shader;
+  scheduler.submit(&shader, task_priority::speculative);
+  scheduler.submit(&pipeline, task_priority::blocking);
+  auto inherited_start = std::chrono::steady_clock::now();
+  wait_done(pipeline);
+  result.inherited_us = elapsed_ns(inherited_start) / 1000;
+
+  wait_all(remaining);
+  result.backlog_us = elapsed_ns(start) / 1000;
+  return result;
+}
+
+int
+main(int argc, char **argv) {
+  uint64_t count = argc > 1 ? strtoull(argv[1], nullptr, 10) : 100000;
+  uint32_t threads = argc > 2 ? strtoul(argv[2], nullptr, 10) : 0;
+  if (!count) {
+    fprintf(stderr, "usage: dxmt-tasks-bench [tasks] [threads]\n");
+    return 1;
+  }
+
+  task_scheduler<bench_task *> scheduler(threads);
+  // let the scheduler grow to its working size
+  bench_independent(scheduler, count);
+
+  double independent_ns = bench_independent(scheduler, count);
+  double dependent_ns = bench_dependent(scheduler, count);
+  auto latency = bench_latency(scheduler, 2000);
+
+  printf("{\n");
+  printf("  \"tasks\": %llu,\n", (unsigned long long)count);
+  printf("  \"threads\": %llu,\n", (unsigned long long)scheduler.get_threads());
+  printf("  \"independent_ns_per_task\": %.1f,\n", independent_ns);
+  printf("  \"dependent_ns_per_task\": %.1f,\n", dependent_ns);
+  printf("  \"stolen_tasks\": %llu,\n", (unsigned long long)scheduler.get_stolen_tasks());
+  printf("  \"backlog_us\": %.1f,\n", latency.backlog_us);
+  printf("  \"prioritized_latency_us\": %.1f,\n", latency.prioritized_us);
+  printf("  \"inherited_latency_us\": %.1f\n", latency.inherited_us);
+  printf("}\n");
+  return 0;
+}
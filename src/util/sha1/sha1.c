@@ -126,9 +126,9 @@ SHA1Update(SHA1_CTX *context, const uint8_t *data, size_t len)
 	context->count += (len << 3);
 	if ((j + len) > 63) {
 		(void)memcpy(&context->buffer[j], data, (i = 64-j));
-		SHA1Transform(context->state, context->buffer);
-		for ( ; i + 63 < len; i += 64)
-			SHA1Transform(context->state, (uint8_t *)&data[i]);
+		SHA1TransformBlocks(context->state, context->buffer, 1);
+		SHA1TransformBlocks(context->state, &data[i], (len - i) / 64);
+		i += (len - i) & ~(size_t)63;
 		j = 0;
 	} else {
 		i = 0;
@@ -137,6 +137,8 @@ SHA1Update(SHA1_CTX *context, const uint8_t *data, size_t len)
 }
 
 
+static const uint8_t sha1_padding[SHA1_BLOCK_LENGTH] = { 0x80 };
+
 /*
  * Add padding and return the message digest.
  */
@@ -150,9 +152,9 @@ SHA1Pad(SHA1_CTX *context)
 		finalcount[i] = (uint8_t)((context->count >>
 		    ((7 - (i & 7)) * 8)) & 255);	/* Endian independent */
 	}
-	SHA1Update(context, (uint8_t *)"\200", 1);
-	while ((context->count & 504) != 448)
-		SHA1Update(context, (uint8_t *)"\0", 1);
+	/* 0x80, then zeros up to 56 mod 64, in one update */
+	SHA1Update(context, sha1_padding,
+	    1 + ((SHA1_BLOCK_LENGTH * 2 - 9 - ((context->count >> 3) & 63)) & 63));
 	SHA1Update(context, finalcount, 8); /* Should cause a SHA1Transform() */
 }
 
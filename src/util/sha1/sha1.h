@@ -32,6 +32,14 @@ void SHA1Transform(uint32_t [5], const uint8_t*);
 void SHA1Update(SHA1_CTX *, const uint8_t *, size_t);
 void SHA1Final(uint8_t [SHA1_DIGEST_LENGTH], SHA1_CTX *);
 
+/* sha1_accel.c: SHA1Transform over consecutive blocks, with SHA-NI or the
+   ARMv8 crypto extension when the CPU has them */
+void SHA1TransformBlocks(uint32_t [5], const uint8_t *, size_t);
+/* "sha-ni", "armv8" or "scalar" */
+const char *SHA1Implementation(void);
+/* for comparison against the portable code; not thread-safe */
+void SHA1DisableAcceleration(int);
+
 #define HTONDIGEST(x) do {                                              \
         x[0] = htonl(x[0]);                                             \
         x[1] = htonl(x[1]);                                             \
@@ -0,0 +1,255 @@
+/*
+ * SHA-1 block transform using the SHA extensions of x86 (SHA-NI) and
+ * ARMv8 (crypto extension), selected at runtime, with the portable
+ * SHA1Transform as fallback. The output is bit-identical, so digests stored
+ * by earlier versions stay valid.
+ *
+ * The instruction sequences follow the public domain reference code by
+ * Jeffrey Walton, Sean Gulley and Dougall Johnson.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include "sha1.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA1_HAVE_SHANI 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && (defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO))
+/* every Apple Silicon CPU has it, so it's part of the baseline target */
+#define SHA1_HAVE_ARMV8 1
+#include <arm_neon.h>
+#endif
+
+typedef void (*sha1_blocks_fn)(uint32_t [5], const uint8_t *, size_t);
+
+static void
+sha1_blocks_scalar(uint32_t state[5], const uint8_t *data, size_t blocks)
+{
+	for (; blocks; blocks--, data += SHA1_BLOCK_LENGTH)
+		SHA1Transform(state, data);
+}
+
+#ifdef SHA1_HAVE_SHANI
+
+/*
+ * Rounds 4*i to 4*i+3, where m0 holds the schedule words of these rounds.
+ * Also advances the schedule: m1 is finished, m3 started, and m2 gets the
+ * xor. Past round 64 that computes words that are never used.
+ */
+#define SHANI_ROUNDS(e_next, e_cur, m0, m1, m2, m3, f)   \
+	e_next = _mm_sha1nexte_epu32(e_next, m0);        \
+	e_cur = abcd;                                    \
+	m1 = _mm_sha1msg2_epu32(m1, m0);                 \
+	abcd = _mm_sha1rnds4_epu32(abcd, e_next, f);     \
+	m3 = _mm_sha1msg1_epu32(m3, m0);                 \
+	m2 = _mm_xor_si128(m2, m0);
+
+__attribute__((target("sha,sse4.1")))
+static void
+sha1_blocks_shani(uint32_t state[5], const uint8_t *data, size_t blocks)
+{
+	const __m128i bswap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	__m128i abcd, abcd_saved, e0, e0_saved, e1;
+	__m128i msg0, msg1, msg2, msg3;
+
+	abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1B);
+	e0 = _mm_set_epi32((int)state[4], 0, 0, 0);
+
+	for (; blocks; blocks--, data += SHA1_BLOCK_LENGTH) {
+		abcd_saved = abcd;
+		e0_saved = e0;
+
+		/* rounds 0-3 */
+		msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 0)), bswap);
+		e0 = _mm_add_epi32(e0, msg0);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+		/* rounds 4-7 */
+		msg1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), bswap);
+		e1 = _mm_sha1nexte_epu32(e1, msg1);
+		e0 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+		msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+
+		/* rounds 8-11 */
+		msg2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), bswap);
+		e0 = _mm_sha1nexte_epu32(e0, msg2);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+		msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+		msg0 = _mm_xor_si128(msg0, msg2);
+
+		/* rounds 12-79 */
+		msg3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), bswap);
+		SHANI_ROUNDS(e1, e0, msg3, msg0, msg1, msg2, 0)
+		SHANI_ROUNDS(e0, e1, msg0, msg1, msg2, msg3, 0)
+		SHANI_ROUNDS(e1, e0, msg1, msg2, msg3, msg0, 1)
+		SHANI_ROUNDS(e0, e1, msg2, msg3, msg0, msg1, 1)
+		SHANI_ROUNDS(e1, e0, msg3, msg0, msg1, msg2, 1)
+		SHANI_ROUNDS(e0, e1, msg0, msg1, msg2, msg3, 1)
+		SHANI_ROUNDS(e1, e0, msg1, msg2, msg3, msg0, 1)
+		SHANI_ROUNDS(e0, e1, msg2, msg3, msg0, msg1, 2)
+		SHANI_ROUNDS(e1, e0, msg3, msg0, msg1, msg2, 2)
+		SHANI_ROUNDS(e0, e1, msg0, msg1, msg2, msg3, 2)
+		SHANI_ROUNDS(e1, e0, msg1, msg2, msg3, msg0, 2)
+		SHANI_ROUNDS(e0, e1, msg2, msg3, msg0, msg1, 2)
+		SHANI_ROUNDS(e1, e0, msg3, msg0, msg1, msg2, 3)
+		SHANI_ROUNDS(e0, e1, msg0, msg1, msg2, msg3, 3)
+		SHANI_ROUNDS(e1, e0, msg1, msg2, msg3, msg0, 3)
+		SHANI_ROUNDS(e0, e1, msg2, msg3, msg0, msg1, 3)
+		SHANI_ROUNDS(e1, e0, msg3, msg0, msg1, msg2, 3)
+
+		e0 = _mm_sha1nexte_epu32(e0, e0_saved);
+		abcd = _mm_add_epi32(abcd, abcd_saved);
+	}
+
+	_mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1B));
+	state[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+
+#undef SHANI_ROUNDS
+
+static int
+sha1_cpu_has_shani(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1))
+		return 0;
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return (ebx & bit_SHA) != 0;
+}
+
+#endif /* SHA1_HAVE_SHANI */
+
+#ifdef SHA1_HAVE_ARMV8
+
+/*
+ * Rounds 4*i to 4*i+3 with t = schedule words + constant. Also prepares
+ * t for rounds 4*i+8, finishes m3 and starts m0 of the schedule. Past
+ * round 64 that computes words that are never used.
+ */
+#define ARMV8_ROUNDS(op, e_next, e_cur, t, m0, m1, m2, m3, k) \
+	e_next = vsha1h_u32(vgetq_lane_u32(abcd, 0));   \
+	abcd = op(abcd, e_cur, t);                      \
+	t = vaddq_u32(m2, vdupq_n_u32(k));              \
+	m3 = vsha1su1q_u32(m3, m2);                     \
+	m0 = vsha1su0q_u32(m0, m1, m2);
+
+static void
+sha1_blocks_armv8(uint32_t state[5], const uint8_t *data, size_t blocks)
+{
+	const uint32_t k0 = 0x5A827999, k1 = 0x6ED9EBA1, k2 = 0x8F1BBCDC, k3 = 0xCA62C1D6;
+	uint32x4_t abcd, abcd_saved, tmp0, tmp1;
+	uint32x4_t msg0, msg1, msg2, msg3;
+	uint32_t e0, e0_saved, e1;
+
+	abcd = vld1q_u32(state);
+	e0 = state[4];
+
+	for (; blocks; blocks--, data += SHA1_BLOCK_LENGTH) {
+		abcd_saved = abcd;
+		e0_saved = e0;
+
+		msg0 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 0)));
+		msg1 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16)));
+		msg2 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 32)));
+		msg3 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 48)));
+		tmp0 = vaddq_u32(msg0, vdupq_n_u32(k0));
+		tmp1 = vaddq_u32(msg1, vdupq_n_u32(k0));
+
+		/* rounds 0-3 */
+		e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1cq_u32(abcd, e0, tmp0);
+		tmp0 = vaddq_u32(msg2, vdupq_n_u32(k0));
+		msg0 = vsha1su0q_u32(msg0, msg1, msg2);
+
+		/* rounds 4-79 */
+		ARMV8_ROUNDS(vsha1cq_u32, e0, e1, tmp1, msg1, msg2, msg3, msg0, k0)
+		ARMV8_ROUNDS(vsha1cq_u32, e1, e0, tmp0, msg2, msg3, msg0, msg1, k0)
+		ARMV8_ROUNDS(vsha1cq_u32, e0, e1, tmp1, msg3, msg0, msg1, msg2, k1)
+		ARMV8_ROUNDS(vsha1cq_u32, e1, e0, tmp0, msg0, msg1, msg2, msg3, k1)
+		ARMV8_ROUNDS(vsha1pq_u32, e0, e1, tmp1, msg1, msg2, msg3, msg0, k1)
+		ARMV8_ROUNDS(vsha1pq_u32, e1, e0, tmp0, msg2, msg3, msg0, msg1, k1)
+		ARMV8_ROUNDS(vsha1pq_u32, e0, e1, tmp1, msg3, msg0, msg1, msg2, k1)
+		ARMV8_ROUNDS(vsha1pq_u32, e1, e0, tmp0, msg0, msg1, msg2, msg3, k2)
+		ARMV8_ROUNDS(vsha1pq_u32, e0, e1, tmp1, msg1, msg2, msg3, msg0, k2)
+		ARMV8_ROUNDS(vsha1mq_u32, e1, e0, tmp0, msg2, msg3, msg0, msg1, k2)
+		ARMV8_ROUNDS(vsha1mq_u32, e0, e1, tmp1, msg3, msg0, msg1, msg2, k2)
+		ARMV8_ROUNDS(vsha1mq_u32, e1, e0, tmp0, msg0, msg1, msg2, msg3, k2)
+		ARMV8_ROUNDS(vsha1mq_u32, e0, e1, tmp1, msg1, msg2, msg3, msg0, k3)
+		ARMV8_ROUNDS(vsha1mq_u32, e1, e0, tmp0, msg2, msg3, msg0, msg1, k3)
+		ARMV8_ROUNDS(vsha1pq_u32, e0, e1, tmp1, msg3, msg0, msg1, msg2, k3)
+		ARMV8_ROUNDS(vsha1pq_u32, e1, e0, tmp0, msg0, msg1, msg2, msg3, k3)
+		ARMV8_ROUNDS(vsha1pq_u32, e0, e1, tmp1, msg1, msg2, msg3, msg0, k3)
+		ARMV8_ROUNDS(vsha1pq_u32, e1, e0, tmp0, msg2, msg3, msg0, msg1, k3)
+		e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1pq_u32(abcd, e1, tmp1);
+
+		e0 += e0_saved;
+		abcd = vaddq_u32(abcd_saved, abcd);
+	}
+
+	vst1q_u32(state, abcd);
+	state[4] = e0;
+}
+
+#undef ARMV8_ROUNDS
+
+#endif /* SHA1_HAVE_ARMV8 */
+
+/* selected on first use; a racing first use selects the same thing */
+static sha1_blocks_fn sha1_blocks_impl;
+static const char *sha1_blocks_name;
+static int sha1_accel_disabled;
+
+static sha1_blocks_fn
+sha1_select(void)
+{
+	sha1_blocks_fn impl = __atomic_load_n(&sha1_blocks_impl, __ATOMIC_ACQUIRE);
+	if (impl)
+		return impl;
+
+	impl = sha1_blocks_scalar;
+	sha1_blocks_name = "scalar";
+	if (!sha1_accel_disabled) {
+#if defined(SHA1_HAVE_ARMV8)
+		impl = sha1_blocks_armv8;
+		sha1_blocks_name = "armv8";
+#elif defined(SHA1_HAVE_SHANI)
+		if (sha1_cpu_has_shani()) {
+			impl = sha1_blocks_shani;
+			sha1_blocks_name = "sha-ni";
+		}
+#endif
+	}
+	__atomic_store_n(&sha1_blocks_impl, impl, __ATOMIC_RELEASE);
+	return impl;
+}
+
+void
+SHA1TransformBlocks(uint32_t state[5], const uint8_t *data, size_t blocks)
+{
+	sha1_select()(state, data, blocks);
+}
+
+const char *
+SHA1Implementation(void)
+{
+	sha1_select();
+	return sha1_blocks_name;
+}
+
+void
+SHA1DisableAcceleration(int disable)
+{
+	sha1_accel_disabled = disable;
+	__atomic_store_n(&sha1_blocks_impl, (sha1_blocks_fn)0, __ATOMIC_RELEASE);
+}
+
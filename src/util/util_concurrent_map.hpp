@@ -0,0 +1,148 @@
+#pragma once
+
+#include "thread.hpp"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace dxmt {
+
+struct ConcurrentHashMapStatistics {
+  /* lookups that missed and took the insertion lock */
+  std::atomic<uint32_t> locked = 0;
+  /* of those, how many found the lock already held */
+  std::atomic<uint32_t> contended = 0;
+};
+
+/**
+Hash map for read-mostly caches whose entries are never removed.
+
+Lookups take no lock: entries are published with a release store and are
+immutable afterwards, and tables replaced when the map grows are kept until
+the map is destroyed, so a reader never sees freed memory. Insertions are
+serialized by a mutex.
+*/
+template <typename Key, typename Value, typename Hash = std::hash<Key>, typename KeyEqual = std::equal_to<Key>>
+class ConcurrentHashMap {
+  struct Node {
+    uint64_t hash;
+    Key key;
+    Value value;
+  };
+
+  struct Table {
+    uint32_t shift;
+    uint64_t capacity;
+    std::unique_ptr<std::atomic<Node *>[]> slots;
+
+    Table(uint32_t log2_capacity) :
+        shift(64 - log2_capacity),
+        capacity(uint64_t(1) << log2_capacity),
+        slots(new std::atomic<Node *>[capacity]()) {}
+  };
+
+public:
+  ConcurrentHashMap(ConcurrentHashMapStatistics *statistics = nullptr, uint32_t log2_capacity = 6) :
+      statistics_(statistics) {
+    tables_.push_back(std::make_unique<Table>(log2_capacity));
+    table_.store(tables_.back().get(), std::memory_order_release);
+  }
+
+  ConcurrentHashMap(const ConcurrentHashMap &) = delete;
+  ConcurrentHashMap &operator=(const ConcurrentHashMap &) = delete;
+
+  Value *
+  find(const Key &key) {
+    return lookup(table_.load(std::memory_order_acquire), Hash{}(key), key);
+  }
+
+  /**
+  Returns the existing value, or inserts the one returned by `create`. The
+  flag tells whether the value was inserted by this call. `create` is called
+  with the insertion lock held.
+  */
+  template <typename Create>
+  std::pair<Value *, bool>
+  findOrInsert(const Key &key, Create &&create) {
+    uint64_t hash = Hash{}(key);
+    if (auto value = lookup(table_.load(std::memory_order_acquire), hash, key))
+      return {value, false};
+
+    std::unique_lock<dxmt::mutex> lock(mutex_, std::try_to_lock);
+    if (!lock.owns_lock()) {
+      if (statistics_)
+        statistics_->contended.fetch_add(1, std::memory_order_relaxed);
+      lock.lock();
+    }
+    if (statistics_)
+      statistics_->locked.fetch_add(1, std::memory_order_relaxed);
+
+    Table *table = table_.load(std::memory_order_relaxed);
+    if (auto value = lookup(table, hash, key))
+      return {value, false};
+
+    // keep probe sequences short: at most half full
+    if ((nodes_.size() + 1) * 2 > table->capacity)
+      table = grow(table);
+
+    nodes_.emplace_back(new Node{hash, key, create()});
+    Node *node = nodes_.back().get();
+    place(table, node, std::memory_order_release);
+    return {&node->value, true};
+  }
+
+  size_t
+  size() {
+    std::lock_guard<dxmt::mutex> lock(mutex_);
+    return nodes_.size();
+  }
+
+private:
+  static uint64_t
+  slot(const Table *table, uint64_t hash) {
+    // std::hash of a pointer is the identity, spread the bits first
+    return (hash * 0x9E3779B97F4A7C15ull) >> table->shift;
+  }
+
+  Value *
+  lookup(Table *table, uint64_t hash, const Key &key) {
+    for (uint64_t i = slot(table, hash);; i = (i + 1) & (table->capacity - 1)) {
+      Node *node = table->slots[i].load(std::memory_order_acquire);
+      if (!node)
+        return nullptr;
+      if (node->hash == hash && KeyEqual{}(node->key, key))
+        return &node->value;
+    }
+  }
+
+  static void
+  place(Table *table, Node *node, std::memory_order order) {
+    uint64_t i = slot(table, node->hash);
+    while (table->slots[i].load(std::memory_order_relaxed))
+      i = (i + 1) & (table->capacity - 1);
+    table->slots[i].store(node, order);
+  }
+
+  Table *
+  grow(Table *table) {
+    tables_.push_back(std::make_unique<Table>(64 - table->shift + 1));
+    Table *grown = tables_.back().get();
+    for (auto &node : nodes_)
+      place(grown, node.get(), std::memory_order_relaxed);
+    // readers still on the old table miss new entries and take the lock
+    table_.store(grown, std::memory_order_release);
+    return grown;
+  }
+
+  std::atomic<Table *> table_;
+  ConcurrentHashMapStatistics *statistics_;
+  dxmt::mutex mutex_;
+  std::vector<std::unique_ptr<Table>> tables_;
+  std::vector<std::unique_ptr<Node>> nodes_;
+};
+
+} // namespace dxmt
@@ -0,0 +1,165 @@
+#include "util_hash128.hpp"
+#include <array>
+#include <cstring>
+
+namespace dxmt {
+
+namespace {
+
+constexpr uint64_t kPrime1 = 0x9E3779B185EBCA87ull;
+constexpr uint64_t kPrime2 = 0xC2B2AE3D27D4EB4Full;
+constexpr uint64_t kPrime3 = 0x165667B19E3779F9ull;
+constexpr uint64_t kPrime32 = 0x9E3779B1ull;
+
+constexpr size_t kStripeSize = 64;
+constexpr size_t kLanes = kStripeSize / 8;
+constexpr size_t kStripesPerBlock = 16;
+constexpr size_t kBlockSize = kStripeSize * kStripesPerBlock;
+
+/* each stripe of a block uses the secret shifted by one more lane */
+constexpr size_t kSecretSize = kLanes + kStripesPerBlock + 8;
+
+constexpr std::array<uint64_t, kSecretSize>
+make_secret() {
+  std::array<uint64_t, kSecretSize> secret{};
+  uint64_t x = 0x243F6A8885A308D3ull; // pi
+  for (auto &s : secret) {
+    // splitmix64
+    x += 0x9E3779B97F4A7C15ull;
+    uint64_t z = x;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    s = z ^ (z >> 31);
+  }
+  return secret;
+}
+
+constexpr std::array<uint64_t, kSecretSize> kSecret = make_secret();
+
+inline uint64_t
+read64(const uint8_t *p) {
+  uint64_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint32_t
+read32(const uint8_t *p) {
+  uint32_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint64_t
+fold_multiply(uint64_t a, uint64_t b) {
+  __uint128_t product = (__uint128_t)a * b;
+  return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+inline uint64_t
+avalanche(uint64_t h) {
+  h ^= h >> 37;
+  h *= 0x165667919E3779F9ull;
+  h ^= h >> 32;
+  return h;
+}
+
+inline void
+accumulate_stripe(uint64_t *__restrict acc, const uint8_t *__restrict stripe, const uint64_t *__restrict secret) {
+  for (size_t i = 0; i < kLanes; i++) {
+    uint64_t value = read64(stripe + i * 8);
+    uint64_t keyed = value ^ secret[i];
+    // the raw value goes to the neighbour lane, so that zeroed keyed
+    // products can't cancel out input
+    acc[i ^ 1] += value;
+    acc[i] += (keyed & 0xFFFFFFFF) * (keyed >> 32);
+  }
+}
+
+inline void
+scramble(uint64_t *acc, const uint64_t *secret) {
+  for (size_t i = 0; i < kLanes; i++) {
+    uint64_t a = acc[i];
+    a ^= a >> 47;
+    a ^= secret[i];
+    a *= kPrime32;
+    acc[i] = a;
+  }
+}
+
+uint64_t
+merge(const uint64_t *acc, const uint64_t *secret, uint64_t start) {
+  uint64_t result = start;
+  for (size_t i = 0; i < kLanes; i += 2)
+    result += fold_multiply(acc[i] ^ secret[i], acc[i + 1] ^ secret[i + 1]);
+  return avalanche(result);
+}
+
+Hash128
+hash_long(const uint8_t *data, size_t size, uint64_t seed) {
+  uint64_t acc[kLanes] = {kPrime32, kPrime1, kPrime2, kPrime3, kPrime2 ^ seed, kPrime1 ^ seed, kPrime3, kPrime32};
+
+  size_t blocks = (size - 1) / kBlockSize;
+  for (size_t b = 0; b < blocks; b++) {
+    for (size_t s = 0; s < kStripesPerBlock; s++)
+      accumulate_stripe(acc, data + b * kBlockSize + s * kStripeSize, kSecret.data() + s);
+    scramble(acc, kSecret.data() + kStripesPerBlock);
+  }
+
+  // remaining stripes of the last block, then the last 64 bytes, which may
+  // overlap with what was already consumed
+  const uint8_t *tail = data + blocks * kBlockSize;
+  size_t stripes = (size - 1 - blocks * kBlockSize) / kStripeSize;
+  for (size_t s = 0; s < stripes; s++)
+    accumulate_stripe(acc, tail + s * kStripeSize, kSecret.data() + s);
+  accumulate_stripe(acc, data + size - kStripeSize, kSecret.data() + kStripesPerBlock + 1);
+
+  return {
+      merge(acc, kSecret.data() + 3, size * kPrime1),
+      merge(acc, kSecret.data() + 11, ~(size * kPrime2)),
+  };
+}
+
+Hash128
+hash_short(const uint8_t *data, size_t size, uint64_t seed) {
+  uint64_t lo = seed ^ (size * kPrime1);
+  uint64_t hi = ~seed ^ (size * kPrime2);
+  if (size >= 16) {
+    // 16-byte chunks, the last one overlapping
+    for (size_t offset = 0;; offset += 16) {
+      if (offset + 16 > size)
+        offset = size - 16;
+      uint64_t a = read64(data + offset), b = read64(data + offset + 8);
+      lo += fold_multiply(a ^ kSecret[offset / 16 * 2], b ^ kSecret[offset / 16 * 2 + 1]);
+      hi += fold_multiply(a ^ kSecret[offset / 16 * 2 + 9], b ^ kSecret[offset / 16 * 2 + 10]);
+      hi ^= lo;
+      if (offset + 16 == size)
+        break;
+    }
+  } else if (size >= 8) {
+    uint64_t a = read64(data), b = read64(data + size - 8);
+    lo += fold_multiply(a ^ kSecret[0], b ^ kSecret[1]);
+    hi += fold_multiply(a ^ kSecret[2], b ^ kSecret[3]);
+  } else if (size >= 4) {
+    uint64_t value = read32(data) | (uint64_t(read32(data + size - 4)) << 32);
+    lo += fold_multiply(value ^ kSecret[0], kPrime1);
+    hi += fold_multiply(value ^ kSecret[1], kPrime2);
+  } else if (size) {
+    uint64_t value = uint64_t(data[0]) | (uint64_t(data[size >> 1]) << 8) | (uint64_t(data[size - 1]) << 16);
+    lo += fold_multiply(value ^ kSecret[0], kPrime1);
+    hi += fold_multiply(value ^ kSecret[1], kPrime2);
+  }
+  return {avalanche(lo), avalanche(hi ^ lo)};
+}
+
+} // namespace
+
+Hash128
+Hash128::compute(const void *data, size_t size, uint64_t seed) {
+  auto bytes = static_cast<const uint8_t *>(data);
+  if (size > 128)
+    return hash_long(bytes, size, seed);
+  return hash_short(bytes, size, seed);
+}
+
+} // namespace dxmt
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace dxmt {
+
+/**
+128-bit non-cryptographic hash, built like XXH3: 64-byte stripes folded into
+eight independent 64-bit lanes with 32x32 multiplies, which compilers turn
+into SSE2/NEON code. Not compatible with XXH3 and not stable across
+versions: use it for in-memory identity only, and Sha1Digest for anything
+persisted.
+*/
+struct Hash128 {
+  uint64_t lo;
+  uint64_t hi;
+
+  bool operator==(const Hash128 &other) const = default;
+
+  static Hash128 compute(const void *data, size_t size, uint64_t seed = 0);
+};
+
+} // namespace dxmt
+
+namespace std {
+template <> struct hash<dxmt::Hash128> {
+  size_t
+  operator()(const dxmt::Hash128 &v) const noexcept {
+    return v.lo;
+  };
+};
+} // namespace std
@@ -0,0 +1,138 @@
+/*
+ * dxmt-hash-bench: Hash128 against SHA-1 on shader-sized inputs.
+ *
+ *   dxmt-hash-bench [file...]
+ *
+ * Without arguments, hashes random data from input layout to large compute
+ * shader sizes. With files (e.g. shader dumps), hashes each of them instead.
+ *
+ * SHA-1 is measured with and without hardware acceleration, after checking
+ * that both give the reference digests.
+ */
+
+#include "sha1/sha1_util.hpp"
+#include "util_hash128.hpp"
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace dxmt;
+
+struct Input {
+  std::string name;
+  std::vector<uint8_t> data;
+};
+
+template <typename Hash>
+static double
+ns_per_hash(const std::vector<uint8_t> &data, Hash &&hash) {
+  // enough rounds for ~64MB, at least 16
+  size_t rounds = std::max<size_t>(16, (64u << 20) / std::max<size_t>(data.size(), 1));
+  volatile uint8_t sink = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < rounds; i++)
+    sink = sink + hash(data);
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() / rounds;
+}
+
+static bool
+check_sha1() {
+  struct {
+    std::string input;
+    size_t repeat;
+    const char *digest;
+  } vectors[] = {
+      {"abc", 1, "a9993e364706816aba3e25717850c26c9cd0d89d"},
+      {"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1, "84983e441c3bd26ebaae4aa1f95129e5e54670f1"},
+      {"a", 1000000, "34aa973cd4c4daa4f61eeb2bdbad27316534016f"},
+  };
+  for (auto &vector : vectors) {
+    std::string input;
+    for (size_t i = 0; i < vector.repeat; i++)
+      input += vector.input;
+    auto digest = Sha1HashState::compute(input.data(), input.size()).string();
+    if (digest != vector.digest) {
+      fprintf(stderr, "sha1 (%s): expected %s, got %s\n", SHA1Implementation(), vector.digest, digest.c_str());
+      return false;
+    }
+  }
+
+  // every length around the block boundaries, fed in uneven pieces
+  std::mt19937_64 rng(7);
+  std::vector<uint8_t> data(4 * SHA1_BLOCK_LENGTH + 1);
+  for (auto &byte : data)
+    byte = rng();
+  for (size_t size = 0; size <= data.size(); size++) {
+    Sha1Digest digests[2];
+    for (int scalar = 0; scalar < 2; scalar++) {
+      SHA1DisableAcceleration(scalar);
+      Sha1HashState state;
+      for (size_t offset = 0, piece = 1; offset < size; offset += piece, piece = piece * 3 % 97 + 1)
+        state.update(data.data() + offset, std::min(piece, size - offset));
+      digests[scalar] = state.final();
+    }
+    SHA1DisableAcceleration(0);
+    if (digests[0] != digests[1]) {
+      fprintf(
+          stderr, "sha1 (%s) of %zu bytes: expected %s, got %s\n", SHA1Implementation(), size,
+          digests[1].string().c_str(), digests[0].string().c_str()
+      );
+      return false;
+    }
+  }
+  return true;
+}
+
+int
+main(int argc, char **argv) {
+  if (!check_sha1())
+    return 1;
+
+  std::vector<Input> inputs;
+  if (argc > 1) {
+    for (int i = 1; i < argc; i++) {
+      FILE *file = fopen(argv[i], "rb");
+      if (!file) {
+        fprintf(stderr, "can't open %s\n", argv[i]);
+        return 1;
+      }
+      Input input{argv[i], {}};
+      uint8_t buffer[4096];
+      for (size_t read; (read = fread(buffer, 1, sizeof(buffer), file));)
+        input.data.insert(input.data.end(), buffer, buffer + read);
+      fclose(file);
+      inputs.push_back(std::move(input));
+    }
+  } else {
+    std::mt19937_64 rng(42);
+    // 16-80: input layouts and other state keys, up to 256K: large compute shaders
+    for (size_t size : {16, 80, 256, 1024, 4096, 16384, 65536, 262144}) {
+      Input input{std::to_string(size), std::vector<uint8_t>(size)};
+      for (auto &byte : input.data)
+        byte = rng();
+      inputs.push_back(std::move(input));
+    }
+  }
+
+  auto sha1 = [](auto &d) { return Sha1HashState::compute(d.data(), d.size()).data[0]; };
+  printf("{\n  \"sha1_implementation\": \"%s\",\n  \"results\": [\n", SHA1Implementation());
+  for (size_t i = 0; i < inputs.size(); i++) {
+    auto &data = inputs[i].data;
+    SHA1DisableAcceleration(1);
+    double sha1_scalar = ns_per_hash(data, sha1);
+    SHA1DisableAcceleration(0);
+    double sha1_accel = ns_per_hash(data, sha1);
+    double hash128 = ns_per_hash(data, [](auto &d) { return (uint8_t)Hash128::compute(d.data(), d.size()).lo; });
+    printf(
+        "    {\"input\": \"%s\", \"bytes\": %zu, \"sha1_scalar_ns\": %.1f, \"sha1_ns\": %.1f, \"hash128_ns\": %.1f, "
+        "\"sha1_scalar_gbps\": %.2f, \"sha1_gbps\": %.2f, \"hash128_gbps\": %.2f}%s\n",
+        inputs[i].name.c_str(), data.size(), sha1_scalar, sha1_accel, hash128, data.size() / sha1_scalar,
+        data.size() / sha1_accel, data.size() / hash128, i + 1 < inputs.size() ? "," : ""
+    );
+  }
+  printf("  ]\n}\n");
+  return 0;
+}
@@ -171,6 +171,13 @@ public:
 
 class DispatchData : public Object {
 public:
+  /**
+  Copies up to `capacity` bytes and returns the total size.
+  */
+  uint64_t
+  copyBytes(void *buffer, uint64_t capacity) {
+    return DispatchData_copyBytes(handle, buffer, capacity);
+  }
 };
 
 class Event : public Object {
@@ -786,6 +793,17 @@ public:
     return Reference<Library>(MTLDevice_newLibrary(handle, data, &error.handle));
   }
 
+  /**
+  One library with the functions of all `datas`, which are metallibs.
+  */
+  Reference<Library>
+  newPackedLibrary(const DispatchData *datas, uint64_t count, Error &error) {
+    static_assert(sizeof(DispatchData) == sizeof(obj_handle_t));
+    return Reference<Library>(
+        MTLDevice_newPackedLibrary(handle, reinterpret_cast<const obj_handle_t *>(datas), count, &error.handle)
+    );
+  }
+
   Reference<ComputePipelineState>
   newComputePipelineState(const Function &compute_function, Error &error) {
     WMTComputePipelineInfo info;
@@ -971,6 +989,24 @@ public:
   get(const K &key) {
     return Reference<DispatchData>(CacheReader_get(handle, reinterpret_cast<const void *>(&key), sizeof(key)));
   };
+
+  /**
+  Copies up to `capacity` keys and returns how many there are in total.
+  */
+  template <typename K>
+  uint64_t
+  copyKeys(K *keys, uint64_t capacity) {
+    return CacheReader_copyKeys(handle, sizeof(K), keys, capacity);
+  };
+
+  /**
+  Values are returned as stored, possibly compressed by CacheWriter. Doesn't
+  touch the reader, so it needs no lock.
+  */
+  static Reference<DispatchData>
+  decode(DispatchData value) {
+    return Reference<DispatchData>(CacheReader_decode(value));
+  };
 };
 
 class CacheWriter : public Object {
@@ -990,6 +1026,25 @@ public:
   set(const K &key, DispatchData value) {
     set(reinterpret_cast<const void *>(&key), sizeof(key), value);
   };
+
+  template <typename K>
+  void
+  touch(const K &key) {
+    CacheWriter_touch(handle, reinterpret_cast<const void *>(&key), sizeof(key));
+  };
+
+  void
+  setSizeLimit(uint64_t size_limit) {
+    CacheWriter_setSizeLimit(handle, size_limit);
+  };
+
+  /**
+  Compresses values written from now on, on the writer thread.
+  */
+  void
+  setCodec(WMTCacheCodec codec) {
+    CacheWriter_setCodec(handle, codec);
+  };
 };
 
 inline Reference<Object>
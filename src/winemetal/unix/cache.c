@@ -1,21 +1,29 @@
 #import <Foundation/Foundation.h>
-#include "sqlite3.h"
+#include "cache_codec.h"
+#include "cache_pack.h"
+#include "cache_sqlite.h"
 #define WINEMETAL_API
 #include "../winemetal_thunks.h"
 
+_Static_assert(WMTCacheCodecLZ4 == CACHE_CODEC_LZ4, "codec ids are passed through as is");
+
 @interface CacheReader : NSObject
 - (instancetype)initWithPath:(NSString *)path version:(uint64_t)version;
 - (dispatch_data_t)get:(NSData *)key;
+- (uint64_t)copyKeys:(uint64_t)keyLength buffer:(void *)buffer capacity:(uint64_t)capacity;
 @end
 
 @interface CacheWriter : NSObject
 - (instancetype)initWithPath:(NSString *)path version:(uint64_t)version;
 - (void)set:(NSData *)key value:(dispatch_data_t)value;
+- (void)touch:(NSData *)key;
+- (void)setSizeLimit:(uint64_t)sizeLimit;
+- (void)setCodec:(enum cache_codec)codec;
 @end
 
 @interface CacheReader () {
-  sqlite3 *_db;
-  sqlite3_stmt *_stmt;
+  struct cache_pack *_pack;
+  struct cache_sqlite_reader *_reader;
 }
 @end
 
@@ -48,18 +56,11 @@ resolve_cache_dir(NSString *path, bool path_is_file) {
       NSLog(@"[CacheReader] Failed to resolve cache path");
       return nil;
     }
-    NSString *tableName = [NSString stringWithFormat:@"cache_%llu", version];
-    if (sqlite3_open_v2([dbPath fileSystemRepresentation], &_db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL) !=
-        SQLITE_OK) {
-      NSLog(@"[CacheReader] Failed to open DB: %s", sqlite3_errmsg(_db));
-      sqlite3_close(_db);
-      return nil;
-    }
-
-    NSString *sqlGet = [NSString stringWithFormat:@"SELECT value FROM %@ WHERE key = ?;", tableName];
-    if (sqlite3_prepare_v2(_db, sqlGet.UTF8String, -1, &_stmt, NULL) != SQLITE_OK) {
-      NSLog(@"[CacheReader] Failed to prepare SELECT: %s", sqlite3_errmsg(_db));
-      sqlite3_close(_db);
+    // a prebuilt pack next to the database takes precedence over it
+    NSString *packPath = [[dbPath stringByDeletingPathExtension] stringByAppendingPathExtension:@"pack"];
+    _pack = cache_pack_open([packPath fileSystemRepresentation], version);
+    _reader = cache_sqlite_reader_open([dbPath fileSystemRepresentation], version);
+    if (!_pack && !_reader) {
       return nil;
     }
   }
@@ -67,33 +68,57 @@ resolve_cache_dir(NSString *path, bool path_is_file) {
 }
 
 - (dispatch_data_t)get:(NSData *)key {
-  sqlite3_reset(_stmt);
-  sqlite3_clear_bindings(_stmt);
-  sqlite3_bind_blob64(_stmt, 1, key.bytes, key.length, SQLITE_STATIC);
-
-  dispatch_data_t result = nil;
-  if (sqlite3_step(_stmt) == SQLITE_ROW) {
-    const void *bytes = sqlite3_column_blob(_stmt, 0);
-    int len = sqlite3_column_bytes(_stmt, 0);
-    result = dispatch_data_create(bytes, len, nil, DISPATCH_DATA_DESTRUCTOR_DEFAULT);
+  size_t length = 0;
+  if (_pack) {
+    const void *mapped;
+    if (cache_pack_find(_pack, key.bytes, key.length, &mapped, &length)) {
+      // a view into the mapping, which stays alive until the data is released
+      struct cache_pack *pack = _pack;
+      cache_pack_retain(pack);
+      return dispatch_data_create(mapped, length, nil, ^{
+        cache_pack_release(pack);
+      });
+    }
+  }
+  if (!_reader)
+    return nil;
+  void *bytes = cache_sqlite_reader_get(_reader, key.bytes, key.length, &length);
+  if (!bytes)
+    return nil;
+  return dispatch_data_create(bytes, length, nil, DISPATCH_DATA_DESTRUCTOR_FREE);
+}
+
+- (uint64_t)copyKeys:(uint64_t)keyLength buffer:(void *)buffer capacity:(uint64_t)capacity {
+  // keys present in both are listed twice, which is harmless for a filter
+  uint64_t count = 0;
+  if (_pack && cache_pack_key_length(_pack) == keyLength) {
+    uint64_t entries = cache_pack_entry_count(_pack);
+    for (uint64_t i = 0; i < entries; i++, count++) {
+      if (count < capacity)
+        memcpy((char *)buffer + count * keyLength, cache_pack_entry_key(_pack, i), keyLength);
+    }
   }
-  sqlite3_reset(_stmt);
-  return result;
+  if (_reader) {
+    uint64_t skip = count < capacity ? count : capacity;
+    count += cache_sqlite_reader_copy_keys(
+        _reader, keyLength, (char *)buffer + skip * keyLength, capacity - skip
+    );
+  }
+  return count;
 }
 
 - (void)dealloc {
-  if (_stmt)
-    sqlite3_finalize(_stmt);
-  if (_db)
-    sqlite3_close(_db);
+  if (_pack)
+    cache_pack_release(_pack);
+  if (_reader)
+    cache_sqlite_reader_close(_reader);
   [super dealloc];
 }
 
 @end
 
 @interface CacheWriter () {
-  sqlite3 *_db;
-  sqlite3_stmt *_stmt;
+  struct cache_sqlite_writer *_writer;
 }
 @end
 
@@ -106,47 +131,11 @@ resolve_cache_dir(NSString *path, bool path_is_file) {
       NSLog(@"[CacheReader] Failed to resolve cache path");
       return nil;
     }
-
-    NSString *lockPath = [dbPath stringByAppendingString:@"-lock"];
-    int fd = open([lockPath fileSystemRepresentation], O_RDWR | O_CREAT, 0666);
-    if (fd < 0) {
-      NSLog(@"[CacheWriter] Failed to open file for locking %@", lockPath);
-      return nil;
-    }
-    flock(fd, LOCK_EX);
-
-    if (sqlite3_open_v2(
-            [dbPath fileSystemRepresentation], &_db, //
-            SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL
-        ) != SQLITE_OK) {
-      NSLog(@"[CacheWriter] Failed to open DB: %s", sqlite3_errmsg(_db));
-      flock(fd, LOCK_UN);
-      close(fd);
-      return nil;
-    }
-
-    sqlite3_exec(_db, "PRAGMA journal_mode=WAL;", NULL, NULL, NULL);
-    sqlite3_exec(_db, "PRAGMA synchronous=NORMAL;", NULL, NULL, NULL);
-
-    NSString *tableName = [NSString stringWithFormat:@"cache_%llu", version];
-    NSString *sqlCreate = [NSString stringWithFormat:@"CREATE TABLE IF NOT EXISTS %@ ("
-                                                      "key BLOB PRIMARY KEY, "
-                                                      "value BLOB NOT NULL);",
-                                                     tableName];
-
-    char *errMsg = NULL;
-    if (sqlite3_exec(_db, sqlCreate.UTF8String, NULL, NULL, &errMsg) != SQLITE_OK) {
-      NSLog(@"[CacheWriter] Failed to create table: %s", errMsg);
-      sqlite3_free(errMsg);
-    }
-
-    flock(fd, LOCK_UN);
-    close(fd);
-
-    NSString *sqlSet = [NSString stringWithFormat:@"INSERT OR REPLACE INTO %@ (key, value) VALUES (?, ?);", tableName];
-    if (sqlite3_prepare_v2(_db, sqlSet.UTF8String, -1, &_stmt, NULL) != SQLITE_OK) {
-      NSLog(@"[CacheWriter] Failed to prepare INSERT: %s", sqlite3_errmsg(_db));
-      sqlite3_close(_db);
+    _writer = cache_sqlite_writer_open(
+        [dbPath fileSystemRepresentation], version, CACHE_SQLITE_DEFAULT_BATCH_SIZE,
+        CACHE_SQLITE_DEFAULT_FLUSH_INTERVAL_MS
+    );
+    if (!_writer) {
       return nil;
     }
   }
@@ -154,28 +143,29 @@ resolve_cache_dir(NSString *path, bool path_is_file) {
 }
 
 - (void)set:(NSData *)key value:(dispatch_data_t)value {
-  sqlite3_reset(_stmt);
-  sqlite3_clear_bindings(_stmt);
-  sqlite3_bind_blob64(_stmt, 1, key.bytes, key.length, SQLITE_STATIC);
-
   const void *bytes = NULL;
   size_t length = 0;
   dispatch_data_t flat = dispatch_data_create_map(value, &bytes, &length);
-  sqlite3_bind_blob64(_stmt, 2, bytes, length, SQLITE_STATIC);
+  cache_sqlite_writer_set(_writer, key.bytes, key.length, bytes, length);
+  dispatch_release(flat);
+}
 
-  if (sqlite3_step(_stmt) != SQLITE_DONE) {
-    NSLog(@"[CacheWriter] Failed to insert: %s", sqlite3_errmsg(_db));
-  }
+- (void)touch:(NSData *)key {
+  cache_sqlite_writer_touch(_writer, key.bytes, key.length);
+}
 
-  dispatch_release(flat);
-  sqlite3_reset(_stmt);
+- (void)setSizeLimit:(uint64_t)sizeLimit {
+  cache_sqlite_writer_set_size_limit(_writer, sizeLimit);
+}
+
+- (void)setCodec:(enum cache_codec)codec {
+  cache_sqlite_writer_set_codec(_writer, codec);
 }
 
 - (void)dealloc {
-  if (_stmt)
-    sqlite3_finalize(_stmt);
-  if (_db)
-    sqlite3_close(_db);
+  // commits whatever is still queued
+  if (_writer)
+    cache_sqlite_writer_close(_writer);
   [super dealloc];
 }
 
@@ -201,6 +191,48 @@ _CacheReader_get(void *obj) {
   return 0;
 }
 
+/*
+ * CacheReader returns values as stored, this undoes the compression applied
+ * by CacheWriter, if any. Kept separate so that callers can decode after
+ * releasing the lock they hold around the reader.
+ */
+static dispatch_data_t
+cache_decode_value(dispatch_data_t value) {
+  const void *bytes = NULL;
+  size_t length = 0;
+  uint64_t raw_length;
+  dispatch_data_t flat = dispatch_data_create_map(value, &bytes, &length);
+  if (!cache_codec_is_encoded(bytes, length, &raw_length)) {
+    dispatch_release(flat);
+    dispatch_retain(value);
+    return value;
+  }
+  void *raw = malloc(raw_length ? raw_length : 1);
+  bool ok = raw && cache_codec_decode(bytes, length, raw, raw_length);
+  dispatch_release(flat);
+  if (!ok) {
+    NSLog(@"[CacheReader] Failed to decode a compressed entry");
+    free(raw);
+    return nil;
+  }
+  return dispatch_data_create(raw, raw_length, nil, DISPATCH_DATA_DESTRUCTOR_FREE);
+}
+
+int
+_CacheReader_decode(void *obj) {
+  struct unixcall_generic_obj_obj_ret *params = obj;
+  params->ret = (obj_handle_t)cache_decode_value((dispatch_data_t)params->handle);
+  return 0;
+}
+
+int
+_CacheReader_copyKeys(void *obj) {
+  struct unixcall_cache_copy_keys *params = obj;
+  CacheReader *reader = (CacheReader *)params->cache;
+  params->ret_count = [reader copyKeys:params->key_length buffer:params->buffer.ptr capacity:params->capacity];
+  return 0;
+}
+
 int
 _CacheWriter_alloc_init(void *obj) {
   struct unixcall_cache_alloc_init *params = obj;
@@ -221,6 +253,33 @@ _CacheWriter_set(void *obj) {
   return 0;
 }
 
+int
+_CacheWriter_touch(void *obj) {
+  struct unixcall_cache_touch *params = obj;
+  NSData *key =
+      [[NSData alloc] initWithBytesNoCopy:(void *)params->key.ptr length:params->key_length freeWhenDone:false];
+  CacheWriter *writer = (CacheWriter *)params->cache;
+  [writer touch:key];
+  [key release];
+  return 0;
+}
+
+int
+_CacheWriter_setSizeLimit(void *obj) {
+  struct unixcall_generic_obj_uint64_noret *params = obj;
+  CacheWriter *writer = (CacheWriter *)params->handle;
+  [writer setSizeLimit:params->arg];
+  return 0;
+}
+
+int
+_CacheWriter_setCodec(void *obj) {
+  struct unixcall_generic_obj_uint64_noret *params = obj;
+  CacheWriter *writer = (CacheWriter *)params->handle;
+  [writer setCodec:(enum cache_codec)params->arg];
+  return 0;
+}
+
 #ifndef DXMT_NO_PRIVATE_API
 
 extern void MTLSetShaderCachePath(NSString* path);
@@ -0,0 +1,217 @@
+#include "cache_codec.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Greedy single-pass LZ4 compressor: a hash table of recent 4-byte
+ * sequences, no match search chains. Compression runs on the cache writer
+ * thread and decompression on whichever thread loads the shader, so only the
+ * latter really has to be fast.
+ */
+
+#define LZ4_HASH_LOG 14
+#define LZ4_MIN_MATCH 4
+#define LZ4_MAX_OFFSET 65535
+/* the last match must start at least 12 bytes before the end of the block */
+#define LZ4_MF_LIMIT 12
+/* and the last 5 bytes are always literals */
+#define LZ4_LAST_LITERALS 5
+
+static inline uint32_t
+lz4_read32(const uint8_t *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static inline uint32_t
+lz4_hash(uint32_t sequence) {
+  return (sequence * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+static inline uint8_t *
+lz4_write_length(uint8_t *op, size_t length) {
+  for (; length >= 255; length -= 255)
+    *op++ = 255;
+  *op++ = (uint8_t)length;
+  return op;
+}
+
+/*
+ * Returns the compressed size, or 0 if it doesn't fit in `capacity`.
+ */
+static size_t
+lz4_compress(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity) {
+  uint32_t *table = calloc(1u << LZ4_HASH_LOG, sizeof(uint32_t));
+  if (!table)
+    return 0;
+
+  uint8_t *op = dst, *op_end = dst + capacity;
+  size_t anchor = 0, ip = 0;
+  size_t match_end_limit = length - LZ4_LAST_LITERALS;
+  unsigned misses = 0;
+
+  while (length > LZ4_MF_LIMIT && ip < length - LZ4_MF_LIMIT) {
+    uint32_t sequence = lz4_read32(src + ip);
+    uint32_t hash = lz4_hash(sequence);
+    size_t ref = table[hash];
+    table[hash] = (uint32_t)ip;
+    if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || lz4_read32(src + ref) != sequence) {
+      // skip faster through data that doesn't compress
+      ip += 1 + (misses++ >> 6);
+      continue;
+    }
+    misses = 0;
+
+    while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+      ip--;
+      ref--;
+    }
+    size_t match_length = LZ4_MIN_MATCH;
+    while (ip + match_length < match_end_limit && src[ip + match_length] == src[ref + match_length])
+      match_length++;
+
+    size_t literals = ip - anchor;
+    // token, literals with their length bytes, offset, match length bytes
+    if ((size_t)(op_end - op) < 1 + literals + literals / 255 + 1 + 2 + match_length / 255 + 1) {
+      free(table);
+      return 0;
+    }
+    uint8_t *token = op++;
+    *token = (uint8_t)((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15)
+      op = lz4_write_length(op, literals - 15);
+    memcpy(op, src + anchor, literals);
+    op += literals;
+    size_t offset = ip - ref;
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    size_t extra = match_length - LZ4_MIN_MATCH;
+    *token |= (uint8_t)(extra < 15 ? extra : 15);
+    if (extra >= 15)
+      op = lz4_write_length(op, extra - 15);
+
+    ip += match_length;
+    anchor = ip;
+    // the inner part of the match is skipped, but its tail is a likely start
+    if (ip < length - LZ4_MF_LIMIT)
+      table[lz4_hash(lz4_read32(src + ip - 2))] = (uint32_t)(ip - 2);
+  }
+
+  size_t literals = length - anchor;
+  if ((size_t)(op_end - op) < 1 + literals + literals / 255 + 1) {
+    free(table);
+    return 0;
+  }
+  *op++ = (uint8_t)((literals < 15 ? literals : 15) << 4);
+  if (literals >= 15)
+    op = lz4_write_length(op, literals - 15);
+  memcpy(op, src + anchor, literals);
+  op += literals;
+
+  free(table);
+  return op - dst;
+}
+
+static bool
+lz4_read_length(const uint8_t *src, size_t length, size_t *ip, size_t *value) {
+  uint8_t byte;
+  do {
+    if (*ip >= length)
+      return false;
+    byte = src[(*ip)++];
+    *value += byte;
+  } while (byte == 255);
+  return true;
+}
+
+static bool
+lz4_decompress(const uint8_t *src, size_t length, uint8_t *dst, size_t raw_length) {
+  size_t ip = 0, op = 0;
+  for (;;) {
+    if (ip >= length)
+      return false;
+    uint8_t token = src[ip++];
+
+    size_t literals = token >> 4;
+    if (literals == 15 && !lz4_read_length(src, length, &ip, &literals))
+      return false;
+    if (literals > length - ip || literals > raw_length - op)
+      return false;
+    memcpy(dst + op, src + ip, literals);
+    ip += literals;
+    op += literals;
+    // the last sequence has no match
+    if (ip == length)
+      return op == raw_length;
+
+    if (length - ip < 2)
+      return false;
+    size_t offset = src[ip] | ((size_t)src[ip + 1] << 8);
+    ip += 2;
+    if (!offset || offset > op)
+      return false;
+    size_t match_length = token & 15;
+    if (match_length == 15 && !lz4_read_length(src, length, &ip, &match_length))
+      return false;
+    match_length += LZ4_MIN_MATCH;
+    if (match_length > raw_length - op)
+      return false;
+
+    uint8_t *match = dst + op - offset;
+    if (offset >= match_length) {
+      memcpy(dst + op, match, match_length);
+    } else {
+      // overlapping: repeats the last `offset` bytes
+      for (size_t i = 0; i < match_length; i++)
+        dst[op + i] = match[i];
+    }
+    op += match_length;
+  }
+}
+
+void *
+cache_codec_encode(enum cache_codec codec, const void *value, size_t length, size_t *encoded_length) {
+  if (codec != CACHE_CODEC_LZ4 || length <= sizeof(struct cache_codec_header))
+    return NULL;
+  // anything that doesn't save space isn't worth decoding
+  size_t capacity = length - sizeof(struct cache_codec_header);
+  uint8_t *encoded = malloc(length);
+  if (!encoded)
+    return NULL;
+  size_t compressed = lz4_compress(value, length, encoded + sizeof(struct cache_codec_header), capacity);
+  if (!compressed) {
+    free(encoded);
+    return NULL;
+  }
+  struct cache_codec_header header;
+  memcpy(header.magic, CACHE_CODEC_MAGIC, sizeof(header.magic));
+  header.codec = codec;
+  header.raw_length = length;
+  memcpy(encoded, &header, sizeof(header));
+  *encoded_length = sizeof(header) + compressed;
+  return encoded;
+}
+
+bool
+cache_codec_is_encoded(const void *value, size_t length, uint64_t *raw_length) {
+  struct cache_codec_header header;
+  if (length < sizeof(header))
+    return false;
+  memcpy(&header, value, sizeof(header));
+  if (memcmp(header.magic, CACHE_CODEC_MAGIC, sizeof(header.magic)) || header.codec != CACHE_CODEC_LZ4)
+    return false;
+  // LZ4 can't expand more than 255 times, don't let a corrupt header allocate more
+  if (header.raw_length / 255 > length)
+    return false;
+  *raw_length = header.raw_length;
+  return true;
+}
+
+bool
+cache_codec_decode(const void *value, size_t length, void *raw, uint64_t raw_length) {
+  const uint8_t *bytes = value;
+  return lz4_decompress(
+      bytes + sizeof(struct cache_codec_header), length - sizeof(struct cache_codec_header), raw, raw_length
+  );
+}
@@ -0,0 +1,56 @@
+#ifndef __CACHE_CODEC_H
+#define __CACHE_CODEC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Optional compression of shader cache values. An encoded value starts with
+ * struct cache_codec_header, followed by an LZ4 block
+ * (https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md). Anything
+ * else is a value stored as is, which is how entries written before
+ * compression existed still read. Plain C, no dependencies.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CACHE_CODEC_MAGIC "DXCZ"
+
+enum cache_codec {
+  CACHE_CODEC_NONE = 0,
+  CACHE_CODEC_LZ4 = 1,
+};
+
+struct cache_codec_header {
+  char magic[4];
+  uint32_t codec;
+  uint64_t raw_length;
+};
+
+/*
+ * Returns a malloc'ed encoded copy of the value, or NULL if the codec is
+ * CACHE_CODEC_NONE or the value doesn't get smaller, in which case it should
+ * be stored as is.
+ */
+void *cache_codec_encode(enum cache_codec codec, const void *value, size_t length, size_t *encoded_length);
+
+/*
+ * Whether the value was produced by cache_codec_encode, and if so its decoded
+ * length.
+ */
+bool cache_codec_is_encoded(const void *value, size_t length, uint64_t *raw_length);
+
+/*
+ * Decodes an encoded value into `raw`, which has room for the length given by
+ * cache_codec_is_encoded. Returns false if the value is corrupt.
+ */
+bool cache_codec_decode(const void *value, size_t length, void *raw, uint64_t raw_length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,129 @@
+#include "cache_pack.h"
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct cache_pack {
+  atomic_uint refcount;
+  const unsigned char *base;
+  size_t size;
+  const struct cache_pack_header *header;
+  const unsigned char *index;
+};
+
+static bool
+cache_pack_validate(const unsigned char *base, size_t size, uint64_t version) {
+  if (size < sizeof(struct cache_pack_header))
+    return false;
+  const struct cache_pack_header *header = (const struct cache_pack_header *)base;
+  if (memcmp(header->magic, CACHE_PACK_MAGIC, sizeof(header->magic)) ||
+      header->format_version != CACHE_PACK_FORMAT_VERSION)
+    return false;
+  if (header->cache_version != version)
+    return false;
+  if (header->index_stride != cache_pack_index_stride(header->key_length) || header->index_offset % 8)
+    return false;
+  if (header->index_offset > size || header->entry_count > (size - header->index_offset) / header->index_stride)
+    return false;
+  // bounds-check every blob once, so that lookups don't have to
+  for (uint64_t i = 0; i < header->entry_count; i++) {
+    const uint64_t *record =
+        (const uint64_t *)(base + header->index_offset + i * header->index_stride + header->index_stride - 16);
+    if (record[0] > size || record[1] > size - record[0])
+      return false;
+  }
+  return true;
+}
+
+struct cache_pack *
+cache_pack_open(const char *path, uint64_t version) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size < (off_t)sizeof(struct cache_pack_header)) {
+    close(fd);
+    return NULL;
+  }
+  void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return NULL;
+
+  if (!cache_pack_validate(base, st.st_size, version)) {
+    fprintf(stderr, "[CachePack] Ignoring invalid or outdated pack %s\n", path);
+    munmap(base, st.st_size);
+    return NULL;
+  }
+  // lookups touch a few index pages and one blob each
+  madvise(base, st.st_size, MADV_RANDOM);
+
+  struct cache_pack *pack = malloc(sizeof(struct cache_pack));
+  if (!pack) {
+    munmap(base, st.st_size);
+    return NULL;
+  }
+  atomic_init(&pack->refcount, 1);
+  pack->base = base;
+  pack->size = st.st_size;
+  pack->header = base;
+  pack->index = pack->base + pack->header->index_offset;
+  return pack;
+}
+
+bool
+cache_pack_find(struct cache_pack *pack, const void *key, size_t key_length, const void **data, size_t *length) {
+  const struct cache_pack_header *header = pack->header;
+  if (key_length != header->key_length)
+    return false;
+  uint64_t low = 0, high = header->entry_count;
+  while (low < high) {
+    uint64_t mid = low + (high - low) / 2;
+    const unsigned char *record = pack->index + mid * header->index_stride;
+    int cmp = memcmp(record, key, key_length);
+    if (cmp == 0) {
+      const uint64_t *blob = (const uint64_t *)(record + header->index_stride - 16);
+      *data = pack->base + blob[0];
+      *length = blob[1];
+      return true;
+    }
+    if (cmp < 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return false;
+}
+
+uint64_t
+cache_pack_entry_count(struct cache_pack *pack) {
+  return pack->header->entry_count;
+}
+
+uint32_t
+cache_pack_key_length(struct cache_pack *pack) {
+  return pack->header->key_length;
+}
+
+const void *
+cache_pack_entry_key(struct cache_pack *pack, uint64_t index) {
+  return pack->index + index * pack->header->index_stride;
+}
+
+void
+cache_pack_retain(struct cache_pack *pack) {
+  atomic_fetch_add_explicit(&pack->refcount, 1, memory_order_relaxed);
+}
+
+void
+cache_pack_release(struct cache_pack *pack) {
+  if (atomic_fetch_sub_explicit(&pack->refcount, 1, memory_order_acq_rel) != 1)
+    return;
+  munmap((void *)pack->base, pack->size);
+  free(pack);
+}
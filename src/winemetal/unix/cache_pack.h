@@ -0,0 +1,66 @@
+#ifndef __CACHE_PACK_H
+#define __CACHE_PACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Read-only shader cache pack, produced offline from a shader cache database
+ * and memory-mapped at runtime. Layout (native endianness):
+ *
+ *   struct cache_pack_header
+ *   index: entry_count records of index_stride bytes, sorted by key (memcmp)
+ *     uint8_t  key[key_length], zero padded to 8 bytes
+ *     uint64_t blob_offset
+ *     uint64_t blob_length
+ *   blobs, each starting at a multiple of blob_alignment
+ */
+
+#define CACHE_PACK_MAGIC "DXMTPACK"
+#define CACHE_PACK_FORMAT_VERSION 1
+#define CACHE_PACK_DEFAULT_BLOB_ALIGNMENT 16384
+
+struct cache_pack_header {
+  char magic[8];
+  uint32_t format_version;
+  uint32_t key_length;
+  uint64_t cache_version;
+  uint64_t entry_count;
+  uint64_t index_offset;
+  uint64_t index_stride;
+  uint64_t blob_alignment;
+  uint64_t reserved;
+};
+
+static inline uint64_t
+cache_pack_index_stride(uint32_t key_length) {
+  return ((key_length + 7ull) & ~7ull) + 2 * sizeof(uint64_t);
+}
+
+struct cache_pack;
+
+/*
+ * Returns NULL if the pack doesn't exist, is malformed, or was built for a
+ * different cache version. The returned pack holds one reference.
+ */
+struct cache_pack *cache_pack_open(const char *path, uint64_t version);
+
+/*
+ * On success, `data` points into the mapping and stays valid as long as a
+ * reference to the pack is held.
+ */
+bool cache_pack_find(struct cache_pack *pack, const void *key, size_t key_length, const void **data,
+                     size_t *length);
+
+uint64_t cache_pack_entry_count(struct cache_pack *pack);
+
+uint32_t cache_pack_key_length(struct cache_pack *pack);
+
+const void *cache_pack_entry_key(struct cache_pack *pack, uint64_t index);
+
+void cache_pack_retain(struct cache_pack *pack);
+
+void cache_pack_release(struct cache_pack *pack);
+
+#endif
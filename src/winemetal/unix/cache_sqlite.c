@@ -0,0 +1,499 @@
+#include "cache_sqlite.h"
+#include "sqlite3.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <time.h>
+#include <unistd.h>
+
+struct cache_sqlite_reader {
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  uint64_t version;
+};
+
+struct cache_sqlite_reader *
+cache_sqlite_reader_open(const char *db_path, uint64_t version) {
+  struct cache_sqlite_reader *reader = calloc(1, sizeof(struct cache_sqlite_reader));
+  if (!reader)
+    return NULL;
+
+  if (sqlite3_open_v2(db_path, &reader->db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+    fprintf(stderr, "[CacheReader] Failed to open DB: %s\n", sqlite3_errmsg(reader->db));
+    cache_sqlite_reader_close(reader);
+    return NULL;
+  }
+  reader->version = version;
+
+  char sql_get[128];
+  snprintf(sql_get, sizeof(sql_get), "SELECT value FROM cache_%llu WHERE key = ?;", (unsigned long long)version);
+  if (sqlite3_prepare_v2(reader->db, sql_get, -1, &reader->stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "[CacheReader] Failed to prepare SELECT: %s\n", sqlite3_errmsg(reader->db));
+    cache_sqlite_reader_close(reader);
+    return NULL;
+  }
+  return reader;
+}
+
+void *
+cache_sqlite_reader_get(struct cache_sqlite_reader *reader, const void *key, size_t key_length,
+                        size_t *value_length) {
+  sqlite3_reset(reader->stmt);
+  sqlite3_clear_bindings(reader->stmt);
+  sqlite3_bind_blob64(reader->stmt, 1, key, key_length, SQLITE_STATIC);
+
+  void *result = NULL;
+  if (sqlite3_step(reader->stmt) == SQLITE_ROW) {
+    const void *bytes = sqlite3_column_blob(reader->stmt, 0);
+    size_t length = sqlite3_column_bytes(reader->stmt, 0);
+    if ((result = malloc(length ? length : 1))) {
+      // an empty blob comes back as NULL
+      if (length)
+        memcpy(result, bytes, length);
+      *value_length = length;
+    }
+  }
+  // don't hold the read transaction (and with it a WAL snapshot) open
+  sqlite3_reset(reader->stmt);
+  return result;
+}
+
+uint64_t
+cache_sqlite_reader_copy_keys(struct cache_sqlite_reader *reader, size_t key_length, void *buffer,
+                              uint64_t capacity) {
+  char sql[128];
+  sqlite3_stmt *stmt;
+  snprintf(sql, sizeof(sql), "SELECT key FROM cache_%llu WHERE length(key) = ?;", (unsigned long long)reader->version);
+  if (sqlite3_prepare_v2(reader->db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    return 0;
+  sqlite3_bind_int64(stmt, 1, key_length);
+  uint64_t count = 0;
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    if (count < capacity)
+      memcpy((unsigned char *)buffer + count * key_length, sqlite3_column_blob(stmt, 0), key_length);
+    count++;
+  }
+  sqlite3_finalize(stmt);
+  return count;
+}
+
+void
+cache_sqlite_reader_close(struct cache_sqlite_reader *reader) {
+  if (reader->stmt)
+    sqlite3_finalize(reader->stmt);
+  if (reader->db)
+    sqlite3_close(reader->db);
+  free(reader);
+}
+
+enum cache_sqlite_entry_kind {
+  CACHE_SQLITE_ENTRY_SET,
+  CACHE_SQLITE_ENTRY_TOUCH,
+};
+
+struct cache_sqlite_entry {
+  struct cache_sqlite_entry *next;
+  enum cache_sqlite_entry_kind kind;
+  int64_t timestamp;
+  size_t key_length;
+  size_t value_length;
+  unsigned char data[];
+};
+
+struct cache_sqlite_writer {
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  sqlite3_stmt *touch_stmt;
+  char table[32];
+  uint32_t batch_size;
+  uint32_t flush_interval_ms;
+
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t wake_cond;
+  pthread_cond_t flushed_cond;
+  /* guarded by mutex */
+  struct cache_sqlite_entry *pending_head;
+  struct cache_sqlite_entry **pending_tail;
+  uint32_t pending_count;
+  struct timespec pending_since;
+  uint64_t flush_requests;
+  uint64_t flush_generation;
+  uint64_t size_limit;
+  enum cache_codec codec;
+  uint64_t bytes_since_eviction;
+  bool eviction_pending;
+  bool stopping;
+};
+
+static bool
+cache_sqlite_writer_step(struct cache_sqlite_writer *writer, struct cache_sqlite_entry *entry,
+                         enum cache_codec codec) {
+  sqlite3_stmt *stmt = entry->kind == CACHE_SQLITE_ENTRY_SET ? writer->stmt : writer->touch_stmt;
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  sqlite3_bind_blob64(stmt, 1, entry->data, entry->key_length, SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 2, entry->timestamp);
+  void *encoded = NULL;
+  if (entry->kind == CACHE_SQLITE_ENTRY_SET) {
+    const void *value = entry->data + entry->key_length;
+    size_t length = entry->value_length;
+    // here rather than in set(), so that compile threads never wait for it
+    if ((encoded = cache_codec_encode(codec, value, length, &length)))
+      value = encoded;
+    sqlite3_bind_blob64(stmt, 3, value, length, SQLITE_STATIC);
+  }
+  bool ok = sqlite3_step(stmt) == SQLITE_DONE;
+  free(encoded);
+  if (!ok)
+    fprintf(stderr, "[CacheWriter] Failed to %s: %s\n", entry->kind == CACHE_SQLITE_ENTRY_SET ? "insert" : "touch",
+            sqlite3_errmsg(writer->db));
+  sqlite3_reset(stmt);
+  return ok;
+}
+
+static void
+cache_sqlite_writer_commit(struct cache_sqlite_writer *writer, struct cache_sqlite_entry *entries,
+                           enum cache_codec codec) {
+  char *err_msg = NULL;
+  if (sqlite3_exec(writer->db, "BEGIN IMMEDIATE;", NULL, NULL, &err_msg) != SQLITE_OK) {
+    fprintf(stderr, "[CacheWriter] Failed to begin transaction: %s\n", err_msg);
+    sqlite3_free(err_msg);
+    return;
+  }
+  for (struct cache_sqlite_entry *entry = entries; entry; entry = entry->next) {
+    if (!cache_sqlite_writer_step(writer, entry, codec)) {
+      sqlite3_exec(writer->db, "ROLLBACK;", NULL, NULL, NULL);
+      return;
+    }
+  }
+  if (sqlite3_exec(writer->db, "COMMIT;", NULL, NULL, &err_msg) != SQLITE_OK) {
+    fprintf(stderr, "[CacheWriter] Failed to commit: %s\n", err_msg);
+    sqlite3_free(err_msg);
+    sqlite3_exec(writer->db, "ROLLBACK;", NULL, NULL, NULL);
+  }
+}
+
+/*
+ * Deletes least recently used entries until the table is 10% below the limit,
+ * so that it doesn't have to run again right after the next few inserts.
+ */
+static void
+cache_sqlite_writer_evict(struct cache_sqlite_writer *writer, uint64_t size_limit) {
+  char sql[192];
+  sqlite3_stmt *stmt;
+  int64_t total = 0;
+  snprintf(sql, sizeof(sql), "SELECT COALESCE(SUM(length(key) + length(value)), 0) FROM %s;", writer->table);
+  if (sqlite3_prepare_v2(writer->db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    return;
+  if (sqlite3_step(stmt) == SQLITE_ROW)
+    total = sqlite3_column_int64(stmt, 0);
+  sqlite3_finalize(stmt);
+  if ((uint64_t)total <= size_limit)
+    return;
+
+  uint64_t to_free = total - (size_limit - size_limit / 10);
+  uint64_t freed = 0, count = 0, capacity = 0;
+  int64_t *rowids = NULL;
+  snprintf(sql, sizeof(sql), "SELECT rowid, length(key) + length(value) FROM %s ORDER BY last_used, rowid;",
+           writer->table);
+  if (sqlite3_prepare_v2(writer->db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    return;
+  // collected first, rows can't be deleted while the table is being iterated
+  while (freed < to_free && sqlite3_step(stmt) == SQLITE_ROW) {
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 256;
+      int64_t *grown = realloc(rowids, capacity * sizeof(int64_t));
+      if (!grown)
+        break;
+      rowids = grown;
+    }
+    rowids[count++] = sqlite3_column_int64(stmt, 0);
+    freed += sqlite3_column_int64(stmt, 1);
+  }
+  sqlite3_finalize(stmt);
+
+  snprintf(sql, sizeof(sql), "DELETE FROM %s WHERE rowid = ?;", writer->table);
+  if (count && sqlite3_prepare_v2(writer->db, sql, -1, &stmt, NULL) == SQLITE_OK) {
+    bool ok = sqlite3_exec(writer->db, "BEGIN IMMEDIATE;", NULL, NULL, NULL) == SQLITE_OK;
+    for (uint64_t i = 0; i < count && ok; i++) {
+      sqlite3_bind_int64(stmt, 1, rowids[i]);
+      ok = sqlite3_step(stmt) == SQLITE_DONE;
+      sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    if (ok && sqlite3_exec(writer->db, "COMMIT;", NULL, NULL, NULL) == SQLITE_OK) {
+      // only returns pages to the file system if the database was created
+      // with auto_vacuum=INCREMENTAL, otherwise they are reused by inserts
+      sqlite3_exec(writer->db, "PRAGMA incremental_vacuum;", NULL, NULL, NULL);
+      fprintf(stderr, "[CacheWriter] Evicted %llu entries (%llu KiB), %llu KiB left\n", (unsigned long long)count,
+              (unsigned long long)(freed >> 10), (unsigned long long)((total - freed) >> 10));
+    } else {
+      fprintf(stderr, "[CacheWriter] Failed to evict: %s\n", sqlite3_errmsg(writer->db));
+      sqlite3_exec(writer->db, "ROLLBACK;", NULL, NULL, NULL);
+    }
+  }
+  free(rowids);
+}
+
+static void *
+cache_sqlite_writer_thread(void *arg) {
+  struct cache_sqlite_writer *writer = arg;
+
+  pthread_mutex_lock(&writer->mutex);
+  for (;;) {
+    while (!writer->stopping && writer->flush_requests == writer->flush_generation) {
+      if (writer->pending_count == 0) {
+        if (writer->eviction_pending)
+          break;
+        pthread_cond_wait(&writer->wake_cond, &writer->mutex);
+        continue;
+      }
+      if (writer->pending_count >= writer->batch_size)
+        break;
+      struct timespec deadline = writer->pending_since;
+      deadline.tv_sec += writer->flush_interval_ms / 1000;
+      deadline.tv_nsec += (long)(writer->flush_interval_ms % 1000) * 1000000;
+      if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000;
+      }
+      if (pthread_cond_timedwait(&writer->wake_cond, &writer->mutex, &deadline) == ETIMEDOUT)
+        break;
+    }
+
+    struct cache_sqlite_entry *entries = writer->pending_head;
+    writer->pending_head = NULL;
+    writer->pending_tail = &writer->pending_head;
+    writer->pending_count = 0;
+    uint64_t generation = writer->flush_requests;
+    enum cache_codec codec = writer->codec;
+    bool stopping = writer->stopping;
+    pthread_mutex_unlock(&writer->mutex);
+
+    uint64_t inserted_bytes = 0;
+    if (entries)
+      cache_sqlite_writer_commit(writer, entries, codec);
+    while (entries) {
+      struct cache_sqlite_entry *next = entries->next;
+      inserted_bytes += entries->key_length + entries->value_length;
+      free(entries);
+      entries = next;
+    }
+
+    pthread_mutex_lock(&writer->mutex);
+    writer->flush_generation = generation;
+    pthread_cond_broadcast(&writer->flushed_cond);
+    if (stopping)
+      break;
+
+    writer->bytes_since_eviction += inserted_bytes;
+    if (writer->size_limit && writer->bytes_since_eviction >= writer->size_limit / 16)
+      writer->eviction_pending = true;
+    // only when idle, never ahead of queued writes
+    if (writer->eviction_pending && writer->pending_count == 0) {
+      uint64_t size_limit = writer->size_limit;
+      writer->eviction_pending = false;
+      writer->bytes_since_eviction = 0;
+      pthread_mutex_unlock(&writer->mutex);
+      if (size_limit)
+        cache_sqlite_writer_evict(writer, size_limit);
+      pthread_mutex_lock(&writer->mutex);
+    }
+  }
+  pthread_mutex_unlock(&writer->mutex);
+  return NULL;
+}
+
+static bool
+cache_sqlite_table_has_column(sqlite3 *db, const char *table, const char *column) {
+  char sql[128];
+  sqlite3_stmt *stmt;
+  snprintf(sql, sizeof(sql), "SELECT %s FROM %s LIMIT 0;", column, table);
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    return false;
+  sqlite3_finalize(stmt);
+  return true;
+}
+
+struct cache_sqlite_writer *
+cache_sqlite_writer_open(const char *db_path, uint64_t version, uint32_t batch_size, uint32_t flush_interval_ms) {
+  struct cache_sqlite_writer *writer = calloc(1, sizeof(struct cache_sqlite_writer));
+  if (!writer)
+    return NULL;
+  writer->batch_size = batch_size ? batch_size : 1;
+  writer->flush_interval_ms = flush_interval_ms;
+  writer->pending_tail = &writer->pending_head;
+  snprintf(writer->table, sizeof(writer->table), "cache_%llu", (unsigned long long)version);
+
+  char lock_path[PATH_MAX];
+  snprintf(lock_path, sizeof(lock_path), "%s-lock", db_path);
+  int fd = open(lock_path, O_RDWR | O_CREAT, 0666);
+  if (fd < 0) {
+    fprintf(stderr, "[CacheWriter] Failed to open file for locking %s\n", lock_path);
+    free(writer);
+    return NULL;
+  }
+  flock(fd, LOCK_EX);
+
+  if (sqlite3_open_v2(db_path, &writer->db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX,
+                      NULL) != SQLITE_OK) {
+    fprintf(stderr, "[CacheWriter] Failed to open DB: %s\n", sqlite3_errmsg(writer->db));
+    flock(fd, LOCK_UN);
+    close(fd);
+    sqlite3_close(writer->db);
+    free(writer);
+    return NULL;
+  }
+
+  // no effect on existing databases
+  sqlite3_exec(writer->db, "PRAGMA auto_vacuum=INCREMENTAL;", NULL, NULL, NULL);
+  sqlite3_exec(writer->db, "PRAGMA journal_mode=WAL;", NULL, NULL, NULL);
+  sqlite3_exec(writer->db, "PRAGMA synchronous=NORMAL;", NULL, NULL, NULL);
+  // other processes may be committing to the same cache
+  sqlite3_busy_timeout(writer->db, 1000);
+
+  char sql[256];
+  snprintf(sql, sizeof(sql),
+           "CREATE TABLE IF NOT EXISTS %s (key BLOB PRIMARY KEY, value BLOB NOT NULL, "
+           "last_used INTEGER NOT NULL DEFAULT 0);",
+           writer->table);
+  char *err_msg = NULL;
+  if (sqlite3_exec(writer->db, sql, NULL, NULL, &err_msg) != SQLITE_OK) {
+    fprintf(stderr, "[CacheWriter] Failed to create table: %s\n", err_msg);
+    sqlite3_free(err_msg);
+  }
+  // tables created before last-used tracking count as least recently used
+  if (!cache_sqlite_table_has_column(writer->db, writer->table, "last_used")) {
+    snprintf(sql, sizeof(sql), "ALTER TABLE %s ADD COLUMN last_used INTEGER NOT NULL DEFAULT 0;", writer->table);
+    sqlite3_exec(writer->db, sql, NULL, NULL, NULL);
+  }
+  snprintf(sql, sizeof(sql), "CREATE INDEX IF NOT EXISTS %s_last_used ON %s (last_used);", writer->table,
+           writer->table);
+  sqlite3_exec(writer->db, sql, NULL, NULL, NULL);
+
+  flock(fd, LOCK_UN);
+  close(fd);
+
+  snprintf(sql, sizeof(sql), "INSERT OR REPLACE INTO %s (key, last_used, value) VALUES (?1, ?2, ?3);",
+           writer->table);
+  if (sqlite3_prepare_v2(writer->db, sql, -1, &writer->stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "[CacheWriter] Failed to prepare INSERT: %s\n", sqlite3_errmsg(writer->db));
+    sqlite3_close(writer->db);
+    free(writer);
+    return NULL;
+  }
+  snprintf(sql, sizeof(sql), "UPDATE %s SET last_used = ?2 WHERE key = ?1;", writer->table);
+  if (sqlite3_prepare_v2(writer->db, sql, -1, &writer->touch_stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "[CacheWriter] Failed to prepare UPDATE: %s\n", sqlite3_errmsg(writer->db));
+    sqlite3_finalize(writer->stmt);
+    sqlite3_close(writer->db);
+    free(writer);
+    return NULL;
+  }
+
+  pthread_mutex_init(&writer->mutex, NULL);
+  pthread_cond_init(&writer->wake_cond, NULL);
+  pthread_cond_init(&writer->flushed_cond, NULL);
+  if (pthread_create(&writer->thread, NULL, cache_sqlite_writer_thread, writer)) {
+    fprintf(stderr, "[CacheWriter] Failed to start flush thread\n");
+    pthread_cond_destroy(&writer->flushed_cond);
+    pthread_cond_destroy(&writer->wake_cond);
+    pthread_mutex_destroy(&writer->mutex);
+    sqlite3_finalize(writer->touch_stmt);
+    sqlite3_finalize(writer->stmt);
+    sqlite3_close(writer->db);
+    free(writer);
+    return NULL;
+  }
+  return writer;
+}
+
+static void
+cache_sqlite_writer_queue(struct cache_sqlite_writer *writer, enum cache_sqlite_entry_kind kind, const void *key,
+                          size_t key_length, const void *value, size_t value_length) {
+  struct cache_sqlite_entry *entry = malloc(sizeof(struct cache_sqlite_entry) + key_length + value_length);
+  if (!entry)
+    return;
+  entry->next = NULL;
+  entry->kind = kind;
+  entry->timestamp = time(NULL);
+  entry->key_length = key_length;
+  entry->value_length = value_length;
+  memcpy(entry->data, key, key_length);
+  if (value_length)
+    memcpy(entry->data + key_length, value, value_length);
+
+  pthread_mutex_lock(&writer->mutex);
+  *writer->pending_tail = entry;
+  writer->pending_tail = &entry->next;
+  if (writer->pending_count++ == 0) {
+    clock_gettime(CLOCK_REALTIME, &writer->pending_since);
+    pthread_cond_signal(&writer->wake_cond);
+  } else if (writer->pending_count == writer->batch_size) {
+    pthread_cond_signal(&writer->wake_cond);
+  }
+  pthread_mutex_unlock(&writer->mutex);
+}
+
+void
+cache_sqlite_writer_set(struct cache_sqlite_writer *writer, const void *key, size_t key_length, const void *value,
+                        size_t value_length) {
+  cache_sqlite_writer_queue(writer, CACHE_SQLITE_ENTRY_SET, key, key_length, value, value_length);
+}
+
+void
+cache_sqlite_writer_touch(struct cache_sqlite_writer *writer, const void *key, size_t key_length) {
+  cache_sqlite_writer_queue(writer, CACHE_SQLITE_ENTRY_TOUCH, key, key_length, NULL, 0);
+}
+
+void
+cache_sqlite_writer_set_size_limit(struct cache_sqlite_writer *writer, uint64_t size_limit) {
+  pthread_mutex_lock(&writer->mutex);
+  writer->size_limit = size_limit;
+  writer->eviction_pending = size_limit != 0;
+  pthread_cond_signal(&writer->wake_cond);
+  pthread_mutex_unlock(&writer->mutex);
+}
+
+void
+cache_sqlite_writer_set_codec(struct cache_sqlite_writer *writer, enum cache_codec codec) {
+  pthread_mutex_lock(&writer->mutex);
+  writer->codec = codec;
+  pthread_mutex_unlock(&writer->mutex);
+}
+
+void
+cache_sqlite_writer_flush(struct cache_sqlite_writer *writer) {
+  pthread_mutex_lock(&writer->mutex);
+  // a commit already in progress may not include what was queued last, so
+  // wait for one that started after this request
+  uint64_t target = ++writer->flush_requests;
+  pthread_cond_signal(&writer->wake_cond);
+  while (writer->flush_generation < target)
+    pthread_cond_wait(&writer->flushed_cond, &writer->mutex);
+  pthread_mutex_unlock(&writer->mutex);
+}
+
+void
+cache_sqlite_writer_close(struct cache_sqlite_writer *writer) {
+  pthread_mutex_lock(&writer->mutex);
+  writer->stopping = true;
+  pthread_cond_signal(&writer->wake_cond);
+  pthread_mutex_unlock(&writer->mutex);
+  pthread_join(writer->thread, NULL);
+
+  pthread_cond_destroy(&writer->flushed_cond);
+  pthread_cond_destroy(&writer->wake_cond);
+  pthread_mutex_destroy(&writer->mutex);
+  sqlite3_finalize(writer->touch_stmt);
+  sqlite3_finalize(writer->stmt);
+  sqlite3_close(writer->db);
+  free(writer);
+}
@@ -0,0 +1,88 @@
+#ifndef __CACHE_SQLITE_H
+#define __CACHE_SQLITE_H
+
+#include "cache_codec.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * SQLite storage behind CacheReader and CacheWriter. Plain C and POSIX only,
+ * so it can be built and exercised without Foundation.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CACHE_SQLITE_DEFAULT_BATCH_SIZE 256
+#define CACHE_SQLITE_DEFAULT_FLUSH_INTERVAL_MS 500
+
+struct cache_sqlite_reader;
+struct cache_sqlite_writer;
+
+struct cache_sqlite_reader *cache_sqlite_reader_open(const char *db_path, uint64_t version);
+
+/*
+ * Returns a malloc'ed copy of the value, or NULL if the key is not present.
+ */
+void *cache_sqlite_reader_get(struct cache_sqlite_reader *reader, const void *key, size_t key_length,
+                              size_t *value_length);
+
+/*
+ * Copies up to `capacity` keys of `key_length` bytes into `buffer` and
+ * returns how many there are in total.
+ */
+uint64_t cache_sqlite_reader_copy_keys(struct cache_sqlite_reader *reader, size_t key_length, void *buffer,
+                                       uint64_t capacity);
+
+void cache_sqlite_reader_close(struct cache_sqlite_reader *reader);
+
+/*
+ * Writes are queued in memory and committed by a background thread in a
+ * single transaction, once `batch_size` entries are pending or
+ * `flush_interval_ms` after the first pending one, whichever comes first.
+ */
+struct cache_sqlite_writer *cache_sqlite_writer_open(const char *db_path, uint64_t version, uint32_t batch_size,
+                                                     uint32_t flush_interval_ms);
+
+/*
+ * Copies key and value, never touches the database.
+ */
+void cache_sqlite_writer_set(struct cache_sqlite_writer *writer, const void *key, size_t key_length,
+                             const void *value, size_t value_length);
+
+/*
+ * Queues an update of the entry's last-used time, if it exists.
+ */
+void cache_sqlite_writer_touch(struct cache_sqlite_writer *writer, const void *key, size_t key_length);
+
+/*
+ * Least recently used entries are evicted in the background once keys and
+ * values take more than `size_limit` bytes: right away, and again whenever
+ * the writer is idle after enough has been inserted. 0 means no limit.
+ */
+void cache_sqlite_writer_set_size_limit(struct cache_sqlite_writer *writer, uint64_t size_limit);
+
+/*
+ * Values committed from now on are compressed with `codec` by the background
+ * thread, unless that doesn't make them smaller. CACHE_CODEC_NONE (the
+ * default) stores them as is. Readers return values as stored, see
+ * cache_codec.h for decoding them.
+ */
+void cache_sqlite_writer_set_codec(struct cache_sqlite_writer *writer, enum cache_codec codec);
+
+/*
+ * Blocks until everything queued before the call is committed.
+ */
+void cache_sqlite_writer_flush(struct cache_sqlite_writer *writer);
+
+/*
+ * Commits what is still queued, then stops the background thread.
+ */
+void cache_sqlite_writer_close(struct cache_sqlite_writer *writer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,203 @@
+/*
+ * dxmt-cache-sqlite-test: round trip of the SQLite shader cache.
+ *
+ *   dxmt-cache-sqlite-test [directory]
+ *
+ * Writes entries through cache_sqlite_writer, some flushed explicitly and
+ * some only committed by closing the writer, then reopens the database with
+ * cache_sqlite_reader and checks every value. Also covers overwriting a key,
+ * a key that was never written, and values compressed by the writer. The
+ * database is created in `directory` (default /tmp) and removed afterwards.
+ * Exits with 1 if anything doesn't match.
+ */
+
+#include "cache_codec.h"
+#include "cache_sqlite.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TEST_VERSION 0x5e5713ull
+#define TEST_KEY_LENGTH 16
+#define TEST_ENTRY_COUNT 1000
+
+static char db_path[4096];
+static int failures;
+
+#define CHECK(cond, ...)                                                                                               \
+  do {                                                                                                                 \
+    if (!(cond)) {                                                                                                     \
+      fprintf(stderr, "%s:%d: ", __FILE__, __LINE__);                                                                 \
+      fprintf(stderr, __VA_ARGS__);                                                                                    \
+      fprintf(stderr, "\n");                                                                                           \
+      failures++;                                                                                                      \
+      return;                                                                                                          \
+    }                                                                                                                  \
+  } while (0)
+
+static void
+make_key(uint32_t index, unsigned char key[TEST_KEY_LENGTH]) {
+  for (unsigned i = 0; i < TEST_KEY_LENGTH; i++)
+    key[i] = (unsigned char)((index >> ((i & 3) * 8)) ^ (i * 0x9d));
+}
+
+/* sizes from empty to a few pages, content depends on index and generation */
+static size_t
+make_value(uint32_t index, uint32_t generation, unsigned char *value) {
+  size_t length = (index * 37u) % 9000;
+  uint32_t state = index * 2654435761u + generation + 1;
+  for (size_t i = 0; i < length; i++) {
+    state = state * 1664525u + 1013904223u;
+    value[i] = (unsigned char)(state >> 24);
+  }
+  return length;
+}
+
+static void
+remove_database(void) {
+  char path[sizeof(db_path) + 8];
+  unlink(db_path);
+  snprintf(path, sizeof(path), "%s-wal", db_path);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s-shm", db_path);
+  unlink(path);
+}
+
+static void
+check_entries(uint32_t begin, uint32_t end, uint32_t generation) {
+  struct cache_sqlite_reader *reader = cache_sqlite_reader_open(db_path, TEST_VERSION);
+  CHECK(reader, "failed to open reader");
+
+  unsigned char key[TEST_KEY_LENGTH];
+  static unsigned char expected[9000];
+  for (uint32_t index = begin; index < end; index++) {
+    make_key(index, key);
+    size_t expected_length = make_value(index, generation, expected);
+    size_t length = 0;
+    unsigned char *value = cache_sqlite_reader_get(reader, key, sizeof(key), &length);
+    if (!value) {
+      cache_sqlite_reader_close(reader);
+      CHECK(0, "entry %u is missing", index);
+    }
+    uint64_t raw_length;
+    if (cache_codec_is_encoded(value, length, &raw_length)) {
+      unsigned char *raw = malloc(raw_length ? raw_length : 1);
+      int decoded = raw && cache_codec_decode(value, length, raw, raw_length);
+      free(value);
+      value = raw;
+      length = raw_length;
+      if (!decoded) {
+        free(raw);
+        cache_sqlite_reader_close(reader);
+        CHECK(0, "entry %u doesn't decode", index);
+      }
+    }
+    int equal = length == expected_length && !memcmp(value, expected, length);
+    free(value);
+    if (!equal) {
+      cache_sqlite_reader_close(reader);
+      CHECK(0, "entry %u has %zu bytes, expected %zu", index, length, expected_length);
+    }
+  }
+  cache_sqlite_reader_close(reader);
+}
+
+static void
+set_entries(struct cache_sqlite_writer *writer, uint32_t begin, uint32_t end, uint32_t generation) {
+  unsigned char key[TEST_KEY_LENGTH];
+  static unsigned char value[9000];
+  for (uint32_t index = begin; index < end; index++) {
+    make_key(index, key);
+    size_t length = make_value(index, generation, value);
+    cache_sqlite_writer_set(writer, key, sizeof(key), value, length);
+  }
+}
+
+static void
+test_round_trip(void) {
+  remove_database();
+  // batch size and interval large enough that only flush and close commit
+  struct cache_sqlite_writer *writer = cache_sqlite_writer_open(db_path, TEST_VERSION, 1u << 20, 60000);
+  CHECK(writer, "failed to open writer");
+  set_entries(writer, 0, TEST_ENTRY_COUNT / 2, 0);
+  cache_sqlite_writer_flush(writer);
+  check_entries(0, TEST_ENTRY_COUNT / 2, 0);
+  set_entries(writer, TEST_ENTRY_COUNT / 2, TEST_ENTRY_COUNT, 0);
+  cache_sqlite_writer_close(writer);
+  check_entries(0, TEST_ENTRY_COUNT, 0);
+}
+
+static void
+test_overwrite_and_missing(void) {
+  struct cache_sqlite_writer *writer = cache_sqlite_writer_open(db_path, TEST_VERSION, 16, 10);
+  CHECK(writer, "failed to reopen writer");
+  set_entries(writer, 0, TEST_ENTRY_COUNT / 4, 1);
+  cache_sqlite_writer_close(writer);
+  check_entries(0, TEST_ENTRY_COUNT / 4, 1);
+  check_entries(TEST_ENTRY_COUNT / 4, TEST_ENTRY_COUNT, 0);
+
+  struct cache_sqlite_reader *reader = cache_sqlite_reader_open(db_path, TEST_VERSION);
+  CHECK(reader, "failed to open reader");
+  unsigned char key[TEST_KEY_LENGTH];
+  make_key(TEST_ENTRY_COUNT, key);
+  size_t length = 0;
+  void *value = cache_sqlite_reader_get(reader, key, sizeof(key), &length);
+  uint64_t key_count = cache_sqlite_reader_copy_keys(reader, TEST_KEY_LENGTH, NULL, 0);
+  cache_sqlite_reader_close(reader);
+  free(value);
+  CHECK(!value, "entry %u was never written", TEST_ENTRY_COUNT);
+  CHECK(key_count == TEST_ENTRY_COUNT, "%" PRIu64 " keys, expected %u", key_count, TEST_ENTRY_COUNT);
+}
+
+static void
+test_compressed(void) {
+  remove_database();
+  struct cache_sqlite_writer *writer = cache_sqlite_writer_open(db_path, TEST_VERSION, 64, 10);
+  CHECK(writer, "failed to open writer");
+  cache_sqlite_writer_set_codec(writer, CACHE_CODEC_LZ4);
+  // shader binaries compress, so add some that do
+  unsigned char key[TEST_KEY_LENGTH];
+  static unsigned char value[8192];
+  for (uint32_t index = 0; index < 64; index++) {
+    make_key(TEST_ENTRY_COUNT + index, key);
+    for (size_t i = 0; i < sizeof(value); i++)
+      value[i] = (unsigned char)((i / 8) ^ index);
+    cache_sqlite_writer_set(writer, key, sizeof(key), value, sizeof(value));
+  }
+  set_entries(writer, 0, TEST_ENTRY_COUNT, 2);
+  cache_sqlite_writer_close(writer);
+  check_entries(0, TEST_ENTRY_COUNT, 2);
+
+  struct cache_sqlite_reader *reader = cache_sqlite_reader_open(db_path, TEST_VERSION);
+  CHECK(reader, "failed to open reader");
+  unsigned encoded = 0;
+  for (uint32_t index = 0; index < 64; index++) {
+    make_key(TEST_ENTRY_COUNT + index, key);
+    size_t length = 0;
+    void *stored = cache_sqlite_reader_get(reader, key, sizeof(key), &length);
+    uint64_t raw_length = 0;
+    if (stored && cache_codec_is_encoded(stored, length, &raw_length) && raw_length == sizeof(value))
+      encoded++;
+    free(stored);
+  }
+  cache_sqlite_reader_close(reader);
+  CHECK(encoded == 64, "%u of 64 compressible entries were stored compressed", encoded);
+}
+
+int
+main(int argc, char **argv) {
+  const char *directory = argc > 1 ? argv[1] : "/tmp";
+  snprintf(db_path, sizeof(db_path), "%s/dxmt-cache-sqlite-test-%d.db", directory, (int)getpid());
+
+  test_round_trip();
+  test_overwrite_and_missing();
+  test_compressed();
+  remove_database();
+
+  if (failures)
+    return 1;
+  printf("ok\n");
+  return 0;
+}
@@ -0,0 +1,460 @@
+/*
+ * dxmt-shader-pack: builds read-only shader cache packs and benchmarks them.
+ *
+ *   dxmt-shader-pack create [-v version] [-a alignment] <shaders.db> <shaders.pack>
+ *   dxmt-shader-pack bench [-n iterations] <shaders.db> <shaders.pack>
+ *   dxmt-shader-pack compression [-v version] [-n iterations] <shaders.db>
+ *
+ * A pack placed next to the database it was built from, with the `.db`
+ * extension replaced by `.pack`, is consulted by CacheReader before SQLite.
+ * Packs keep values as stored, compressed or not.
+ *
+ * `compression` measures what LZ4 compression (see cache_codec.h) does to the
+ * size of a database and the time to load its values, whether they were
+ * stored compressed or not.
+ */
+
+#include "cache_codec.h"
+#include "cache_pack.h"
+#include "cache_sqlite.h"
+#include "sqlite3.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct pack_entry {
+  unsigned char *key;
+  uint64_t length;
+  uint64_t offset;
+};
+
+static uint32_t sort_key_length;
+
+static int
+compare_entry(const void *a, const void *b) {
+  return memcmp(((const struct pack_entry *)a)->key, ((const struct pack_entry *)b)->key, sort_key_length);
+}
+
+static uint64_t
+align_up(uint64_t value, uint64_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+static int
+find_latest_version(sqlite3 *db, uint64_t *version) {
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, "SELECT name FROM sqlite_master WHERE type = 'table' AND name LIKE 'cache_%';", -1,
+                         &stmt, NULL) != SQLITE_OK)
+    return 1;
+  int found = 0;
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    const char *name = (const char *)sqlite3_column_text(stmt, 0);
+    char *end;
+    unsigned long long v = strtoull(name + 6, &end, 10);
+    if (*end || end == name + 6)
+      continue;
+    if (!found || v > *version)
+      *version = v;
+    found = 1;
+  }
+  sqlite3_finalize(stmt);
+  return !found;
+}
+
+static int
+write_all(int fd, const void *data, size_t length, uint64_t offset) {
+  const unsigned char *bytes = data;
+  while (length) {
+    ssize_t written = pwrite(fd, bytes, length, offset);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return 1;
+    }
+    bytes += written;
+    length -= written;
+    offset += written;
+  }
+  return 0;
+}
+
+static int
+create_pack(const char *db_path, const char *pack_path, uint64_t version, int has_version, uint64_t alignment) {
+  sqlite3 *db;
+  if (sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+    fprintf(stderr, "Failed to open %s: %s\n", db_path, sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return 1;
+  }
+  if (!has_version && find_latest_version(db, &version)) {
+    fprintf(stderr, "No shader cache table in %s\n", db_path);
+    sqlite3_close(db);
+    return 1;
+  }
+
+  char sql[128];
+  sqlite3_stmt *list, *get;
+  snprintf(sql, sizeof(sql), "SELECT key, length(value) FROM cache_%" PRIu64 ";", version);
+  if (sqlite3_prepare_v2(db, sql, -1, &list, NULL) != SQLITE_OK) {
+    fprintf(stderr, "Failed to read cache_%" PRIu64 ": %s\n", version, sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return 1;
+  }
+  snprintf(sql, sizeof(sql), "SELECT value FROM cache_%" PRIu64 " WHERE key = ?;", version);
+  sqlite3_prepare_v2(db, sql, -1, &get, NULL);
+
+  struct pack_entry *entries = NULL;
+  uint64_t count = 0, capacity = 0;
+  uint32_t key_length = 0;
+  int ret = 1;
+  while (sqlite3_step(list) == SQLITE_ROW) {
+    uint32_t length = sqlite3_column_bytes(list, 0);
+    if (count && length != key_length) {
+      fprintf(stderr, "Keys of different lengths can't be packed\n");
+      goto cleanup;
+    }
+    key_length = length;
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 1024;
+      entries = realloc(entries, capacity * sizeof(struct pack_entry));
+    }
+    entries[count].key = malloc(key_length ? key_length : 1);
+    memcpy(entries[count].key, sqlite3_column_blob(list, 0), key_length);
+    entries[count].length = sqlite3_column_int64(list, 1);
+    count++;
+  }
+
+  sort_key_length = key_length;
+  qsort(entries, count, sizeof(struct pack_entry), compare_entry);
+
+  struct cache_pack_header header = {0};
+  memcpy(header.magic, CACHE_PACK_MAGIC, sizeof(header.magic));
+  header.format_version = CACHE_PACK_FORMAT_VERSION;
+  header.key_length = key_length;
+  header.cache_version = version;
+  header.entry_count = count;
+  header.index_offset = sizeof(header);
+  header.index_stride = cache_pack_index_stride(key_length);
+  header.blob_alignment = alignment;
+
+  uint64_t offset = header.index_offset + count * header.index_stride;
+  for (uint64_t i = 0; i < count; i++) {
+    offset = align_up(offset, alignment);
+    entries[i].offset = offset;
+    offset += entries[i].length;
+  }
+
+  // written aside and renamed, so that a running process never maps a
+  // partially written pack
+  char tmp_path[PATH_MAX];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", pack_path);
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to create %s\n", tmp_path);
+    goto cleanup;
+  }
+
+  unsigned char *record = calloc(1, header.index_stride);
+  int failed = write_all(fd, &header, sizeof(header), 0);
+  for (uint64_t i = 0; i < count && !failed; i++) {
+    memset(record, 0, header.index_stride);
+    memcpy(record, entries[i].key, key_length);
+    uint64_t blob[2] = {entries[i].offset, entries[i].length};
+    memcpy(record + header.index_stride - sizeof(blob), blob, sizeof(blob));
+    failed = write_all(fd, record, header.index_stride, header.index_offset + i * header.index_stride);
+
+    sqlite3_reset(get);
+    sqlite3_bind_blob64(get, 1, entries[i].key, key_length, SQLITE_STATIC);
+    if (!failed && sqlite3_step(get) == SQLITE_ROW) {
+      failed = (uint64_t)sqlite3_column_bytes(get, 0) != entries[i].length ||
+               write_all(fd, sqlite3_column_blob(get, 0), entries[i].length, entries[i].offset);
+    } else {
+      failed = 1;
+    }
+  }
+  free(record);
+  // the last blob may end before the alignment boundary
+  if (!failed && ftruncate(fd, offset))
+    failed = 1;
+  if (!failed && fsync(fd))
+    failed = 1;
+  close(fd);
+
+  if (failed || rename(tmp_path, pack_path)) {
+    fprintf(stderr, "Failed to write %s\n", pack_path);
+    unlink(tmp_path);
+    goto cleanup;
+  }
+
+  printf("Packed %" PRIu64 " entries (cache version %" PRIu64 ", %" PRIu64 " bytes) into %s\n", count, version,
+         offset, pack_path);
+  ret = 0;
+
+cleanup:
+  for (uint64_t i = 0; i < count; i++)
+    free(entries[i].key);
+  free(entries);
+  sqlite3_finalize(get);
+  sqlite3_finalize(list);
+  sqlite3_close(db);
+  return ret;
+}
+
+static double
+now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int
+bench_pack(const char *db_path, const char *pack_path, unsigned iterations) {
+  // the version is taken from the pack, both sides must agree on it
+  int fd = open(pack_path, O_RDONLY);
+  struct cache_pack_header header;
+  if (fd < 0 || read(fd, &header, sizeof(header)) != sizeof(header)) {
+    fprintf(stderr, "Failed to read %s\n", pack_path);
+    if (fd >= 0)
+      close(fd);
+    return 1;
+  }
+  close(fd);
+
+  struct cache_pack *pack = cache_pack_open(pack_path, header.cache_version);
+  struct cache_sqlite_reader *reader = cache_sqlite_reader_open(db_path, header.cache_version);
+  if (!pack || !reader) {
+    fprintf(stderr, "Failed to open %s\n", pack ? db_path : pack_path);
+    if (pack)
+      cache_pack_release(pack);
+    if (reader)
+      cache_sqlite_reader_close(reader);
+    return 1;
+  }
+
+  uint64_t count = cache_pack_entry_count(pack);
+  uint32_t key_length = cache_pack_key_length(pack);
+  if (!count) {
+    fprintf(stderr, "%s is empty\n", pack_path);
+    cache_pack_release(pack);
+    cache_sqlite_reader_close(reader);
+    return 1;
+  }
+
+  // random order, like a game streaming in shaders
+  uint64_t *order = malloc(count * sizeof(uint64_t));
+  for (uint64_t i = 0; i < count; i++)
+    order[i] = i;
+  srand(1);
+  for (uint64_t i = count - 1; i > 0; i--) {
+    uint64_t j = (((uint64_t)rand() << 31) ^ rand()) % (i + 1);
+    uint64_t t = order[i];
+    order[i] = order[j];
+    order[j] = t;
+  }
+
+  uint64_t checksum = 0, misses = 0;
+  double pack_ns = 0, sqlite_ns = 0;
+  for (unsigned iter = 0; iter < iterations; iter++) {
+    double start = now_ns();
+    for (uint64_t i = 0; i < count; i++) {
+      const void *data;
+      size_t length;
+      if (cache_pack_find(pack, cache_pack_entry_key(pack, order[i]), key_length, &data, &length))
+        checksum += ((const unsigned char *)data)[length / 2] + length;
+      else
+        misses++;
+    }
+    pack_ns += now_ns() - start;
+
+    start = now_ns();
+    for (uint64_t i = 0; i < count; i++) {
+      size_t length = 0;
+      unsigned char *data = cache_sqlite_reader_get(reader, cache_pack_entry_key(pack, order[i]), key_length, &length);
+      if (data)
+        checksum -= data[length / 2] + length;
+      else
+        misses++;
+      free(data);
+    }
+    sqlite_ns += now_ns() - start;
+  }
+
+  uint64_t lookups = count * iterations;
+  printf("{\n");
+  printf("  \"entries\": %" PRIu64 ",\n", count);
+  printf("  \"iterations\": %u,\n", iterations);
+  printf("  \"pack_ns_per_lookup\": %.1f,\n", pack_ns / lookups);
+  printf("  \"sqlite_ns_per_lookup\": %.1f,\n", sqlite_ns / lookups);
+  printf("  \"misses\": %" PRIu64 ",\n", misses);
+  // both sides read the same bytes, anything else means the pack is stale
+  printf("  \"consistent\": %s\n", checksum || misses ? "false" : "true");
+  printf("}\n");
+
+  free(order);
+  cache_pack_release(pack);
+  cache_sqlite_reader_close(reader);
+  return 0;
+}
+
+struct compression_entry {
+  unsigned char *raw;
+  size_t raw_length;
+  unsigned char *encoded;
+  size_t encoded_length;
+};
+
+static int
+bench_compression(const char *db_path, uint64_t version, int has_version, unsigned iterations) {
+  sqlite3 *db;
+  if (sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+    fprintf(stderr, "Failed to open %s: %s\n", db_path, sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return 1;
+  }
+  if (!has_version && find_latest_version(db, &version)) {
+    fprintf(stderr, "No shader cache table in %s\n", db_path);
+    sqlite3_close(db);
+    return 1;
+  }
+  char sql[128];
+  sqlite3_stmt *list;
+  snprintf(sql, sizeof(sql), "SELECT value FROM cache_%" PRIu64 ";", version);
+  if (sqlite3_prepare_v2(db, sql, -1, &list, NULL) != SQLITE_OK) {
+    fprintf(stderr, "Failed to read cache_%" PRIu64 ": %s\n", version, sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return 1;
+  }
+
+  struct compression_entry *entries = NULL;
+  uint64_t count = 0, capacity = 0, stored_compressed = 0, corrupt = 0, mismatches = 0;
+  uint64_t raw_bytes = 0, stored_bytes = 0, encoded_bytes = 0;
+  double encode_ns = 0;
+  while (sqlite3_step(list) == SQLITE_ROW) {
+    const void *stored = sqlite3_column_blob(list, 0);
+    size_t length = sqlite3_column_bytes(list, 0);
+    struct compression_entry entry = {0};
+    uint64_t raw_length;
+    if (cache_codec_is_encoded(stored, length, &raw_length)) {
+      stored_compressed++;
+      entry.raw = malloc(raw_length ? raw_length : 1);
+      if (!cache_codec_decode(stored, length, entry.raw, raw_length)) {
+        corrupt++;
+        free(entry.raw);
+        continue;
+      }
+      entry.raw_length = raw_length;
+    } else {
+      entry.raw = malloc(length ? length : 1);
+      memcpy(entry.raw, stored, length);
+      entry.raw_length = length;
+    }
+    double start = now_ns();
+    entry.encoded = cache_codec_encode(CACHE_CODEC_LZ4, entry.raw, entry.raw_length, &entry.encoded_length);
+    encode_ns += now_ns() - start;
+
+    stored_bytes += length;
+    raw_bytes += entry.raw_length;
+    encoded_bytes += entry.encoded ? entry.encoded_length : entry.raw_length;
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 1024;
+      entries = realloc(entries, capacity * sizeof(struct compression_entry));
+    }
+    entries[count++] = entry;
+  }
+  sqlite3_finalize(list);
+  sqlite3_close(db);
+
+  // what a cache hit adds on top of reading the value
+  double decode_ns = 0;
+  uint64_t decoded_bytes = 0;
+  for (unsigned iter = 0; iter < iterations; iter++) {
+    for (uint64_t i = 0; i < count; i++) {
+      if (!entries[i].encoded)
+        continue;
+      unsigned char *raw = malloc(entries[i].raw_length);
+      double start = now_ns();
+      bool ok = cache_codec_decode(entries[i].encoded, entries[i].encoded_length, raw, entries[i].raw_length);
+      decode_ns += now_ns() - start;
+      decoded_bytes += entries[i].raw_length;
+      if (!ok || memcmp(raw, entries[i].raw, entries[i].raw_length))
+        mismatches++;
+      free(raw);
+    }
+  }
+
+  printf("{\n");
+  printf("  \"entries\": %" PRIu64 ",\n", count);
+  printf("  \"stored_compressed\": %" PRIu64 ",\n", stored_compressed);
+  printf("  \"corrupt\": %" PRIu64 ",\n", corrupt);
+  printf("  \"stored_bytes\": %" PRIu64 ",\n", stored_bytes);
+  printf("  \"raw_bytes\": %" PRIu64 ",\n", raw_bytes);
+  printf("  \"lz4_bytes\": %" PRIu64 ",\n", encoded_bytes);
+  printf("  \"lz4_ratio\": %.2f,\n", encoded_bytes ? (double)raw_bytes / encoded_bytes : 0.0);
+  printf("  \"encode_mb_per_s\": %.0f,\n", encode_ns ? raw_bytes / encode_ns * 1e3 : 0.0);
+  printf("  \"decode_mb_per_s\": %.0f,\n", decode_ns ? decoded_bytes / decode_ns * 1e3 : 0.0);
+  printf("  \"consistent\": %s\n", mismatches || corrupt ? "false" : "true");
+  printf("}\n");
+
+  for (uint64_t i = 0; i < count; i++) {
+    free(entries[i].raw);
+    free(entries[i].encoded);
+  }
+  free(entries);
+  return 0;
+}
+
+static void
+usage(void) {
+  fprintf(stderr, "usage: dxmt-shader-pack create [-v version] [-a alignment] <shaders.db> <shaders.pack>\n"
+                  "       dxmt-shader-pack bench [-n iterations] <shaders.db> <shaders.pack>\n"
+                  "       dxmt-shader-pack compression [-v version] [-n iterations] <shaders.db>\n");
+}
+
+int
+main(int argc, char **argv) {
+  if (argc < 2) {
+    usage();
+    return 1;
+  }
+  const char *command = argv[1];
+  uint64_t version = 0, alignment = CACHE_PACK_DEFAULT_BLOB_ALIGNMENT;
+  int has_version = 0;
+  unsigned iterations = 5;
+  int opt;
+  optind = 2;
+  while ((opt = getopt(argc, argv, "v:a:n:")) != -1) {
+    switch (opt) {
+    case 'v':
+      version = strtoull(optarg, NULL, 10);
+      has_version = 1;
+      break;
+    case 'a':
+      alignment = strtoull(optarg, NULL, 10);
+      break;
+    case 'n':
+      iterations = strtoul(optarg, NULL, 10);
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  if (!strcmp(command, "compression") && argc - optind == 1 && iterations)
+    return bench_compression(argv[optind], version, has_version, iterations);
+  if (argc - optind != 2 || !alignment || !iterations) {
+    usage();
+    return 1;
+  }
+  if (!strcmp(command, "create"))
+    return create_pack(argv[optind], argv[optind + 1], version, has_version, alignment);
+  if (!strcmp(command, "bench"))
+    return bench_pack(argv[optind], argv[optind + 1], iterations);
+  usage();
+  return 1;
+}
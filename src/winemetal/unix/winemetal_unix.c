@@ -363,6 +363,50 @@ _MTLDevice_newLibrary(void *obj) {
   return STATUS_SUCCESS;
 }
 
+static NTSTATUS
+_MTLDevice_newPackedLibrary(void *obj) {
+  struct unixcall_mtldevice_newpackedlibrary *params = obj;
+  id<MTLDevice> device = (id<MTLDevice>)params->device;
+  const obj_handle_t *datas = params->datas.ptr;
+  uint64_t count = params->num_datas;
+  dispatch_data_t *flat = calloc(count, sizeof(dispatch_data_t));
+  struct SM50_COMPILED_BITCODE *libraries = calloc(count, sizeof(struct SM50_COMPILED_BITCODE));
+  for (uint64_t i = 0; i < count; i++) {
+    const void *bytes;
+    size_t length;
+    flat[i] = dispatch_data_create_map((dispatch_data_t)datas[i], &bytes, &length);
+    libraries[i].Data = (void *)bytes;
+    libraries[i].Size = length;
+  }
+
+  sm50_bitcode_t packed = NULL;
+  sm50_error_t sm50_err = NULL;
+  params->ret_library = 0;
+  if (SM50PackBitcode(libraries, count, &packed, &sm50_err)) {
+    char message[256];
+    SM50GetErrorMessage(sm50_err, message, sizeof(message));
+    SM50FreeError(sm50_err);
+    params->ret_error = (obj_handle_t)[NSError errorWithDomain:@"dxmt"
+                                                         code:0
+                                                     userInfo:@{NSLocalizedDescriptionKey : [NSString stringWithUTF8String:message]}];
+  } else {
+    struct SM50_COMPILED_BITCODE bitcode;
+    SM50GetCompiledBitcode(packed, &bitcode);
+    dispatch_data_t data = dispatch_data_create(bitcode.Data, bitcode.Size, NULL, DISPATCH_DATA_DESTRUCTOR_DEFAULT);
+    SM50DestroyBitcode(packed);
+    NSError *err = NULL;
+    params->ret_library = (obj_handle_t)[device newLibraryWithData:data error:&err];
+    params->ret_error = (obj_handle_t)err;
+    dispatch_release(data);
+  }
+
+  for (uint64_t i = 0; i < count; i++)
+    dispatch_release(flat[i]);
+  free(flat);
+  free(libraries);
+  return STATUS_SUCCESS;
+}
+
 static NTSTATUS
 _MTLLibrary_newFunction(void *obj) {
   struct unixcall_generic_obj_uint64_obj_ret *params = obj;
@@ -2567,6 +2611,22 @@ _DispatchData_alloc_init(void *obj) {
   return STATUS_SUCCESS;
 }
 
+static NTSTATUS
+_DispatchData_copyBytes(void *obj) {
+  struct unixcall_dispatchdata_copy_bytes *params = obj;
+  dispatch_data_t data = (dispatch_data_t)params->data;
+  char *dst = params->buffer.ptr;
+  uint64_t capacity = params->capacity;
+  params->ret_size = dispatch_data_get_size(data);
+  dispatch_data_apply(data, ^bool(dispatch_data_t region, size_t offset, const void *buffer, size_t size) {
+    if (offset >= capacity)
+      return false;
+    memcpy(dst + offset, buffer, size < capacity - offset ? size : capacity - offset);
+    return true;
+  });
+  return STATUS_SUCCESS;
+}
+
 @interface MTLSharedTextureHandle ()
 
 - (MTLSharedTextureHandle *)initWithMachPort:(mach_port_t)port;
@@ -2824,6 +2884,11 @@ NTSTATUS _CacheReader_alloc_init(void *obj);
 NTSTATUS _CacheReader_get(void *obj);
 NTSTATUS _CacheWriter_alloc_init(void *obj);
 NTSTATUS _CacheWriter_set(void *obj);
+NTSTATUS _CacheWriter_touch(void *obj);
+NTSTATUS _CacheWriter_setSizeLimit(void *obj);
+NTSTATUS _CacheReader_copyKeys(void *obj);
+NTSTATUS _CacheWriter_setCodec(void *obj);
+NTSTATUS _CacheReader_decode(void *obj);
 NTSTATUS _WMTSetMetalShaderCachePath(void *obj);
 
 const void *__wine_unix_call_funcs[] = {
@@ -2959,6 +3024,13 @@ const void *__wine_unix_call_funcs[] = {
     &_MTLCommandBuffer_blitCommandEncoderWithSampleBuffers,
     &_MTLCommandBuffer_property,
     &_MTLDevice_newTileRenderPipelineState,
+    &_CacheWriter_touch,
+    &_CacheWriter_setSizeLimit,
+    &_CacheReader_copyKeys,
+    &_DispatchData_copyBytes,
+    &_CacheWriter_setCodec,
+    &_CacheReader_decode,
+    &_MTLDevice_newPackedLibrary,
 };
 
 #ifndef DXMT_NATIVE
@@ -3095,5 +3167,12 @@ const void *__wine_unix_call_wow64_funcs[] = {
     &_MTLCommandBuffer_blitCommandEncoderWithSampleBuffers,
     &_MTLCommandBuffer_property,
     &_MTLDevice_newTileRenderPipelineState,
+    &_CacheWriter_touch,
+    &_CacheWriter_setSizeLimit,
+    &_CacheReader_copyKeys,
+    &_DispatchData_copyBytes,
+    &_CacheWriter_setCodec,
+    &_CacheReader_decode,
+    &_MTLDevice_newPackedLibrary,
 };
 #endif
@@ -1864,6 +1864,27 @@ WINEMETAL_API obj_handle_t CacheWriter_alloc_init(const char *path, uint64_t ver
 
 WINEMETAL_API void CacheWriter_set(obj_handle_t writer, const void *key, uint64_t key_length, obj_handle_t value);
 
+WINEMETAL_API void CacheWriter_touch(obj_handle_t writer, const void *key, uint64_t key_length);
+
+WINEMETAL_API void CacheWriter_setSizeLimit(obj_handle_t writer, uint64_t size_limit);
+
+WINEMETAL_API uint64_t CacheReader_copyKeys(obj_handle_t reader, uint64_t key_length, void *buffer, uint64_t capacity);
+
+WINEMETAL_API uint64_t DispatchData_copyBytes(obj_handle_t data, void *buffer, uint64_t capacity);
+
+/* same values as enum cache_codec in unix/cache_codec.h */
+enum WMTCacheCodec : uint32_t {
+  WMTCacheCodecNone = 0,
+  WMTCacheCodecLZ4 = 1,
+};
+
+WINEMETAL_API void CacheWriter_setCodec(obj_handle_t writer, enum WMTCacheCodec codec);
+
+WINEMETAL_API obj_handle_t CacheReader_decode(obj_handle_t data);
+
+WINEMETAL_API obj_handle_t
+MTLDevice_newPackedLibrary(obj_handle_t device, const obj_handle_t *datas, uint64_t num_datas, obj_handle_t *err_out);
+
 WINEMETAL_API bool WMTSetMetalShaderCachePath(const char *path);
 
 WINEMETAL_API obj_handle_t MTLDevice_newSharedTexture(obj_handle_t device, struct WMTTextureInfo *info);
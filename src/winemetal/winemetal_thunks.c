@@ -1179,3 +1179,71 @@ MTLDevice_newTileRenderPipelineState(
     *err_out = params.ret_error;
   return params.ret_pso;
 }
+
+WINEMETAL_API void
+CacheWriter_touch(obj_handle_t writer, const void *key, uint64_t key_length) {
+  struct unixcall_cache_touch params;
+  params.cache = writer;
+  WMT_MEMPTR_SET(params.key, key);
+  params.key_length = key_length;
+  UNIX_CALL(132, &params);
+}
+
+WINEMETAL_API void
+CacheWriter_setSizeLimit(obj_handle_t writer, uint64_t size_limit) {
+  struct unixcall_generic_obj_uint64_noret params;
+  params.handle = writer;
+  params.arg = size_limit;
+  UNIX_CALL(133, &params);
+}
+
+WINEMETAL_API uint64_t
+CacheReader_copyKeys(obj_handle_t reader, uint64_t key_length, void *buffer, uint64_t capacity) {
+  struct unixcall_cache_copy_keys params;
+  params.cache = reader;
+  params.key_length = key_length;
+  WMT_MEMPTR_SET(params.buffer, buffer);
+  params.capacity = capacity;
+  UNIX_CALL(134, &params);
+  return params.ret_count;
+}
+
+WINEMETAL_API uint64_t
+DispatchData_copyBytes(obj_handle_t data, void *buffer, uint64_t capacity) {
+  struct unixcall_dispatchdata_copy_bytes params;
+  params.data = data;
+  WMT_MEMPTR_SET(params.buffer, buffer);
+  params.capacity = capacity;
+  UNIX_CALL(135, &params);
+  return params.ret_size;
+}
+
+WINEMETAL_API void
+CacheWriter_setCodec(obj_handle_t writer, enum WMTCacheCodec codec) {
+  struct unixcall_generic_obj_uint64_noret params;
+  params.handle = writer;
+  params.arg = codec;
+  UNIX_CALL(136, &params);
+}
+
+WINEMETAL_API obj_handle_t
+CacheReader_decode(obj_handle_t data) {
+  struct unixcall_generic_obj_obj_ret params;
+  params.handle = data;
+  UNIX_CALL(137, &params);
+  return params.ret;
+}
+
+WINEMETAL_API obj_handle_t
+MTLDevice_newPackedLibrary(obj_handle_t device, const obj_handle_t *datas, uint64_t num_datas, obj_handle_t *err_out) {
+  struct unixcall_mtldevice_newpackedlibrary params;
+  params.device = device;
+  WMT_MEMPTR_SET(params.datas, datas);
+  params.num_datas = num_datas;
+  params.ret_error = 0;
+  params.ret_library = 0;
+  UNIX_CALL(138, &params);
+  if (err_out)
+    *err_out = params.ret_error;
+  return params.ret_library;
+}
@@ -117,6 +117,14 @@ struct unixcall_mtldevice_newlibrary {
   obj_handle_t ret_library;
 };
 
+struct unixcall_mtldevice_newpackedlibrary {
+  obj_handle_t device;
+  struct WMTConstMemoryPointer datas;
+  uint64_t num_datas;
+  obj_handle_t ret_error;
+  obj_handle_t ret_library;
+};
+
 struct unixcall_mtldevice_newcomputepso {
   obj_handle_t device;
   struct WMTConstMemoryPointer info;
@@ -331,6 +339,27 @@ struct unixcall_cache_set {
   obj_handle_t value_data;
 };
 
+struct unixcall_cache_touch {
+  obj_handle_t cache;
+  struct WMTConstMemoryPointer key;
+  uint64_t key_length;
+};
+
+struct unixcall_cache_copy_keys {
+  obj_handle_t cache;
+  uint64_t key_length;
+  struct WMTMemoryPointer buffer;
+  uint64_t capacity;
+  uint64_t ret_count;
+};
+
+struct unixcall_dispatchdata_copy_bytes {
+  obj_handle_t data;
+  struct WMTMemoryPointer buffer;
+  uint64_t capacity;
+  uint64_t ret_size;
+};
+
 struct unixcall_setmetalcachepath {
   struct WMTConstMemoryPointer path;
   uint64_t ret_success;